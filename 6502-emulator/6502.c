@@ -5,18 +5,83 @@
 // CPU implementation
 // ------------------
 // all registers and flags implemented
-// decimal mode, stack, timing/cycles and interrupt routines not implemented
+// cycle counts implemented, including page crossing penalties (see indexed())
+// decimal mode implemented for ADC and SBC (lookup tables, see prepare_decimal_tables())
+// flags N, V, Z and C are evaluated lazily: only when SR is read (see get_status() in 6502.h)
+// stack operations, BRK, IRQ and NMI implemented (see service_interrupt())
+//
+// Opcode dispatch
+// ---------------
+// Every opcode has its own small handler, built from one addressing mode function (which returns the effective address)
+// and one operation function (which does the actual work). All 256 handlers are stored in a table, so execute_command()
+// needs exactly one indirect call per instruction instead of two nested switch statements. Unused slots point to
+// opcode_unknown. The original switch-based core is kept at the end of this file as a baseline for the benchmark
+// (start the emulator with -b to compare both).
+// Handlers never touch memory directly: all reads and writes go through the memory bus of the machine (bus_read(),
+// bus_write(), see bus.c), whose page tables decide between RAM, ROM, and I/O devices.
+//
+// Running
+// -------
+// run() executes instructions in a tight loop until a cycle or instruction budget is used up, BRK has been executed,
+// a breakpoint is reached, or an interrupt is requested. It returns the reason and the cycles consumed, so callers
+// can slice emulation into batches of any size (e.g. one video frame) instead of calling execute_command() each time.
+// A profile in the budget counts every instruction (see profile.c).
+// Between two instructions, a pending NMI or IRQ (interrupt_pending()) is serviced first: PC and SR are pushed and
+// PC is loaded from the vector, as on the chip. run_machine() cuts its budget at the events that devices have
+// scheduled (see events.c) and calls them in between, so no device is polled per instruction.
+// run_paced() uses such batches to run at the speed of the real chip (CLOCK_SPEED) instead of as fast as possible.
+// run_machine() uses the translation cache (cache.c) if it has been enabled for the machine; every handler has a
+// variant for pre-decoded instructions for that (decode_instruction()). With a debugger in the budget, it uses
+// run_debug() instead (breakpoints, watchpoints, and conditions, see debug.c).
+//
+// Machines
+// --------
+// A machine is a CPU with its own 64 KB of memory (create_machine(), load_image() or load_program(), run_machine()). As the core has no
+// global state, many machines can run in one process; batch.c uses this to run whole collections of programs on all
+// cores. main() and the demo program live in main.c, everything else can be linked into other programs as a library.
+// Machines can be checkpointed, rewound, and forked cheaply with snapshots (see snapshot.c).
+//
+// Tracing
+// -------
+// execute_command() itself prints nothing. The demo builds one trace record per instruction and prints it; with -t file,
+// the records go into a ring buffer instead, which a background thread saves as a binary file (see trace.c).
+// -d file prints such a file in the same text format as the live output.
 //
 // Opcode implementation table
 // ---------------------------
 // $00  BRK           works
-// $81  STA ($vw,X)   under construction
+// $08  PHP           works
+// $18  CLC           works
+// $20  JSR  $vwxy    works
+// $28  PLP           works
+// $38  SEC           works
+// $40  RTI           works
+// $48  PHA           works
+// $58  CLI           works
+// $60  RTS           works
+// $61  ADC ($xy,X)   works
+// $65  ADC  $xy      works
+// $68  PLA           works
+// $69  ADC #$xy      works
+// $6D  ADC  $vwxy    works
+// $71  ADC ($xy),Y   works
+// $75  ADC  $xy,X    works
+// $78  SEI           works
+// $79  ADC  $vwxy,Y  works
+// $7D  ADC  $vwxy,X  works
+// $81  STA ($vw,X)   works
+// $84  STY  $xy      works
 // $85  STA  $vw      works
-// $8D  STA  $vwxy    under construction
-// $91  STA ($xy),Y   under construction
+// $86  STX  $vw      works
+// $8C  STY  $vwxy    works
+// $8D  STA  $vwxy    works
+// $8E  STX  $vwxy    works
+// $91  STA ($xy),Y   works
+// $94  STY  $vw,X    works
 // $95  STA  $vx,X    works
-// $99  STA  $vwxy,Y  under construction
-// $9D  STA  $vwxy,X  under construction
+// $96  STX  $vw,Y    works
+// $99  STA  $vwxy,Y  works
+// $9D  STA  $vwxy,X  works
 // $A0  LDY #$xy      works
 // $A1  LDA ($xy,X)   works
 // $A2  LDX #$xy      works
@@ -35,111 +100,1338 @@
 // $BC  LDY  $vwxy,X  works
 // $BD  LDA  $vwxy,X  works
 // $BE  LDX  $vwxy,Y  works
+// $D8  CLD           works
+// $E1  SBC ($xy,X)   works
+// $E5  SBC  $xy      works
+// $E9  SBC #$xy      works
+// $ED  SBC  $vwxy    works
+// $F1  SBC ($xy),Y   works
+// $F5  SBC  $xy,X    works
+// $F8  SED           works
+// $F9  SBC  $vwxy,Y  works
+// $FD  SBC  $vwxy,X  works
 //
-// Next opcodes to be implemented
-// ------------------------------
-// $84  STY  $xy      under construction
-// $86  STX  $vw      under construction
-// $8C  STY  $vwxy    under construction
-// $8E  STX  $vwxy    under construction
-// $94  STY  $vw,X    under construction
-// $96  STX  $vw,Y    under construction
-//
-// Next features to be implemented
-// -------------------------------
-// basic debugging (set breakpoint/s)
-// read program data from binary file
-//
-// Checks: do zeropage addresses properly wrap around?
+// Checks: zeropage addresses wrap around within page zero (the switch-based core does not do this)
 // ------  when should flags be cleared?
 
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdint.h>                                         // for uint8_t and uint16_t data types
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for clock() in the benchmark, clock_nanosleep()
+
+#include "6502.h"
 
-#define SHOW_PROCESSED_DATA   true
-#define SHOW_PROCESSOR_STATUS true
-
-#define MEMORY_SIZE 65536                                   // 64 KB memory
-
-#define FLAG_N 0x80                                         // N (negative) flag           1000 0000
-#define FLAG_V 0x40                                         // V (overflow) flag           0100 0000
-#define FLAG_U 0x20                                         // U (unused) flag             0010 0000
-#define FLAG_B 0x10                                         // B (break command) flag      0001 0000
-#define FLAG_D 0x08                                         // D (decimal mode) flag       0000 1000
-#define FLAG_I 0x04                                         // I (interrupt disable) flag  0000 0100
-#define FLAG_Z 0x02                                         // Z (zero) flag               0000 0010
-#define FLAG_C 0x01                                         // C (carry) flag              0000 0001
-
-typedef struct {                                            // define CPU registers
-    uint8_t  A, X, Y;                                       // A (accumulator), X register, Y register
-    uint8_t  SP;                                            // stack pointer
-    uint16_t PC;                                            // program counter, 2 byte
-    uint8_t  SR;                                            // status register, 1 bit for each flag:
-                                                            // N (negative), V (overflow), U (undefined), B (break interrput),
-                                                            // D (decimal mode), I (interrupt disable), Z (zero), C (carry)
-} CPU6502;
-
-void reset_cpu(CPU6502 *cpu);
-void enter_code(uint8_t memory[MEMORY_SIZE]);
-uint8_t get_byte(CPU6502* cpu, uint8_t memory[MEMORY_SIZE]);        // under construction
-void execute_command(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE]);
-void show_cpu_status(CPU6502 cpu);
-void show_memory_dump(uint16_t start, uint16_t end, uint8_t memory[MEMORY_SIZE]);
-
-bool check_flag(uint8_t SR, uint8_t flag);
-void update_flag(uint8_t *SR, uint8_t flag, bool set);
+typedef void (*opcode_handler)(CPU6502 *cpu, memory_bus *bus);
 
+void execute_command_switch(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE]);
 void lda(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode);
 void ldx(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode);
 void ldy(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode);
-
 void sta(CPU6502* cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode);
 
-int main() {
-    CPU6502 cpu;                                            // define CPU
-    uint8_t memory[MEMORY_SIZE] = {0};                      // define memory and fill with zeros
+void reset_cpu(CPU6502 *cpu) {
+    cpu->A  = 0x00;                                         // A, X, Y set to 0
+    cpu->X  = 0x00;
+    cpu->Y  = 0x00;
+    cpu->SP = 0xFD;                                         // set stack pointer to standard value
+    cpu->PC = 0xFFFC;                                       // set PC to reset vector (the demo code starts right there;
+                                                            // reset_cpu_from_vector() loads PC from FFFC/FFFD like the chip)
+    set_status(cpu, 0x24);                                  // set default flags; 0x24 = 0010 0100: disables interrupts after reset
+    cpu->cycles = 0;                                        // reset cycle counter
+    cpu->irq = 0;                                           // no interrupt pending
+    cpu->nmi = false;
+}
+
+void reset_cpu_from_vector(CPU6502 *cpu, memory_bus *bus) {
+    reset_cpu(cpu);
+    cpu->PC = bus_read(bus, 0xFFFC) | (bus_read(bus, 0xFFFD) << 8);     // reset vector, low byte first
+}
+
+
+// Addressing modes: each function reads the operand bytes (moving PC along) and returns the effective address.
+// Immediate mode returns the address of the operand byte itself, so every operation can simply read from "address".
+// Zeropage results are kept in a uint8_t so that they wrap around within page zero, just like on the real chip.
+// The work after fetching is done by the *_operand functions, which pre-decoded instructions (see cache.c) call
+// directly with the operand they have kept. PC already points behind the instruction when those are called.
+// Indexed modes that cross a page boundary cost one more cycle, but only for reads ("read" is a constant of the
+// operation): stores always take that cycle, so it is part of their base count in opcode_table.
+
+static inline uint16_t indexed(CPU6502 *cpu, uint16_t base, uint8_t index, bool read) {
+    uint16_t address = base + index;                        // uint16_t wraps around $FFFF
+    if(read) {
+        cpu->cycles += (address ^ base) >> 8 != 0;          // page crossed: high byte has to be fixed, one more cycle
+    }
+    return address;
+}
 
-    printf("SIMPLE\n\n    ###   #####    ####    #####\n   ##  #  ##      ##  ##  #    ##\n  ##      ##      ##  ##       ##\n  #####   #####   ##  ##      ##\n  ##  ##      ##  ##  ##     ##\n  ##  ##  #   ##  ##  ##    ##  #\n   ####    ####    ####   #######\n\n                           EMULATOR\n\n");
+static inline uint16_t mode_implied_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) cpu, (void) bus, (void) operand, (void) read;    // no operand
+    return 0;
+}
 
-    reset_cpu(&cpu);                                        // reset CPU to initial settings
-    printf("Initial CPU status after reset:\n");
-    show_cpu_status(cpu);
+static inline uint16_t mode_immediate_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) bus, (void) operand, (void) read;
+    return cpu->PC - 1;                                     // the operand byte, right before PC
+}
 
-    enter_code(memory);                                     // load test scenario
+static inline uint16_t mode_zeropage_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) cpu, (void) bus, (void) read;
+    return operand;
+}
 
-    do {                                                    // main loop,
-        execute_command(&cpu, memory);
-        if(SHOW_PROCESSOR_STATUS) {
-            show_cpu_status(cpu);
+static inline uint16_t mode_zeropage_x_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) bus, (void) read;
+    return (uint8_t) (operand + cpu->X);                    // $FF,X with X=5 is $04, not $0104; no extra cycle
+}
+
+static inline uint16_t mode_zeropage_y_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) bus, (void) read;
+    return (uint8_t) (operand + cpu->Y);
+}
+
+static inline uint16_t mode_absolute_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) cpu, (void) bus, (void) read;
+    return operand;
+}
+
+static inline uint16_t mode_absolute_x_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) bus;
+    return indexed(cpu, operand, cpu->X, read);
+}
+
+static inline uint16_t mode_absolute_y_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) bus;
+    return indexed(cpu, operand, cpu->Y, read);
+}
+
+static inline uint16_t mode_indexed_indirect_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    (void) read;
+    uint8_t pointer = operand + cpu->X;                     // ($xy,X): pointer in page zero, wraps around $FF
+    return bus_read(bus, pointer) | (bus_read(bus, (uint8_t) (pointer + 1)) << 8);
+}
+
+static inline uint16_t mode_indirect_indexed_operand(CPU6502 *cpu, memory_bus *bus, uint16_t operand, bool read) {
+    uint8_t pointer = operand;                              // ($xy),Y: fetch base address from page zero, then add Y
+    uint16_t base = bus_read(bus, pointer) | (bus_read(bus, (uint8_t) (pointer + 1)) << 8);
+    return indexed(cpu, base, cpu->Y, read);
+}
+
+static inline uint16_t mode_implied(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_implied_operand(cpu, bus, 0, read);
+}
+
+static inline uint16_t mode_immediate(CPU6502 *cpu, memory_bus *bus, bool read) {
+    (void) read;
+    if(!bus->read[cpu->PC >> 8]) {                          // the operation reads the operand: still a fetch
+        bus->fetching = true;
+    }
+    return cpu->PC++;                                       // operand is the byte right after the opcode
+}
+
+static inline uint16_t mode_zeropage(CPU6502 *cpu, memory_bus *bus, bool read) {
+    (void) read;
+    return get_byte(cpu, bus);
+}
+
+static inline uint16_t mode_zeropage_x(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_zeropage_x_operand(cpu, bus, get_byte(cpu, bus), read);
+}
+
+static inline uint16_t mode_zeropage_y(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_zeropage_y_operand(cpu, bus, get_byte(cpu, bus), read);
+}
+
+static inline uint16_t mode_absolute(CPU6502 *cpu, memory_bus *bus, bool read) {
+    (void) read;
+    uint8_t low = get_byte(cpu, bus);                       // two statements, as the evaluation order within
+    return low | (get_byte(cpu, bus) << 8);                 // one expression is not defined in C
+}
+
+static inline uint16_t mode_absolute_x(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_absolute_x_operand(cpu, bus, mode_absolute(cpu, bus, read), read);
+}
+
+static inline uint16_t mode_absolute_y(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_absolute_y_operand(cpu, bus, mode_absolute(cpu, bus, read), read);
+}
+
+static inline uint16_t mode_indexed_indirect(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_indexed_indirect_operand(cpu, bus, get_byte(cpu, bus), read);
+}
+
+static inline uint16_t mode_indirect_indexed(CPU6502 *cpu, memory_bus *bus, bool read) {
+    return mode_indirect_indexed_operand(cpu, bus, get_byte(cpu, bus), read);
+}
+
+
+// Decimal mode: ADC and SBC take result and flags from tables indexed by (carry, A, operand), so the digit
+// corrections cost no branches at run time. The tables are built once, on first use, with the rules of the NMOS
+// 6502 (and of the 6510 and 7501/8501 in the C64 and C16), including their flags that only make sense in binary:
+// - ADC corrects the low digit first; N and V come from the sum before the correction of the high digit, Z from the
+//   binary sum. Unlike bcd_correction() in alu.py, a digit sum that carries (9 + 9 = $12) is corrected as well.
+// - SBC sets all flags as in binary mode; only the result is corrected.
+// An entry holds the result in the low byte and the flags C, Z, V, N in the high byte, at their places in SR.
+
+#define DECIMAL_FLAGS (FLAG_N | FLAG_V | FLAG_Z | FLAG_C)
+
+enum { DECIMAL_ADC, DECIMAL_SBC };
+
+static uint16_t decimal_tables[2][2][256][256];             // [DECIMAL_ADC/SBC][carry][A][operand], 512 KB
+static pthread_once_t decimal_tables_ready = PTHREAD_ONCE_INIT;
+
+static uint8_t binary_flags(uint8_t a, uint8_t b, int sum) {    // flags of the binary sum a + b + carry
+    uint8_t result = sum;
+    return (sum > 0xFF ? FLAG_C : 0) | (result == 0 ? FLAG_Z : 0) | (result & FLAG_N)
+           | (~(a ^ b) & (a ^ result) & 0x80 ? FLAG_V : 0);
+}
+
+static void prepare_decimal_tables(void) {
+    for(int carry = 0; carry < 2; carry++) {
+        for(int a = 0; a < 256; a++) {
+            for(int b = 0; b < 256; b++) {
+                int low = (a & 0x0F) + (b & 0x0F) + carry;
+                if(low > 9) {
+                    low = ((low + 6) & 0x0F) + 0x10;
+                }
+                int sum = (a & 0xF0) + (b & 0xF0) + low;
+                int sign = (int8_t) (a & 0xF0) + (int8_t) (b & 0xF0) + low;
+                uint8_t flags = (binary_flags(a, b, a + b + carry) & FLAG_Z) | (sum & FLAG_N)
+                                | (sign < -128 || sign > 127 ? FLAG_V : 0);
+                if(sum >= 0xA0) {
+                    sum += 0x60;
+                }
+                decimal_tables[DECIMAL_ADC][carry][a][b] = (uint8_t) sum | (flags | (sum > 0xFF ? FLAG_C : 0)) << 8;
+
+                low = (a & 0x0F) - (b & 0x0F) + carry - 1;
+                if(low < 0) {
+                    low = ((low - 6) & 0x0F) - 0x10;
+                }
+                int difference = (a & 0xF0) - (b & 0xF0) + low;
+                if(difference < 0) {
+                    difference -= 0x60;
+                }
+                flags = binary_flags(a, ~b, a + (uint8_t) ~b + carry);
+                decimal_tables[DECIMAL_SBC][carry][a][b] = (uint8_t) difference | flags << 8;
+            }
         }
-    } while(!check_flag(cpu.SR, FLAG_B));                   // exited if B flag has been set
+    }
+}
+
+static inline void add_decimal(CPU6502 *cpu, int operation, uint8_t value) {
+    pthread_once(&decimal_tables_ready, prepare_decimal_tables);
+    uint16_t entry = decimal_tables[operation][cpu->carry][cpu->A][value];
+    cpu->A = entry & 0xFF;
+    set_status(cpu, (cpu->SR & ~DECIMAL_FLAGS) | entry >> 8);   // N and Z do not follow from A here
+}
+
+static inline void add_binary(CPU6502 *cpu, uint8_t value) {    // SBC adds the complement of the operand
+    int sum = cpu->A + value + cpu->carry;
+    cpu->overflow = ~(cpu->A ^ value) & (cpu->A ^ sum);     // as in binary_flags()
+    cpu->carry = sum >> 8;
+    cpu->A = sum;
+    cpu->nz = cpu->A;
+}
+
+
+// Stack and interrupts: the stack is page 1, SP points to the next free byte. BRK, IRQ and NMI push PC (high byte
+// first) and SR, set the I flag, and continue at the address in their vector; only the SR pushed by BRK has the
+// B flag set. RTI and PLP take B and U from the pulled byte as they are: neither exists in the real register.
+
+static inline void push(CPU6502 *cpu, memory_bus *bus, uint8_t value) {
+    bus_write(bus, 0x0100 | cpu->SP--, value);
+}
+
+static inline uint8_t pull(CPU6502 *cpu, memory_bus *bus) {
+    return bus_read(bus, 0x0100 | ++cpu->SP);
+}
+
+static inline void interrupt(CPU6502 *cpu, memory_bus *bus, uint16_t return_address, uint8_t status, uint16_t vector) {
+    push(cpu, bus, return_address >> 8);
+    push(cpu, bus, return_address & 0xFF);
+    push(cpu, bus, status);
+    update_flag(&(cpu->SR), FLAG_I, true);
+    cpu->PC = bus_read(bus, vector) | (bus_read(bus, vector + 1) << 8);
+}
 
-    if(SHOW_PROCESSED_DATA && !SHOW_PROCESSOR_STATUS) {
-        printf("\n");
+void service_interrupt(CPU6502 *cpu, memory_bus *bus) {     // only call if interrupt_pending()
+    uint16_t vector = 0xFFFE;                               // IRQ
+    if(cpu->nmi) {
+        cpu->nmi = false;                                   // an edge: serviced once
+        vector = 0xFFFA;
     }
-    printf("B flag has been set, program terminated. Final CPU status:\n\n");
-    show_cpu_status(cpu);
-    show_memory_dump(0XEE, 0XEE, memory);
-    return 0;
+    interrupt(cpu, bus, cpu->PC, (get_status(cpu) & ~FLAG_B) | FLAG_U, vector);
+    cpu->cycles += 7;
 }
 
-void reset_cpu(CPU6502 *cpu) {
-    cpu->A  = 0x00;                                         // A, X, Y set to 0
-    cpu->X  = 0x00;
-    cpu->Y  = 0x00;
-    cpu->SP = 0xFD;                                         // set stack pointer to standard value
-    cpu->PC = 0xFFFC;                                       // set PC to reset vector
-                                                            // (usually, values at FFFC/FFFD (low/high) would be loaded into PC)
-    cpu->SR = 0x24;                                         // set default flags; 0x24 = 0010 0100: disables interrupts after reset
+
+// Operations: they receive the effective address from the addressing mode and do the actual work.
+// op_*_reads tells the addressing mode whether the operation reads from "address" (see indexed()).
+
+enum {
+    op_brk_reads = false,
+    op_lda_reads = true, op_ldx_reads = true, op_ldy_reads = true,
+    op_sta_reads = false, op_stx_reads = false, op_sty_reads = false,
+    op_adc_reads = true, op_sbc_reads = true,
+    op_clc_reads = false, op_sec_reads = false, op_cld_reads = false, op_sed_reads = false,
+    op_cli_reads = false, op_sei_reads = false,
+    op_pha_reads = false, op_php_reads = false, op_pla_reads = false, op_plp_reads = false,
+    op_jsr_reads = false, op_rts_reads = false, op_rti_reads = false
+};
+
+static inline void op_brk(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    update_flag(&(cpu->SR), FLAG_B, true);                  // B stays visible in SR, as before
+    interrupt(cpu, bus, cpu->PC + 1, get_status(cpu) | FLAG_U, 0xFFFE);     // skips the byte after BRK
+}
+
+static inline void op_lda(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    cpu->A = bus_read(bus, address);
+    cpu->nz = cpu->A;                                       // Z and N follow from A when SR is read
+}
+
+static inline void op_ldx(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    cpu->X = bus_read(bus, address);
+    cpu->nz = cpu->X;
+}
+
+static inline void op_ldy(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    cpu->Y = bus_read(bus, address);
+    cpu->nz = cpu->Y;
 }
 
-void execute_command(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE]) {
-    if(SHOW_PROCESSED_DATA) {
-        printf(".%04X  ", cpu->PC);
+static inline void op_sta(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    bus_write(bus, address, cpu->A);
+}
+
+static inline void op_stx(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    bus_write(bus, address, cpu->X);
+}
+
+static inline void op_sty(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    bus_write(bus, address, cpu->Y);
+}
+
+static inline void op_adc(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    uint8_t value = bus_read(bus, address);
+    if(cpu->SR & FLAG_D) {
+        add_decimal(cpu, DECIMAL_ADC, value);
+    } else {
+        add_binary(cpu, value);
+    }
+}
+
+static inline void op_sbc(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    uint8_t value = bus_read(bus, address);
+    if(cpu->SR & FLAG_D) {
+        add_decimal(cpu, DECIMAL_SBC, value);
+    } else {
+        add_binary(cpu, ~value);                            // A - value - (1 - C) = A + ~value + C
+    }
+}
+
+static inline void op_clc(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) bus, (void) address;
+    cpu->carry = 0;
+}
+
+static inline void op_sec(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) bus, (void) address;
+    cpu->carry = 1;
+}
+
+static inline void op_cld(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) bus, (void) address;
+    update_flag(&(cpu->SR), FLAG_D, false);
+}
+
+static inline void op_sed(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) bus, (void) address;
+    update_flag(&(cpu->SR), FLAG_D, true);
+}
+
+static inline void op_cli(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) bus, (void) address;
+    update_flag(&(cpu->SR), FLAG_I, false);                 // a pending IRQ is taken before the next instruction
+}
+
+static inline void op_sei(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) bus, (void) address;
+    update_flag(&(cpu->SR), FLAG_I, true);
+}
+
+static inline void op_pha(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    push(cpu, bus, cpu->A);
+}
+
+static inline void op_php(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    push(cpu, bus, get_status(cpu) | FLAG_B | FLAG_U);
+}
+
+static inline void op_pla(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    cpu->A = pull(cpu, bus);
+    cpu->nz = cpu->A;
+}
+
+static inline void op_plp(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    set_status(cpu, pull(cpu, bus));
+}
+
+static inline void op_jsr(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    uint16_t last = cpu->PC - 1;                            // the chip pushes the address of the JSR's last byte
+    push(cpu, bus, last >> 8);
+    push(cpu, bus, last & 0xFF);
+    cpu->PC = address;
+}
+
+static inline void op_rts(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    uint8_t low = pull(cpu, bus);
+    cpu->PC = (low | (pull(cpu, bus) << 8)) + 1;
+}
+
+static inline void op_rti(CPU6502 *cpu, memory_bus *bus, uint16_t address) {
+    (void) address;
+    set_status(cpu, pull(cpu, bus));
+    uint8_t low = pull(cpu, bus);
+    cpu->PC = low | (pull(cpu, bus) << 8);                  // no + 1, unlike RTS
+}
+
+
+// Opcode handlers: one function per opcode, glueing addressing mode and operation together.
+// As both are inlined, every handler compiles to straight code without any further branching on the opcode.
+// Each opcode also gets a handler for pre-decoded instructions, which takes the operand instead of fetching it.
+
+#define OPCODE(code, operation, mode)                                               \
+    static void opcode_##code(CPU6502 *cpu, memory_bus *bus) {                      \
+        operation(cpu, bus, mode(cpu, bus, operation##_reads));                     \
+    }                                                                               \
+    static void decoded_##code(CPU6502 *cpu, memory_bus *bus, uint16_t operand) {   \
+        operation(cpu, bus, mode##_operand(cpu, bus, operand, operation##_reads));  \
+    }
+
+OPCODE(00, op_brk, mode_implied)                            // BRK
+OPCODE(08, op_php, mode_implied)                            // PHP
+OPCODE(18, op_clc, mode_implied)                            // CLC
+OPCODE(20, op_jsr, mode_absolute)                           // JSR  $vwxy
+OPCODE(28, op_plp, mode_implied)                            // PLP
+OPCODE(38, op_sec, mode_implied)                            // SEC
+OPCODE(40, op_rti, mode_implied)                            // RTI
+OPCODE(48, op_pha, mode_implied)                            // PHA
+OPCODE(58, op_cli, mode_implied)                            // CLI
+OPCODE(60, op_rts, mode_implied)                            // RTS
+OPCODE(61, op_adc, mode_indexed_indirect)                   // ADC ($xy,X)
+OPCODE(65, op_adc, mode_zeropage)                           // ADC  $xy
+OPCODE(68, op_pla, mode_implied)                            // PLA
+OPCODE(69, op_adc, mode_immediate)                          // ADC #$xy
+OPCODE(6D, op_adc, mode_absolute)                           // ADC  $vwxy
+OPCODE(71, op_adc, mode_indirect_indexed)                   // ADC ($xy),Y
+OPCODE(75, op_adc, mode_zeropage_x)                         // ADC  $xy,X
+OPCODE(78, op_sei, mode_implied)                            // SEI
+OPCODE(79, op_adc, mode_absolute_y)                         // ADC  $vwxy,Y
+OPCODE(7D, op_adc, mode_absolute_x)                         // ADC  $vwxy,X
+OPCODE(81, op_sta, mode_indexed_indirect)                   // STA ($vw,X)
+OPCODE(84, op_sty, mode_zeropage)                           // STY  $vw
+OPCODE(85, op_sta, mode_zeropage)                           // STA  $vw
+OPCODE(86, op_stx, mode_zeropage)                           // STX  $vw
+OPCODE(8C, op_sty, mode_absolute)                           // STY  $vwxy
+OPCODE(8D, op_sta, mode_absolute)                           // STA  $vwxy
+OPCODE(8E, op_stx, mode_absolute)                           // STX  $vwxy
+OPCODE(91, op_sta, mode_indirect_indexed)                   // STA ($vw),Y
+OPCODE(94, op_sty, mode_zeropage_x)                         // STY  $vw,X
+OPCODE(95, op_sta, mode_zeropage_x)                         // STA  $vw,X
+OPCODE(96, op_stx, mode_zeropage_y)                         // STX  $vw,Y
+OPCODE(99, op_sta, mode_absolute_y)                         // STA  $vwxy,Y
+OPCODE(9D, op_sta, mode_absolute_x)                         // STA  $vwxy,X
+OPCODE(A0, op_ldy, mode_immediate)                          // LDY #$xy
+OPCODE(A1, op_lda, mode_indexed_indirect)                   // LDA ($xy,X)
+OPCODE(A2, op_ldx, mode_immediate)                          // LDX #$xy
+OPCODE(A4, op_ldy, mode_zeropage)                           // LDY  $xy
+OPCODE(A5, op_lda, mode_zeropage)                           // LDA  $xy
+OPCODE(A6, op_ldx, mode_zeropage)                           // LDX  $xy
+OPCODE(A9, op_lda, mode_immediate)                          // LDA #$xy
+OPCODE(AC, op_ldy, mode_absolute)                           // LDY  $vwxy
+OPCODE(AD, op_lda, mode_absolute)                           // LDA  $vwxy
+OPCODE(AE, op_ldx, mode_absolute)                           // LDX  $vwxy
+OPCODE(B1, op_lda, mode_indirect_indexed)                   // LDA ($xy),Y
+OPCODE(B4, op_ldy, mode_zeropage_x)                         // LDY  $xy,X
+OPCODE(B5, op_lda, mode_zeropage_x)                         // LDA  $xy,X
+OPCODE(B6, op_ldx, mode_zeropage_y)                         // LDX  $xy,Y
+OPCODE(B9, op_lda, mode_absolute_y)                         // LDA  $vwxy,Y
+OPCODE(BC, op_ldy, mode_absolute_x)                         // LDY  $vwxy,X
+OPCODE(BD, op_lda, mode_absolute_x)                         // LDA  $vwxy,X
+OPCODE(BE, op_ldx, mode_absolute_y)                         // LDX  $vwxy,Y
+OPCODE(D8, op_cld, mode_implied)                            // CLD
+OPCODE(E1, op_sbc, mode_indexed_indirect)                   // SBC ($xy,X)
+OPCODE(E5, op_sbc, mode_zeropage)                           // SBC  $xy
+OPCODE(E9, op_sbc, mode_immediate)                          // SBC #$xy
+OPCODE(ED, op_sbc, mode_absolute)                           // SBC  $vwxy
+OPCODE(F1, op_sbc, mode_indirect_indexed)                   // SBC ($xy),Y
+OPCODE(F5, op_sbc, mode_zeropage_x)                         // SBC  $xy,X
+OPCODE(F8, op_sed, mode_implied)                            // SED
+OPCODE(F9, op_sbc, mode_absolute_y)                         // SBC  $vwxy,Y
+OPCODE(FD, op_sbc, mode_absolute_x)                         // SBC  $vwxy,X
+
+static void opcode_unknown(CPU6502 *cpu, memory_bus *bus) {
+    (void) cpu, (void) bus;                                 // a one-byte NOP for execute_command(); run() and the
+}                                                           // other engines stop in front of it (STOP_UNKNOWN_OPCODE)
+
+static void decoded_unknown(CPU6502 *cpu, memory_bus *bus, uint16_t operand) {
+    (void) cpu, (void) bus, (void) operand;
+}
+
+
+// The dispatch table, laid out like the usual 16 x 16 opcode matrix (row = high nibble, column = low nibble).
+
+#define ___ opcode_unknown
+
+static const opcode_handler opcode_handlers[256] = {
+//   x0         x1         x2         x3   x4         x5         x6         x7   x8         x9         xA   xB   xC         xD         xE         xF
+    opcode_00, ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_08, ___,       ___, ___, ___,       ___,       ___,       ___,  // 0x
+    ___,       ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_18, ___,       ___, ___, ___,       ___,       ___,       ___,  // 1x
+    opcode_20, ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_28, ___,       ___, ___, ___,       ___,       ___,       ___,  // 2x
+    ___,       ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_38, ___,       ___, ___, ___,       ___,       ___,       ___,  // 3x
+    opcode_40, ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_48, ___,       ___, ___, ___,       ___,       ___,       ___,  // 4x
+    ___,       ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_58, ___,       ___, ___, ___,       ___,       ___,       ___,  // 5x
+    opcode_60, opcode_61, ___,       ___, ___,       opcode_65, ___,       ___, opcode_68, opcode_69, ___, ___, ___,       opcode_6D, ___,       ___,  // 6x
+    ___,       opcode_71, ___,       ___, ___,       opcode_75, ___,       ___, opcode_78, opcode_79, ___, ___, ___,       opcode_7D, ___,       ___,  // 7x
+    ___,       opcode_81, ___,       ___, opcode_84, opcode_85, opcode_86, ___, ___,       ___,       ___, ___, opcode_8C, opcode_8D, opcode_8E, ___,  // 8x
+    ___,       opcode_91, ___,       ___, opcode_94, opcode_95, opcode_96, ___, ___,       opcode_99, ___, ___, ___,       opcode_9D, ___,       ___,  // 9x
+    opcode_A0, opcode_A1, opcode_A2, ___, opcode_A4, opcode_A5, opcode_A6, ___, ___,       opcode_A9, ___, ___, opcode_AC, opcode_AD, opcode_AE, ___,  // Ax
+    ___,       opcode_B1, ___,       ___, opcode_B4, opcode_B5, opcode_B6, ___, ___,       opcode_B9, ___, ___, opcode_BC, opcode_BD, opcode_BE, ___,  // Bx
+    ___,       ___,       ___,       ___, ___,       ___,       ___,       ___, ___,       ___,       ___, ___, ___,       ___,       ___,       ___,  // Cx
+    ___,       ___,       ___,       ___, ___,       ___,       ___,       ___, opcode_D8, ___,       ___, ___, ___,       ___,       ___,       ___,  // Dx
+    ___,       opcode_E1, ___,       ___, ___,       opcode_E5, ___,       ___, ___,       opcode_E9, ___, ___, ___,       opcode_ED, ___,       ___,  // Ex
+    ___,       opcode_F1, ___,       ___, ___,       opcode_F5, ___,       ___, opcode_F8, opcode_F9, ___, ___, ___,       opcode_FD, ___,       ___   // Fx
+};
+
+#undef ___
+
+
+// All implemented opcodes, for the tables below that only list those
+
+#define IMPLEMENTED_OPCODES(X)                                                                          \
+    X(00) X(81) X(84) X(85) X(86) X(8C) X(8D) X(8E) X(91) X(94) X(95) X(96) X(99) X(9D)                 \
+    X(A0) X(A1) X(A2) X(A4) X(A5) X(A6) X(A9) X(AC) X(AD) X(AE) X(B1) X(B4) X(B5) X(B6) X(B9) X(BC)     \
+    X(BD) X(BE)                                                                                         \
+    X(18) X(38) X(D8) X(F8) X(58) X(78)                                                                 \
+    X(08) X(28) X(48) X(68) X(20) X(60) X(40)                                                           \
+    X(61) X(65) X(69) X(6D) X(71) X(75) X(79) X(7D)                                                     \
+    X(E1) X(E5) X(E9) X(ED) X(F1) X(F5) X(F9) X(FD)
+
+
+// Handlers for pre-decoded instructions; missing opcodes are unknown (one byte, no effect)
+
+#define DECODER(code) [0x##code] = decoded_##code,
+
+static const decoded_handler decoded_handlers[256] = {
+    IMPLEMENTED_OPCODES(DECODER)
+};
+
+#undef DECODER
+
+
+// Threaded dispatch with computed gotos (a GCC and Clang extension), for the benchmark: every opcode gets a label
+// with its handler inlined and its own indirect jump to the next instruction, instead of all instructions sharing
+// the indirect call of the table loop. Like that loop, it sets PC back to "first" when it reaches "end".
+// It is only a point of comparison, not an optimization: on this core it is no faster than the table loop (between
+// 0.96x and about 1x over several runs, within their noise), the handlers cost more than the dispatch. run() and
+// everything else keep the table.
+
+#ifdef __GNUC__
+#define THREADED_DISPATCH
+
+static void run_threaded(CPU6502 *cpu, memory_bus *bus, uint64_t instructions, uint16_t first, uint16_t end) {
+    void *labels[256];                                      // filled once per call, a label is local to the function
+    for(int i = 0; i < 256; i++) {
+        labels[i] = &&threaded_unknown;
+    }
+    #define LABEL(code) labels[0x##code] = &&threaded_##code;
+    IMPLEMENTED_OPCODES(LABEL)
+    #undef LABEL
+
+    #define NEXT                                                                    \
+        if(!--instructions) {                                                       \
+            return;                                                                 \
+        }                                                                           \
+        if(cpu->PC >= end) {                                                        \
+            cpu->PC = first;                                                        \
+        }                                                                           \
+        goto *labels[get_byte(cpu, bus)];
+    #define BODY(code)                                                              \
+        threaded_##code:                                                            \
+            opcode_##code(cpu, bus);                                                \
+            NEXT
+
+    if(!instructions) {
+        return;
+    }
+    if(cpu->PC >= end) {
+        cpu->PC = first;
+    }
+    goto *labels[get_byte(cpu, bus)];
+    IMPLEMENTED_OPCODES(BODY)
+    threaded_unknown:
+        NEXT
+    #undef BODY
+    #undef NEXT
+}
+#endif
+
+
+// Opcode metadata of the complete instruction set, shared by the executor (cycles, instruction lengths of the
+// pre-decoded instructions), the lockstep kernels, the profiler and the disassembler (disasm.c).
+// Base cycle counts from the 6502 manuals, as in cc6502.py; page crossing penalties of loads are added by the
+// addressing modes. Undocumented opcodes are listed as "???", one byte long, and counted like a NOP, which is how
+// the core executes every opcode it does not implement.
+
+const opcode_info opcode_table[256] = {
+    [0x00] = {"BRK", MODE_IMPLIED,           1, 7},
+    [0x01] = {"ORA", MODE_INDEXED_INDIRECT,  2, 6},
+    [0x02] = {"???", MODE_IMPLIED,           1, 2},
+    [0x03] = {"???", MODE_IMPLIED,           1, 2},
+    [0x04] = {"???", MODE_IMPLIED,           1, 2},
+    [0x05] = {"ORA", MODE_ZEROPAGE,          2, 3},
+    [0x06] = {"ASL", MODE_ZEROPAGE,          2, 5},
+    [0x07] = {"???", MODE_IMPLIED,           1, 2},
+    [0x08] = {"PHP", MODE_IMPLIED,           1, 3},
+    [0x09] = {"ORA", MODE_IMMEDIATE,         2, 2},
+    [0x0A] = {"ASL", MODE_ACCUMULATOR,       1, 2},
+    [0x0B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x0C] = {"???", MODE_IMPLIED,           1, 2},
+    [0x0D] = {"ORA", MODE_ABSOLUTE,          3, 4},
+    [0x0E] = {"ASL", MODE_ABSOLUTE,          3, 6},
+    [0x0F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x10] = {"BPL", MODE_RELATIVE,          2, 2},
+    [0x11] = {"ORA", MODE_INDIRECT_INDEXED,  2, 5},
+    [0x12] = {"???", MODE_IMPLIED,           1, 2},
+    [0x13] = {"???", MODE_IMPLIED,           1, 2},
+    [0x14] = {"???", MODE_IMPLIED,           1, 2},
+    [0x15] = {"ORA", MODE_ZEROPAGE_X,        2, 4},
+    [0x16] = {"ASL", MODE_ZEROPAGE_X,        2, 6},
+    [0x17] = {"???", MODE_IMPLIED,           1, 2},
+    [0x18] = {"CLC", MODE_IMPLIED,           1, 2},
+    [0x19] = {"ORA", MODE_ABSOLUTE_Y,        3, 4},
+    [0x1A] = {"???", MODE_IMPLIED,           1, 2},
+    [0x1B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x1C] = {"???", MODE_IMPLIED,           1, 2},
+    [0x1D] = {"ORA", MODE_ABSOLUTE_X,        3, 4},
+    [0x1E] = {"ASL", MODE_ABSOLUTE_X,        3, 7},
+    [0x1F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x20] = {"JSR", MODE_ABSOLUTE,          3, 6},
+    [0x21] = {"AND", MODE_INDEXED_INDIRECT,  2, 6},
+    [0x22] = {"???", MODE_IMPLIED,           1, 2},
+    [0x23] = {"???", MODE_IMPLIED,           1, 2},
+    [0x24] = {"BIT", MODE_ZEROPAGE,          2, 3},
+    [0x25] = {"AND", MODE_ZEROPAGE,          2, 3},
+    [0x26] = {"ROL", MODE_ZEROPAGE,          2, 5},
+    [0x27] = {"???", MODE_IMPLIED,           1, 2},
+    [0x28] = {"PLP", MODE_IMPLIED,           1, 4},
+    [0x29] = {"AND", MODE_IMMEDIATE,         2, 2},
+    [0x2A] = {"ROL", MODE_ACCUMULATOR,       1, 2},
+    [0x2B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x2C] = {"BIT", MODE_ABSOLUTE,          3, 4},
+    [0x2D] = {"AND", MODE_ABSOLUTE,          3, 4},
+    [0x2E] = {"ROL", MODE_ABSOLUTE,          3, 6},
+    [0x2F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x30] = {"BMI", MODE_RELATIVE,          2, 2},
+    [0x31] = {"AND", MODE_INDIRECT_INDEXED,  2, 5},
+    [0x32] = {"???", MODE_IMPLIED,           1, 2},
+    [0x33] = {"???", MODE_IMPLIED,           1, 2},
+    [0x34] = {"???", MODE_IMPLIED,           1, 2},
+    [0x35] = {"AND", MODE_ZEROPAGE_X,        2, 4},
+    [0x36] = {"ROL", MODE_ZEROPAGE_X,        2, 6},
+    [0x37] = {"???", MODE_IMPLIED,           1, 2},
+    [0x38] = {"SEC", MODE_IMPLIED,           1, 2},
+    [0x39] = {"AND", MODE_ABSOLUTE_Y,        3, 4},
+    [0x3A] = {"???", MODE_IMPLIED,           1, 2},
+    [0x3B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x3C] = {"???", MODE_IMPLIED,           1, 2},
+    [0x3D] = {"AND", MODE_ABSOLUTE_X,        3, 4},
+    [0x3E] = {"ROL", MODE_ABSOLUTE_X,        3, 7},
+    [0x3F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x40] = {"RTI", MODE_IMPLIED,           1, 6},
+    [0x41] = {"EOR", MODE_INDEXED_INDIRECT,  2, 6},
+    [0x42] = {"???", MODE_IMPLIED,           1, 2},
+    [0x43] = {"???", MODE_IMPLIED,           1, 2},
+    [0x44] = {"???", MODE_IMPLIED,           1, 2},
+    [0x45] = {"EOR", MODE_ZEROPAGE,          2, 3},
+    [0x46] = {"LSR", MODE_ZEROPAGE,          2, 5},
+    [0x47] = {"???", MODE_IMPLIED,           1, 2},
+    [0x48] = {"PHA", MODE_IMPLIED,           1, 3},
+    [0x49] = {"EOR", MODE_IMMEDIATE,         2, 2},
+    [0x4A] = {"LSR", MODE_ACCUMULATOR,       1, 2},
+    [0x4B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x4C] = {"JMP", MODE_ABSOLUTE,          3, 3},
+    [0x4D] = {"EOR", MODE_ABSOLUTE,          3, 4},
+    [0x4E] = {"LSR", MODE_ABSOLUTE,          3, 6},
+    [0x4F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x50] = {"BVC", MODE_RELATIVE,          2, 2},
+    [0x51] = {"EOR", MODE_INDIRECT_INDEXED,  2, 5},
+    [0x52] = {"???", MODE_IMPLIED,           1, 2},
+    [0x53] = {"???", MODE_IMPLIED,           1, 2},
+    [0x54] = {"???", MODE_IMPLIED,           1, 2},
+    [0x55] = {"EOR", MODE_ZEROPAGE_X,        2, 4},
+    [0x56] = {"LSR", MODE_ZEROPAGE_X,        2, 6},
+    [0x57] = {"???", MODE_IMPLIED,           1, 2},
+    [0x58] = {"CLI", MODE_IMPLIED,           1, 2},
+    [0x59] = {"EOR", MODE_ABSOLUTE_Y,        3, 4},
+    [0x5A] = {"???", MODE_IMPLIED,           1, 2},
+    [0x5B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x5C] = {"???", MODE_IMPLIED,           1, 2},
+    [0x5D] = {"EOR", MODE_ABSOLUTE_X,        3, 4},
+    [0x5E] = {"LSR", MODE_ABSOLUTE_X,        3, 7},
+    [0x5F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x60] = {"RTS", MODE_IMPLIED,           1, 6},
+    [0x61] = {"ADC", MODE_INDEXED_INDIRECT,  2, 6},
+    [0x62] = {"???", MODE_IMPLIED,           1, 2},
+    [0x63] = {"???", MODE_IMPLIED,           1, 2},
+    [0x64] = {"???", MODE_IMPLIED,           1, 2},
+    [0x65] = {"ADC", MODE_ZEROPAGE,          2, 3},
+    [0x66] = {"ROR", MODE_ZEROPAGE,          2, 5},
+    [0x67] = {"???", MODE_IMPLIED,           1, 2},
+    [0x68] = {"PLA", MODE_IMPLIED,           1, 4},
+    [0x69] = {"ADC", MODE_IMMEDIATE,         2, 2},
+    [0x6A] = {"ROR", MODE_ACCUMULATOR,       1, 2},
+    [0x6B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x6C] = {"JMP", MODE_INDIRECT,          3, 5},
+    [0x6D] = {"ADC", MODE_ABSOLUTE,          3, 4},
+    [0x6E] = {"ROR", MODE_ABSOLUTE,          3, 6},
+    [0x6F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x70] = {"BVS", MODE_RELATIVE,          2, 2},
+    [0x71] = {"ADC", MODE_INDIRECT_INDEXED,  2, 5},
+    [0x72] = {"???", MODE_IMPLIED,           1, 2},
+    [0x73] = {"???", MODE_IMPLIED,           1, 2},
+    [0x74] = {"???", MODE_IMPLIED,           1, 2},
+    [0x75] = {"ADC", MODE_ZEROPAGE_X,        2, 4},
+    [0x76] = {"ROR", MODE_ZEROPAGE_X,        2, 6},
+    [0x77] = {"???", MODE_IMPLIED,           1, 2},
+    [0x78] = {"SEI", MODE_IMPLIED,           1, 2},
+    [0x79] = {"ADC", MODE_ABSOLUTE_Y,        3, 4},
+    [0x7A] = {"???", MODE_IMPLIED,           1, 2},
+    [0x7B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x7C] = {"???", MODE_IMPLIED,           1, 2},
+    [0x7D] = {"ADC", MODE_ABSOLUTE_X,        3, 4},
+    [0x7E] = {"ROR", MODE_ABSOLUTE_X,        3, 7},
+    [0x7F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x80] = {"???", MODE_IMPLIED,           1, 2},
+    [0x81] = {"STA", MODE_INDEXED_INDIRECT,  2, 6},
+    [0x82] = {"???", MODE_IMPLIED,           1, 2},
+    [0x83] = {"???", MODE_IMPLIED,           1, 2},
+    [0x84] = {"STY", MODE_ZEROPAGE,          2, 3},
+    [0x85] = {"STA", MODE_ZEROPAGE,          2, 3},
+    [0x86] = {"STX", MODE_ZEROPAGE,          2, 3},
+    [0x87] = {"???", MODE_IMPLIED,           1, 2},
+    [0x88] = {"DEY", MODE_IMPLIED,           1, 2},
+    [0x89] = {"???", MODE_IMPLIED,           1, 2},
+    [0x8A] = {"TXA", MODE_IMPLIED,           1, 2},
+    [0x8B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x8C] = {"STY", MODE_ABSOLUTE,          3, 4},
+    [0x8D] = {"STA", MODE_ABSOLUTE,          3, 4},
+    [0x8E] = {"STX", MODE_ABSOLUTE,          3, 4},
+    [0x8F] = {"???", MODE_IMPLIED,           1, 2},
+    [0x90] = {"BCC", MODE_RELATIVE,          2, 2},
+    [0x91] = {"STA", MODE_INDIRECT_INDEXED,  2, 6},
+    [0x92] = {"???", MODE_IMPLIED,           1, 2},
+    [0x93] = {"???", MODE_IMPLIED,           1, 2},
+    [0x94] = {"STY", MODE_ZEROPAGE_X,        2, 4},
+    [0x95] = {"STA", MODE_ZEROPAGE_X,        2, 4},
+    [0x96] = {"STX", MODE_ZEROPAGE_Y,        2, 4},
+    [0x97] = {"???", MODE_IMPLIED,           1, 2},
+    [0x98] = {"TYA", MODE_IMPLIED,           1, 2},
+    [0x99] = {"STA", MODE_ABSOLUTE_Y,        3, 5},
+    [0x9A] = {"TXS", MODE_IMPLIED,           1, 2},
+    [0x9B] = {"???", MODE_IMPLIED,           1, 2},
+    [0x9C] = {"???", MODE_IMPLIED,           1, 2},
+    [0x9D] = {"STA", MODE_ABSOLUTE_X,        3, 5},
+    [0x9E] = {"???", MODE_IMPLIED,           1, 2},
+    [0x9F] = {"???", MODE_IMPLIED,           1, 2},
+    [0xA0] = {"LDY", MODE_IMMEDIATE,         2, 2},
+    [0xA1] = {"LDA", MODE_INDEXED_INDIRECT,  2, 6},
+    [0xA2] = {"LDX", MODE_IMMEDIATE,         2, 2},
+    [0xA3] = {"???", MODE_IMPLIED,           1, 2},
+    [0xA4] = {"LDY", MODE_ZEROPAGE,          2, 3},
+    [0xA5] = {"LDA", MODE_ZEROPAGE,          2, 3},
+    [0xA6] = {"LDX", MODE_ZEROPAGE,          2, 3},
+    [0xA7] = {"???", MODE_IMPLIED,           1, 2},
+    [0xA8] = {"TAY", MODE_IMPLIED,           1, 2},
+    [0xA9] = {"LDA", MODE_IMMEDIATE,         2, 2},
+    [0xAA] = {"TAX", MODE_IMPLIED,           1, 2},
+    [0xAB] = {"???", MODE_IMPLIED,           1, 2},
+    [0xAC] = {"LDY", MODE_ABSOLUTE,          3, 4},
+    [0xAD] = {"LDA", MODE_ABSOLUTE,          3, 4},
+    [0xAE] = {"LDX", MODE_ABSOLUTE,          3, 4},
+    [0xAF] = {"???", MODE_IMPLIED,           1, 2},
+    [0xB0] = {"BCS", MODE_RELATIVE,          2, 2},
+    [0xB1] = {"LDA", MODE_INDIRECT_INDEXED,  2, 5},
+    [0xB2] = {"???", MODE_IMPLIED,           1, 2},
+    [0xB3] = {"???", MODE_IMPLIED,           1, 2},
+    [0xB4] = {"LDY", MODE_ZEROPAGE_X,        2, 4},
+    [0xB5] = {"LDA", MODE_ZEROPAGE_X,        2, 4},
+    [0xB6] = {"LDX", MODE_ZEROPAGE_Y,        2, 4},
+    [0xB7] = {"???", MODE_IMPLIED,           1, 2},
+    [0xB8] = {"CLV", MODE_IMPLIED,           1, 2},
+    [0xB9] = {"LDA", MODE_ABSOLUTE_Y,        3, 4},
+    [0xBA] = {"TSX", MODE_IMPLIED,           1, 2},
+    [0xBB] = {"???", MODE_IMPLIED,           1, 2},
+    [0xBC] = {"LDY", MODE_ABSOLUTE_X,        3, 4},
+    [0xBD] = {"LDA", MODE_ABSOLUTE_X,        3, 4},
+    [0xBE] = {"LDX", MODE_ABSOLUTE_Y,        3, 4},
+    [0xBF] = {"???", MODE_IMPLIED,           1, 2},
+    [0xC0] = {"CPY", MODE_IMMEDIATE,         2, 2},
+    [0xC1] = {"CMP", MODE_INDEXED_INDIRECT,  2, 6},
+    [0xC2] = {"???", MODE_IMPLIED,           1, 2},
+    [0xC3] = {"???", MODE_IMPLIED,           1, 2},
+    [0xC4] = {"CPY", MODE_ZEROPAGE,          2, 3},
+    [0xC5] = {"CMP", MODE_ZEROPAGE,          2, 3},
+    [0xC6] = {"DEC", MODE_ZEROPAGE,          2, 5},
+    [0xC7] = {"???", MODE_IMPLIED,           1, 2},
+    [0xC8] = {"INY", MODE_IMPLIED,           1, 2},
+    [0xC9] = {"CMP", MODE_IMMEDIATE,         2, 2},
+    [0xCA] = {"DEX", MODE_IMPLIED,           1, 2},
+    [0xCB] = {"???", MODE_IMPLIED,           1, 2},
+    [0xCC] = {"CPY", MODE_ABSOLUTE,          3, 4},
+    [0xCD] = {"CMP", MODE_ABSOLUTE,          3, 4},
+    [0xCE] = {"DEC", MODE_ABSOLUTE,          3, 6},
+    [0xCF] = {"???", MODE_IMPLIED,           1, 2},
+    [0xD0] = {"BNE", MODE_RELATIVE,          2, 2},
+    [0xD1] = {"CMP", MODE_INDIRECT_INDEXED,  2, 5},
+    [0xD2] = {"???", MODE_IMPLIED,           1, 2},
+    [0xD3] = {"???", MODE_IMPLIED,           1, 2},
+    [0xD4] = {"???", MODE_IMPLIED,           1, 2},
+    [0xD5] = {"CMP", MODE_ZEROPAGE_X,        2, 4},
+    [0xD6] = {"DEC", MODE_ZEROPAGE_X,        2, 6},
+    [0xD7] = {"???", MODE_IMPLIED,           1, 2},
+    [0xD8] = {"CLD", MODE_IMPLIED,           1, 2},
+    [0xD9] = {"CMP", MODE_ABSOLUTE_Y,        3, 4},
+    [0xDA] = {"???", MODE_IMPLIED,           1, 2},
+    [0xDB] = {"???", MODE_IMPLIED,           1, 2},
+    [0xDC] = {"???", MODE_IMPLIED,           1, 2},
+    [0xDD] = {"CMP", MODE_ABSOLUTE_X,        3, 4},
+    [0xDE] = {"DEC", MODE_ABSOLUTE_X,        3, 7},
+    [0xDF] = {"???", MODE_IMPLIED,           1, 2},
+    [0xE0] = {"CPX", MODE_IMMEDIATE,         2, 2},
+    [0xE1] = {"SBC", MODE_INDEXED_INDIRECT,  2, 6},
+    [0xE2] = {"???", MODE_IMPLIED,           1, 2},
+    [0xE3] = {"???", MODE_IMPLIED,           1, 2},
+    [0xE4] = {"CPX", MODE_ZEROPAGE,          2, 3},
+    [0xE5] = {"SBC", MODE_ZEROPAGE,          2, 3},
+    [0xE6] = {"INC", MODE_ZEROPAGE,          2, 5},
+    [0xE7] = {"???", MODE_IMPLIED,           1, 2},
+    [0xE8] = {"INX", MODE_IMPLIED,           1, 2},
+    [0xE9] = {"SBC", MODE_IMMEDIATE,         2, 2},
+    [0xEA] = {"NOP", MODE_IMPLIED,           1, 2},
+    [0xEB] = {"???", MODE_IMPLIED,           1, 2},
+    [0xEC] = {"CPX", MODE_ABSOLUTE,          3, 4},
+    [0xED] = {"SBC", MODE_ABSOLUTE,          3, 4},
+    [0xEE] = {"INC", MODE_ABSOLUTE,          3, 6},
+    [0xEF] = {"???", MODE_IMPLIED,           1, 2},
+    [0xF0] = {"BEQ", MODE_RELATIVE,          2, 2},
+    [0xF1] = {"SBC", MODE_INDIRECT_INDEXED,  2, 5},
+    [0xF2] = {"???", MODE_IMPLIED,           1, 2},
+    [0xF3] = {"???", MODE_IMPLIED,           1, 2},
+    [0xF4] = {"???", MODE_IMPLIED,           1, 2},
+    [0xF5] = {"SBC", MODE_ZEROPAGE_X,        2, 4},
+    [0xF6] = {"INC", MODE_ZEROPAGE_X,        2, 6},
+    [0xF7] = {"???", MODE_IMPLIED,           1, 2},
+    [0xF8] = {"SED", MODE_IMPLIED,           1, 2},
+    [0xF9] = {"SBC", MODE_ABSOLUTE_Y,        3, 4},
+    [0xFA] = {"???", MODE_IMPLIED,           1, 2},
+    [0xFB] = {"???", MODE_IMPLIED,           1, 2},
+    [0xFC] = {"???", MODE_IMPLIED,           1, 2},
+    [0xFD] = {"SBC", MODE_ABSOLUTE_X,        3, 4},
+    [0xFE] = {"INC", MODE_ABSOLUTE_X,        3, 7},
+    [0xFF] = {"???", MODE_IMPLIED,           1, 2}
+};
+
+
+// One instruction: fetch, dispatch, count cycles. Returns the opcode so that run() can react to BRK.
+
+static inline uint8_t step(CPU6502 *cpu, memory_bus *bus) {
+    uint8_t opcode = get_byte(cpu, bus);
+    opcode_handlers[opcode](cpu, bus);                      // one table lookup, one call
+    cpu->cycles += opcode_table[opcode].cycles;
+    return opcode;
+}
+
+uint8_t execute_command(CPU6502 *cpu, memory_bus *bus) {
+    return step(cpu, bus);                                  // output is done by the caller
+}
+
+
+// Decodes the instruction at "address" once, for as many executions as the caller likes (see cache.c).
+
+decoded_instruction decode_instruction(memory_bus *bus, uint16_t address) {
+    uint8_t opcode = bus_read(bus, address);
+    decoded_instruction instruction = {decoded_unknown, 0, opcode_table[opcode].cycles, 1, opcode};
+
+    if(decoded_handlers[opcode]) {
+        instruction.handler = decoded_handlers[opcode];
+        instruction.length = opcode_table[opcode].length;
+    }
+    if(instruction.length >= 2) {
+        instruction.operand = bus_read(bus, (uint16_t) (address + 1));
     }
-    uint8_t opcode = get_byte(cpu, memory);
+    if(instruction.length == 3) {
+        instruction.operand |= bus_read(bus, (uint16_t) (address + 2)) << 8;
+    }
+    return instruction;
+}
+
+
+// Runs until the budget is used up, BRK has been executed, a breakpoint or an unknown opcode is reached, or an
+// interrupt is requested.
+// All optional checks test a pointer that does not change during the call, so the branches are always predicted
+// correctly. The breakpoint at the very first instruction is ignored, so that a call after STOP_BREAKPOINT continues.
+
+run_result run(CPU6502 *cpu, memory_bus *bus, run_budget budget) {
+    run_result result = {STOP_BUDGET, 0, 0};
+    uint64_t first_cycle = cpu->cycles;
+    uint64_t cycle_limit = budget.cycles ? first_cycle + budget.cycles : UINT64_MAX;
+    uint64_t instruction_limit = budget.instructions ? budget.instructions : UINT64_MAX;
+
+    while(result.instructions < instruction_limit && cpu->cycles < cycle_limit) {
+        if(budget.interrupt_request && *budget.interrupt_request) {
+            result.reason = STOP_INTERRUPT;
+            break;
+        }
+        if(interrupt_pending(cpu)) {                        // IRQ or NMI: the handler is next
+            service_interrupt(cpu, bus);
+        }
+        if(budget.breakpoints && result.instructions && (budget.breakpoints[cpu->PC >> 3] & (1 << (cpu->PC & 7)))) {
+            result.reason = STOP_BREAKPOINT;
+            break;
+        }
+
+        uint16_t start = cpu->PC;
+        uint64_t cycle = cpu->cycles;
+        uint8_t bytes[3];
+        if(budget.trace) {
+            trace_fetch_begin(bus, start, bytes);
+        }
+        uint8_t opcode = step(cpu, bus);
+        if(__builtin_expect(opcode_handlers[opcode] == opcode_unknown, 0)) {  // undone: fetched, but not executed
+            cpu->PC = start;
+            cpu->cycles = cycle;
+            result.reason = STOP_UNKNOWN_OPCODE;
+            break;
+        }
+        result.instructions++;
+        if(budget.trace) {
+            trace_fetch_end(bus, start, bytes);
+            trace_instruction(budget.trace, cpu, start, cycle, bytes);
+        }
+        if(budget.profile) {
+            profile_instruction(budget.profile, opcode, start, cpu->PC, cpu->cycles - cycle);
+        }
+        if(opcode == 0x00) {                                // BRK
+            result.reason = STOP_BRK;
+            break;
+        }
+    }
+    result.cycles = cpu->cycles - first_cycle;
+    return result;
+}
+
+void set_breakpoint(uint8_t breakpoints[MEMORY_SIZE / 8], uint16_t address, bool set) {
+    if(set) {
+        breakpoints[address >> 3] |= 1 << (address & 7);    // one bit per address
+    } else {
+        breakpoints[address >> 3] &= ~(1 << (address & 7));
+    }
+}
+
+const char* stop_reason_name(stop_reason reason) {
+    static const char *names[] = {"budget", "BRK", "breakpoint", "interrupt", "watchpoint", "unknown opcode"};
+    return names[reason];
+}
+
+
+// Machines: a CPU together with its own memory and memory bus. The core keeps no state outside of CPU6502 and the bus,
+// so any number of machines can run side by side, also in different threads. New machines are flat 64 KB of RAM.
+
+machine* create_machine(void) {
+    machine *m = calloc(1, sizeof(machine));                // memory filled with zeros
+    if(!m) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    set_machine_profile(m, PROFILE_FLAT);
+    reset_cpu(&m->cpu);
+    return m;
+}
+
+void destroy_machine(machine *m) {
+    if(!m) {
+        return;
+    }
+    stop_recording(m);                                      // the recording stays, without the machine
+    stop_dirty_tracking(m);                                 // releases snapshot pages
+    disable_translation_cache(m);
+    free(m);
+}
+
+void reset_machine(machine *m) {                            // clears RAM and I/O registers as well (not the ROMs)
+    mark_all_dirty(m);
+    memset(m->memory, 0, MEMORY_SIZE);
+    memset(m->io, 0, IO_SIZE);
+    reset_cpu(&m->cpu);
+}
+
+bool load_image(machine *m, const uint8_t *image, size_t size, uint16_t address) {
+    if(size > (size_t) (MEMORY_SIZE - address)) {           // no wrapping around $FFFF
+        printf("Image of %zu bytes does not fit at %04X.\n", size, address);
+        return false;
+    }
+    mark_dirty(m, address, size);
+    memcpy(m->memory + address, image, size);
+    return true;
+}
+
+static run_result run_engine(machine *m, run_budget budget) {
+    if(budget.debugger) {
+        return run_debug(m, budget);
+    }
+    if(m->cache) {
+        return run_translated(m, budget);
+    }
+    return run(&m->cpu, &m->bus, budget);
+}
+
+
+// With scheduled events (events.c), the budget is cut into slices that end at the cycle of the next event, and the
+// events that are due are called between the slices. The budget applies to the whole call, as in run_paced().
+
+run_result run_machine(machine *m, run_budget budget) {
+    if(m->event_count == 0) {
+        return run_engine(m, budget);
+    }
+
+    run_result result = {STOP_BUDGET, 0, 0};
+    uint64_t first_cycle = m->cpu.cycles;
+    uint64_t cycle_limit = budget.cycles ? first_cycle + budget.cycles : UINT64_MAX;
+    while(true) {
+        dispatch_events(m);
+        if(m->cpu.cycles >= cycle_limit || (budget.instructions && result.instructions >= budget.instructions)) {
+            break;
+        }
+        uint16_t PC = m->cpu.PC;                            // run() ignores the breakpoint at its first instruction
+        if(budget.breakpoints && result.instructions && (budget.breakpoints[PC >> 3] & (1 << (PC & 7)))) {
+            result.reason = STOP_BREAKPOINT;
+            break;
+        }
+
+        run_budget slice = budget;
+        uint64_t end = m->event_count && m->events[0].cycle < cycle_limit ? m->events[0].cycle : cycle_limit;
+        slice.cycles = end == UINT64_MAX ? 0 : end - m->cpu.cycles;
+        if(budget.instructions) {
+            slice.instructions = budget.instructions - result.instructions;
+        }
+        run_result part = run_engine(m, slice);
+        result.instructions += part.instructions;
+        if(part.reason != STOP_BUDGET) {
+            result.reason = part.reason;
+            break;
+        }
+    }
+    result.cycles = m->cpu.cycles - first_cycle;
+    return result;
+}
+
+
+// Real-time pacing: runs slices of PACING_SLICE cycles at full speed and sleeps until the moment the real chip would
+// have finished them, so there is no sleep per instruction. The deadlines are absolute (start time + cycles / clock
+// speed), so a late wake-up is made up in the next slice. The budget applies to the whole call.
+
+#define PACING_SLICE 20000                                  // cycles: 20 ms at 1 MHz
+
+run_result run_paced(machine *m, run_budget budget, uint64_t clock_speed) {
+    run_result result = {STOP_BUDGET, 0, 0};
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(true) {
+        run_budget slice = budget;
+        slice.cycles = PACING_SLICE;
+        if(budget.cycles) {
+            if(result.cycles >= budget.cycles) {
+                break;
+            }
+            slice.cycles = budget.cycles - result.cycles < PACING_SLICE ? budget.cycles - result.cycles : PACING_SLICE;
+        }
+        if(budget.instructions) {
+            if(result.instructions >= budget.instructions) {
+                break;
+            }
+            slice.instructions = budget.instructions - result.instructions;
+        }
+        uint16_t PC = m->cpu.PC;                            // run() ignores the breakpoint at its first instruction
+        if(budget.breakpoints && result.instructions && (budget.breakpoints[PC >> 3] & (1 << (PC & 7)))) {
+            result.reason = STOP_BREAKPOINT;
+            break;
+        }
+
+        run_result part = run_machine(m, slice);
+        result.cycles += part.cycles;
+        result.instructions += part.instructions;
+
+        struct timespec deadline = start;                   // in two parts, so that the product cannot overflow
+        deadline.tv_sec += result.cycles / clock_speed;
+        deadline.tv_nsec += (result.cycles % clock_speed) * 1000000000 / clock_speed;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+        if(part.reason != STOP_BUDGET) {
+            result.reason = part.reason;
+            break;
+        }
+    }
+    return result;
+}
+
+bool opcode_implemented(uint8_t opcode) {
+    return opcode_handlers[opcode] != opcode_unknown;
+}
+
+void show_cpu_status(CPU6502 cpu) {
+    uint8_t SR = get_status(&cpu);
+    printf(" A: %02X  |   X: %02X  |   Y: %02X    |  NV-BDIZC\n", cpu.A, cpu.X, cpu.Y);
+    printf("SP: %02X  |  SR: %02X  |  PC: %04X  |  %d%d%d%d%d%d%d%d\n\n", cpu.SP, SR, cpu.PC, check_flag(SR, FLAG_N), check_flag(SR, FLAG_V), check_flag(SR, FLAG_U), check_flag(SR, FLAG_B), check_flag(SR, FLAG_D), check_flag(SR, FLAG_I), check_flag(SR, FLAG_Z), check_flag(SR, FLAG_C));
+}
+
+bool check_flag(uint8_t SR, uint8_t flag) {                 // check if flag has been set (by doing a bitwise AND
+    return (SR & flag) != 0;                                // and comparing to "NOT 0" to get a bool value)
+}
+
+void update_flag(uint8_t *SR, uint8_t flag, bool set) {     // update a flag
+    if(set) {                                               // set flag by doing a bitwise OR with 1
+        *SR |= flag;
+    } else {                                                // clear flag by doing a bitwise AND with an inverted bit mask
+        *SR &= ~flag;
+    }
+}
+
+uint8_t get_byte(CPU6502* cpu, memory_bus *bus) {
+    uint8_t byte = bus_fetch(bus, cpu->PC);                       // processed bytes are shown by the trace, not here
+    cpu->PC++;
+    return byte;
+}
+
+void show_memory_dump(uint16_t start, uint16_t end, uint8_t memory[MEMORY_SIZE]) {
+    printf("       Memory dump from %04X to %04X\n", start, end);
+    uint16_t location = start;
+    int linebreak_counter = 0;
+
+    // As uint16_t wraps around from FFFF to 0000, I cannot do this with a for loop
+    while(1) {
+        if(!(linebreak_counter % 10) || location == start) {
+            printf("\n.%04X  ", location);
+            linebreak_counter = 0;
+        }
+        printf("%02X ", memory[location]);
+        if(location == end) {
+            printf("\n\n");
+            return;
+        }
+        location++;
+        linebreak_counter++;
+    }
+}
+
+
+// Check of the decimal tables (./6502 -g): ADC and SBC #$xx with the decimal flag set for all 131,072 combinations
+// of A, operand and carry each, against a reference computed differently from prepare_decimal_tables() (as in VICE,
+// which follows the NMOS chip): result in the low byte, flags C, Z, V, N in the high byte. Z always comes from the
+// binary result, and SBC sets all flags as in binary mode. Then the worked examples of the decimal mode tutorial on
+// 6502.org, and ADC against the model of alu.py (the binary sum followed by its bcd_correction()) where that is
+// exact: valid BCD inputs whose digit sums do not carry.
+
+static uint16_t decimal_reference(bool subtract, int a, int b, int carry) {
+    int binary = subtract ? a - b - !carry : a + b + carry;
+    uint8_t flags = ((uint8_t) binary == 0 ? FLAG_Z : 0);
+    int result;
+    if(subtract) {
+        int low = (a & 0x0F) - (b & 0x0F) - !carry;
+        result = low & 0x10 ? ((low - 6) & 0x0F) | ((a & 0xF0) - (b & 0xF0) - 0x10)
+                            : (low & 0x0F) | ((a & 0xF0) - (b & 0xF0));
+        if(result & 0x100) {
+            result -= 0x60;
+        }
+        flags |= (binary & FLAG_N) | (binary >= 0 ? FLAG_C : 0) | ((a ^ b) & (a ^ binary) & 0x80 ? FLAG_V : 0);
+    } else {
+        int low = (a & 0x0F) + (b & 0x0F) + carry;
+        if(low > 9) {
+            low += 6;
+        }
+        result = (low & 0x0F) + (a & 0xF0) + (b & 0xF0) + (low > 0x0F ? 0x10 : 0);
+        flags |= (result & FLAG_N) | (((a ^ result) & 0x80) && !((a ^ b) & 0x80) ? FLAG_V : 0);
+        if((result & 0x1F0) > 0x90) {
+            result += 0x60;
+        }
+        flags |= (result & 0xFF0) > 0xF0 ? FLAG_C : 0;
+    }
+    return (uint8_t) result | flags << 8;
+}
+
+static uint8_t bcd_correction(int result) {                 // as in alu.py, on the binary sum
+    int low_nibble = result & 0x0F, high_nibble = (result >> 4) & 0x0F;
+    if(low_nibble > 9) {
+        result += 6;
+    }
+    if(high_nibble > 9) {
+        result += 0x60;
+    }
+    return (uint8_t) result;
+}
+
+bool check_decimal(void) {
+    static const uint8_t examples[][5] = {                  // operation, A, operand, carry, result
+        {0, 0x12, 0x34, 0, 0x46}, {0, 0x15, 0x26, 0, 0x41}, {0, 0x81, 0x92, 0, 0x73}, {0, 0x58, 0x46, 1, 0x05},
+        {1, 0x46, 0x12, 1, 0x34}, {1, 0x40, 0x13, 1, 0x27}, {1, 0x32, 0x02, 0, 0x29}, {1, 0x12, 0x21, 1, 0x91},
+        {1, 0x21, 0x34, 1, 0x87}
+    };
+    machine *m = create_machine();
+    if(!m) {
+        return false;
+    }
+    CPU6502 *cpu = &m->cpu;
+    size_t mismatches = 0, examples_wrong = 0, bcd_inputs = 0, bcd_wrong = 0;
+
+    for(int operation = 0; operation < 2; operation++) {
+        m->memory[0x0200] = operation ? 0xE9 : 0x69;        // SBC / ADC #$xx
+        for(int i = 0; i < 2 * 256 * 256; i++) {
+            int a = (i >> 8) & 0xFF, b = i & 0xFF, carry = i >> 16;
+            m->memory[0x0201] = b;
+            cpu->PC = 0x0200;
+            cpu->A = a;
+            set_status(cpu, FLAG_U | FLAG_D | carry);
+            execute_command(cpu, &m->bus);
+            uint8_t status = get_status(cpu) & (FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
+            uint16_t expected = decimal_reference(operation, a, b, carry);
+            if(cpu->A != (expected & 0xFF) || status != expected >> 8) {
+                if(mismatches++ < 10) {
+                    printf("Decimal %s $%02X, $%02X, %d: core $%02X, flags $%02X; reference $%02X, flags $%02X\n",
+                           operation ? "SBC" : "ADC", a, b, carry, cpu->A, status, expected & 0xFF, expected >> 8);
+                }
+            }
+            for(size_t e = 0; e < sizeof(examples) / sizeof(examples[0]); e++) {
+                const uint8_t *x = examples[e];
+                examples_wrong += x[0] == operation && x[1] == a && x[2] == b && x[3] == carry && cpu->A != x[4];
+            }
+            if(!operation && (a & 0x0F) + (b & 0x0F) + carry <= 9 && (a >> 4) + (b >> 4) <= 9) {
+                bcd_inputs++;                               // valid BCD, no digit carries: alu.py is exact here
+                bcd_wrong += cpu->A != bcd_correction((uint8_t) (a + b + carry));
+            }
+        }
+    }
+    printf("Decimal mode: %d ADC and SBC inputs, %zu mismatches with the reference model; %zu of %zu examples and "
+           "%zu of %zu ADC inputs of alu.py differ\n", 2 * 2 * 256 * 256, mismatches, examples_wrong,
+           sizeof(examples) / sizeof(examples[0]), bcd_wrong, bcd_inputs);
+    destroy_machine(m);
+    return mismatches + examples_wrong + bcd_wrong == 0;
+}
+
+
+// Dispatch benchmark: runs the same instruction mix through the table-driven core and through the original switch,
+// then through run() with and without the translation cache (cache.c).
+// The code block at $0200 uses every load and STA opcode, the instructions the original switch-based core knows, so
+// that all engines run the same instruction stream (the switch core would skip STX/STY as one-byte no-ops and run
+// their operands as opcodes). Indexed and indirect instructions only run with known X/Y values, so stores never hit
+// the code itself. When PC leaves the block, it is simply set back to its start.
+
+void benchmark(uint64_t instructions) {
+    static const uint8_t code[] = {
+        0xA6, 0x11,         0xAE, 0x01, 0x80,   0xA4, 0x13,         0xAC, 0x03, 0x80,   // X and Y from memory
+        0xA9, 0x42,         0xA5, 0x10,         0xAD, 0x00, 0x80,   0x85, 0x30,         0x8D, 0x00, 0x81,
+        0xA2, 0x03,         0xA0, 0x05,                                                 // known X and Y for indexing
+        0xBD, 0x00, 0x80,   0xB5, 0x10,         0xA1, 0x20,         0xB9, 0x10, 0x80,   0xB1, 0x22,
+        0x95, 0x31,         0x9D, 0x00, 0x81,   0x99, 0x00, 0x81,   0x81, 0x20,         0x91, 0x22,
+        0xB6, 0x12,         0xBE, 0x02, 0x80,   0xB4, 0x14,         0xBC, 0x04, 0x80
+    };
+    const uint16_t code_start = 0x0200, code_end = code_start + sizeof(code);
+    enum {SWITCH, TABLE, THREADED, RUN, CACHE, ENGINES};
+    const char *names[ENGINES] = {"switch (original)", "handler table", "computed goto", "run()", "translation cache"};
+    double seconds[ENGINES];
+    machine *m = create_machine();                          // the switch-based core uses its memory directly
+    if(!m) {
+        return;
+    }
+
+    printf("Dispatch benchmark, %llu instructions per run\n\n", (unsigned long long) instructions);
+    for(int engine = 0; engine < ENGINES; engine++) {
+        CPU6502 *cpu = &m->cpu;
+        reset_machine(m);
+        for(int i = 0; i < 0x100; i++) {                    // some data for the loads
+            m->memory[0x8000 + i] = (uint8_t) (i * 7);
+        }
+        for(int i = 0x20; i < 0x30; i++) {                  // pointers for ($xy,X) and ($xy),Y: $8110 or $1081,
+            m->memory[i] = (i & 1) ? 0x81 : 0x10;           // far away from the code in both cores
+        }
+        load_image(m, code, sizeof(code), code_start);
+        cpu->PC = code_start;
+        if(engine == CACHE && !enable_translation_cache(m)) {
+            break;
+        }
+
+        clock_t start = clock();
+        if(engine == SWITCH || engine == TABLE) {
+            for(uint64_t i = 0; i < instructions; i++) {
+                if(cpu->PC >= code_end) {
+                    cpu->PC = code_start;
+                }
+                if(engine == TABLE) {                       // both loops inline the dispatch on purpose:
+                    opcode_handlers[get_byte(cpu, &m->bus)](cpu, &m->bus);      // no output, no status checks
+                } else {
+                    execute_command_switch(cpu, m->memory);
+                }
+            }
+        } else if(engine == THREADED) {
+#ifdef THREADED_DISPATCH
+            run_threaded(cpu, &m->bus, instructions, code_start, code_end);
+#else
+            continue;                                       // not available with this compiler
+#endif
+        } else {                                            // one run_machine() call per pass through the block
+            run_budget budget = {0};
+            for(uint16_t address = code_start; address < code_end; budget.instructions++) {
+                address += decode_instruction(&m->bus, address).length;
+            }
+            for(uint64_t i = 0; i < instructions; i += budget.instructions) {
+                cpu->PC = code_start;
+                run_machine(m, budget);
+            }
+        }
+        seconds[engine] = (double) (clock() - start) / CLOCKS_PER_SEC;
+        if(seconds[engine] <= 0) {
+            seconds[engine] = 1e-9;
+        }
+        printf("%-20s %8.3f s  %12.0f instructions/s\n", names[engine], seconds[engine], instructions / seconds[engine]);
+    }
+    printf("\nSpeedup of handler table over switch: %.2fx\n", seconds[SWITCH] / seconds[TABLE]);
+#ifdef THREADED_DISPATCH
+    printf("Computed goto over switch (a comparison only): %.2fx\n", seconds[SWITCH] / seconds[THREADED]);
+#endif
+    printf("Speedup of translation cache over run(): %.2fx\n", seconds[RUN] / seconds[CACHE]);
+    destroy_machine(m);
+}
+
+
+// Switch-based core: the original implementation, which decodes every opcode twice (once in execute_command_switch()
+// to find the instruction, once more in lda() etc. to find the addressing mode). It is only used as the baseline
+// for the benchmark above and still has the old zeropage behavior (no wrap-around, different ($xy),Y) and the old
+// flag updates in SR after every load, instead of lazy flags.
+
+static inline uint8_t get_byte_flat(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE]) {
+    return memory[cpu->PC++];                               // get_byte() for the flat memory array of this core
+}
+
+void execute_command_switch(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE]) {
+    uint8_t opcode = get_byte_flat(cpu, memory);
 
     switch(opcode) {
         case 0x00:                                          // BRK
@@ -178,78 +1470,53 @@ void execute_command(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE]) {
         case 0X9D:                                          // STA  $vwxy,X
             sta(cpu, memory, opcode);
             break;
-        default:
-            printf("Unknown opcode %02X.\n", opcode);
+        default:                                            // (STX/STY were never part of this core)
             break;
     }
-    if(SHOW_PROCESSED_DATA && SHOW_PROCESSOR_STATUS) {
-        printf("\n\n");
-    } else {
-        if(SHOW_PROCESSED_DATA) {
-            printf("\n");
-        }
-    }
-}
-
-void show_cpu_status(CPU6502 cpu) {
-    printf(" A: %02X  |   X: %02X  |   Y: %02X    |  NV-BDIZC\n", cpu.A, cpu.X, cpu.Y);
-    printf("SP: %02X  |  SR: %02X  |  PC: %04X  |  %d%d%d%d%d%d%d%d\n\n", cpu.SP, cpu.SR, cpu.PC, check_flag(cpu.SR, FLAG_N), check_flag(cpu.SR, FLAG_V), check_flag(cpu.SR, FLAG_U), check_flag(cpu.SR, FLAG_B), check_flag(cpu.SR, FLAG_D), check_flag(cpu.SR, FLAG_I), check_flag(cpu.SR, FLAG_Z), check_flag(cpu.SR, FLAG_C));
-}
-
-bool check_flag(uint8_t SR, uint8_t flag) {                 // check if flag has been set (by doing a bitwise AND
-    return (SR & flag) != 0;                                // and comparing to "NOT 0" to get a bool value)
-}
-
-void update_flag(uint8_t *SR, uint8_t flag, bool set) {     // update a flag
-    if(set) {                                               // set flag by doing a bitwise OR with 1
-        *SR |= flag;
-    } else {                                                // clear flag by doing a bitwise AND with an inverted bit mask
-        *SR &= ~flag;
-    }
 }
 
 void lda(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode) {
     uint8_t temp_address_low, temp_address_high;
     uint16_t actual_word_address;
-    
+
     switch(opcode) {
         case 0xA1:                                          // A1: LDA ($xy,X)
             // add X to one-byte address and get temp_address as a zeropage address as a pointer to low byte;
             // high byte of destination is stored at (temp_address + 1); if temp is FF and X=1, high byte will be at 00
-            temp_address_low = get_byte(cpu, memory) + cpu->X;    // calculate temp address;
+            temp_address_low = get_byte_flat(cpu, memory) + cpu->X;    // calculate temp address;
             temp_address_high = temp_address_low + 1;       // uint8_t data type guarantees address will "wrap around" $FF
-            actual_word_address = memory[temp_address_low] | 
+            actual_word_address = memory[temp_address_low] |
             (memory[(temp_address_high)] << 8);             // calculate two-byte address: shift wrapped high byte, blend with low byte
             cpu->A = memory[actual_word_address];
             break;
         case 0xA5:                                          // A5: LDA  $xy
-            cpu->A = memory[get_byte(cpu, memory)];         // use operand as one-byte pointer
+            cpu->A = memory[get_byte_flat(cpu, memory)];         // use operand as one-byte pointer
             break;
         case 0xA9:                                          // A9: LDA #$xy
-            cpu->A = get_byte(cpu, memory);
+            cpu->A = get_byte_flat(cpu, memory);
             break;
         case 0xAD:                                          // AD: LDA  $vwxy
             // shift high byte to left and blend with low byte to form address:
-            cpu->A = memory[get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)];
+            cpu->A = memory[get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)];
             break;
         case 0xB1:                                          // B1: LDA ($xy),Y
             // "In indirect indexed addressing, the second byte of the instruction points to a memory location in page zero. The contents of this memory location is added to the contents of the Y index register, the result being the low order eight bits of the effective address. The carry from this addition is added to the contents of the next page zero memory location, the result being the high order eight bits of the effective address."
-            temp_address_low = memory[get_byte(cpu, memory)] + cpu->Y;
+            temp_address_low = memory[get_byte_flat(cpu, memory)] + cpu->Y;
             temp_address_high = temp_address_low + 1;       // uint8_t data type guarantees address will "wrap around" $FF
-            actual_word_address = memory[temp_address_low] | 
+            actual_word_address = memory[temp_address_low] |
             (memory[(temp_address_high)] << 8);             // calculate two-byte address: shift wrapped high byte, blend with low byte
             cpu->A = memory[actual_word_address];
             break;
         case 0xB5:                                          // B5: LDA  $xy,X
-            cpu->A = memory[get_byte(cpu, memory) + cpu->X];       // uint8_t automatically wraps around
+            cpu->A = memory[get_byte_flat(cpu, memory) + cpu->X];       // uint8_t automatically wraps around
             break;
         case 0xB9:                                          // B9: LDA  $vwxy,Y
             // shift high byte to left and blend with low byte to form address:
-            cpu->A = memory[(get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)) + cpu->Y];
+            cpu->A = memory[(get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)) + cpu->Y];
             break;
         case 0xBD:                                          // BD: LDA  $vwxy,X
             // shift high byte to left and blend with low byte to form address:
-            cpu->A = memory[(get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)) + cpu->X];
+            cpu->A = memory[(get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)) + cpu->X];
             break;
     }
     update_flag(&(cpu->SR), FLAG_Z, cpu->A == 0);           // set/clear Z flag depending on A == 0
@@ -259,21 +1526,21 @@ void lda(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode) {
 void ldx(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode) {
     switch(opcode) {
         case 0xA2:                                          // A2: LDX #$xy
-            cpu->X = get_byte(cpu, memory);                 // copy current value to X
+            cpu->X = get_byte_flat(cpu, memory);                 // copy current value to X
             break;
         case 0xA6:                                          // A6: LDX  $xy
-            cpu->X = memory[get_byte(cpu, memory)];         // use operand as one-byte pointer
+            cpu->X = memory[get_byte_flat(cpu, memory)];         // use operand as one-byte pointer
             break;
         case 0xAE:                                          // AE: LDX  %vwxy
             // shift high byte to left and blend with low byte to form address:
-            cpu->X = memory[get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)];
+            cpu->X = memory[get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)];
             break;
         case 0xB6:                                          // B6: LDX  $xy,Y
-            cpu->X = memory[get_byte(cpu, memory) + cpu->Y];       // uint8_t automatically wraps around
+            cpu->X = memory[get_byte_flat(cpu, memory) + cpu->Y];       // uint8_t automatically wraps around
             break;
         case 0xBE:                                          // BE: LDX  vwxy,Y
             // shift high byte to left and blend with low byte to form address:
-            cpu->X = memory[(get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)) + cpu->Y];
+            cpu->X = memory[(get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)) + cpu->Y];
             break;
     }
     update_flag(&(cpu->SR), FLAG_Z, cpu->X == 0);           // set/clear Z flag depending on Y == 0
@@ -283,193 +1550,60 @@ void ldx(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode) {
 void ldy(CPU6502 *cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode) {
     switch(opcode) {
         case 0xA0:                                          // A2: LDY #$xy
-            cpu->Y = get_byte(cpu, memory);
+            cpu->Y = get_byte_flat(cpu, memory);
             break;
         case 0xA4:                                          // A4: LDY  $xy
-            cpu->Y = memory[get_byte(cpu, memory)];         // use operand as one-byte pointer
+            cpu->Y = memory[get_byte_flat(cpu, memory)];         // use operand as one-byte pointer
             break;
         case 0xAC:                                          // AC: LDY  $vwxy
             // shift high byte to left and blend with low byte to form address:
-            cpu->Y = memory[get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)];
+            cpu->Y = memory[get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)];
             break;
         case 0xB4:                                          // B4: LDY  $xy,X
-            cpu->Y = memory[get_byte(cpu, memory) + cpu->X];       // uint8_t automatically wraps around
+            cpu->Y = memory[get_byte_flat(cpu, memory) + cpu->X];       // uint8_t automatically wraps around
             break;
         case 0xBC:                                          // BC: LDY  $vwxy,X
             // shift high byte to left and blend with low byte to form address:
-            cpu->Y = memory[(get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)) + cpu->X];
+            cpu->Y = memory[(get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)) + cpu->X];
             break;
     }
     update_flag(&(cpu->SR), FLAG_Z, cpu->Y == 0);           // set/clear Z flag depending on Y == 0
     update_flag(&(cpu->SR), FLAG_N, cpu->Y & 0x80);         // set/clear N flag depending on highest bit; 0x80 = 1000 0000
 }
 
-void enter_code(uint8_t memory[MEMORY_SIZE]) {
-
-    // Test case for LDA/LDX/LDY: program code
-
-    memory[0xFFFC] = 0xA9;   // LDA #$FF
-    memory[0xFFFD] = 0xFF;   //     A9 FF
-    memory[0xFFFE] = 0xA5;   // LDA $22
-    memory[0xFFFF] = 0x22;   //     A9 22
-    memory[0x0000] = 0xAD;   // LDA $1234
-    memory[0x0001] = 0x34;   //     AC 34 12
-    memory[0x0002] = 0x12;   //
-    memory[0x0003] = 0xA2;   // LDX #$05
-    memory[0x0004] = 0x05;   //     A2 05
-    memory[0x0005] = 0xBD;   // LDA $1234,X
-    memory[0x0006] = 0x34;   //     BD 34 12
-    memory[0x0007] = 0x12;   //
-    memory[0x0008] = 0xB5;   // LDA $FF,X
-    memory[0x0009] = 0xFF;   //     B5 FF
-    memory[0x000A] = 0xA1;   // LDA ($02,X)
-    memory[0x000B] = 0x02;   //     A1 02
-    memory[0x000C] = 0xA0;   // LDY #$03
-    memory[0x000D] = 0x03;   //     A0 03
-    memory[0x000E] = 0xB9;   // LDA $3456,Y
-    memory[0x000F] = 0x56;   //     B9 56 34
-    memory[0x0010] = 0x34;   //
-    memory[0x0011] = 0xB1;   // LDA $05,Y
-    memory[0x0012] = 0x05;   //
-    memory[0x0013] = 0xA6;   // LDX $00
-    memory[0x0014] = 0x00;   //     A6 00
-    memory[0x0015] = 0xAE;   // LDX $1234
-    memory[0x0016] = 0x34;   //     AE 34 12
-    memory[0x0017] = 0x12;   //
-    memory[0x0018] = 0xB6;   // LDX $05,Y
-    memory[0x0019] = 0x05;   //     B6 05
-    memory[0x001A] = 0xBE;   // LDX $1231,Y
-    memory[0x001B] = 0x31;   //     BE 31 12
-    memory[0x001C] = 0x12;   //
-    memory[0x001D] = 0xA4;   // LDY $03
-    memory[0x001E] = 0x03;   //     A4 03
-    memory[0x001F] = 0xAC;   // LDY $1234
-    memory[0x0020] = 0x34;   //     AC 34 12
-    memory[0x0021] = 0x12;   //
-    memory[0x0022] = 0xB4;   // LDY $00,X
-    memory[0x0023] = 0x01;   //
-    memory[0x0024] = 0xBC;   // LDY $46CD,X
-    memory[0x0025] = 0xCD;   //     BC CD 46
-    memory[0x0026] = 0x46;   //
-    memory[0x0027] = 0x95;   // STA $AA,X
-    memory[0x0028] = 0xAA;   //     85 AA
-    memory[0x0029] = 0x00;   // BRK
-
-    printf("This code will test LDA, LDX, and LDY commands:\n\n");
-    printf(".FFFC  A9 FF     LDA #$FF\n");
-    printf(".FFFE  A5 22     LDA  $22\n");
-    printf(".0000  AD 34 12  LDA  $1234\n");
-    printf(".0003  A2 EE     LDX #$05\n");
-    printf(".0005  BD 34 12  LDA  $1234,X\n");
-    printf(".0008  B5 FF     LDA  $FF,X\n");
-    printf(".000A  A1 02     LDA ($02,X)\n");      // with X=5, low byte is at 7 ("12"), high byte at 8 ("B5"), destination is B512
-    printf(".000C  A0 89     LDY #$03\n");
-    printf(".000E  B9 56 34  LDA  $3456,Y\n");     // with Y=03, this will be 3459
-    printf(".0011  B1 05     LDA ($05),Y\n");      // 05 contains "BD", BD+03 = C0, so low byte in C0, high byte in C1
-    printf(".0013  A6 00     LDX  $00\n");         // 00 has "AD"
-    printf(".0015  AE 34 12  LDX  $1234\n");
-    printf(".0018  B6 05     LDX  $05,Y\n");       // with Y=03, destination is 08
-    printf(".001A  BE 31 12  LDX  $1231,Y\n");     // with Y=03, destination is 1234
-    printf(".001D  A4 03     LDY  $03\n");         // 03 contains "A2"
-    printf(".001F  AC 34 12  LDY  $1234\n");
-    printf(".0022  B4 00     LDY  $01,X\n");       // with X=44, destination is 45
-    printf(".0024  BC CD 46  LDY  $46CD,X\n");     // with X=44, destination is 4711
-    printf(".0027  95 AA     STA  $AA,X\n");
-    printf(".0029  00        BRK\n");
-
-    // Test case for LDA/LDX/LDY: data
-
-    memory[0x0022] = 0xB4;
-    memory[0x0045] = 0x42;
-    memory[0x00AD] = 0xAA;
-    memory[0x00C0] = 0x11;
-    memory[0x00C1] = 0x47;
-    memory[0x1234] = 0x44;
-    memory[0x1239] = 0x93;
-    memory[0x3459] = 0x99;
-    memory[0x4711] = 0xDA;
-    memory[0xB512] = 0x77;
-
-    printf("Contents of 0022 is %02X.  ", memory[0x0022]);
-    printf("Contents of 1234 is %02X.  ", memory[0x1234]);
-    printf("Contents of 1239 is %02X.  ", memory[0x1239]);
-    printf("Contents of 0004 is %02X.\n", memory[0x0004]);
-    printf("Contents of B512 is %02X.  ", memory[0xB512]);
-    printf("Contents of 3459 is %02X.  ", memory[0x3459]);
-    printf("Contents of 0001 is %02X.  ", memory[0x0001]);
-    printf("Contents of 0008 is %02X.\n", memory[0x0008]);
-    printf("Contents of 4711 is %02X.  ", memory[0x4711]);
-    printf("Contents of 00B0 is %02X.  ", memory[0x00B0]);
-    printf("Contents of 0008 is %02X.  ", memory[0x0008]);
-    printf("Contents of 0003 is %02X.\n", memory[0x0003]);
-    printf("Contents of 0045 is %02X.  ", memory[0x0045]);
-    printf("\n\n");
-}
-
-uint8_t get_byte(CPU6502* cpu, uint8_t memory[MEMORY_SIZE]) {
-    uint8_t byte = memory[cpu->PC];
-    if(SHOW_PROCESSED_DATA) {
-        printf("%02X ", byte);
-    }
-    cpu->PC++;
-    return byte;
-}
-
-void show_memory_dump(uint16_t start, uint16_t end, uint8_t memory[MEMORY_SIZE]) {
-    printf("       Memory dump from %04X to %04X\n", start, end);
-    uint16_t location = start;
-    int linebreak_counter = 0;
-
-    // As uint16_t wraps around from FFFF to 0000, I cannot do this with a for loop
-    while(1) {
-        if(!(linebreak_counter % 10) || location == start) {
-            printf("\n.%04X  ", location);
-            linebreak_counter = 0;
-        }
-        printf("%02X ", memory[location]);
-        if(location == end) {
-            printf("\n\n");
-            return;
-        }
-        location++;
-        linebreak_counter++;
-    }
-}
-
-
 void sta(CPU6502* cpu, uint8_t memory[MEMORY_SIZE], uint8_t opcode) {
     uint8_t temp_address_low, temp_address_high;
     uint16_t actual_word_address;
 
     switch(opcode) {
         case 0X81:                                                      // $81  STA ($vw,X)
-            temp_address_low = get_byte(cpu, memory) + cpu->X;          // calculate temp address;
+            temp_address_low = get_byte_flat(cpu, memory) + cpu->X;          // calculate temp address;
             temp_address_high = temp_address_low + 1;                   // uint8_t data type guarantees address will "wrap around" $FF
-            actual_word_address = memory[temp_address_low] | 
+            actual_word_address = memory[temp_address_low] |
             (memory[(temp_address_high)] << 8);                         // calculate two-byte address
             memory[actual_word_address] = cpu->A;
             break;
         case 0X85:                                                      // $85  STA  $vw
-            memory[get_byte(cpu, memory)] = cpu->A;
+            memory[get_byte_flat(cpu, memory)] = cpu->A;
             break;
         case 0X8D:                                                      // $8D  STA  $vwxy
-            memory[get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)] = cpu->A;
+            memory[get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)] = cpu->A;
             break;
         case 0X91:                                                      // $91  STA ($vw),Y
-            temp_address_low = memory[get_byte(cpu, memory)] + cpu->Y;
+            temp_address_low = memory[get_byte_flat(cpu, memory)] + cpu->Y;
             temp_address_high = temp_address_low + 1;                   // uint8_t data type guarantees address will "wrap around" $FF
-            actual_word_address = memory[temp_address_low] | 
+            actual_word_address = memory[temp_address_low] |
             (memory[(temp_address_high)] << 8);                         // calculate two-byte address
             memory[actual_word_address] = cpu->A;
             break;
         case 0x95:                                                      // $95  STA  $vx,X
-            memory[get_byte(cpu, memory) + cpu->X] = cpu->A;
+            memory[get_byte_flat(cpu, memory) + cpu->X] = cpu->A;
             break;
         case 0X99:                                                      // $99  STA  $vwxy,Y
-            memory[(get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)) + cpu->Y] = cpu->A;
+            memory[(get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)) + cpu->Y] = cpu->A;
             break;
         case 0X9D:                                                      // $9D  STA  $vwxy,X
-            memory[(get_byte(cpu, memory) | (get_byte(cpu, memory) << 8)) + cpu->X] = cpu->A;
+            memory[(get_byte_flat(cpu, memory) | (get_byte_flat(cpu, memory) << 8)) + cpu->X] = cpu->A;
             break;
     }
-}
\ No newline at end of file
+}
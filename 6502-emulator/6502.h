@@ -0,0 +1,711 @@
+// SIMPLE 6502 EMULATOR -- shared declarations
+//
+// Everything that more than one part of the emulator needs: CPU registers, flags, machines, and the functions of
+// the core (6502.c), the memory bus (bus.c), snapshots (snapshot.c), the translation cache (cache.c), the program
+// loader (loader.c), the event scheduler (events.c), record and replay (replay.c), audio output (audio.c), TED sound
+// (tedsound.c), the debugger (debug.c), the profiler (profile.c), the disassembler (disasm.c), the tracing subsystem
+// (trace.c), the batch runner (batch.c), test suites (suite.c), lockstep emulation (lockstep.c), and the gate-level
+// ALU (alu.c).
+// main.c is the command line front end; all other files can be linked into other programs as a library.
+//
+// Build: gcc -O2 -pthread -o 6502 main.c 6502.c bus.c snapshot.c cache.c loader.c events.c replay.c audio.c tedsound.c
+//        debug.c profile.c disasm.c trace.c batch.c suite.c lockstep.c alu.c
+//        (add -mavx2 or -march=native for the AVX2 kernels of lockstep.c and the 256 lanes of alu.c)
+
+#ifndef EMULATOR_6502_H
+#define EMULATOR_6502_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>                                         // for uint8_t and uint16_t data types
+
+#define MEMORY_SIZE 65536                                   // 64 KB memory
+
+#define FLAG_N 0x80                                         // N (negative) flag           1000 0000
+#define FLAG_V 0x40                                         // V (overflow) flag           0100 0000
+#define FLAG_U 0x20                                         // U (unused) flag             0010 0000
+#define FLAG_B 0x10                                         // B (break command) flag      0001 0000
+#define FLAG_D 0x08                                         // D (decimal mode) flag       0000 1000
+#define FLAG_I 0x04                                         // I (interrupt disable) flag  0000 0100
+#define FLAG_Z 0x02                                         // Z (zero) flag               0000 0010
+#define FLAG_C 0x01                                         // C (carry) flag              0000 0001
+
+typedef struct {                                            // define CPU registers
+    uint8_t  A, X, Y;                                       // A (accumulator), X register, Y register
+    uint8_t  SP;                                            // stack pointer
+    uint16_t PC;                                            // program counter, 2 byte
+    uint8_t  SR;                                            // status register, 1 bit for each flag:
+                                                            // N (negative), V (overflow), U (undefined), B (break interrput),
+                                                            // D (decimal mode), I (interrupt disable), Z (zero), C (carry)
+                                                            // N, V, Z and C are not kept here, but in the fields below:
+                                                            // read and write SR with get_status() and set_status()
+    uint64_t cycles;                                        // clock cycles since reset
+    uint8_t  irq;                                           // IRQ line: one bit per device holding it low (set_irq())
+    bool     nmi;                                           // NMI edge seen, not yet serviced (trigger_nmi())
+    uint16_t nz;                                            // lazy N and Z: the last result; Z if the low byte is 0,
+                                                            // N if bit 7 or bit 8 (for results without that bit) is set
+    uint8_t  carry;                                         // lazy C: 0 or 1
+    uint8_t  overflow;                                      // lazy V: bit 7
+} CPU6502;
+
+typedef struct trace_buffer trace_buffer;
+typedef struct debugger debugger;
+typedef struct profile profile;
+
+typedef enum {                                              // why run() has returned
+    STOP_BUDGET,                                            // cycle or instruction budget used up
+    STOP_BRK,                                               // BRK has been executed
+    STOP_BREAKPOINT,                                        // PC has reached a breakpoint (instruction not yet executed)
+    STOP_INTERRUPT,                                         // the budget's interrupt_request is set (not IRQ/NMI)
+    STOP_WATCHPOINT,                                        // a watched address has been accessed (debug.c)
+    STOP_UNKNOWN_OPCODE                                     // PC is at an opcode the core lacks (it is not executed)
+} stop_reason;
+
+typedef struct {                                            // budget and stop conditions for run(); 0 / NULL = not used
+    uint64_t cycles;                                        // maximum number of cycles (the last instruction may overshoot)
+    uint64_t instructions;                                  // maximum number of instructions
+    const uint8_t *breakpoints;                             // bitmap with one bit per address (MEMORY_SIZE / 8 bytes)
+    volatile bool *interrupt_request;                       // run() returns as soon as this is set, e.g. by another thread
+    trace_buffer *trace;                                    // record every instruction
+    debugger *debugger;                                     // breakpoints, watchpoints, conditions (run_machine() only)
+    profile *profile;                                       // count every instruction (profile.c)
+} run_budget;
+
+typedef struct {
+    stop_reason reason;
+    uint64_t cycles;                                        // cycles consumed by this call
+    uint64_t instructions;                                  // instructions executed by this call
+} run_result;
+
+
+// Memory bus (bus.c)
+//
+// All memory accesses of the CPU go through two page tables with 256 entries each, one for reads and one for writes.
+// An entry is either a pointer to the 256 bytes of host memory behind that page (RAM, ROM), which bus_read() and
+// bus_write() access directly, or NULL, in which case the device callback of that page is called (I/O chips, writes
+// to ROM that must be ignored, ...). A plain RAM access costs one table lookup plus the indexed load, however many
+// devices exist. As every page has its own pointer, pages can come from anywhere, e.g. from a snapshot (snapshot.c).
+// The pointers and the callbacks are kept in separate arrays, so the fast path only touches the 2 KB of pointers.
+
+#define BUS_PAGES 256
+
+typedef uint8_t (*bus_read_function)(void *device, uint16_t address);
+typedef void (*bus_write_function)(void *device, uint16_t address, uint8_t value);
+
+typedef struct {
+    uint8_t *read[BUS_PAGES];                               // host memory of each page for reads, NULL: device
+    uint8_t *write[BUS_PAGES];                              // host memory of each page for writes, NULL: device
+    bus_read_function read_device[BUS_PAGES];               // slow path: called for pages without host memory
+    bus_write_function write_device[BUS_PAGES];
+    void *read_context[BUS_PAGES];                          // first argument of the device callbacks
+    void *write_context[BUS_PAGES];
+    bool fetching;                                          // the next slow read is an opcode or operand byte
+    uint16_t fetch_start;                                   // instruction being traced: the bytes it fetches from
+    uint8_t fetched[4];                                     // devices, by offset from fetch_start (trace.c)
+} memory_bus;
+
+uint8_t bus_read_device(memory_bus *bus, uint16_t address);                    // slow paths, not inlined
+uint8_t bus_fetch_device(memory_bus *bus, uint16_t address);
+void bus_write_device(memory_bus *bus, uint16_t address, uint8_t value);
+
+static inline uint8_t bus_read(memory_bus *bus, uint16_t address) {
+    const uint8_t *memory = bus->read[address >> 8];
+    if(__builtin_expect(memory != NULL, 1)) {
+        return memory[address & 0xFF];                      // fast path: RAM or ROM
+    }
+    return bus_read_device(bus, address);
+}
+
+static inline uint8_t bus_fetch(memory_bus *bus, uint16_t address) {   // bus_read() for the bytes of instructions
+    const uint8_t *memory = bus->read[address >> 8];
+    if(__builtin_expect(memory != NULL, 1)) {
+        return memory[address & 0xFF];
+    }
+    return bus_fetch_device(bus, address);
+}
+
+static inline void bus_write(memory_bus *bus, uint16_t address, uint8_t value) {
+    uint8_t *memory = bus->write[address >> 8];
+    if(__builtin_expect(memory != NULL, 1)) {
+        memory[address & 0xFF] = value;                     // fast path: RAM
+    } else {
+        bus_write_device(bus, address, value);
+    }
+}
+
+void bus_map_memory(memory_bus *bus, uint8_t first_page, uint8_t last_page, uint8_t *read, uint8_t *write);
+void bus_map_device(memory_bus *bus, uint8_t first_page, uint8_t last_page, bus_read_function read, bus_write_function write,
+                    void *device);
+
+typedef enum {                                              // memory layouts (see settings.py for the C64 one)
+    PROFILE_FLAT,                                           // 64 KB of RAM, nothing else (default)
+    PROFILE_C64,                                            // BASIC ROM $A000-$BFFF, I/O $D000-$DFFF, KERNAL ROM $E000-$FFFF
+    PROFILE_C16                                             // C16/Plus4: BASIC ROM $8000-$BFFF, KERNAL ROM $C000-$FFFF,
+} machine_profile;                                          // I/O $FD00-$FF3F (TED at $FF00)
+
+#define IO_SIZE 0x1000                                      // registers of unattached I/O chips, address & 0x0FFF
+#define MACHINE_DEVICES 8
+
+typedef struct {                                            // a device attached to an address range (see attach_device())
+    uint16_t first, last;
+    bus_read_function read;                                 // NULL: reads are not handled by this device
+    bus_write_function write;                               // NULL: writes are not handled by this device
+    void *device;
+} io_device;
+
+#define MACHINE_EVENTS 32
+
+typedef void (*event_function)(void *device, uint64_t cycle);  // cycle: the one the event was scheduled for
+
+typedef struct {                                            // a scheduled call of a device (see schedule_event())
+    uint64_t cycle;
+    event_function function;
+    void *device;
+} scheduled_event;
+
+#define PAGE_SIZE 256
+#define SNAPSHOT_PAGES (BUS_PAGES + IO_SIZE / PAGE_SIZE)    // RAM pages, then the pages of machine.io
+
+typedef struct snapshot snapshot;
+typedef struct snapshot_page snapshot_page;
+typedef struct translation_cache translation_cache;
+typedef struct recording recording;
+
+typedef struct {                                            // one complete computer: CPU, its own 64 KB of RAM, ROMs, I/O
+    CPU6502 cpu;
+    memory_bus bus;                                         // points into this struct, so a machine must not be copied
+    machine_profile profile;
+    uint8_t memory[MEMORY_SIZE];                            // RAM (below ROM and I/O as well, as on the real machines)
+    uint8_t rom[MEMORY_SIZE];                               // ROM contents at their addresses, used by the profile's ROM areas
+    uint8_t io[IO_SIZE];                                    // default registers of the I/O area
+    io_device devices[MACHINE_DEVICES];
+    int device_count;
+    uint8_t *watched_write[BUS_PAGES];                      // write pointers taken out of the page table by watch_page()
+    uint32_t generation[BUS_PAGES];                         // counts the changes of watched pages (see page_changed())
+    uint32_t page_changes;                                  // sum of all generations
+    snapshot *base;                                         // dirty tracking (snapshot.c): memory equals this snapshot,
+    uint64_t dirty[(SNAPSHOT_PAGES + 63) / 64];             // apart from the pages marked here
+    snapshot_page *shared[BUS_PAGES];                       // pages read straight from a snapshot (forked machines)
+    translation_cache *cache;                               // pre-decoded code (cache.c), NULL if not enabled
+    scheduled_event events[MACHINE_EVENTS];                 // binary min-heap by cycle (events.c)
+    int event_count;
+    recording *recording;                                   // inputs are recorded or replayed (replay.c), NULL: neither
+} machine;
+
+void set_machine_profile(machine *m, machine_profile profile);
+bool attach_device(machine *m, uint16_t first, uint16_t last, bus_read_function read, bus_write_function write, void *device);
+uint8_t peek_register(machine *m, uint16_t address);        // as the CPU reads it, but never recorded or replayed
+
+void watch_page(machine *m, int page);
+void unwatch_page(machine *m, int page);
+
+static inline void mark_page_dirty(machine *m, int page) {  // page: index into RAM pages and I/O pages (SNAPSHOT_PAGES)
+    m->dirty[page >> 6] |= 1ull << (page & 63);
+}
+
+static inline void page_changed(machine *m, int page) {     // page: 0-255; code decoded from it is out of date
+    m->generation[page]++;
+    m->page_changes++;
+}
+
+
+// Core (6502.c)
+
+void reset_cpu(CPU6502 *cpu);
+void reset_cpu_from_vector(CPU6502 *cpu, memory_bus *bus);
+uint8_t get_byte(CPU6502* cpu, memory_bus *bus);
+uint8_t execute_command(CPU6502 *cpu, memory_bus *bus);    // returns the opcode
+run_result run(CPU6502 *cpu, memory_bus *bus, run_budget budget);
+void set_breakpoint(uint8_t breakpoints[MEMORY_SIZE / 8], uint16_t address, bool set);
+const char* stop_reason_name(stop_reason reason);
+bool opcode_implemented(uint8_t opcode);
+void service_interrupt(CPU6502 *cpu, memory_bus *bus);
+void show_cpu_status(CPU6502 cpu);
+void show_memory_dump(uint16_t start, uint16_t end, uint8_t memory[MEMORY_SIZE]);
+
+#define CLOCK_SPEED 1000000                                 // 1 MHz, as in settings.py
+
+typedef enum {
+    MODE_IMPLIED, MODE_ACCUMULATOR, MODE_IMMEDIATE,
+    MODE_ZEROPAGE, MODE_ZEROPAGE_X, MODE_ZEROPAGE_Y,
+    MODE_ABSOLUTE, MODE_ABSOLUTE_X, MODE_ABSOLUTE_Y,
+    MODE_INDIRECT, MODE_INDEXED_INDIRECT, MODE_INDIRECT_INDEXED, MODE_RELATIVE
+} addressing_mode;
+
+typedef struct {                                            // one entry per opcode, see opcode_table in 6502.c
+    char mnemonic[4];                                       // "???" for undocumented opcodes
+    uint8_t mode;                                           // addressing_mode
+    uint8_t length;                                         // in bytes
+    uint8_t cycles;                                         // base cycle count (loads with a page crossing take one more)
+} opcode_info;
+
+extern const opcode_info opcode_table[256];
+
+typedef void (*decoded_handler)(CPU6502 *cpu, memory_bus *bus, uint16_t operand);
+
+typedef struct {                                            // one instruction, decoded in advance (see cache.c)
+    decoded_handler handler;                                // call with PC already pointing behind the instruction
+    uint16_t operand;                                       // the bytes after the opcode (low byte first)
+    uint8_t cycles;                                         // base cycles
+    uint8_t length;                                         // in bytes
+    uint8_t opcode;
+} decoded_instruction;
+
+decoded_instruction decode_instruction(memory_bus *bus, uint16_t address);
+
+static inline bool interrupt_pending(const CPU6502 *cpu) {     // NMI, or IRQ while the I flag is clear
+    return cpu->nmi || (cpu->irq && !(cpu->SR & FLAG_I));
+}
+
+// Lazy flags: instructions store their result (and carry and overflow) as they are, instead of updating N, V, Z and C
+// in SR one by one. SR is only put together when something reads it: PHP, BRK, interrupts, status dumps, traces.
+
+static inline uint8_t get_status(const CPU6502 *cpu) {
+    return (cpu->SR & (FLAG_U | FLAG_B | FLAG_D | FLAG_I)) | ((cpu->nz & 0x180) ? FLAG_N : 0)
+           | (cpu->overflow & 0x80 ? FLAG_V : 0) | ((cpu->nz & 0xFF) == 0 ? FLAG_Z : 0) | (cpu->carry & FLAG_C);
+}
+
+static inline void set_status(CPU6502 *cpu, uint8_t SR) {
+    cpu->SR = SR;
+    cpu->nz = ((SR & FLAG_N) << 1) | !(SR & FLAG_Z);        // N in bit 8, so that it can be set together with Z
+    cpu->carry = SR & FLAG_C;
+    cpu->overflow = SR << 1;                                // V to bit 7
+}
+
+bool check_flag(uint8_t SR, uint8_t flag);
+void update_flag(uint8_t *SR, uint8_t flag, bool set);
+
+machine* create_machine(void);
+void destroy_machine(machine *m);
+void reset_machine(machine *m);
+bool load_image(machine *m, const uint8_t *image, size_t size, uint16_t address);
+run_result run_machine(machine *m, run_budget budget);
+run_result run_paced(machine *m, run_budget budget, uint64_t clock_speed);    // real time, clock_speed in Hz
+
+void benchmark(uint64_t instructions);
+bool check_decimal(void);                                   // ADC and SBC in decimal mode, all inputs
+
+
+// Events and interrupts (events.c)
+//
+// Devices do not get polled after every instruction. Instead, they schedule calls for the cycle at which something
+// happens (a timer running out, a raster line); run_machine() runs the CPU without interruption up to the next of
+// these cycles, then calls the events that are due. An event may schedule the next one, and raise or clear an IRQ
+// with set_irq() (level-triggered, one bit per source) or trigger an NMI (edge-triggered); the core checks for both
+// before every instruction and jumps through the vector at $FFFE or $FFFA.
+
+bool schedule_event(machine *m, uint64_t cycle, event_function function, void *device);
+void cancel_events(machine *m, void *device);              // all events of this device
+void dispatch_events(machine *m);                          // calls the events due by the current cycle
+void set_irq(machine *m, uint8_t source, bool active);     // source: a bit of CPU6502.irq
+void trigger_nmi(machine *m);
+bool check_events(int rounds);                              // cancel_events() on random queues
+
+
+// Program loader (loader.c)
+//
+// Raw binaries and Commodore .prg files (recognized by their extension) are mapped with mmap() and copied straight
+// into memory. load_program() also points the reset vector at $FFFC/$FFFD to the load address and resets the CPU.
+
+typedef struct {
+    const uint8_t *data;                                    // program bytes (without the two byte .prg header)
+    size_t size;
+    uint16_t address;                                       // load address
+    void *mapping;                                          // the whole mapped file
+    size_t mapping_size;
+} program_file;
+
+bool map_program(const char *filename, uint16_t address, program_file *program);   // address: for raw files only
+void unmap_program(program_file *program);
+bool load_program(machine *m, const char *filename, uint16_t address);
+bool load_rom(machine *m, const char *filename, uint16_t address);
+void set_reset_vector(uint8_t memory[MEMORY_SIZE], uint16_t address);
+
+
+// Snapshots (snapshot.c)
+//
+// A snapshot is the CPU plus one pointer per page of RAM and I/O registers. Pages are reference counted and shared
+// between snapshots: take_snapshot() only copies the pages written since the previous snapshot of the machine,
+// restore_snapshot() only copies back the pages that differ, and fork_machine() does not copy RAM at all -- the new
+// machine reads the snapshot's pages until it writes to them. ROMs and attached devices are not part of a snapshot.
+// Code that writes machine.memory or machine.io directly (instead of through the bus) must call mark_dirty().
+
+struct snapshot_page {
+    _Atomic int references;
+    uint8_t bytes[PAGE_SIZE];
+};
+
+struct snapshot {
+    _Atomic int references;
+    CPU6502 cpu;
+    machine_profile profile;
+    snapshot_page *pages[SNAPSHOT_PAGES];
+    int stored_pages;                                       // pages copied for this snapshot, the rest is shared
+};
+
+snapshot* take_snapshot(machine *m);
+bool restore_snapshot(machine *m, snapshot *s);
+machine* fork_machine(const machine *parent, snapshot *s);  // parent: provides the ROMs
+void retain_snapshot(snapshot *s);
+void release_snapshot(snapshot *s);
+void mark_dirty(machine *m, uint16_t address, size_t size);
+void mark_all_dirty(machine *m);
+void stop_dirty_tracking(machine *m);
+void unshare_page(machine *m, int page);                    // for the bus: the page is about to be written
+bool check_snapshots(int steps);                            // random restores and forks against full copies
+
+
+// Record and replay (replay.c)
+//
+// A recording logs everything that comes from outside the machine -- reads from attached devices, IRQ and NMI, bytes
+// written by the host with write_input() -- each with its cycle, in a few bytes per entry. A replay starts from the
+// recorded initial state and feeds the log back at the same cycles, so it repeats the run exactly. Keyframes
+// (snapshots every keyframe_interval cycles) let seek_replay() jump to any cycle without replaying from the start.
+
+#define RECORDING_KEYFRAME_INTERVAL CLOCK_SPEED             // one keyframe per emulated second
+
+recording* start_recording(machine *m, uint64_t keyframe_interval);    // from the current state; 0: no keyframes
+void stop_recording(machine *m);                            // ends recording or replaying, keeps the recording
+bool save_recording(recording *r, const char *filename);
+recording* load_recording(const char *filename);
+void destroy_recording(recording *r);
+bool start_replay(machine *m, recording *r);                // ROMs and devices as when recording
+bool seek_replay(machine *m, uint64_t cycle);               // to the first instruction boundary at or after cycle
+bool replay_diverged(const recording *r);
+void show_recording_summary(const recording *r);
+bool check_replay(void);                                    // record, save, load, replay and seek a test program
+void write_input(machine *m, uint16_t address, uint8_t value);  // input from the host, e.g. into a keyboard buffer
+
+uint8_t recorded_read(machine *m, const io_device *device, uint16_t address);  // hooks for bus.c and events.c
+void recorded_write(machine *m, const io_device *device, uint16_t address, uint8_t value);
+bool recorded_interrupt(machine *m, uint8_t irq, bool nmi);                    // false: do not apply (replaying)
+
+
+// Audio output (audio.c)
+//
+// Sound devices deliver 16 bit mono samples in blocks to a sample_sink. wav_write() is one: it writes to a WAV file, or
+// to stdout as a stream.
+
+typedef void (*sample_sink)(void *context, const int16_t *samples, size_t count);
+typedef struct wav_file wav_file;
+
+wav_file* wav_open(const char *filename, uint32_t sample_rate);    // "-": stdout
+void wav_write(void *context, const int16_t *samples, size_t count);   // a sample_sink, context: the wav_file
+bool wav_close(wav_file *wav);                              // false if anything could not be written
+
+// Real-time output: an audio stream takes the samples of the emulation thread without ever blocking it, and a thread
+// of its own writes them to a WAV file, a named pipe or stdout at the output rate, resampled to absorb the drift
+// between the emulated clock and the host clock.
+
+typedef struct audio_stream audio_stream;
+
+typedef struct {
+    uint64_t received;                                      // samples from the emulation
+    uint64_t overruns;                                      // of those, dropped because the ring buffer was full
+    uint64_t played;                                        // samples written to the output
+    uint64_t underruns;                                     // of those, filled in because the ring buffer was empty
+    double ratio;                                           // last drift correction of the resampling ratio
+} audio_stream_stats;
+
+audio_stream* audio_stream_open(const char *filename, uint32_t input_rate, uint32_t output_rate);  // "-": stdout
+void audio_stream_write(void *context, const int16_t *samples, size_t count);  // a sample_sink, never blocks
+audio_stream_stats audio_stream_close(audio_stream *stream);                    // plays the rest first
+
+
+// TED sound (tedsound.c)
+//
+// The two voices and the noise generator of the C16/Plus4 TED at $FF0E-$FF12. Register writes are rendered into
+// samples in blocks up to the cycle of the next write, never cycle by cycle, and within a block in runs of equal
+// samples, mixed with SIMD where available.
+
+#define TED_SOUND_BLOCK 4096                                // samples per call of the sink
+#define TED_SAMPLE_RATE 44100
+
+typedef struct ted_sound ted_sound;
+
+ted_sound* create_ted_sound(machine *m, uint64_t clock_speed, uint32_t sample_rate, sample_sink sink, void *context);
+void destroy_ted_sound(ted_sound *ted);                     // m: NULL for register logs, otherwise attached to it
+void ted_sound_write(ted_sound *ted, uint64_t cycle, uint16_t address, uint8_t value);   // cycles in write order
+uint8_t ted_sound_register(const ted_sound *ted, uint16_t address);
+void ted_sound_render(ted_sound *ted, uint64_t cycle);      // all samples up to cycle, passed on to the sink
+uint64_t ted_sound_samples(const ted_sound *ted);           // rendered so far
+bool ted_sound_schedule(ted_sound *ted, uint64_t interval);   // also render every interval cycles, for live output
+bool benchmark_ted_sound(double seconds);                   // block renderer against the per-sample loop
+
+
+// Translation cache (cache.c)
+//
+// Straight runs of instructions are decoded once into blocks of decoded_instruction records (handler, operand,
+// cycles), which run_machine() executes without fetching or decoding anything. The generation counters of the pages
+// a block was decoded from tell whether it is still valid, so self-modifying code works as before.
+
+bool enable_translation_cache(machine *m);
+void disable_translation_cache(machine *m);
+run_result run_translated(machine *m, run_budget budget);
+bool check_cache(int programs);                             // cached against plain runs of self-modifying code
+
+
+// Debugger (debug.c)
+//
+// Breakpoints of all types are kept in bitmaps with one bit per address, so checking an address costs the same for
+// any number of breakpoints. Watchpoints redirect only their own pages to the slow path of the bus, in a copy of the
+// page tables used by run_debug(); all other accesses run at full speed.
+
+typedef enum {
+    BREAK_EXECUTE,                                          // PC reaches the range (stops before the instruction)
+    BREAK_READ,                                             // the range is read (stops after the instruction)
+    BREAK_WRITE                                             // the range is written (stops after the instruction)
+} breakpoint_type;
+
+typedef enum {
+    REGISTER_NONE, REGISTER_A, REGISTER_X, REGISTER_Y, REGISTER_SP, REGISTER_SR
+} register_name;
+
+typedef struct {                                            // fires only if (register & mask) == value
+    register_name reg;                                      // REGISTER_NONE: always
+    uint8_t mask, value;
+} breakpoint_condition;
+
+typedef struct {
+    breakpoint_type type;
+    uint16_t first, last;                                   // address range
+    breakpoint_condition condition;
+} breakpoint;
+
+typedef struct {                                            // the breakpoint that has stopped the last run
+    int id;                                                 // -1: none
+    breakpoint_type type;
+    uint16_t address;
+    uint8_t value;                                          // value read or written by a watched access
+} debug_hit;
+
+debugger* create_debugger(void);
+void destroy_debugger(debugger *d);
+int add_breakpoint(debugger *d, breakpoint b);              // returns the id, -1 on failure
+void remove_breakpoint(debugger *d, int id);
+breakpoint execution_breakpoint(uint16_t address);
+breakpoint watchpoint(breakpoint_type type, uint16_t first, uint16_t last);
+debug_hit debugger_hit(const debugger *d);
+run_result run_debug(machine *m, run_budget budget);
+bool check_debugger(void);                                  // read watchpoints on the bytes of instructions
+
+
+// Profiler (profile.c)
+//
+// Counters for every instruction, cheap enough to be left on: per address (instructions and cycles), per opcode,
+// and per calling context (JSR/RTS nesting). Only jumps, JSR and RTS take the out-of-line path, which records loop
+// back-edges and moves between contexts. profile_report() prints the hot spots, profile_write_folded() writes the
+// contexts as collapsed stacks for flame graph tools.
+
+#define PROFILE_EDGES 4096                                  // back-edges kept (must be a power of two)
+#define PROFILE_CONTEXTS 4096                               // calling contexts kept (must be a power of two)
+
+typedef struct {
+    uint16_t from, to;
+    uint64_t count;                                         // 0: free slot
+} profile_edge;
+
+typedef struct {
+    int parent;                                             // -1: the root (code outside of any subroutine)
+    uint16_t function;                                      // address of the subroutine
+    uint64_t cycles;                                        // cycles spent in it, without its callees
+} profile_context;
+
+struct profile {
+    uint64_t hits[MEMORY_SIZE];                             // instructions started at each address
+    uint64_t cycles[MEMORY_SIZE];                           // their cycles
+    uint64_t opcodes[256];                                  // instructions per opcode
+    uint64_t instructions, total_cycles;
+    profile_edge edges[PROFILE_EDGES];                      // hash table of (from, to)
+    int lost_edges;                                         // not recorded, table full
+    profile_context contexts[PROFILE_CONTEXTS];             // calling context tree, entry 0 is the root
+    int context_slots[2 * PROFILE_CONTEXTS];                // hash table of (parent, function): index + 1, 0 = free
+    int context_count, context;                             // entries used, current context
+    int lost_contexts;                                      // calls not recorded, table full
+};
+
+profile* create_profile(void);
+void destroy_profile(profile *p);
+void profile_control(profile *p, uint8_t opcode, uint16_t start, uint16_t next);
+uint64_t profile_range_cycles(const profile *p, uint16_t first, uint16_t last);
+void profile_report(const profile *p, FILE *file, int count);
+bool profile_write_folded(const profile *p, const char *filename);   // false on write errors
+bool check_profile(void);                                   // back-edges, contexts, no loops from RTI
+
+static inline void profile_instruction(profile *p, uint8_t opcode, uint16_t start, uint16_t next, uint64_t cycles) {
+    p->hits[start]++;
+    p->cycles[start] += cycles;
+    p->opcodes[opcode]++;
+    p->instructions++;
+    p->total_cycles += cycles;
+    p->contexts[p->context].cycles += cycles;
+    if(next == start || (uint16_t) (next - start) > 3 || opcode == 0x20 || opcode == 0x60) {   // jump, JSR, RTS
+        profile_control(p, opcode, start, next);
+    }
+}
+
+
+// Disassembler (disasm.c)
+//
+// Listings in the format ".C000  BD 34 12  LDA  $1234,X", driven by opcode_table. One pass over the code, straight
+// into a buffer the caller provides and reuses, without any per-line formatting.
+
+#define DISASSEMBLY_LINE 32                                 // longer than any line, room the output must always have
+
+size_t disassemble(const uint8_t *code, size_t size, uint16_t address, char *output, size_t output_size, size_t *written);
+bool disassemble_file(const char *filename, uint16_t address, FILE *output);
+
+
+// Tracing (trace.c)
+//
+// One fixed-size record per instruction. The emulator writes records into a preallocated ring buffer,
+// a background thread saves them to a file, and trace_decode() turns such a file back into the usual text output.
+
+#define TRACE_BUFFER_SIZE 65536                             // records in the ring buffer (must be a power of two)
+
+typedef struct {                                            // 24 bytes per instruction
+    uint64_t cycle;                                         // cycle count when the instruction started
+    uint16_t PC;                                            // address of the instruction
+    uint16_t next_PC;                                       // PC after the instruction
+    uint8_t  bytes[3];                                      // opcode and up to two operand bytes
+    uint8_t  length;                                        // number of valid bytes in bytes[]
+    uint8_t  A, X, Y, SP, SR;                               // registers after the instruction
+    uint8_t  reserved[3];
+} trace_record;
+
+trace_buffer* trace_open(const char *filename);
+void trace_fetch_begin(memory_bus *bus, uint16_t start, uint8_t bytes[3]);
+void trace_fetch_end(const memory_bus *bus, uint16_t start, uint8_t bytes[3]);
+void trace_instruction(trace_buffer *trace, CPU6502 *cpu, uint16_t start, uint64_t cycle, const uint8_t bytes[3]);
+bool trace_close(trace_buffer *trace);                      // false on write errors
+
+void fill_trace_record(trace_record *record, CPU6502 *cpu, uint16_t start, uint64_t cycle, const uint8_t bytes[3]);
+void print_trace_record(const trace_record *record, bool show_data, bool show_status);
+int  trace_decode(const char *filename, bool show_data, bool show_status);
+bool check_trace(void);                                     // bytes as fetched, no extra device reads
+
+
+// Batch runner (batch.c)
+//
+// Runs a whole array of independent jobs on a pool of threads, each thread with its own machine.
+// Jobs are distributed in equal shares; a thread that has finished its share steals half of the rest of another one.
+
+typedef struct batch_job batch_job;
+
+struct batch_job {
+    const uint8_t *image;                                   // program image, loaded at load_address
+    size_t size;
+    uint16_t load_address;
+    uint16_t start_address;                                 // initial PC
+    run_budget budget;                                      // per run (trace must be NULL, as it is not shared)
+    void (*check)(batch_job *job, machine *m);              // optional: called with the final machine state
+    bool (*stop)(batch_job *job, machine *m);               // optional: called after every slice, true ends the run
+    uint64_t slice;                                         // cycles per slice (only used with stop)
+    void *user;                                             // free for the caller, e.g. for expected results
+    bool loaded;                                            // results: false if the image did not fit
+    run_result result;
+    CPU6502 cpu;                                            // final CPU state
+    double seconds;                                         // wall time of this run
+};
+
+typedef struct {                                            // aggregated results of a batch
+    size_t runs;
+    size_t stops[6];                                        // number of runs per stop_reason
+    size_t failed;                                          // images that could not be loaded
+    uint64_t cycles, instructions;
+    int threads;
+    double seconds;                                         // wall time of the whole batch
+} batch_summary;
+
+batch_summary run_batch(batch_job *jobs, size_t count, int threads);   // threads <= 0: one per core
+void show_batch_summary(batch_summary summary);
+
+
+// Test suites (suite.c)
+//
+// A suite is a directory of program images, or a manifest that lists images with their load and start addresses,
+// cycle budgets, end conditions and expected memory contents (see suite.c for the format). All images run with the
+// batch runner; each one passes or fails by its end condition, and the results can be saved as JSON or CSV.
+
+#define SUITE_EXPECTS 8                                     // expected bytes per image
+
+typedef enum {                                              // what makes a test pass
+    END_BRK,                                                // BRK has been executed
+    END_TRAP,                                               // the program loops at end_address (JMP or branch to itself)
+    END_MEMORY                                              // end_value at end_address
+} suite_end;
+
+typedef struct {
+    char image[FILENAME_MAX];                               // file name, relative to the working directory
+    program_file program;
+    uint16_t load_address;                                  // for raw binaries
+    int32_t start_address;                                  // initial PC, -1: load address
+    uint64_t cycles;                                        // cycle budget
+    suite_end end;
+    uint16_t end_address;
+    uint8_t end_value;
+    int expects;
+    uint16_t expect_address[SUITE_EXPECTS];                 // checked after the end
+    uint8_t expect_value[SUITE_EXPECTS];
+    bool passed;                                            // results
+    char detail[64];                                        // how the run has ended, or why the test has failed
+    uint16_t PC;                                            // where it has ended: for BRK its address, not the vector's
+} suite_test;
+
+typedef struct {
+    suite_test *tests;
+    batch_job *jobs;                                        // one per test, with cycles, instructions and wall time
+    size_t count;
+    size_t passed;
+    batch_summary summary;
+} test_suite;
+
+test_suite* load_suite(const char *path);                   // path: directory or manifest
+void run_suite(test_suite *suite, int threads);             // threads <= 0: one per core
+void show_suite_results(const test_suite *suite);
+bool write_suite_report(const test_suite *suite, const char *filename);  // CSV for *.csv, JSON otherwise
+void destroy_suite(test_suite *suite);
+bool check_suite(void);                                     // end conditions and reports of a small suite
+
+
+// Lockstep emulation (lockstep.c)
+//
+// Up to LOCKSTEP_LANES machines in structure-of-arrays form. Lanes that agree on PC and instruction bytes execute
+// each instruction together in SIMD kernels; lanes whose control flow has diverged fall back to the scalar core.
+
+#define LOCKSTEP_LANES 32                                   // one AVX2 register of bytes
+
+typedef struct {
+    _Alignas(32) uint8_t A[LOCKSTEP_LANES];                 // one entry per lane for every register
+    uint8_t  X[LOCKSTEP_LANES];
+    uint8_t  Y[LOCKSTEP_LANES];
+    uint8_t  SP[LOCKSTEP_LANES];
+    uint8_t  SR[LOCKSTEP_LANES];
+    uint8_t  running[LOCKSTEP_LANES];                       // 0xFF while the lane runs, 0x00 after BRK
+    uint16_t PC[LOCKSTEP_LANES];
+    uint64_t cycles[LOCKSTEP_LANES];
+    int lanes;                                              // lanes in use
+    uint8_t *memory;                                        // LOCKSTEP_LANES blocks of MEMORY_SIZE bytes (flat RAM)
+    memory_bus *buses;                                      // one per lane, for the scalar core
+    uint64_t lockstep_instructions;                         // statistics: lane instructions executed in lockstep
+    uint64_t scalar_instructions;                           // and in the scalar core
+} lockstep_group;
+
+lockstep_group* create_lockstep(int lanes);
+void destroy_lockstep(lockstep_group *group);
+uint8_t* lane_memory(lockstep_group *group, int lane);
+void get_lane(const lockstep_group *group, int lane, CPU6502 *cpu);
+void set_lane(lockstep_group *group, int lane, const CPU6502 *cpu);
+run_result run_lockstep(lockstep_group *group, run_budget budget);
+void benchmark_lockstep(uint64_t instructions);
+
+
+// Gate-level ALU (alu.c)
+//
+// The ADC gate graph of alu.py in C, evaluated bit-sliced: every gate works on 64 (256 with AVX2) additions at once.
+// check_alu() compares it with the core for every input.
+
+void alu_adc(const uint8_t *a, const uint8_t *b, const uint8_t *carry, uint8_t *result, uint8_t *flags, size_t count);
+bool check_alu(void);
+
+#endif
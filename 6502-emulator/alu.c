@@ -0,0 +1,231 @@
+// GATE-LEVEL ALU FOR THE SIMPLE 6502 EMULATOR
+//
+// C port of the gate graph in alu.py: eight full adders of two XOR, two AND and one OR gate each (FullAdder), with
+// the carry chained from bit to bit, plus gates for the Z and V flags, which alu.py computes from the result. The
+// netlist is a list of gates in evaluation order, each naming the signals it reads and the one it drives, so other
+// netlists (e.g. the decimal correction, or one built from transistors) only need other lists.
+//
+// Evaluation is bit-sliced: a signal is not one bit but one word with a bit for each of ALU_LANES independent input
+// vectors (64 in a uint64_t, 256 in an AVX2 register), so every gate evaluation is one AND, OR, XOR or NOT for all
+// of them at once. Inputs and outputs are bytes, one per vector; they are turned into and out of bit planes eight
+// lanes at a time by transposing 8 x 8 bit matrices.
+//
+// alu_adc() is the co-simulation interface (any number of additions in one call), check_alu() compares the netlist
+// with the ADC of the core for all 131,072 combinations of A, operand and carry (./6502 -g). Only binary mode is
+// modelled: alu.py applies its BCD correction to the finished result, not with gates.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for clock() in check_alu()
+
+#include "6502.h"
+
+#ifdef __AVX2__
+#define ALU_LANES 256
+#else
+#define ALU_LANES 64
+#endif
+
+#define ALU_SIGNALS 128                                     // inputs plus gate outputs
+
+typedef uint64_t signal_word __attribute__((vector_size(ALU_LANES / 8)));  // one bit per lane
+
+typedef enum { GATE_AND, GATE_OR, GATE_XOR, GATE_NOT } gate_type;   // ANDNode, ORNode, XORNode, NOTNode in alu.py
+
+typedef struct {
+    uint8_t type;                                           // gate_type
+    uint8_t inputs[2];                                      // signal numbers; NOT reads only the first
+    uint8_t output;
+} gate;
+
+typedef struct {
+    gate gates[ALU_SIGNALS];
+    int count;
+    int signals;                                            // signals in use
+    uint8_t a[8], b[8], carry_in;                           // input signals, bit 0 first
+    uint8_t ground;                                         // always 0: unused bit planes of inputs and outputs
+    uint8_t sum[8], carry, zero, negative, overflow;        // output signals
+} netlist;
+
+static netlist adc_netlist;
+static pthread_once_t netlist_ready = PTHREAD_ONCE_INIT;
+
+
+// Building the netlist: every gate drives a new signal
+
+static uint8_t add_gate(netlist *n, gate_type type, uint8_t first, uint8_t second) {
+    uint8_t output = n->signals++;
+    n->gates[n->count++] = (gate) {type, {first, second}, output};
+    return output;
+}
+
+static uint8_t full_adder(netlist *n, uint8_t a, uint8_t b, uint8_t carry_in, uint8_t *carry_out) {
+    uint8_t xor1 = add_gate(n, GATE_XOR, a, b);
+    uint8_t sum = add_gate(n, GATE_XOR, xor1, carry_in);
+    uint8_t and1 = add_gate(n, GATE_AND, a, b);
+    uint8_t and2 = add_gate(n, GATE_AND, xor1, carry_in);
+    *carry_out = add_gate(n, GATE_OR, and1, and2);
+    return sum;
+}
+
+static void build_netlist(void) {
+    netlist *n = &adc_netlist;
+
+    for(int bit = 0; bit < 8; bit++) {
+        n->a[bit] = n->signals++;
+        n->b[bit] = n->signals++;
+    }
+    n->carry_in = n->signals++;
+    n->ground = n->signals++;
+
+    uint8_t carry = n->carry_in;
+    for(int bit = 0; bit < 8; bit++) {                      // ALU.add_8bit(): one full adder per bit
+        n->sum[bit] = full_adder(n, n->a[bit], n->b[bit], carry, &carry);
+    }
+    n->carry = carry;
+
+    uint8_t any = n->sum[0];                                // Z: no bit of the result set
+    for(int bit = 1; bit < 8; bit++) {
+        any = add_gate(n, GATE_OR, any, n->sum[bit]);
+    }
+    n->zero = add_gate(n, GATE_NOT, any, any);
+    n->negative = n->sum[7];
+    n->overflow = add_gate(n, GATE_AND, add_gate(n, GATE_XOR, n->a[7], n->sum[7]),     // V: both operands differ
+                           add_gate(n, GATE_XOR, n->b[7], n->sum[7]));                 // from the result in sign
+}
+
+
+// Bit slicing: bytes of eight lanes to eight bit planes and back (the transposition is its own inverse)
+
+static inline uint64_t transpose_bits(uint64_t x) {         // 8 x 8 bit matrix, byte i bit j <-> byte j bit i
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAull;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+    x ^= t ^ (t << 28);
+    return x;
+}
+
+static void slice(const uint8_t bytes[ALU_LANES], signal_word *signals, const uint8_t planes[8]) {
+    for(int group = 0; group < ALU_LANES / 8; group++) {
+        uint64_t x;
+        memcpy(&x, bytes + 8 * group, 8);
+        x = transpose_bits(x);
+        for(int bit = 0; bit < 8; bit++) {
+            ((uint8_t *) &signals[planes[bit]])[group] = x >> (8 * bit);
+        }
+    }
+}
+
+static void unslice(const signal_word *signals, const uint8_t planes[8], uint8_t bytes[ALU_LANES]) {
+    for(int group = 0; group < ALU_LANES / 8; group++) {
+        uint64_t x = 0;
+        for(int bit = 0; bit < 8; bit++) {
+            x |= (uint64_t) ((const uint8_t *) &signals[planes[bit]])[group] << (8 * bit);
+        }
+        x = transpose_bits(x);
+        memcpy(bytes + 8 * group, &x, 8);
+    }
+}
+
+static void evaluate(const netlist *n, signal_word *signals) {
+    for(int i = 0; i < n->count; i++) {
+        const gate *g = &n->gates[i];
+        signal_word first = signals[g->inputs[0]], second = signals[g->inputs[1]];
+        switch(g->type) {
+            case GATE_AND: signals[g->output] = first & second; break;
+            case GATE_OR:  signals[g->output] = first | second; break;
+            case GATE_XOR: signals[g->output] = first ^ second; break;
+            default:       signals[g->output] = ~first;         break;
+        }
+    }
+}
+
+
+// ADC for "count" input vectors at once: results, and flags C, Z, V, N at their places in SR (all other bits 0).
+// Only bit 0 of "carry" counts.
+
+void alu_adc(const uint8_t *a, const uint8_t *b, const uint8_t *carry, uint8_t *result, uint8_t *flags, size_t count) {
+    const netlist *n = &adc_netlist;
+    signal_word signals[ALU_SIGNALS];
+    uint8_t in[3][ALU_LANES], out[2][ALU_LANES];
+
+    pthread_once(&netlist_ready, build_netlist);
+    for(size_t first = 0; first < count; first += ALU_LANES) {
+        size_t lanes = count - first < ALU_LANES ? count - first : ALU_LANES;
+        uint8_t carry_planes[8] = {n->carry_in, n->ground, n->ground, n->ground, n->ground, n->ground, n->ground,
+                                   n->ground};
+        uint8_t flag_planes[8] = {n->carry, n->zero, n->ground, n->ground, n->ground, n->ground, n->overflow,
+                                  n->negative};
+
+        memset(in, 0, sizeof(in));                          // the last, partial slice is padded with zeros
+        memcpy(in[0], a + first, lanes);
+        memcpy(in[1], b + first, lanes);
+        for(size_t lane = 0; lane < lanes; lane++) {
+            in[2][lane] = carry[first + lane] & 1;          // so that only bit 0 is ever set
+        }
+        slice(in[0], signals, n->a);
+        slice(in[1], signals, n->b);
+        slice(in[2], signals, carry_planes);                // this also clears the ground
+
+        evaluate(n, signals);
+        unslice(signals, n->sum, out[0]);
+        unslice(signals, flag_planes, out[1]);
+        memcpy(result + first, out[0], lanes);
+        memcpy(flags + first, out[1], lanes);
+    }
+}
+
+
+// All 131,072 inputs through the netlist and through the core (ADC #$xx with the decimal flag clear)
+
+bool check_alu(void) {
+    const size_t count = 2 * 256 * 256;
+    uint8_t *inputs = malloc(5 * count);
+    machine *m = create_machine();
+    if(!inputs || !m) {
+        printf("Memory allocation failed.\n");
+        free(inputs);
+        destroy_machine(m);
+        return false;
+    }
+    uint8_t *a = inputs, *b = a + count, *carry = b + count, *result = carry + count, *flags = result + count;
+    for(size_t i = 0; i < count; i++) {
+        a[i] = i >> 8;
+        b[i] = i;
+        carry[i] = i >> 16;
+    }
+
+    clock_t start = clock();
+    alu_adc(a, b, carry, result, flags, count);
+    double gates = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    size_t mismatches = 0;
+    CPU6502 *cpu = &m->cpu;
+    start = clock();
+    m->memory[0x0200] = 0x69;                               // ADC #$xx
+    for(size_t i = 0; i < count; i++) {
+        m->memory[0x0201] = b[i];
+        cpu->PC = 0x0200;
+        cpu->A = a[i];
+        set_status(cpu, FLAG_U | carry[i]);
+        execute_command(cpu, &m->bus);
+        uint8_t status = get_status(cpu) & (FLAG_N | FLAG_V | FLAG_Z | FLAG_C);
+        if(cpu->A != result[i] || status != flags[i]) {
+            if(mismatches++ < 10) {
+                printf("ADC $%02X + $%02X + %d: core $%02X, flags $%02X; gates $%02X, flags $%02X\n", a[i], b[i],
+                       carry[i], cpu->A, status, result[i], flags[i]);
+            }
+        }
+    }
+    double core = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    printf("Gate-level ALU: %d gates, %d lanes per evaluation\n", adc_netlist.count, ALU_LANES);
+    printf("%zu ADC inputs, %zu mismatches; netlist %.3f s, core %.3f s\n", count, mismatches, gates, core);
+    free(inputs);
+    destroy_machine(m);
+    return mismatches == 0;
+}
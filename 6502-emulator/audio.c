@@ -0,0 +1,292 @@
+// AUDIO OUTPUT FOR THE SIMPLE 6502 EMULATOR
+//
+// Sound devices (tedsound.c) hand over their samples in blocks to a sample_sink: a function with a context pointer.
+// The WAV writer is such a sink. It writes 16 bit mono PCM to a file, or to stdout for pipes ("-"). The sizes in the
+// header are only known at the end: wav_close() fills them in if the file is seekable, and leaves them at their
+// maximum for streams, which players and tools read until the end of the data.
+//
+// For real-time output, an audio stream sits between the emulation and the WAV writer. The emulation thread is the
+// only producer of a ring buffer, a consumer thread the only consumer, and each side only writes its own index, as in
+// trace.c. Unlike a trace, sound must never hold up the emulation: when the ring is full, new samples are dropped
+// (overruns). The consumer plays like a sound card: every AUDIO_PERIOD_MS it writes one period of samples to the
+// output, and fills in the last sample again where the ring has run dry (underruns).
+//
+// The emulation is paced to the host clock by cycles (CLOCK_SPEED), the output by samples, and both drift apart a
+// little. The consumer therefore resamples, by linear interpolation, at the nominal ratio of the two sample rates,
+// corrected by up to AUDIO_MAX_DRIFT in proportion to how far the ring is above or below AUDIO_TARGET samples.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for clock_nanosleep()
+
+#include "6502.h"
+
+#define AUDIO_RING_SIZE 16384                               // samples, must be a power of two
+#define AUDIO_TARGET 4096                                   // fill level the rate control aims at (latency)
+#define AUDIO_PERIOD_MS 10                                  // output written at once by the consumer
+#define AUDIO_MAX_DRIFT 0.005                               // largest correction of the resampling ratio
+#define AUDIO_SMOOTHING 0.05                                // share of a new correction per period
+
+struct wav_file {
+    FILE *file;
+    bool seekable;                                          // false for stdout and pipes
+    uint32_t sample_rate;
+    uint64_t samples;                                       // written so far
+};
+
+static void put_16(uint8_t *bytes, uint16_t value);
+static void put_32(uint8_t *bytes, uint32_t value);
+static void write_header(wav_file *wav, uint32_t data_size);
+
+struct audio_stream {
+    int16_t ring[AUDIO_RING_SIZE];
+    _Atomic uint64_t head;                                  // next sample to be filled by the emulation
+    _Atomic uint64_t tail;                                  // next sample to be read by the consumer
+    atomic_bool stop;                                       // set by audio_stream_close()
+    uint64_t step;                                          // nominal input samples per output sample, 32.32
+    uint64_t position;                                      // fraction of a sample past tail, 32.32
+    double ratio;                                           // current correction of step
+    int16_t last;                                           // last sample played, repeated in underruns
+    uint32_t output_rate;
+    audio_stream_stats stats;                               // received and overruns: producer, the rest: consumer
+    wav_file *wav;
+    pthread_t consumer;
+};
+
+static void* audio_consumer(void *argument);
+static size_t resample(audio_stream *stream, int16_t *output, size_t count, bool draining);
+
+
+// Opens the file ("-": stdout) and writes a header with unknown sizes
+
+wav_file* wav_open(const char *filename, uint32_t sample_rate) {
+    wav_file *wav = calloc(1, sizeof(wav_file));
+    if(!wav) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    wav->sample_rate = sample_rate;
+    if(!strcmp(filename, "-")) {
+        wav->file = stdout;
+    } else {
+        wav->file = fopen(filename, "wb");
+        wav->seekable = true;
+    }
+    if(!wav->file) {
+        printf("Unable to open %s.\n", filename);
+        free(wav);
+        return NULL;
+    }
+    write_header(wav, UINT32_MAX);
+    return wav;
+}
+
+void wav_write(void *context, const int16_t *samples, size_t count) {     // a sample_sink
+    wav_file *wav = context;
+    uint8_t bytes[4096];                                    // WAV is little-endian, whatever the host is
+
+    for(size_t done = 0; done < count; ) {
+        size_t block = count - done < sizeof(bytes) / 2 ? count - done : sizeof(bytes) / 2;
+        for(size_t i = 0; i < block; i++) {
+            put_16(bytes + 2 * i, (uint16_t) samples[done + i]);
+        }
+        fwrite(bytes, 2, block, wav->file);
+        done += block;
+    }
+    wav->samples += count;
+}
+
+bool wav_close(wav_file *wav) {                             // fills in the sizes if possible; false on write errors
+    uint64_t data_size = wav->samples * 2;
+    if(wav->seekable && data_size <= UINT32_MAX - 36 && !fseek(wav->file, 0, SEEK_SET)) {
+        write_header(wav, (uint32_t) data_size);
+    }
+    bool written = !ferror(wav->file);
+    if(wav->file == stdout) {
+        written = !fflush(stdout) && written;
+    } else {
+        written = !fclose(wav->file) && written;
+    }
+    free(wav);
+    return written;
+}
+
+static void write_header(wav_file *wav, uint32_t data_size) {   // RIFF header for 16 bit mono PCM
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    put_32(header + 4, data_size == UINT32_MAX ? UINT32_MAX : data_size + 36);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_32(header + 16, 16);                                // size of the format chunk
+    put_16(header + 20, 1);                                 // PCM
+    put_16(header + 22, 1);                                 // mono
+    put_32(header + 24, wav->sample_rate);
+    put_32(header + 28, wav->sample_rate * 2);              // bytes per second
+    put_16(header + 32, 2);                                 // bytes per frame
+    put_16(header + 34, 16);                                // bits per sample
+    memcpy(header + 36, "data", 4);
+    put_32(header + 40, data_size);
+    fwrite(header, 1, sizeof(header), wav->file);
+}
+
+static void put_16(uint8_t *bytes, uint16_t value) {
+    bytes[0] = value & 0xFF;
+    bytes[1] = value >> 8;
+}
+
+static void put_32(uint8_t *bytes, uint32_t value) {
+    put_16(bytes, value & 0xFFFF);
+    put_16(bytes + 2, value >> 16);
+}
+
+
+// Opens the output and starts the consumer thread. input_rate: samples per second from the emulation (per
+// CLOCK_SPEED cycles); output_rate: samples per second written to the output.
+
+audio_stream* audio_stream_open(const char *filename, uint32_t input_rate, uint32_t output_rate) {
+    audio_stream *stream = calloc(1, sizeof(audio_stream));
+    if(!stream) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    stream->wav = wav_open(filename, output_rate);
+    if(!stream->wav) {
+        free(stream);
+        return NULL;
+    }
+    stream->step = ((uint64_t) input_rate << 32) / output_rate;
+    stream->ratio = 1;
+    stream->output_rate = output_rate;
+    atomic_init(&stream->head, 0);
+    atomic_init(&stream->tail, 0);
+    atomic_init(&stream->stop, false);
+    if(pthread_create(&stream->consumer, NULL, audio_consumer, stream)) {
+        printf("Unable to start audio output.\n");
+        wav_close(stream->wav);
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+
+// Called by the emulation (a sample_sink): copies the samples into the ring, or drops what does not fit
+
+void audio_stream_write(void *context, const int16_t *samples, size_t count) {
+    audio_stream *stream = context;
+    uint64_t head = atomic_load_explicit(&stream->head, memory_order_relaxed);     // only this thread writes head
+    uint64_t space = AUDIO_RING_SIZE - (head - atomic_load_explicit(&stream->tail, memory_order_acquire));
+
+    stream->stats.received += count;
+    if(count > space) {
+        stream->stats.overruns += count - space;
+        count = space;
+    }
+    size_t first = head & (AUDIO_RING_SIZE - 1);
+    size_t part = count < AUDIO_RING_SIZE - first ? count : AUDIO_RING_SIZE - first;
+    memcpy(&stream->ring[first], samples, part * sizeof(int16_t));
+    memcpy(stream->ring, samples + part, (count - part) * sizeof(int16_t));
+    atomic_store_explicit(&stream->head, head + count, memory_order_release);      // publish the samples
+}
+
+
+// Lets the consumer play what is left, stops it, closes the output; returns the counters
+
+audio_stream_stats audio_stream_close(audio_stream *stream) {
+    atomic_store(&stream->stop, true);
+    pthread_join(stream->consumer, NULL);
+    audio_stream_stats stats = stream->stats;
+    stats.ratio = stream->ratio;
+    if(!wav_close(stream->wav)) {
+        printf("Unable to write the audio output.\n");
+    }
+    free(stream);
+    return stats;
+}
+
+
+// Consumer thread: waits until the ring holds AUDIO_TARGET samples, then writes one period after the other at the
+// output rate, by the host clock. After audio_stream_close(), it plays the rest without waiting.
+
+static void* audio_consumer(void *argument) {
+    audio_stream *stream = argument;
+    size_t period = stream->output_rate * AUDIO_PERIOD_MS / 1000;
+    int16_t *block = malloc(period * sizeof(int16_t));
+    struct timespec pause = {0, 1000000}, start;
+    uint64_t periods = 0;
+
+    if(!block) {
+        printf("Memory allocation failed.\n");
+        return NULL;                                        // the emulation goes on, its samples are dropped
+    }
+    while(!atomic_load(&stream->stop) && atomic_load_explicit(&stream->head, memory_order_acquire) < AUDIO_TARGET) {
+        nanosleep(&pause, NULL);                            // fill the ring up to the latency first
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(!atomic_load(&stream->stop)) {
+        resample(stream, block, period, false);
+        wav_write(stream->wav, block, period);
+        periods++;
+        struct timespec deadline = start;                   // the moment the next period is due
+        uint64_t nanoseconds = periods * AUDIO_PERIOD_MS * 1000000ull;
+        deadline.tv_sec += nanoseconds / 1000000000;
+        deadline.tv_nsec += nanoseconds % 1000000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+    while(atomic_load_explicit(&stream->head, memory_order_acquire) - atomic_load(&stream->tail) > 1) {
+        size_t count = resample(stream, block, period, true);   // the rest, at the nominal ratio
+        if(count == 0) {
+            break;
+        }
+        wav_write(stream->wav, block, count);
+    }
+    free(block);
+    return NULL;
+}
+
+
+// Produces "count" output samples from the ring by linear interpolation. The ratio is corrected once per call.
+// Missing samples count as underruns and repeat the last one; while draining, they end the output instead, and fewer
+// samples are returned.
+
+static size_t resample(audio_stream *stream, int16_t *output, size_t count, bool draining) {
+    uint64_t tail = atomic_load_explicit(&stream->tail, memory_order_relaxed);     // only this thread writes tail
+    uint64_t fill = atomic_load_explicit(&stream->head, memory_order_acquire) - tail;
+
+    if(!draining) {
+        double ratio = 1 + AUDIO_MAX_DRIFT * ((double) fill - AUDIO_TARGET) / AUDIO_TARGET;
+        ratio = ratio < 1 - AUDIO_MAX_DRIFT ? 1 - AUDIO_MAX_DRIFT : ratio > 1 + AUDIO_MAX_DRIFT ? 1 + AUDIO_MAX_DRIFT : ratio;
+        stream->ratio += (ratio - stream->ratio) * AUDIO_SMOOTHING;
+    }
+    uint64_t step = draining ? stream->step : (uint64_t) (stream->step * stream->ratio);
+    for(size_t i = 0; i < count; i++) {
+        uint64_t index = stream->position >> 32;
+        if(index + 1 >= fill) {                             // the ring has run dry
+            if(draining) {
+                count = i;
+                break;
+            }
+            stream->stats.underruns++;
+            output[i] = stream->last;
+            continue;
+        }
+        int32_t a = stream->ring[(tail + index) & (AUDIO_RING_SIZE - 1)];
+        int32_t b = stream->ring[(tail + index + 1) & (AUDIO_RING_SIZE - 1)];
+        int32_t fraction = (stream->position >> 17) & 0x7FFF;                     // 15 bits, so the product fits
+        output[i] = stream->last = (int16_t) (a + (((b - a) * fraction) >> 15));
+        stream->position += step;
+    }
+    uint64_t consumed = stream->position >> 32;
+    if(consumed > fill) {
+        consumed = fill;
+    }
+    stream->position -= consumed << 32;
+    stream->stats.played += count;
+    atomic_store_explicit(&stream->tail, tail + consumed, memory_order_release);   // free the samples for the emulation
+    return count;
+}
@@ -0,0 +1,239 @@
+// BATCH RUNNER FOR THE SIMPLE 6502 EMULATOR
+//
+// Runs thousands of independent programs (regression tests, fuzzing inputs, ...) in one process on all cores.
+//
+// Every worker thread owns one machine, which is reset and reloaded for each job, so no memory is allocated per run.
+// The machines use the translation cache (cache.c).
+// The jobs are split into one contiguous share per worker. A worker takes jobs from the front of its own share;
+// when that is empty, it steals the back half of the largest share it can find. Front and back of each share are packed
+// into one 64 bit word, so taking and stealing are both a single compare-and-swap, without any locks.
+//
+// Results are written into the job structs (each job is touched by exactly one worker) and summed up at the end.
+// Jobs with a stop() function run in slices of job->slice cycles, and stop() decides after each slice whether the run
+// is over, e.g. because the program has got stuck in a loop (see suite.c).
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for clock_gettime()
+#include <unistd.h>                                         // for sysconf()
+
+#include "6502.h"
+
+#define BATCH_MAX_THREADS 256
+
+typedef struct {
+    _Atomic uint64_t share;                                 // front (high 32 bits) and back (low 32 bits) of the share
+    pthread_t thread;
+    struct batch_pool *pool;
+} batch_worker;
+
+typedef struct batch_pool {
+    batch_job *jobs;
+    batch_worker *workers;
+    int threads;
+} batch_pool;
+
+static double now(void);
+static void* batch_thread(void *argument);
+static bool take_job(batch_worker *worker, uint32_t *job);
+static bool steal_jobs(batch_pool *pool, batch_worker *thief);
+static void run_job(batch_job *job, machine *m);
+static run_result run_slices(batch_job *job, machine *m);
+
+static inline uint64_t make_share(uint32_t front, uint32_t back) {
+    return ((uint64_t) front << 32) | back;
+}
+
+
+// Runs all jobs and returns the aggregated results
+
+batch_summary run_batch(batch_job *jobs, size_t count, int threads) {
+    batch_summary summary;
+    memset(&summary, 0, sizeof(summary));
+
+    if(threads <= 0) {                                      // default: one thread per core
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > BATCH_MAX_THREADS) {
+        threads = BATCH_MAX_THREADS;
+    }
+    if((size_t) threads > count && count > 0) {             // no idle threads for small batches
+        threads = (int) count;
+    }
+    summary.threads = threads;
+    if(count == 0 || count > UINT32_MAX) {
+        return summary;
+    }
+
+    batch_pool pool = {jobs, calloc(threads, sizeof(batch_worker)), threads};
+    if(!pool.workers) {
+        printf("Memory allocation failed.\n");
+        return summary;
+    }
+    for(int i = 0; i < threads; i++) {                      // equal shares to start with
+        uint32_t front = (uint32_t) (count * i / threads);
+        uint32_t back = (uint32_t) (count * (i + 1) / threads);
+        atomic_init(&pool.workers[i].share, make_share(front, back));
+        pool.workers[i].pool = &pool;
+    }
+
+    double start = now();
+    int started = 0;
+    for(int i = 1; i < threads; i++) {                      // worker 0 is the calling thread itself
+        if(pthread_create(&pool.workers[i].thread, NULL, batch_thread, &pool.workers[i])) {
+            break;                                          // the others will steal the jobs of missing workers
+        }
+        started = i;
+    }
+    batch_thread(&pool.workers[0]);
+    for(int i = 1; i <= started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+    summary.seconds = now() - start;
+    summary.threads = started + 1;
+    free(pool.workers);
+
+    for(size_t i = 0; i < count; i++) {                     // aggregate
+        summary.runs++;
+        if(!jobs[i].loaded) {
+            summary.failed++;
+            continue;
+        }
+        summary.stops[jobs[i].result.reason]++;
+        summary.cycles += jobs[i].result.cycles;
+        summary.instructions += jobs[i].result.instructions;
+    }
+    return summary;
+}
+
+void show_batch_summary(batch_summary summary) {
+    printf("%zu runs on %d thread%s in %.3f s\n", summary.runs, summary.threads, summary.threads == 1 ? "" : "s", summary.seconds);
+    printf("Stopped by budget: %zu  |  BRK: %zu  |  breakpoint: %zu  |  watchpoint: %zu  |  interrupt: %zu  |  "
+           "unknown opcode: %zu  |  not loaded: %zu\n", summary.stops[STOP_BUDGET], summary.stops[STOP_BRK],
+           summary.stops[STOP_BREAKPOINT], summary.stops[STOP_WATCHPOINT], summary.stops[STOP_INTERRUPT],
+           summary.stops[STOP_UNKNOWN_OPCODE], summary.failed);
+    printf("%llu instructions, %llu cycles", (unsigned long long) summary.instructions, (unsigned long long) summary.cycles);
+    if(summary.seconds > 0) {
+        printf(" (%.1f million instructions/s)", summary.instructions / summary.seconds / 1e6);
+    }
+    printf("\n");
+}
+
+
+// Worker: own share first, then steal until there is nothing left anywhere
+
+static void* batch_thread(void *argument) {
+    batch_worker *worker = argument;
+    machine *m = create_machine();
+    uint32_t job;
+
+    if(!m || !enable_translation_cache(m)) {                // one cache per worker, reused for every job
+        destroy_machine(m);
+        return NULL;                                        // the other workers steal this share
+    }
+    while(take_job(worker, &job) || (steal_jobs(worker->pool, worker) && take_job(worker, &job))) {
+        run_job(&worker->pool->jobs[job], m);
+    }
+    destroy_machine(m);
+    return NULL;
+}
+
+static bool take_job(batch_worker *worker, uint32_t *job) {
+    uint64_t share = atomic_load(&worker->share);
+    while(1) {
+        uint32_t front = share >> 32, back = (uint32_t) share;
+        if(front >= back) {
+            return false;
+        }
+        if(atomic_compare_exchange_weak(&worker->share, &share, make_share(front + 1, back))) {
+            *job = front;
+            return true;
+        }                                                   // a thief was faster: share has been reloaded, try again
+    }
+}
+
+static bool steal_jobs(batch_pool *pool, batch_worker *thief) {
+    while(1) {
+        batch_worker *victim = NULL;                        // look for the largest remaining share
+        uint32_t largest = 0;
+        for(int i = 0; i < pool->threads; i++) {
+            uint64_t share = atomic_load(&pool->workers[i].share);
+            uint32_t left = (uint32_t) share > (share >> 32) ? (uint32_t) share - (uint32_t) (share >> 32) : 0;
+            if(&pool->workers[i] != thief && left > largest) {
+                largest = left;
+                victim = &pool->workers[i];
+            }
+        }
+        if(!victim) {
+            return false;                                   // all done
+        }
+
+        uint64_t share = atomic_load(&victim->share);
+        uint32_t front = share >> 32, back = (uint32_t) share;
+        if(front >= back) {
+            continue;                                       // finished in the meantime, look again
+        }
+        uint32_t middle = front + (back - front) / 2;       // leave the front half to the victim
+        if(atomic_compare_exchange_strong(&victim->share, &share, make_share(front, middle))) {
+            atomic_store(&thief->share, make_share(middle, back));
+            return true;
+        }
+    }
+}
+
+static void run_job(batch_job *job, machine *m) {
+    double start = now();
+
+    reset_machine(m);
+    job->loaded = load_image(m, job->image, job->size, job->load_address);
+    if(job->loaded) {
+        m->cpu.PC = job->start_address;
+        job->budget.trace = NULL;
+        job->result = job->stop && job->slice ? run_slices(job, m) : run_machine(m, job->budget);
+        if(job->check) {
+            job->check(job, m);
+        }
+    }
+    job->cpu = m->cpu;
+    job->seconds = now() - start;
+}
+
+// Runs a job slice by slice within its budget, until the budget is used up, run_machine() stops by itself, or stop()
+// returns true
+
+static run_result run_slices(batch_job *job, machine *m) {
+    run_result total = {STOP_BUDGET, 0, 0};
+    run_budget budget = job->budget;
+
+    while(1) {
+        budget.cycles = job->slice;
+        if(job->budget.cycles && job->budget.cycles - total.cycles < job->slice) {
+            budget.cycles = job->budget.cycles - total.cycles;
+        }
+        if(job->budget.instructions) {
+            budget.instructions = job->budget.instructions - total.instructions;
+        }
+        run_result result = run_machine(m, budget);
+        total.reason = result.reason;
+        total.cycles += result.cycles;
+        total.instructions += result.instructions;
+        if(result.reason != STOP_BUDGET || job->stop(job, m)) {
+            return total;
+        }
+        if((job->budget.cycles && total.cycles >= job->budget.cycles)
+           || (job->budget.instructions && total.instructions >= job->budget.instructions)) {
+            return total;                                   // the last instruction may have overshot the budget
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
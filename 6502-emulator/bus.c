@@ -0,0 +1,234 @@
+// MEMORY BUS FOR THE SIMPLE 6502 EMULATOR
+//
+// The CPU sees memory through two page tables (see memory_bus in 6502.h): every page either points to host memory,
+// which is read or written directly, or has a device callback. This file builds those tables.
+//
+// A machine profile decides which pages are RAM, ROM, or I/O (the layouts follow settings.py for the C64 and the
+// C16/Plus4 memory map for the TED machines):
+// - RAM pages point to machine.memory for reads and writes.
+// - ROM pages point to machine.rom for reads and to machine.memory for writes, so a program can never change ROM.
+//   Just like on the real machines, the bytes end up in the RAM below the ROM.
+// - I/O pages have no host memory; their accesses go to attached devices (attach_device()), or to plain registers
+//   in machine.io if no device handles the address. C16 page $FF is shared: TED up to $FF3F, KERNAL ROM above.
+//
+// Only I/O pages take the slow path, so attaching devices does not slow down code that runs in RAM or ROM.
+
+#include <string.h>
+
+#include "6502.h"
+
+typedef struct {
+    uint16_t first, last;
+} address_range;
+
+static const address_range rom_areas[][2] = {              // per profile, empty range = last < first
+    [PROFILE_FLAT] = {{1, 0},           {1, 0}},
+    [PROFILE_C64]  = {{0xA000, 0xBFFF}, {0xE000, 0xFFFF}},  // BASIC, KERNAL
+    [PROFILE_C16]  = {{0x8000, 0xBFFF}, {0xC000, 0xFFFF}}   // BASIC, KERNAL (below the I/O area)
+};
+
+static const address_range io_areas[] = {
+    [PROFILE_FLAT] = {1, 0},
+    [PROFILE_C64]  = {0xD000, 0xDFFF},                      // VIC, SID, color RAM, CIA 1 and 2
+    [PROFILE_C16]  = {0xFD00, 0xFF3F}                       // ACIA, 6529, ..., TED $FF00-$FF3F
+};
+
+static uint8_t io_read(void *device, uint16_t address);
+static void io_write(void *device, uint16_t address, uint8_t value);
+static void ignore_write(void *device, uint16_t address, uint8_t value);
+static void watched_write(void *device, uint16_t address, uint8_t value);
+
+static inline bool in_range(address_range range, uint16_t address) {
+    return address >= range.first && address <= range.last;
+}
+
+static bool in_rom(const machine *m, uint16_t address) {
+    return in_range(rom_areas[m->profile][0], address) || in_range(rom_areas[m->profile][1], address);
+}
+
+
+// Page table entries. "read" and "write" are 64 KB arrays indexed by address (machine.memory, machine.rom); each page
+// points to its own 256 bytes in them. write = NULL makes the pages read-only: writes are ignored.
+
+void bus_map_memory(memory_bus *bus, uint8_t first_page, uint8_t last_page, uint8_t *read, uint8_t *write) {
+    for(int page = first_page; page <= last_page; page++) {
+        bus->read[page] = read + (page << 8);
+        bus->write[page] = write ? write + (page << 8) : NULL;
+        bus->write_device[page] = write ? NULL : ignore_write;
+        bus->write_context[page] = NULL;
+    }
+}
+
+void bus_map_device(memory_bus *bus, uint8_t first_page, uint8_t last_page, bus_read_function read, bus_write_function write,
+                    void *device) {
+    for(int page = first_page; page <= last_page; page++) {
+        if(read) {                                          // NULL leaves that direction as it is
+            bus->read[page] = NULL;
+            bus->read_device[page] = read;
+            bus->read_context[page] = device;
+        }
+        if(write) {
+            bus->write[page] = NULL;
+            bus->write_device[page] = write;
+            bus->write_context[page] = device;
+        }
+    }
+}
+
+
+// Slow paths of bus_read() and bus_write(), kept out of line so that the inlined fast paths stay small
+
+uint8_t bus_read_device(memory_bus *bus, uint16_t address) {
+    uint8_t value = bus->read_device[address >> 8](bus->read_context[address >> 8], address);
+    if(bus->fetching) {                                     // kept for the trace, which must not read devices itself
+        bus->fetched[(uint16_t) (address - bus->fetch_start) & 3] = value;
+    }
+    bus->fetching = false;                                  // marks a single read
+    return value;
+}
+
+uint8_t bus_fetch_device(memory_bus *bus, uint16_t address) {   // devices can tell fetches from data reads (debug.c)
+    bus->fetching = true;
+    return bus_read_device(bus, address);
+}
+
+void bus_write_device(memory_bus *bus, uint16_t address, uint8_t value) {
+    bus->write_device[address >> 8](bus->write_context[address >> 8], address, value);
+}
+
+
+// Profiles: RAM first, then the ROM areas on top, then the I/O pages. Attached devices stay attached.
+// As all pages are mapped anew, dirty tracking (snapshot.c) has to consider all of them changed.
+
+void set_machine_profile(machine *m, machine_profile profile) {
+    address_range io = io_areas[profile];
+
+    mark_all_dirty(m);
+    m->profile = profile;
+    bus_map_memory(&m->bus, 0x00, 0xFF, m->memory, m->memory);
+    for(int i = 0; i < 2; i++) {
+        address_range rom = rom_areas[profile][i];
+        if(rom.first <= rom.last) {
+            bus_map_memory(&m->bus, rom.first >> 8, rom.last >> 8, m->rom, m->memory);
+        }
+    }
+    if(io.first <= io.last) {
+        bus_map_device(&m->bus, io.first >> 8, io.last >> 8, io_read, io_write, m);
+    }
+    for(int i = 0; i < m->device_count; i++) {
+        bus_map_device(&m->bus, m->devices[i].first >> 8, m->devices[i].last >> 8, io_read, io_write, m);
+    }
+}
+
+
+// Attaches a device to an address range. All pages touched by the range take the slow path from now on; addresses
+// in those pages that the device does not cover behave as before (RAM, ROM, or I/O registers).
+
+bool attach_device(machine *m, uint16_t first, uint16_t last, bus_read_function read, bus_write_function write, void *device) {
+    if(m->device_count == MACHINE_DEVICES || first > last) {
+        printf("Unable to attach device at %04X-%04X.\n", first, last);
+        return false;
+    }
+    mark_dirty(m, first, (size_t) last - first + 1);        // the pages are no longer watched or shared
+    m->devices[m->device_count++] = (io_device) {first, last, read, write, device};
+    bus_map_device(&m->bus, first >> 8, last >> 8, io_read, io_write, m);
+    return true;
+}
+
+
+// Slow path for all I/O pages: attached devices first, then the I/O registers of the profile, then ROM and RAM
+
+static uint8_t io_read(void *device, uint16_t address) {
+    machine *m = device;
+    for(int i = 0; i < m->device_count; i++) {
+        if(m->devices[i].read && address >= m->devices[i].first && address <= m->devices[i].last) {
+            if(m->recording) {                              // logged, or taken from the log (replay.c)
+                return recorded_read(m, &m->devices[i], address);
+            }
+            return m->devices[i].read(m->devices[i].device, address);
+        }
+    }
+    if(in_range(io_areas[m->profile], address)) {
+        return m->io[address & (IO_SIZE - 1)];
+    }
+    return in_rom(m, address) ? m->rom[address] : m->memory[address];
+}
+
+static void io_write(void *device, uint16_t address, uint8_t value) {
+    machine *m = device;
+    for(int i = 0; i < m->device_count; i++) {
+        if(m->devices[i].write && address >= m->devices[i].first && address <= m->devices[i].last) {
+            if(m->recording) {
+                recorded_write(m, &m->devices[i], address, value);
+            } else {
+                m->devices[i].write(m->devices[i].device, address, value);
+            }
+            return;
+        }
+    }
+    if(in_range(io_areas[m->profile], address)) {
+        m->io[address & (IO_SIZE - 1)] = value;
+        mark_page_dirty(m, BUS_PAGES + ((address & (IO_SIZE - 1)) >> 8));
+    } else {
+        m->memory[address] = value;                         // RAM, also below ROM
+        mark_page_dirty(m, address >> 8);
+        page_changed(m, address >> 8);
+    }
+}
+
+// For devices that look at the registers of others (e.g. the TED video at the sound registers): the same value as
+// io_read(), but the read is not part of a recording and does not consume one in a replay. Only for registers that
+// can be read without side effects.
+
+uint8_t peek_register(machine *m, uint16_t address) {
+    if(m->bus.read[address >> 8]) {
+        return m->bus.read[address >> 8][address & 0xFF];
+    }
+    for(int i = 0; i < m->device_count; i++) {
+        if(m->devices[i].read && address >= m->devices[i].first && address <= m->devices[i].last) {
+            return m->devices[i].read(m->devices[i].device, address);
+        }
+    }
+    if(in_range(io_areas[m->profile], address)) {
+        return m->io[address & (IO_SIZE - 1)];
+    }
+    return in_rom(m, address) ? m->rom[address] : m->memory[address];
+}
+
+static void ignore_write(void *device, uint16_t address, uint8_t value) {
+    (void) device, (void) address, (void) value;
+}
+
+
+// Watched pages: the write pointer of a page is taken out of the page table, so that the next write to the page goes
+// through watched_write(). That write counts a new generation of the page (decoded code is out of date, see cache.c),
+// marks it dirty for the next snapshot, copies it if it is still shared with a snapshot, and puts the pointer back,
+// so all further writes run at full speed again. Snapshots and the translation cache both watch pages this way.
+
+void watch_page(machine *m, int page) {
+    if(m->bus.write[page]) {                                // host memory only, device pages are watched by io_write()
+        m->watched_write[page] = m->bus.write[page];
+        m->bus.write[page] = NULL;
+        m->bus.write_device[page] = watched_write;
+        m->bus.write_context[page] = m;
+    }
+}
+
+void unwatch_page(machine *m, int page) {
+    if(!m->bus.write[page] && m->bus.write_device[page] == watched_write) {
+        m->bus.write[page] = m->watched_write[page];
+    }
+}
+
+static void watched_write(void *device, uint16_t address, uint8_t value) {
+    machine *m = device;
+    int page = address >> 8;
+
+    if(m->shared[page]) {
+        unshare_page(m, page);
+    }
+    unwatch_page(m, page);
+    mark_page_dirty(m, page);
+    page_changed(m, page);
+    m->bus.write[page][address & 0xFF] = value;
+}
@@ -0,0 +1,334 @@
+// TRANSLATION CACHE FOR THE SIMPLE 6502 EMULATOR
+//
+// run() fetches every opcode and every operand byte through the bus and dispatches on the opcode each time, although
+// most code runs the same instructions over and over. With the translation cache, a straight run of instructions is
+// decoded once into a block of decoded_instruction records (handler, operand, cycles); afterwards, executing the block
+// is a loop of direct calls with the operand at hand, without any instruction fetches.
+//
+// Blocks are kept in a direct-mapped table indexed by their start address. Code is only decoded when it runs for the
+// second time; until then, single instructions are executed as in run(), so code that runs only once (initialization,
+// programs without loops) does not pay for decoding. A block ends after BLOCK_INSTRUCTIONS instructions, after BRK or
+// any other instruction that continues somewhere else (JSR, RTS, RTI, jumps, branches), or at the end of a page (the
+// last instruction may reach into the next page), so it depends on two pages at most. Both pages are watched (see
+// watch_page() in bus.c), and the block remembers their generation counters: any write to one of them counts a new
+// generation, and the block is decoded again the next time it is needed. Within a block, the machine's total of page
+// changes is checked after every instruction, so an instruction that changes one of the following ones
+// (self-modifying code) ends the block right there; so does an instruction after which an IRQ or NMI is pending
+// (CLI, a write to a device), which is then serviced as in run().
+//
+// Code in I/O pages is never cached, as reading it can have side effects. Runs with breakpoints or tracing use run().
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+
+#define CACHE_BLOCKS 1024                                   // must be a power of two
+#define BLOCK_INSTRUCTIONS 16
+
+typedef struct {
+    uint16_t start;                                         // address of the first instruction
+    uint8_t pages[2];                                       // first and last page of the instruction bytes
+    uint32_t generations[2];                                // their generation counters when the block was decoded
+    uint8_t count;                                          // number of instructions, 0 = not decoded (yet)
+    bool ends_with_brk;
+    decoded_instruction instructions[BLOCK_INSTRUCTIONS];
+} cached_block;
+
+struct translation_cache {
+    uint32_t seen[CACHE_BLOCKS];                            // last start address executed in each slot, + SEEN
+    cached_block blocks[CACHE_BLOCKS];
+};
+
+#define SEEN 0x10000                                        // distinguishes address $0000 from an empty slot
+
+static const cached_block* find_block(machine *m, uint16_t address);
+static bool changes_flow(uint8_t opcode);
+static bool decode_block(machine *m, cached_block *block, uint16_t address);
+
+bool enable_translation_cache(machine *m) {
+    if(!m->cache) {
+        m->cache = calloc(1, sizeof(translation_cache));
+        if(!m->cache) {
+            printf("Memory allocation failed.\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+void disable_translation_cache(machine *m) {
+    free(m->cache);
+    m->cache = NULL;
+}
+
+
+// Same as run(), but executes whole blocks from the cache. The checks of budget and interrupt request are the same;
+// BRK can only be the last instruction of a block. Profiles count the instructions of a block one by one.
+
+run_result run_translated(machine *m, run_budget budget) {
+    if(!m->cache || budget.breakpoints || budget.trace) {
+        return run(&m->cpu, &m->bus, budget);
+    }
+
+    CPU6502 *cpu = &m->cpu;
+    memory_bus *bus = &m->bus;
+    run_result result = {STOP_BUDGET, 0, 0};
+    uint64_t first_cycle = cpu->cycles;
+    uint64_t cycle_limit = budget.cycles ? first_cycle + budget.cycles : UINT64_MAX;
+    uint64_t instruction_limit = budget.instructions ? budget.instructions : UINT64_MAX;
+
+    while(result.instructions < instruction_limit && cpu->cycles < cycle_limit) {
+        if(budget.interrupt_request && *budget.interrupt_request) {
+            result.reason = STOP_INTERRUPT;
+            break;
+        }
+        if(interrupt_pending(cpu)) {
+            service_interrupt(cpu, bus);
+        }
+        const cached_block *block = find_block(m, cpu->PC);
+        if(!block) {                                        // first run, or code in an I/O page
+            uint16_t start = cpu->PC;
+            uint64_t cycle = cpu->cycles;
+            uint8_t opcode = execute_command(cpu, bus);
+            if(!opcode_implemented(opcode)) {               // as in run(): not executed after all
+                cpu->PC = start;
+                cpu->cycles = cycle;
+                result.reason = STOP_UNKNOWN_OPCODE;
+                break;
+            }
+            result.instructions++;
+            if(budget.profile) {
+                profile_instruction(budget.profile, opcode, start, cpu->PC, cpu->cycles - cycle);
+            }
+            if(opcode == 0x00) {
+                result.reason = STOP_BRK;
+                break;
+            }
+            continue;
+        }
+
+        uint64_t left = instruction_limit - result.instructions;
+        int count = block->count < left ? block->count : (int) left;
+        uint32_t page_changes = m->page_changes;
+        int executed = 0;
+        while(executed < count) {
+            const decoded_instruction *instruction = &block->instructions[executed++];
+            uint16_t start = cpu->PC;
+            uint64_t cycle = cpu->cycles;
+            cpu->PC += instruction->length;
+            instruction->handler(cpu, bus, instruction->operand);
+            cpu->cycles += instruction->cycles;
+            if(budget.profile) {
+                profile_instruction(budget.profile, instruction->opcode, start, cpu->PC, cpu->cycles - cycle);
+            }
+            if(cpu->cycles >= cycle_limit || m->page_changes != page_changes || interrupt_pending(cpu)) {
+                break;                                      // budget used up, code may have changed, or IRQ/NMI
+            }
+        }
+        result.instructions += executed;
+        if(executed == block->count && block->ends_with_brk) {
+            result.reason = STOP_BRK;
+            break;
+        }
+    }
+    result.cycles = cpu->cycles - first_cycle;
+    return result;
+}
+
+
+// Returns the valid block starting at "address", decoding it if necessary; NULL if the address is new, or for code
+// in I/O pages
+
+static const cached_block* find_block(machine *m, uint16_t address) {
+    uint32_t *seen = &m->cache->seen[address & (CACHE_BLOCKS - 1)];
+    cached_block *block = &m->cache->blocks[address & (CACHE_BLOCKS - 1)];
+
+    if(*seen != (address | SEEN)) {                         // kept apart from the blocks, so that code running only
+        *seen = address | SEEN;                             // once touches just a few cache lines
+        return NULL;
+    }
+    if(block->count && block->start == address && block->generations[0] == m->generation[block->pages[0]]
+       && block->generations[1] == m->generation[block->pages[1]]) {
+        return block;
+    }
+    return decode_block(m, block, address) ? block : NULL;
+}
+
+static bool changes_flow(uint8_t opcode) {                  // jumps, branches, JSR, RTS, RTI
+    return opcode_implemented(opcode) && (opcode_table[opcode].mode == MODE_RELATIVE || opcode == 0x20
+                                          || opcode == 0x40 || opcode == 0x4C || opcode == 0x60 || opcode == 0x6C);
+}
+
+static bool decode_block(machine *m, cached_block *block, uint16_t address) {
+    uint8_t first_page = address >> 8, last_page = first_page;
+
+    block->start = address;
+    block->count = 0;
+    block->ends_with_brk = false;
+    if(!m->bus.read[first_page]) {
+        return false;
+    }
+    while(block->count < BLOCK_INSTRUCTIONS) {
+        uint8_t end_page = (uint16_t) (address + 2) >> 8;   // an instruction has three bytes at most
+        if(end_page != first_page && !m->bus.read[end_page]) {
+            break;                                          // might reach into an I/O page
+        }
+        decoded_instruction instruction = decode_instruction(&m->bus, address);
+        if(!opcode_implemented(instruction.opcode)) {       // left to the uncached path, which stops there
+            break;
+        }
+        block->instructions[block->count++] = instruction;
+        last_page = (uint16_t) (address + instruction.length - 1) >> 8;
+        address += instruction.length;
+        if(instruction.opcode == 0x00) {                    // BRK: run() stops here
+            block->ends_with_brk = true;
+            break;
+        }
+        if(changes_flow(instruction.opcode)) {              // the next instruction is somewhere else
+            break;
+        }
+        if((address >> 8) != first_page) {                  // end of the page
+            break;
+        }
+    }
+    if(block->count == 0) {
+        return false;
+    }
+
+    watch_page(m, first_page);                              // the next write to the code counts a new generation
+    watch_page(m, last_page);
+    block->pages[0] = first_page;
+    block->pages[1] = last_page;
+    block->generations[0] = m->generation[first_page];
+    block->generations[1] = m->generation[last_page];
+    return true;
+}
+
+
+// Self-check (./6502 -c): random programs full of stores into their own code run on two machines, one with the
+// cache and one without, in slices of random length. In between, both get the same new code loaded into them, the
+// same IRQ line changes, and are set back to the same snapshots, and both start over at the beginning when they have
+// run off the code. CPU and memory have to be the same after every slice.
+
+#define CHECK_CODE 0x0200                                   // code and stores: $0200-$03FF, pointers into it
+#define CHECK_CODE_SIZE 0x200
+#define CHECK_SLICES 300
+
+static const uint8_t check_opcodes[] = {                   // more stores than anything else
+    0x81, 0x85, 0x8D, 0x8D, 0x8D, 0x91, 0x91, 0x95, 0x99, 0x9D, 0x9D, 0x84, 0x86, 0x8C, 0x8E, 0x94, 0x96,
+    0xA9, 0xA9, 0xA2, 0xA0, 0xA5, 0xAD, 0xBD, 0xB9, 0xB1, 0xA1, 0xB5, 0xA6, 0xB6, 0xAE, 0xBE, 0xA4, 0xB4, 0xAC,
+    0xBC, 0x69, 0x65, 0x6D, 0x7D, 0xE9, 0xF1, 0x61, 0x48, 0x68, 0x08, 0x28, 0x18, 0x38, 0x58, 0x78, 0xD8, 0xF8,
+    0x20, 0x60, 0x40, 0x00
+};
+
+static uint32_t next_random(uint32_t *random) {
+    *random = *random * 1103515245u + 12345u;
+    return *random >> 8;
+}
+
+static void write_check_program(machine *m, uint32_t *random) {
+    uint8_t *memory = m->memory;
+    for(int address = 0; address < 0x100; address++) {     // zero page: pointers into the code
+        memory[address] = (address & 1) ? (uint8_t) (CHECK_CODE >> 8) + next_random(random) % 2 : next_random(random);
+    }
+    int address = CHECK_CODE;
+    while(address < CHECK_CODE + CHECK_CODE_SIZE - 6) {
+        uint8_t opcode = check_opcodes[next_random(random) % sizeof(check_opcodes)];
+        uint16_t operand = CHECK_CODE + next_random(random) % CHECK_CODE_SIZE;
+        if(opcode == 0x20) {                                // JSR back to the start, now and then somewhere else
+            operand = next_random(random) % 4 ? CHECK_CODE : operand;
+        }
+        memory[address] = opcode;
+        memory[address + 1] = (uint8_t) operand;
+        memory[address + 2] = operand >> 8;
+        int length = decode_instruction(&m->bus, address).length;
+        if(length == 2) {                                   // immediate and zero page: any value
+            memory[address + 1] = (uint8_t) next_random(random);
+        }
+        address += length;
+    }
+    memory[address] = 0x20;                                 // JSR $0200
+    memory[address + 1] = CHECK_CODE & 0xFF;
+    memory[address + 2] = CHECK_CODE >> 8;
+    memory[0xFFFE] = CHECK_CODE & 0xFF;                     // BRK and IRQ start over as well
+    memory[0xFFFF] = CHECK_CODE >> 8;
+}
+
+static bool same_machines(const machine *cached, const machine *plain) {
+    const CPU6502 *a = &cached->cpu, *b = &plain->cpu;
+    return a->A == b->A && a->X == b->X && a->Y == b->Y && a->SP == b->SP && a->PC == b->PC && a->cycles == b->cycles
+           && get_status(a) == get_status(b) && !memcmp(cached->memory, plain->memory, MEMORY_SIZE);
+}
+
+bool check_cache(int programs) {
+    uint32_t random = 9;
+    uint64_t instructions = 0;
+    int program, failures = 0;
+
+    for(program = 0; program < programs && failures < 10; program++) {
+        machine *machines[2] = {create_machine(), create_machine()};
+        snapshot *snapshots[2] = {NULL, NULL};
+        if(!machines[0] || !machines[1] || !enable_translation_cache(machines[0])) {
+            destroy_machine(machines[0]);
+            destroy_machine(machines[1]);
+            return false;
+        }
+        uint32_t seed = random;
+        for(int i = 0; i < 2; i++) {                        // the same program on both
+            random = seed;
+            reset_machine(machines[i]);
+            write_check_program(machines[i], &random);
+            machines[i]->cpu.PC = CHECK_CODE;
+        }
+        for(int slice = 0; slice < CHECK_SLICES; slice++) {
+            uint32_t action = next_random(&random) % 32;
+            uint8_t code[64];
+            uint16_t address = CHECK_CODE + next_random(&random) % (CHECK_CODE_SIZE - sizeof(code));
+            for(size_t i = 0; i < sizeof(code); i++) {
+                code[i] = check_opcodes[next_random(&random) % sizeof(check_opcodes)];
+            }
+            run_budget budget = {0};
+            if(next_random(&random) % 2) {
+                budget.instructions = 1 + next_random(&random) % 2000;
+            } else {
+                budget.cycles = 1 + next_random(&random) % 6000;
+            }
+            run_result results[2];
+            for(int i = 0; i < 2; i++) {
+                machine *m = machines[i];
+                if(action == 0) {                           // new code, written without the bus
+                    load_image(m, code, 1 + code[0] % sizeof(code), address);
+                } else if(action == 1) {
+                    set_irq(m, 1, !(m->cpu.irq & 1));
+                } else if(action == 2) {
+                    release_snapshot(snapshots[i]);
+                    snapshots[i] = take_snapshot(m);
+                } else if(action == 3 && snapshots[i]) {
+                    restore_snapshot(m, snapshots[i]);
+                }
+                if(m->cpu.PC < CHECK_CODE || m->cpu.PC >= CHECK_CODE + CHECK_CODE_SIZE) {     // ran off the code
+                    m->cpu.PC = CHECK_CODE;
+                }
+                results[i] = run_machine(m, budget);
+            }
+            instructions += results[1].instructions;
+            if(results[0].reason != results[1].reason || results[0].instructions != results[1].instructions
+               || !same_machines(machines[0], machines[1])) {
+                printf("Translation cache: program %d differs after slice %d: PC %04X, cycle %llu (without cache: "
+                       "PC %04X, cycle %llu)\n", program, slice, machines[0]->cpu.PC,
+                       (unsigned long long) machines[0]->cpu.cycles, machines[1]->cpu.PC,
+                       (unsigned long long) machines[1]->cpu.cycles);
+                failures++;
+                break;
+            }
+        }
+        for(int i = 0; i < 2; i++) {
+            release_snapshot(snapshots[i]);
+            destroy_machine(machines[i]);
+        }
+    }
+    printf("Translation cache: %d self-modifying programs, %llu instructions with and without the cache, %d "
+           "differences\n", program, (unsigned long long) instructions, failures);
+    return failures == 0;
+}
@@ -0,0 +1,319 @@
+// DEBUGGER FOR THE SIMPLE 6502 EMULATOR
+//
+// Execution breakpoints, read and write watchpoints on address ranges, and conditions on register values, for any
+// number of them (up to DEBUG_BREAKPOINTS) without slowing the run down:
+// - Every breakpoint sets its addresses in a bitmap with one bit per address and type, so the question "is there
+//   anything at this address?" is one bit test. Only if a bit is set, the list of breakpoints is searched for the one
+//   that fires (right range, condition true), so the cost does not depend on the number of breakpoints.
+// - Watchpoints also mark their pages. A debugged run uses its own copy of the machine's page tables, in which only
+//   pages with watchpoints take the slow path (see memory_bus in 6502.h); all other pages are read and written at
+//   full speed. The slow path tests the bitmap and forwards the access to the machine's bus.
+//
+// Execution breakpoints stop before the instruction (STOP_BREAKPOINT), watchpoints after the instruction that made
+// the access (STOP_WATCHPOINT); debugger_hit() tells which breakpoint has fired. Instruction fetches do not count as
+// reads: the core marks opcodes and operands, also immediate ones, on the bus (bus_fetch(), memory_bus.fetching), so
+// a read of the bytes right behind an instruction (LDA $0203 at $0200) is still a read. As in run(), the breakpoint
+// at the very first instruction of a call is ignored, so a call after STOP_BREAKPOINT continues. Conditions compare
+// one register, masked, with a value: (register & mask) == value.
+//
+// run_machine() uses run_debug() if the budget has a debugger. A debugger belongs to one machine at a time.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+
+#define DEBUG_BREAKPOINTS 1024
+
+struct debugger {
+    breakpoint breakpoints[DEBUG_BREAKPOINTS];
+    bool used[DEBUG_BREAKPOINTS];
+    int count;                                              // highest used slot + 1
+    uint8_t bitmaps[3][MEMORY_SIZE / 8];                    // per breakpoint_type, one bit per address
+    uint8_t watched_pages[2][BUS_PAGES];                    // pages with read / write watchpoints
+    debug_hit hit;
+
+    machine *machine;                                       // during run_debug()
+    memory_bus bus;                                         // the machine's page tables, watched pages redirected
+};
+
+static void sync_page(debugger *d, int page);
+static uint8_t debug_read(void *device, uint16_t address);
+static void debug_write(void *device, uint16_t address, uint8_t value);
+
+static inline bool bit_set(const uint8_t *bitmap, uint16_t address) {
+    return bitmap[address >> 3] & (1 << (address & 7));
+}
+
+debugger* create_debugger(void) {
+    debugger *d = calloc(1, sizeof(debugger));
+    if(!d) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    d->hit.id = -1;
+    return d;
+}
+
+void destroy_debugger(debugger *d) {
+    free(d);
+}
+
+
+// Breakpoints: adding one sets its bits, removing one builds the bitmaps anew from all the others
+// (overlapping breakpoints share bits). add_breakpoint() returns the id of the breakpoint, -1 if there is no free slot.
+
+static void set_bits(debugger *d, breakpoint b) {
+    for(int address = b.first; address <= b.last; address++) {
+        set_breakpoint(d->bitmaps[b.type], address, true);
+    }
+    if(b.type != BREAK_EXECUTE) {
+        for(int page = b.first >> 8; page <= b.last >> 8; page++) {
+            d->watched_pages[b.type - BREAK_READ][page] = true;
+        }
+    }
+}
+
+int add_breakpoint(debugger *d, breakpoint b) {
+    int id = 0;
+    while(id < DEBUG_BREAKPOINTS && d->used[id]) {
+        id++;
+    }
+    if(id == DEBUG_BREAKPOINTS || b.first > b.last) {
+        printf("Unable to add breakpoint at %04X-%04X.\n", b.first, b.last);
+        return -1;
+    }
+    d->breakpoints[id] = b;
+    d->used[id] = true;
+    if(id >= d->count) {
+        d->count = id + 1;
+    }
+    set_bits(d, b);
+    return id;
+}
+
+void remove_breakpoint(debugger *d, int id) {
+    if(id < 0 || id >= d->count || !d->used[id]) {
+        return;
+    }
+    d->used[id] = false;
+    memset(d->bitmaps, 0, sizeof(d->bitmaps));
+    memset(d->watched_pages, 0, sizeof(d->watched_pages));
+    while(d->count > 0 && !d->used[d->count - 1]) {
+        d->count--;
+    }
+    for(int i = 0; i < d->count; i++) {
+        if(d->used[i]) {
+            set_bits(d, d->breakpoints[i]);
+        }
+    }
+}
+
+breakpoint execution_breakpoint(uint16_t address) {
+    return (breakpoint) {BREAK_EXECUTE, address, address, {REGISTER_NONE, 0, 0}};
+}
+
+breakpoint watchpoint(breakpoint_type type, uint16_t first, uint16_t last) {
+    return (breakpoint) {type, first, last, {REGISTER_NONE, 0, 0}};
+}
+
+debug_hit debugger_hit(const debugger *d) {
+    return d->hit;
+}
+
+
+// Finds the breakpoint that fires at an address whose bit is set, and records it as the hit
+
+static bool condition_true(const CPU6502 *cpu, breakpoint_condition condition) {
+    uint8_t value;
+    switch(condition.reg) {
+        case REGISTER_A:  value = cpu->A;  break;
+        case REGISTER_X:  value = cpu->X;  break;
+        case REGISTER_Y:  value = cpu->Y;  break;
+        case REGISTER_SP: value = cpu->SP; break;
+        case REGISTER_SR: value = get_status(cpu); break;
+        default:          return true;                      // REGISTER_NONE: no condition
+    }
+    return (value & condition.mask) == condition.value;
+}
+
+static bool fires(debugger *d, breakpoint_type type, uint16_t address, uint8_t value) {
+    for(int id = 0; id < d->count; id++) {
+        const breakpoint *b = &d->breakpoints[id];
+        if(d->used[id] && b->type == type && address >= b->first && address <= b->last
+           && condition_true(&d->machine->cpu, b->condition)) {
+            d->hit = (debug_hit) {id, type, address, value};
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Same as run(), on the debugger's copy of the page tables, which is built anew for every call: the machine's bus
+// may have changed in between (profiles, snapshots, devices).
+
+run_result run_debug(machine *m, run_budget budget) {
+    debugger *d = budget.debugger;
+    CPU6502 *cpu = &m->cpu;
+    run_result result = {STOP_BUDGET, 0, 0};
+    uint64_t first_cycle = cpu->cycles;
+    uint64_t cycle_limit = budget.cycles ? first_cycle + budget.cycles : UINT64_MAX;
+    uint64_t instruction_limit = budget.instructions ? budget.instructions : UINT64_MAX;
+
+    d->machine = m;
+    d->hit.id = -1;
+    for(int page = 0; page < BUS_PAGES; page++) {
+        sync_page(d, page);
+    }
+
+    while(result.instructions < instruction_limit && cpu->cycles < cycle_limit) {
+        if(budget.interrupt_request && *budget.interrupt_request) {
+            result.reason = STOP_INTERRUPT;
+            break;
+        }
+        if(interrupt_pending(cpu)) {
+            service_interrupt(cpu, &d->bus);
+        }
+        if(result.instructions && ((bit_set(d->bitmaps[BREAK_EXECUTE], cpu->PC) && fires(d, BREAK_EXECUTE, cpu->PC, 0))
+                                   || (budget.breakpoints && bit_set(budget.breakpoints, cpu->PC)))) {
+            result.reason = STOP_BREAKPOINT;
+            break;
+        }
+
+        uint16_t start = cpu->PC;
+        uint64_t cycle = cpu->cycles;
+        uint8_t bytes[3];
+        if(budget.trace) {
+            trace_fetch_begin(&d->bus, start, bytes);
+        }
+        uint8_t opcode = execute_command(cpu, &d->bus);
+        if(!opcode_implemented(opcode)) {                   // as in run(): not executed after all
+            cpu->PC = start;
+            cpu->cycles = cycle;
+            result.reason = STOP_UNKNOWN_OPCODE;
+            break;
+        }
+        result.instructions++;
+        if(budget.trace) {
+            trace_fetch_end(&d->bus, start, bytes);
+            trace_instruction(budget.trace, cpu, start, cycle, bytes);
+        }
+        if(budget.profile) {
+            profile_instruction(budget.profile, opcode, start, cpu->PC, cpu->cycles - cycle);
+        }
+        if(d->hit.id >= 0) {                                // a watchpoint has fired during the instruction
+            result.reason = STOP_WATCHPOINT;
+            break;
+        }
+        if(opcode == 0x00) {                                // BRK
+            result.reason = STOP_BRK;
+            break;
+        }
+    }
+    d->machine = NULL;
+    result.cycles = cpu->cycles - first_cycle;
+    return result;
+}
+
+
+// The debugger's page table entry of a page: the machine's entry, unless the page is watched. Pages that take the
+// slow path in the machine's bus as well (I/O, pages watched for snapshots or the translation cache) are redirected
+// too, as their entries may change with the next write (see watched_write() in bus.c); they are copied again after it.
+
+static void sync_page(debugger *d, int page) {
+    memory_bus *bus = &d->bus, *machine_bus = &d->machine->bus;
+
+    bus->read[page] = machine_bus->read[page];
+    bus->read_device[page] = machine_bus->read_device[page];
+    bus->read_context[page] = machine_bus->read_context[page];
+    bus->write[page] = machine_bus->write[page];
+    bus->write_device[page] = machine_bus->write_device[page];
+    bus->write_context[page] = machine_bus->write_context[page];
+    if(d->watched_pages[0][page]) {
+        bus->read[page] = NULL;
+        bus->read_device[page] = debug_read;
+        bus->read_context[page] = d;
+    }
+    if(d->watched_pages[1][page] || !machine_bus->write[page]) {
+        bus->write[page] = NULL;
+        bus->write_device[page] = debug_write;
+        bus->write_context[page] = d;
+    }
+}
+
+static uint8_t debug_read(void *device, uint16_t address) {
+    debugger *d = device;
+    uint8_t value = bus_read(&d->machine->bus, address);
+
+    if(!d->bus.fetching && d->hit.id < 0 && bit_set(d->bitmaps[BREAK_READ], address)) {
+        fires(d, BREAK_READ, address, value);
+    }
+    return value;
+}
+
+static void debug_write(void *device, uint16_t address, uint8_t value) {
+    debugger *d = device;
+
+    if(d->hit.id < 0 && bit_set(d->bitmaps[BREAK_WRITE], address)) {
+        fires(d, BREAK_WRITE, address, value);
+    }
+    bus_write(&d->machine->bus, address, value);
+    sync_page(d, address >> 8);
+}
+
+
+// Self-check (./6502 -c): read watchpoints on the bytes of instructions fire for data reads only, also for reads of
+// the bytes right behind the instruction, which are not fetched yet
+
+static const uint8_t check_program[] = {
+    0xAD, 0x03, 0x02,                                       // $0200 LDA $0203  reads the opcode of the next one
+    0xAD, 0x01, 0x02,                                       // $0203 LDA $0201  reads the operand of the first one
+    0xA9, 0x55,                                             // $0206 LDA #$55   nothing but fetches
+    0x00                                                    // $0208 BRK
+};
+
+static const struct {
+    uint16_t first, last;                                   // read watchpoint
+    stop_reason reason;
+    uint64_t instructions;
+    uint16_t address;                                       // hit
+    uint8_t value;
+} check_cases[] = {
+    {0x0203, 0x0203, STOP_WATCHPOINT, 1, 0x0203, 0xAD},
+    {0x0201, 0x0202, STOP_WATCHPOINT, 2, 0x0201, 0x03},
+    {0x0206, 0x0208, STOP_BRK,        4, 0,      0}
+};
+
+bool check_debugger(void) {
+    machine *m = create_machine();
+    debugger *d = create_debugger();
+    int failures = 0, cases = sizeof(check_cases) / sizeof(check_cases[0]);
+
+    if(!m || !d || !load_image(m, check_program, sizeof(check_program), 0x0200)) {
+        destroy_machine(m);
+        destroy_debugger(d);
+        return false;
+    }
+    for(int i = 0; i < cases; i++) {
+        int id = add_breakpoint(d, watchpoint(BREAK_READ, check_cases[i].first, check_cases[i].last));
+        reset_cpu(&m->cpu);
+        m->cpu.PC = 0x0200;
+        run_result result = run_machine(m, (run_budget) {.instructions = 10, .debugger = d});
+        debug_hit hit = debugger_hit(d);
+        bool stopped = result.reason == STOP_WATCHPOINT;
+        bool right_hit = hit.id == id && hit.address == check_cases[i].address && hit.value == check_cases[i].value;
+        if(result.reason != check_cases[i].reason || result.instructions != check_cases[i].instructions
+           || (stopped && !right_hit)) {
+            printf("Debugger: read watchpoint at %04X-%04X stopped after %llu instructions at %04X (expected: %llu at "
+                   "%04X)\n", check_cases[i].first, check_cases[i].last, (unsigned long long) result.instructions,
+                   stopped ? hit.address : 0, (unsigned long long) check_cases[i].instructions, check_cases[i].address);
+            failures++;
+        }
+        remove_breakpoint(d, id);
+    }
+    printf("Debugger: %d read watchpoints on instruction bytes, %d failed\n", cases, failures);
+    destroy_debugger(d);
+    destroy_machine(m);
+    return failures == 0;
+}
@@ -0,0 +1,187 @@
+// DISASSEMBLER FOR THE SIMPLE 6502 EMULATOR
+//
+// Turns memory images into listings in the format of the demo:
+//
+//   .C000  A9 FF     LDA #$FF
+//   .C002  BD 34 12  LDA  $1234,X
+//
+// Everything about an opcode comes from opcode_table (6502.c). As every opcode always produces the same text except
+// for the hex digits, the text is prepared once per opcode: a line template with address, opcode byte, mnemonic and
+// operand punctuation already in place, and a mask of the columns that take digits. Disassembling an instruction
+// then means writing all possible digits (address, operand bytes, operand) into a 32-byte line, longer than any
+// line, and blending it with the template in four 64-bit operations: no formatting and no branches on length or
+// addressing mode, which random data would mispredict all the time. Lines are written one after the other into the
+// caller's buffer, so large dumps go through one reused buffer and one fwrite() per buffer.
+//
+// Undocumented opcodes are listed as "???", one byte each; so is an instruction cut off by the end of the image.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+
+#define DISASSEMBLY_BUFFER (1 << 20)                        // output buffer of disassemble_file()
+
+enum {                                                      // columns of a line
+    COLUMN_ADDRESS = 1,
+    COLUMN_BYTES = 7,                                       // three times two digits and a space
+    COLUMN_MNEMONIC = 17,
+    COLUMN_OPERAND = 23                                     // after "#$", "($", or " $"
+};
+
+typedef union {
+    char text[DISASSEMBLY_LINE];
+    uint64_t words[DISASSEMBLY_LINE / 8];
+} line;
+
+typedef struct {
+    line text;                                              // the complete line, digits still missing
+    line digits;                                            // 0xFF in the columns that take digits
+    uint8_t size;                                           // line length including the newline
+    uint8_t length;                                         // instruction length
+    bool relative;                                          // the operand is a branch offset
+} line_template;
+
+static line_template templates[256];
+static pthread_once_t templates_ready = PTHREAD_ONCE_INIT;
+
+static const char hex_digits[] = "0123456789ABCDEF";
+static char hex_pairs[256][2];                              // both digits of each byte
+
+static inline void put_hex(char *text, uint8_t value) {
+    memcpy(text, hex_pairs[value], 2);
+}
+
+static inline void put_hex16(char *text, uint16_t value) {
+    put_hex(text, value >> 8);
+    put_hex(text + 2, value & 0xFF);
+}
+
+
+// Operand punctuation per addressing mode; "xx" marks the digits of one byte
+
+static const char *operand_formats[] = {
+    [MODE_IMPLIED]          = "",
+    [MODE_ACCUMULATOR]      = " A",
+    [MODE_IMMEDIATE]        = " #$xx",
+    [MODE_ZEROPAGE]         = "  $xx",
+    [MODE_ZEROPAGE_X]       = "  $xx,X",
+    [MODE_ZEROPAGE_Y]       = "  $xx,Y",
+    [MODE_ABSOLUTE]         = "  $xxxx",
+    [MODE_ABSOLUTE_X]       = "  $xxxx,X",
+    [MODE_ABSOLUTE_Y]       = "  $xxxx,Y",
+    [MODE_INDIRECT]         = " ($xxxx)",
+    [MODE_INDEXED_INDIRECT] = " ($xx,X)",
+    [MODE_INDIRECT_INDEXED] = " ($xx),Y",
+    [MODE_RELATIVE]         = "  $xxxx"                     // branch target, not the offset
+};
+
+static void prepare_templates(void) {
+    for(int value = 0; value < 256; value++) {
+        hex_pairs[value][0] = hex_digits[value >> 4];
+        hex_pairs[value][1] = hex_digits[value & 15];
+    }
+    for(int opcode = 0; opcode < 256; opcode++) {
+        const opcode_info *info = &opcode_table[opcode];
+        line_template *t = &templates[opcode];
+        const char *operand = operand_formats[info->mode];
+        char *digits = t->digits.text;
+
+        memset(t->text.text, ' ', DISASSEMBLY_LINE);
+        t->text.text[0] = '.';
+        put_hex(t->text.text + COLUMN_BYTES, opcode);
+        memcpy(t->text.text + COLUMN_MNEMONIC, info->mnemonic, 3);
+        memcpy(t->text.text + COLUMN_MNEMONIC + 3, operand, strlen(operand));
+        t->size = COLUMN_MNEMONIC + 3 + strlen(operand) + 1;
+        t->text.text[t->size - 1] = '\n';
+        t->length = info->length;
+        t->relative = info->mode == MODE_RELATIVE;
+
+        memset(digits, 0, DISASSEMBLY_LINE);
+        memset(digits + COLUMN_ADDRESS, 0xFF, 4);
+        memset(digits + COLUMN_BYTES + 3, 0xFF, 2 * (info->length >= 2));           // operand bytes
+        memset(digits + COLUMN_BYTES + 6, 0xFF, 2 * (info->length == 3));
+        memset(digits + COLUMN_OPERAND, 0xFF, 2 * (info->length >= 2));             // operand: "xx", "xxxx"
+        memset(digits + COLUMN_OPERAND + 2, 0xFF, 2 * (info->length == 3 || t->relative));
+    }
+}
+
+
+// One line: all digits that any instruction could need, then blended into the template
+
+static inline size_t disassemble_line(const line_template *t, uint16_t address, uint8_t low, uint8_t high, char *out) {
+    line digits;
+    uint16_t target = address + 2 + (int8_t) low;
+    uint16_t operand = t->length == 3 ? low | (high << 8) : t->relative ? target : low << 8;    // conditional moves
+
+    put_hex16(digits.text + COLUMN_ADDRESS, address);
+    put_hex(digits.text + COLUMN_BYTES + 3, low);
+    put_hex(digits.text + COLUMN_BYTES + 6, high);
+    put_hex16(digits.text + COLUMN_OPERAND, operand);
+    for(int i = 0; i < DISASSEMBLY_LINE / 8; i++) {
+        uint64_t word = (t->text.words[i] & ~t->digits.words[i]) | (digits.words[i] & t->digits.words[i]);
+        memcpy(out + 8 * i, &word, 8);
+    }
+    return t->size;
+}
+
+
+// Disassembles "code" (loaded at "address") into "output" until either the code or the space in the output ends.
+// Returns the number of code bytes done and sets "written" to the number of characters written; call again with the
+// rest of the code for the next part. "output" must have room for at least DISASSEMBLY_LINE characters.
+
+size_t disassemble(const uint8_t *code, size_t size, uint16_t address, char *output, size_t output_size, size_t *written) {
+    char *out = output, *end = output + output_size - DISASSEMBLY_LINE;
+    size_t offset = 0;
+
+    pthread_once(&templates_ready, prepare_templates);
+    while(offset + 3 <= size && out <= end) {               // all three bytes can be read, whatever the length
+        const line_template *t = &templates[code[offset]];
+        out += disassemble_line(t, address, code[offset + 1], code[offset + 2], out);
+        offset += t->length;
+        address += t->length;
+    }
+    while(offset < size && out <= end) {                    // the last two bytes
+        const line_template *t = &templates[code[offset]];
+        if(t->length > size - offset) {                     // cut off: byte by byte, as "???"
+            t = &templates[0x02];
+            out += disassemble_line(t, address, 0, 0, out);
+            put_hex(out - t->size + COLUMN_BYTES, code[offset]);
+        } else {
+            out += disassemble_line(t, address, code[offset + 1 < size ? offset + 1 : offset], 0, out);
+        }
+        offset += t->length;
+        address += t->length;
+    }
+    *written = out - output;
+    return offset;
+}
+
+
+// Streams the listing of a whole file (raw binary at "address", or .prg) to "output" through one buffer
+
+bool disassemble_file(const char *filename, uint16_t address, FILE *output) {
+    program_file program;
+    char *buffer = malloc(DISASSEMBLY_BUFFER);
+
+    if(!buffer) {
+        printf("Memory allocation failed.\n");
+        return false;
+    }
+    if(!map_program(filename, address, &program)) {
+        free(buffer);
+        return false;
+    }
+    size_t done = 0;
+    while(done < program.size) {
+        size_t written;
+        size_t part = disassemble(program.data + done, program.size - done, (uint16_t) (program.address + done),
+                                  buffer, DISASSEMBLY_BUFFER, &written);
+        fwrite(buffer, 1, written, output);
+        done += part;
+    }
+    unmap_program(&program);
+    free(buffer);
+    return true;
+}
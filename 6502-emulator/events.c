@@ -0,0 +1,151 @@
+// EVENT SCHEDULER FOR THE SIMPLE 6502 EMULATOR
+//
+// Timers and video chips change their state at known cycles, so instead of asking every device after every
+// instruction whether something has happened, devices tell the machine when it will happen: schedule_event() files a
+// call of the device for a given cycle. The events of a machine are kept in a binary min-heap ordered by cycle, so
+// the next one is always events[0], and adding or removing one costs O(log n) for the few dozen a machine has.
+//
+// run_machine() (6502.c) cuts its budget into slices that end at events[0].cycle; the CPU runs each slice at full
+// speed without looking at any device, and dispatch_events() calls whatever has become due in between. As slices end
+// after a complete instruction, an event is called up to one instruction late (never early), with the cycle it was
+// scheduled for, so periodic devices can schedule their next event without drift.
+//
+// Interrupts are pins of the CPU: set_irq() pulls the IRQ line low for one source (it stays low until the source
+// releases it, like the open-collector line of the real machines), trigger_nmi() latches an NMI edge. The core
+// checks both before every instruction (see interrupt_pending() in 6502.h and service_interrupt() in 6502.c).
+// Events belong to devices: like these, they are kept by reset_machine() and not part of snapshots. While a machine
+// records or replays its inputs (replay.c), both lines go through the recording.
+
+#include "6502.h"
+
+static void sift_up(scheduled_event *heap, int index) {
+    scheduled_event event = heap[index];
+    while(index > 0 && heap[(index - 1) / 2].cycle > event.cycle) {
+        heap[index] = heap[(index - 1) / 2];
+        index = (index - 1) / 2;
+    }
+    heap[index] = event;
+}
+
+static void sift_down(scheduled_event *heap, int count, int index) {
+    scheduled_event event = heap[index];
+    while(2 * index + 1 < count) {
+        int child = 2 * index + 1;
+        if(child + 1 < count && heap[child + 1].cycle < heap[child].cycle) {
+            child++;
+        }
+        if(heap[child].cycle >= event.cycle) {
+            break;
+        }
+        heap[index] = heap[child];
+        index = child;
+    }
+    heap[index] = event;
+}
+
+static void remove_event(machine *m, int index) {
+    m->events[index] = m->events[--m->event_count];
+    if(index < m->event_count) {
+        sift_down(m->events, m->event_count, index);
+        sift_up(m->events, index);
+    }
+}
+
+
+// Scheduling: an event in the past is called at the next opportunity
+
+bool schedule_event(machine *m, uint64_t cycle, event_function function, void *device) {
+    if(m->event_count == MACHINE_EVENTS) {
+        printf("Unable to schedule event at cycle %llu.\n", (unsigned long long) cycle);
+        return false;
+    }
+    m->events[m->event_count] = (scheduled_event) {cycle, function, device};
+    sift_up(m->events, m->event_count++);
+    return true;
+}
+
+void cancel_events(machine *m, void *device) {            // keeps the other events, then rebuilds the heap
+    int count = 0;
+    for(int i = 0; i < m->event_count; i++) {
+        if(m->events[i].device != device) {
+            m->events[count++] = m->events[i];
+        }
+    }
+    m->event_count = count;
+    for(int i = count / 2 - 1; i >= 0; i--) {
+        sift_down(m->events, count, i);
+    }
+}
+
+void dispatch_events(machine *m) {
+    while(m->event_count && m->events[0].cycle <= m->cpu.cycles) {
+        scheduled_event event = m->events[0];
+        remove_event(m, 0);                                 // first, so that the event can schedule the next one
+        event.function(event.device, event.cycle);
+    }
+}
+
+
+// Interrupt lines
+
+void set_irq(machine *m, uint8_t source, bool active) {
+    uint8_t irq = active ? m->cpu.irq | source : m->cpu.irq & ~source;
+    if(irq == m->cpu.irq || (m->recording && !recorded_interrupt(m, irq, false))) {
+        return;                                             // no change, or replayed from a recording instead
+    }
+    m->cpu.irq = irq;
+}
+
+void trigger_nmi(machine *m) {
+    if(m->recording && !recorded_interrupt(m, 0, true)) {
+        return;
+    }
+    m->cpu.nmi = true;
+}
+
+
+// Self-check (./6502 -c): fills the queue with random events of a few devices, cancels one device, and checks that
+// none of its events are left, that the others all are, and that the heap still hands them out in order.
+
+static void check_event(void *device, uint64_t cycle) {
+    (void) device, (void) cycle;
+}
+
+bool check_events(int rounds) {
+    static int devices[4];
+    machine *m = create_machine();
+    if(!m) {
+        return false;
+    }
+    uint32_t random = 1;
+    int failures = 0;
+    for(int round = 0; round < rounds; round++) {
+        int counts[4] = {0};
+        m->event_count = 0;
+        random = random * 1103515245u + 12345u;
+        int events = 1 + (random >> 16) % MACHINE_EVENTS;
+        for(int i = 0; i < events; i++) {
+            random = random * 1103515245u + 12345u;
+            int device = (random >> 8) % 4;
+            schedule_event(m, (random >> 16) % 64, check_event, &devices[device]);
+            counts[device]++;
+        }
+        int cancelled = round % 4;
+        cancel_events(m, &devices[cancelled]);
+        bool failed = m->event_count != events - counts[cancelled];
+        uint64_t last = 0;
+        while(m->event_count && !failed) {
+            scheduled_event next = m->events[0];
+            remove_event(m, 0);
+            failed = next.device == &devices[cancelled] || next.cycle < last;
+            last = next.cycle;
+        }
+        if(failed && failures++ < 10) {
+            printf("Event queue: round %d, %d events, wrong queue after cancelling device %d\n", round,
+                   events, cancelled);
+        }
+    }
+    printf("Event queue: %d rounds of cancelling, %d failed\n", rounds, failures);
+    destroy_machine(m);
+    return failures == 0;
+}
@@ -0,0 +1,122 @@
+// PROGRAM LOADER FOR THE SIMPLE 6502 EMULATOR
+//
+// Loads raw binaries and Commodore .prg files (the first two bytes are the load address, low byte first) into the
+// 64 KB of a machine. The file is mapped into memory with mmap() and copied straight into the machine, so loading
+// an image costs one memcpy() and no parsing at all; batch runs can even keep thousands of files mapped and copy
+// each of them again for every run.
+//
+// After loading, the reset vector at $FFFC/$FFFD points to the load address, and reset_cpu_from_vector() starts the
+// CPU there, just like the real chip. Images that cover the vector themselves (e.g. a complete 64 KB dump) keep theirs.
+// In machine profiles with a KERNAL ROM, the vector belongs to the ROM; the program is then started directly.
+//
+// ROM images (load_rom()) go into machine.rom, where the ROM areas of the machine profile read them from.
+
+#include <fcntl.h>
+#include <strings.h>                                        // for strcasecmp()
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "6502.h"
+
+static bool is_prg(const char *filename) {
+    const char *extension = strrchr(filename, '.');
+    return extension && !strcasecmp(extension, ".prg");
+}
+
+
+// Maps a file. Raw files are loaded at "address", .prg files at the address from their header.
+
+bool map_program(const char *filename, uint16_t address, program_file *program) {
+    struct stat status;
+    int file = open(filename, O_RDONLY);
+
+    memset(program, 0, sizeof(program_file));
+    if(file < 0 || fstat(file, &status) || status.st_size == 0) {
+        printf("Unable to read %s.\n", filename);
+        if(file >= 0) {
+            close(file);
+        }
+        return false;
+    }
+    program->mapping_size = (size_t) status.st_size;
+    program->mapping = mmap(NULL, program->mapping_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);                                            // the mapping stays valid
+    if(program->mapping == MAP_FAILED) {
+        printf("Unable to map %s.\n", filename);
+        program->mapping = NULL;
+        return false;
+    }
+
+    const uint8_t *bytes = program->mapping;
+    if(is_prg(filename)) {
+        if(program->mapping_size < 2) {
+            printf("%s is not a PRG file.\n", filename);
+            unmap_program(program);
+            return false;
+        }
+        program->address = bytes[0] | (bytes[1] << 8);      // load address, low byte first
+        program->data = bytes + 2;
+        program->size = program->mapping_size - 2;
+    } else {
+        program->address = address;
+        program->data = bytes;
+        program->size = program->mapping_size;
+    }
+    return true;
+}
+
+void unmap_program(program_file *program) {
+    if(program->mapping) {
+        munmap(program->mapping, program->mapping_size);
+    }
+    memset(program, 0, sizeof(program_file));
+}
+
+
+// Loads a file into a machine (the rest of the memory is left as it is), sets the reset vector and resets the CPU
+
+bool load_program(machine *m, const char *filename, uint16_t address) {
+    program_file program;
+
+    if(!map_program(filename, address, &program)) {
+        return false;
+    }
+    bool loaded = load_image(m, program.data, program.size, program.address);
+    if(loaded) {
+        bool covers_vector = program.address + program.size > 0xFFFC && program.address <= 0xFFFD;
+        bool vector_in_ram = m->bus.read[0xFF] == m->memory + 0xFF00;
+        if(!covers_vector && vector_in_ram) {
+            mark_dirty(m, 0xFFFC, 2);
+            set_reset_vector(m->memory, program.address);
+        }
+        reset_cpu_from_vector(&m->cpu, &m->bus);
+        if(!vector_in_ram) {                                // the KERNAL vector stays, start the program directly
+            m->cpu.PC = program.address;
+        }
+    }
+    unmap_program(&program);
+    return loaded;
+}
+
+bool load_rom(machine *m, const char *filename, uint16_t address) {
+    program_file rom;
+
+    if(!map_program(filename, address, &rom)) {
+        return false;
+    }
+    bool loaded = rom.size <= (size_t) (MEMORY_SIZE - rom.address);
+    if(loaded) {
+        memcpy(m->rom + rom.address, rom.data, rom.size);
+    } else {
+        printf("ROM image of %zu bytes does not fit at %04X.\n", rom.size, rom.address);
+    }
+    unmap_program(&rom);
+    return loaded;
+}
+
+void set_reset_vector(uint8_t memory[MEMORY_SIZE], uint16_t address) {
+    memory[0xFFFC] = address & 0xFF;                        // low byte first
+    memory[0xFFFD] = address >> 8;
+}
@@ -0,0 +1,594 @@
+// LOCKSTEP EMULATION FOR THE SIMPLE 6502 EMULATOR
+//
+// For fuzzing and parameter sweeps, the same program runs on many slightly different inputs. A lockstep group keeps
+// up to 32 machines in structure-of-arrays form: A, X, Y, SP, SR and PC are arrays with one entry per lane, and every
+// lane has its own 64 KB of flat RAM (see lockstep_group in 6502.h). The vector kernels access it directly; the scalar
+// core sees it through one memory bus per lane, which maps all pages to that RAM.
+//
+// In every step, the lanes that agree with the first running lane on PC and instruction bytes execute that instruction
+// together: the effective addresses of all lanes are computed in vector registers, loads are gathered from the lane
+// memories, and registers and N/Z flags of all lanes are updated with a handful of byte operations. All other lanes
+// (their control flow has diverged) are executed one by one by the normal core, so every lane executes exactly one
+// instruction per step, and lanes that meet again are back in lockstep. Opcodes without a vector kernel (currently
+// everything except loads and stores) always take that scalar path.
+//
+// The kernels use AVX2 if the compiler targets it (-mavx2 or -march=native), SSE2 for the register and flag updates
+// otherwise, and plain loops as a last resort. Stores are done lane by lane in any case, as AVX2 has no scatter.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for clock() in the benchmark
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "6502.h"
+
+#define LOCKSTEP_MIN_LANES 2                                // a single lane is faster in the scalar core
+
+enum {                                                      // operations with a vector kernel
+    KERNEL_NONE,                                            // scalar core only
+    KERNEL_LDA, KERNEL_LDX, KERNEL_LDY,
+    KERNEL_STA, KERNEL_STX, KERNEL_STY
+};
+
+static const uint8_t lockstep_kernels[256] = {              // addressing mode and length: opcode_table
+    [0x81] = KERNEL_STA,                                    // STA ($vw,X)
+    [0x84] = KERNEL_STY,                                    // STY  $vw
+    [0x85] = KERNEL_STA,                                    // STA  $vw
+    [0x86] = KERNEL_STX,                                    // STX  $vw
+    [0x8C] = KERNEL_STY,                                    // STY  $vwxy
+    [0x8D] = KERNEL_STA,                                    // STA  $vwxy
+    [0x8E] = KERNEL_STX,                                    // STX  $vwxy
+    [0x91] = KERNEL_STA,                                    // STA ($vw),Y
+    [0x94] = KERNEL_STY,                                    // STY  $vw,X
+    [0x95] = KERNEL_STA,                                    // STA  $vw,X
+    [0x96] = KERNEL_STX,                                    // STX  $vw,Y
+    [0x99] = KERNEL_STA,                                    // STA  $vwxy,Y
+    [0x9D] = KERNEL_STA,                                    // STA  $vwxy,X
+    [0xA0] = KERNEL_LDY,                                    // LDY #$xy
+    [0xA1] = KERNEL_LDA,                                    // LDA ($xy,X)
+    [0xA2] = KERNEL_LDX,                                    // LDX #$xy
+    [0xA4] = KERNEL_LDY,                                    // LDY  $xy
+    [0xA5] = KERNEL_LDA,                                    // LDA  $xy
+    [0xA6] = KERNEL_LDX,                                    // LDX  $xy
+    [0xA9] = KERNEL_LDA,                                    // LDA #$xy
+    [0xAC] = KERNEL_LDY,                                    // LDY  $vwxy
+    [0xAD] = KERNEL_LDA,                                    // LDA  $vwxy
+    [0xAE] = KERNEL_LDX,                                    // LDX  $vwxy
+    [0xB1] = KERNEL_LDA,                                    // LDA ($xy),Y
+    [0xB4] = KERNEL_LDY,                                    // LDY  $xy,X
+    [0xB5] = KERNEL_LDA,                                    // LDA  $xy,X
+    [0xB6] = KERNEL_LDX,                                    // LDX  $xy,Y
+    [0xB9] = KERNEL_LDA,                                    // LDA  $vwxy,Y
+    [0xBC] = KERNEL_LDY,                                    // LDY  $vwxy,X
+    [0xBD] = KERNEL_LDA,                                    // LDA  $vwxy,X
+    [0xBE] = KERNEL_LDX                                     // LDX  $vwxy,Y
+};
+
+
+// Lockstep groups: all LOCKSTEP_LANES lanes always have their memory, so the vector kernels never need to check
+// which lanes exist. Lanes beyond "lanes" simply never run.
+
+lockstep_group* create_lockstep(int lanes) {
+    if(lanes < 1 || lanes > LOCKSTEP_LANES) {
+        printf("A lockstep group has 1 to %d lanes.\n", LOCKSTEP_LANES);
+        return NULL;
+    }
+    lockstep_group *group = aligned_alloc(32, sizeof(lockstep_group));
+    uint8_t *memory = calloc(1, (size_t) LOCKSTEP_LANES * MEMORY_SIZE + 4);     // +4: gathers read 32 bits
+    memory_bus *buses = malloc(LOCKSTEP_LANES * sizeof(memory_bus));
+    if(!group || !memory || !buses) {
+        printf("Memory allocation failed.\n");
+        free(group);
+        free(memory);
+        free(buses);
+        return NULL;
+    }
+    memset(group, 0, sizeof(lockstep_group));
+    group->memory = memory;
+    group->buses = buses;
+    group->lanes = lanes;
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        CPU6502 cpu;
+        reset_cpu(&cpu);
+        set_lane(group, lane, &cpu);
+        bus_map_memory(&buses[lane], 0x00, 0xFF, lane_memory(group, lane), lane_memory(group, lane));
+    }
+    return group;
+}
+
+void destroy_lockstep(lockstep_group *group) {
+    if(group) {
+        free(group->memory);
+        free(group->buses);
+        free(group);
+    }
+}
+
+uint8_t* lane_memory(lockstep_group *group, int lane) {
+    return group->memory + (size_t) lane * MEMORY_SIZE;
+}
+
+void get_lane(const lockstep_group *group, int lane, CPU6502 *cpu) {
+    cpu->A  = group->A[lane];
+    cpu->X  = group->X[lane];
+    cpu->Y  = group->Y[lane];
+    cpu->SP = group->SP[lane];
+    cpu->PC = group->PC[lane];
+    set_status(cpu, group->SR[lane]);
+    cpu->cycles = group->cycles[lane];
+    cpu->irq = 0;                                           // lanes have no devices
+    cpu->nmi = false;
+}
+
+void set_lane(lockstep_group *group, int lane, const CPU6502 *cpu) {      // (re)starts the lane as well
+    group->A[lane]  = cpu->A;
+    group->X[lane]  = cpu->X;
+    group->Y[lane]  = cpu->Y;
+    group->SP[lane] = cpu->SP;
+    group->PC[lane] = cpu->PC;
+    group->SR[lane] = get_status(cpu);
+    group->cycles[lane] = cpu->cycles;
+    group->running[lane] = lane < group->lanes ? 0xFF : 0x00;
+}
+
+
+// Vector kernels, part 1: effective addresses of all lanes, already turned into offsets into group->memory
+// (lane * MEMORY_SIZE + address). Same wrap-around rules as the addressing modes in 6502.c.
+
+#ifdef __AVX2__
+
+static inline __m256i widen(const uint8_t *bytes) {         // 8 bytes to 8 x 32 bits
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) bytes));
+}
+
+static inline __m256i gather_bytes(const uint8_t *memory, __m256i offsets) {
+    return _mm256_and_si256(_mm256_i32gather_epi32((const int *) memory, offsets, 1), _mm256_set1_epi32(0xFF));
+}
+
+static void lockstep_addresses(lockstep_group *group, uint8_t mode, uint8_t low, uint8_t high, uint32_t offsets[LOCKSTEP_LANES]) {
+    const __m256i page = _mm256_set1_epi32(0xFF), bank = _mm256_set1_epi32(0xFFFF);
+    const __m256i zeropage = _mm256_set1_epi32(low), absolute = _mm256_set1_epi32(low | (high << 8));
+
+    for(int i = 0; i < LOCKSTEP_LANES; i += 8) {
+        __m256i base = _mm256_slli_epi32(_mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)), 16);
+        __m256i address, pointer;
+        switch(mode) {
+            case MODE_ZEROPAGE:
+                address = zeropage;
+                break;
+            case MODE_ZEROPAGE_X:
+                address = _mm256_and_si256(_mm256_add_epi32(zeropage, widen(&group->X[i])), page);
+                break;
+            case MODE_ZEROPAGE_Y:
+                address = _mm256_and_si256(_mm256_add_epi32(zeropage, widen(&group->Y[i])), page);
+                break;
+            case MODE_ABSOLUTE_X:
+                address = _mm256_and_si256(_mm256_add_epi32(absolute, widen(&group->X[i])), bank);
+                break;
+            case MODE_ABSOLUTE_Y:
+                address = _mm256_and_si256(_mm256_add_epi32(absolute, widen(&group->Y[i])), bank);
+                break;
+            case MODE_INDEXED_INDIRECT:                     // ($xy,X): pointer in page zero, per lane
+                pointer = _mm256_and_si256(_mm256_add_epi32(zeropage, widen(&group->X[i])), page);
+                address = _mm256_or_si256(gather_bytes(group->memory, _mm256_add_epi32(base, pointer)),
+                          _mm256_slli_epi32(gather_bytes(group->memory, _mm256_add_epi32(base,
+                              _mm256_and_si256(_mm256_add_epi32(pointer, _mm256_set1_epi32(1)), page))), 8));
+                break;
+            case MODE_INDIRECT_INDEXED:                     // ($xy),Y: same pointer address, different contents
+                pointer = _mm256_set1_epi32((uint8_t) (low + 1));
+                address = _mm256_or_si256(gather_bytes(group->memory, _mm256_add_epi32(base, zeropage)),
+                          _mm256_slli_epi32(gather_bytes(group->memory, _mm256_add_epi32(base, pointer)), 8));
+                address = _mm256_and_si256(_mm256_add_epi32(address, widen(&group->Y[i])), bank);
+                break;
+            default:                                        // MODE_ABSOLUTE
+                address = absolute;
+                break;
+        }
+        _mm256_storeu_si256((__m256i *) &offsets[i], _mm256_add_epi32(base, address));
+    }
+}
+
+static void lockstep_gather(lockstep_group *group, const uint32_t offsets[LOCKSTEP_LANES], uint8_t values[LOCKSTEP_LANES]) {
+    __m256i chunk[4];
+    for(int i = 0; i < 4; i++) {
+        chunk[i] = gather_bytes(group->memory, _mm256_loadu_si256((const __m256i *) &offsets[8 * i]));
+    }
+    __m256i words = _mm256_packus_epi16(_mm256_packus_epi32(chunk[0], chunk[1]), _mm256_packus_epi32(chunk[2], chunk[3]));
+    words = _mm256_permutevar8x32_epi32(words, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));     // undo the lane interleaving
+    _mm256_storeu_si256((__m256i *) values, words);
+}
+
+#else
+
+static void lockstep_addresses(lockstep_group *group, uint8_t mode, uint8_t low, uint8_t high, uint32_t offsets[LOCKSTEP_LANES]) {
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        const uint8_t *memory = lane_memory(group, lane);
+        uint16_t address;
+        uint8_t pointer;
+        switch(mode) {
+            case MODE_ZEROPAGE:
+                address = low;
+                break;
+            case MODE_ZEROPAGE_X:
+                address = (uint8_t) (low + group->X[lane]);
+                break;
+            case MODE_ZEROPAGE_Y:
+                address = (uint8_t) (low + group->Y[lane]);
+                break;
+            case MODE_ABSOLUTE_X:
+                address = (uint16_t) ((low | (high << 8)) + group->X[lane]);
+                break;
+            case MODE_ABSOLUTE_Y:
+                address = (uint16_t) ((low | (high << 8)) + group->Y[lane]);
+                break;
+            case MODE_INDEXED_INDIRECT:
+                pointer = low + group->X[lane];
+                address = memory[pointer] | (memory[(uint8_t) (pointer + 1)] << 8);
+                break;
+            case MODE_INDIRECT_INDEXED:
+                address = (uint16_t) ((memory[low] | (memory[(uint8_t) (low + 1)] << 8)) + group->Y[lane]);
+                break;
+            default:                                        // MODE_ABSOLUTE
+                address = low | (high << 8);
+                break;
+        }
+        offsets[lane] = (uint32_t) lane * MEMORY_SIZE + address;
+    }
+}
+
+static void lockstep_gather(lockstep_group *group, const uint32_t offsets[LOCKSTEP_LANES], uint8_t values[LOCKSTEP_LANES]) {
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        values[lane] = group->memory[offsets[lane]];
+    }
+}
+
+#endif
+
+
+// Vector kernels, part 2: register load with N/Z flags, i.e. op_lda() and update_flag() for all lanes at once.
+// Only lanes with mask = 0xFF are changed.
+
+static void lockstep_load(uint8_t reg[LOCKSTEP_LANES], uint8_t SR[LOCKSTEP_LANES], const uint8_t values[LOCKSTEP_LANES],
+                          const uint8_t mask[LOCKSTEP_LANES]) {
+#ifdef __AVX2__
+    __m256i value = _mm256_loadu_si256((const __m256i *) values);
+    __m256i select = _mm256_loadu_si256((const __m256i *) mask);
+    __m256i status = _mm256_loadu_si256((const __m256i *) SR);
+    __m256i flags = _mm256_or_si256(_mm256_and_si256(value, _mm256_set1_epi8((char) FLAG_N)),
+                                    _mm256_and_si256(_mm256_cmpeq_epi8(value, _mm256_setzero_si256()), _mm256_set1_epi8(FLAG_Z)));
+    status = _mm256_or_si256(_mm256_andnot_si256(_mm256_set1_epi8((char) (FLAG_N | FLAG_Z)), status), flags);
+    _mm256_storeu_si256((__m256i *) reg, _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *) reg), value, select));
+    _mm256_storeu_si256((__m256i *) SR, _mm256_blendv_epi8(_mm256_loadu_si256((const __m256i *) SR), status, select));
+#elif defined(__SSE2__)
+    for(int i = 0; i < LOCKSTEP_LANES; i += 16) {           // SSE2 has no blend: (new & mask) | (old & ~mask)
+        __m128i value = _mm_loadu_si128((const __m128i *) &values[i]);
+        __m128i select = _mm_loadu_si128((const __m128i *) &mask[i]);
+        __m128i status = _mm_loadu_si128((const __m128i *) &SR[i]);
+        __m128i flags = _mm_or_si128(_mm_and_si128(value, _mm_set1_epi8((char) FLAG_N)),
+                                     _mm_and_si128(_mm_cmpeq_epi8(value, _mm_setzero_si128()), _mm_set1_epi8(FLAG_Z)));
+        flags = _mm_or_si128(_mm_andnot_si128(_mm_set1_epi8((char) (FLAG_N | FLAG_Z)), status), flags);
+        _mm_storeu_si128((__m128i *) &reg[i], _mm_or_si128(_mm_and_si128(select, value),
+                                                           _mm_andnot_si128(select, _mm_loadu_si128((const __m128i *) &reg[i]))));
+        _mm_storeu_si128((__m128i *) &SR[i], _mm_or_si128(_mm_and_si128(select, flags), _mm_andnot_si128(select, status)));
+    }
+#else
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if(mask[lane]) {
+            reg[lane] = values[lane];
+            update_flag(&SR[lane], FLAG_Z, values[lane] == 0);
+            update_flag(&SR[lane], FLAG_N, values[lane] & 0x80);
+        }
+    }
+#endif
+}
+
+static void lockstep_store(lockstep_group *group, const uint32_t offsets[LOCKSTEP_LANES], const uint8_t reg[LOCKSTEP_LANES],
+                           const uint8_t mask[LOCKSTEP_LANES]) {
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {      // no scatter in AVX2, and every lane has its own memory anyway
+        if(mask[lane]) {
+            group->memory[offsets[lane]] = reg[lane];
+        }
+    }
+}
+
+
+// One instruction for all lanes in "mask" (they all have the same PC and instruction bytes)
+
+static void lockstep_execute(lockstep_group *group, const uint8_t mask[LOCKSTEP_LANES], uint8_t opcode, uint8_t low, uint8_t high) {
+    const opcode_info *info = &opcode_table[opcode];
+    uint32_t offsets[LOCKSTEP_LANES];
+    uint8_t values[LOCKSTEP_LANES];
+    uint8_t crossed[LOCKSTEP_LANES] = {0};                  // page crossing penalty of loads, per lane
+    uint8_t *load = NULL;
+
+    if(info->mode != MODE_IMPLIED && info->mode != MODE_IMMEDIATE) {
+        lockstep_addresses(group, info->mode, low, high, offsets);
+    }
+    switch(lockstep_kernels[opcode]) {
+        case KERNEL_LDA:
+            load = group->A;
+            break;
+        case KERNEL_LDX:
+            load = group->X;
+            break;
+        case KERNEL_LDY:
+            load = group->Y;
+            break;
+        case KERNEL_STA:
+            lockstep_store(group, offsets, group->A, mask);
+            break;
+        case KERNEL_STX:
+            lockstep_store(group, offsets, group->X, mask);
+            break;
+        case KERNEL_STY:
+            lockstep_store(group, offsets, group->Y, mask);
+            break;
+    }
+    if(load) {
+        const uint8_t *index = info->mode == MODE_ABSOLUTE_X ? group->X : group->Y;
+        if(info->mode == MODE_ABSOLUTE_X || info->mode == MODE_ABSOLUTE_Y || info->mode == MODE_INDIRECT_INDEXED) {
+            for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {  // low byte below the index: adding it carried
+                crossed[lane] = (uint8_t) offsets[lane] < index[lane];
+            }
+        }
+        if(info->mode == MODE_IMMEDIATE) {
+            memset(values, low, LOCKSTEP_LANES);
+        } else {
+            lockstep_gather(group, offsets, values);
+        }
+        lockstep_load(load, group->SR, values, mask);
+    }
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {      // without branches, so that the compiler can vectorize it
+        group->PC[lane] += info->length & mask[lane];
+        group->cycles[lane] += (info->cycles + crossed[lane]) & mask[lane];
+    }
+}
+
+static void lockstep_scalar(lockstep_group *group, int lane) {    // one instruction of one lane in the normal core
+    CPU6502 cpu;
+    uint8_t *memory = lane_memory(group, lane);
+
+    get_lane(group, lane, &cpu);
+    uint8_t opcode = memory[cpu.PC];
+    if(!opcode_implemented(opcode)) {                       // stops in front of it, as run() does
+        group->running[lane] = 0x00;
+        return;
+    }
+    execute_command(&cpu, &group->buses[lane]);
+    set_lane(group, lane, &cpu);
+    if(opcode == 0x00) {                                    // BRK
+        group->running[lane] = 0x00;
+    }
+}
+
+
+// Lanes as bit masks (bit n = lane n): which lanes are running, and which of them follow the leader, i.e. have
+// the same PC and the same three instruction bytes ("instruction", little endian). The latter also fills "mask".
+
+static inline uint32_t running_lanes(const lockstep_group *group) {
+#ifdef __AVX2__
+    return (uint32_t) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) group->running));
+#else
+    uint32_t bits = 0;
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        bits |= (uint32_t) (group->running[lane] & 1) << lane;
+    }
+    return bits;
+#endif
+}
+
+static uint32_t follower_lanes(lockstep_group *group, uint32_t running, uint16_t PC, uint32_t instruction,
+                               uint8_t mask[LOCKSTEP_LANES]) {
+    uint32_t bits = 0;
+#ifdef __AVX2__
+    if(PC <= 0xFFFD) {                                      // one 32 bit gather per lane fetches all three bytes
+        const __m256i same_PC = _mm256_set1_epi32(PC), same_bytes = _mm256_set1_epi32(instruction);
+        for(int i = 0; i < LOCKSTEP_LANES; i += 8) {
+            __m256i base = _mm256_slli_epi32(_mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)), 16);
+            __m256i lane_PC = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) &group->PC[i]));
+            __m256i bytes = _mm256_and_si256(_mm256_i32gather_epi32((const int *) group->memory, _mm256_add_epi32(base, same_PC), 1),
+                                             _mm256_set1_epi32(0xFFFFFF));
+            __m256i equal = _mm256_and_si256(_mm256_cmpeq_epi32(lane_PC, same_PC), _mm256_cmpeq_epi32(bytes, same_bytes));
+            bits |= (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(equal)) << i;
+        }
+        bits &= running;
+    } else
+#endif
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        const uint8_t *memory = lane_memory(group, lane);
+        uint32_t bytes = memory[PC] | (memory[(uint16_t) (PC + 1)] << 8) | (memory[(uint16_t) (PC + 2)] << 16);
+        if((running >> lane & 1) && group->PC[lane] == PC && bytes == instruction) {
+            bits |= 1u << lane;
+        }
+    }
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        mask[lane] = (uint8_t) -(uint8_t) (bits >> lane & 1);
+    }
+    return bits;
+}
+
+
+// One step: every running lane executes one instruction. Returns false if no lane is running any more.
+
+static bool lockstep_step(lockstep_group *group) {
+    uint8_t mask[LOCKSTEP_LANES];
+    uint32_t running = running_lanes(group), followers = 0;
+
+    if(!running) {
+        return false;
+    }
+    int leader = __builtin_ctz(running);                    // the first running lane decides what runs in lockstep
+    uint16_t PC = group->PC[leader];
+    const uint8_t *code = lane_memory(group, leader);
+    uint8_t opcode = code[PC], low = code[(uint16_t) (PC + 1)], high = code[(uint16_t) (PC + 2)];
+
+    if(lockstep_kernels[opcode] != KERNEL_NONE) {
+        followers = follower_lanes(group, running, PC, opcode | (low << 8) | (high << 16), mask);
+        if(__builtin_popcount(followers) >= LOCKSTEP_MIN_LANES) {
+            lockstep_execute(group, mask, opcode, low, high);
+            group->lockstep_instructions += __builtin_popcount(followers);
+        } else {
+            followers = 0;
+        }
+    }
+    for(uint32_t rest = running & ~followers; rest; rest &= rest - 1) {         // all others through the scalar core
+        lockstep_scalar(group, __builtin_ctz(rest));
+        group->scalar_instructions++;
+    }
+    return true;
+}
+
+
+// Runs all lanes until each of them has executed BRK (STOP_BRK), the budget is used up, a running lane reaches
+// a breakpoint, or an interrupt is requested. The instruction budget counts steps, the cycle budget applies to every
+// lane. The result reports the cycles of the lane that has used the most. Tracing is not supported (budget.trace).
+
+run_result run_lockstep(lockstep_group *group, run_budget budget) {
+    run_result result = {STOP_BUDGET, 0, 0};
+    uint64_t first_cycles[LOCKSTEP_LANES];
+    uint64_t instruction_limit = budget.instructions ? budget.instructions : UINT64_MAX;
+
+    memcpy(first_cycles, group->cycles, sizeof(first_cycles));
+    while(result.instructions < instruction_limit && (!budget.cycles || result.cycles < budget.cycles)) {
+        if(budget.interrupt_request && *budget.interrupt_request) {
+            result.reason = STOP_INTERRUPT;
+            break;
+        }
+        if(budget.breakpoints && result.instructions) {
+            bool hit = false;
+            for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                hit |= group->running[lane] && (budget.breakpoints[group->PC[lane] >> 3] & (1 << (group->PC[lane] & 7)));
+            }
+            if(hit) {
+                result.reason = STOP_BREAKPOINT;
+                break;
+            }
+        }
+        if(!lockstep_step(group)) {
+            result.reason = STOP_BRK;
+            break;
+        }
+        result.instructions++;
+        if(budget.cycles) {                                 // only needed for the cycle budget
+            for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if(group->cycles[lane] - first_cycles[lane] > result.cycles) {
+                    result.cycles = group->cycles[lane] - first_cycles[lane];
+                }
+            }
+        }
+    }
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if(group->cycles[lane] - first_cycles[lane] > result.cycles) {
+            result.cycles = group->cycles[lane] - first_cycles[lane];
+        }
+    }
+    return result;
+}
+
+
+// Lockstep benchmark: LOCKSTEP_LANES copies of a load/store program with different data, run once as a lockstep group
+// and once as separate machines in the scalar core. Both must end up with exactly the same registers and memory.
+
+void benchmark_lockstep(uint64_t instructions) {
+    static const uint8_t code[] = {
+        0xA6, 0x11,         0xAE, 0x01, 0x80,   0xA4, 0x13,         0xAC, 0x03, 0x80,   // X and Y from memory
+        0xA9, 0x42,         0xA5, 0x10,         0xAD, 0x00, 0x80,   0x85, 0x30,         0x8D, 0x00, 0x81,
+        0x86, 0x32,         0x8E, 0x01, 0x81,   0x84, 0x34,         0x8C, 0x02, 0x81,
+        0xBD, 0x00, 0x80,   0xB5, 0x10,         0xA1, 0x20,         0xB9, 0x10, 0x80,   0xB1, 0x22,
+        0x95, 0x31,         0x9D, 0x00, 0x81,   0x99, 0x00, 0x81,   0x81, 0x20,         0x91, 0x22,
+        0x96, 0x33,         0x94, 0x35,
+        0xB6, 0x12,         0xBE, 0x02, 0x80,   0xB4, 0x14,         0xBC, 0x04, 0x80,
+        0x00                                                                            // BRK
+    };
+    const uint16_t code_start = 0x0200;
+    const uint64_t program_length = 33;                     // instructions per run, including BRK
+    uint64_t runs = instructions / (program_length * LOCKSTEP_LANES) + 1;
+    lockstep_group *group = create_lockstep(LOCKSTEP_LANES);
+    machine *machines[LOCKSTEP_LANES] = {NULL};
+    run_budget budget = {0};
+    double seconds[2];
+    bool identical = true;
+
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        machines[lane] = create_machine();
+        if(!machines[lane]) {
+            identical = false;
+        }
+    }
+    if(!group || !identical) {
+        for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            destroy_machine(machines[lane]);
+        }
+        destroy_lockstep(group);
+        return;
+    }
+
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {      // same program, different data (and so different X and Y)
+        uint8_t *memory = lane_memory(group, lane);
+        for(int i = 0; i < 0x100; i++) {
+            memory[0x8000 + i] = (uint8_t) (i * 7 + lane);
+        }
+        for(int i = 0x10; i < 0x15; i++) {
+            memory[i] = (uint8_t) (lane * 3 + i);
+        }
+        for(int i = 0x20; i < 0x60; i++) {                  // pointers for ($xy,X) and ($xy),Y
+            memory[i] = (i & 1) ? 0x81 : 0x10;
+        }
+        memcpy(memory + code_start, code, sizeof(code));
+        memcpy(machines[lane]->memory, memory, MEMORY_SIZE);
+    }
+
+    printf("Lockstep benchmark, %d lanes, %llu instructions per lane\n\n", LOCKSTEP_LANES,
+           (unsigned long long) (runs * program_length));
+    clock_t start = clock();
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        for(uint64_t i = 0; i < runs; i++) {
+            machines[lane]->cpu.PC = code_start;
+            run_machine(machines[lane], budget);
+        }
+    }
+    seconds[0] = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    start = clock();
+    for(uint64_t i = 0; i < runs; i++) {
+        for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            CPU6502 cpu;
+            get_lane(group, lane, &cpu);
+            cpu.PC = code_start;
+            set_lane(group, lane, &cpu);
+        }
+        run_lockstep(group, budget);
+    }
+    seconds[1] = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        CPU6502 cpu, scalar = machines[lane]->cpu;
+        get_lane(group, lane, &cpu);
+        set_status(&scalar, get_status(&scalar));           // the lazy flags in the same form as from get_lane()
+        if(memcmp(&cpu, &scalar, sizeof(CPU6502)) || memcmp(lane_memory(group, lane), machines[lane]->memory, MEMORY_SIZE)) {
+            printf("Lane %d differs from the scalar core.\n", lane);
+            identical = false;
+        }
+    }
+    for(int engine = 0; engine < 2; engine++) {
+        if(seconds[engine] <= 0) {
+            seconds[engine] = 1e-9;
+        }
+        printf("%-20s %8.3f s  %12.0f instructions/s\n", engine ? "lockstep" : "separate machines", seconds[engine],
+               runs * program_length * LOCKSTEP_LANES / seconds[engine]);
+    }
+    printf("\nSpeedup of lockstep over separate machines: %.2fx\n", seconds[0] / seconds[1]);
+    printf("Lane instructions in lockstep: %llu, in the scalar core: %llu\n",
+           (unsigned long long) group->lockstep_instructions, (unsigned long long) group->scalar_instructions);
+    printf("Results %s.\n", identical ? "identical" : "differ");
+
+    for(int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        destroy_machine(machines[lane]);
+    }
+    destroy_lockstep(group);
+}
@@ -0,0 +1,463 @@
+// SIMPLE 6502 EMULATOR -- command line front end
+//
+// Without arguments, runs the demo program from enter_code() and prints every instruction.
+//   -f file        run a raw binary (loaded at $0200) or a .prg file instead of the demo program
+//   -p file        same as -f, but at the speed of a real 1 MHz 6502 and without live output
+//   -P file        same as -f, but profiled and without live output; prints a report at the end and writes the
+//                  calling contexts to file.folded (collapsed stacks for flame graph tools)
+//   -b [count]     benchmark of the dispatch table against the original switch-based core (and computed gotos for
+//                  comparison), and of the translation cache
+//   -l [count]     benchmark of lockstep emulation against separate machines
+//   -g             check the gate-level ALU against the core for all ADC inputs, and the decimal ADC/SBC tables
+//   -c             self-checks of the emulator's internals: the event queue, snapshots, the translation cache, the
+//                  debugger's watchpoints, the profiler, the trace, test suites, record and replay; returns 1 if any fails
+//   -n [seconds]   benchmark of the TED sound block renderer against the per-sample loop (default 600 s of sound);
+//                  returns 1 if the samples differ
+//   -t file        run the demo, but record a binary trace instead of printing
+//   -d file        print a recorded trace
+//   -a file [addr] disassemble a raw binary (at the hex address given, or $0200) or a .prg file
+//   -r file ...    run raw binaries or .prg files in parallel (until BRK or the cycle budget)
+//   -T path [file] run a test suite (a directory of images or a manifest, see suite.c) in parallel and write a JSON
+//                  report to file, or a CSV report if the name ends in .csv; returns 1 if any test has failed
+//   -s file wav [seconds]  run a program file with TED sound at $FF0E-$FF12 until BRK or for the given emulated time
+//                  (default 60 s), and write the sound to a WAV file ("-": stdout)
+//   -S file out [seconds]  same as -s, but in real time: the sound is streamed to a WAV file, named pipe or stdout
+//                  while the program runs at the speed of a real 1 MHz 6502
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "6502.h"
+
+#ifndef SHOW_PROCESSED_DATA                                 // default live output of the demo; both can be switched off
+#define SHOW_PROCESSED_DATA   true                          // from the command line, e.g. gcc -DSHOW_PROCESSOR_STATUS=false
+#endif
+#ifndef SHOW_PROCESSOR_STATUS
+#define SHOW_PROCESSOR_STATUS true
+#endif
+
+#define BENCHMARK_INSTRUCTIONS 50000000                     // default number of instructions per benchmark run
+#define RAW_ADDRESS 0x0200                                  // load and start address of raw binaries (-f and -r)
+#define BATCH_CYCLES 100000000                              // cycle budget per image run with -r
+#define PROFILE_REPORT_LINES 20                             // hottest addresses and loops in the report of -P
+#define SOUND_SECONDS 60                                    // default emulated time for -s and -S
+#define SOUND_BENCHMARK_SECONDS 600                         // default length of the sound rendered by -n
+#define LIVE_SAMPLE_RATE 48000                              // output rate of -S, resampled from TED_SAMPLE_RATE
+#define LIVE_RENDER_INTERVAL (CLOCK_SPEED / 100)            // cycles between renders of -S: 10 ms
+#define EVENT_CHECK_ROUNDS 20000                           // random event queues cancelled by -c
+#define SNAPSHOT_CHECK_STEPS 3000                          // random writes, snapshots, restores and forks per profile
+#define CACHE_CHECK_PROGRAMS 300                           // random self-modifying programs, with and without cache
+
+void enter_code(uint8_t memory[MEMORY_SIZE]);
+void show_listing(uint8_t memory[MEMORY_SIZE], uint16_t first, uint16_t end);
+int run_images(int count, char *files[]);
+int run_tests(const char *path, const char *report);
+int render_sound(const char *program, const char *output, double seconds);
+int play_sound(const char *program, const char *output, double seconds);
+bool run_checks(void);
+
+int main(int argc, char *argv[]) {
+    bool show_data = SHOW_PROCESSED_DATA, show_status = SHOW_PROCESSOR_STATUS;
+    trace_buffer *trace = NULL;                             // no tracing unless asked for
+    const char *program = NULL;                             // demo program unless a file is given
+    bool paced = false;                                     // as fast as possible unless asked for
+    profile *profile = NULL;                                // no profiling unless asked for
+
+    if(argc > 1 && !strcmp(argv[1], "-b")) {               // -b [count]: run the dispatch benchmark instead of the demo
+        benchmark(argc > 2 ? strtoull(argv[2], NULL, 10) : BENCHMARK_INSTRUCTIONS);
+        return 0;
+    }
+    if(argc > 1 && !strcmp(argv[1], "-l")) {               // -l [count]: run the lockstep benchmark
+        benchmark_lockstep(argc > 2 ? strtoull(argv[2], NULL, 10) : BENCHMARK_INSTRUCTIONS);
+        return 0;
+    }
+    if(argc > 1 && !strcmp(argv[1], "-g")) {               // -g: check the ALU netlist and the BCD tables
+        return !(check_alu() & check_decimal());
+    }
+    if(argc > 1 && !strcmp(argv[1], "-c")) {               // -c: run the self-checks
+        return !run_checks();
+    }
+    if(argc > 1 && !strcmp(argv[1], "-n")) {               // -n [seconds]: compare and time the TED sound renderers
+        return !benchmark_ted_sound(argc > 2 ? strtod(argv[2], NULL) : SOUND_BENCHMARK_SECONDS);
+    }
+    if(argc > 2 && !strcmp(argv[1], "-d")) {               // -d file: print a recorded trace in the usual text format
+        return trace_decode(argv[2], true, true);
+    }
+    if(argc > 2 && !strcmp(argv[1], "-a")) {               // -a file [address]: print a listing of a program file
+        return !disassemble_file(argv[2], argc > 3 ? strtoul(argv[3], NULL, 16) : RAW_ADDRESS, stdout);
+    }
+    if(argc > 2 && !strcmp(argv[1], "-r")) {               // -r file...: run program images on all cores
+        return run_images(argc - 2, &argv[2]);
+    }
+    if(argc > 2 && !strcmp(argv[1], "-T")) {               // -T path [report]: run a test suite on all cores
+        return run_tests(argv[2], argc > 3 ? argv[3] : NULL);
+    }
+    if(argc > 3 && !strcmp(argv[1], "-s")) {               // -s file wav [seconds]: render the TED sound of a program
+        return render_sound(argv[2], argv[3], argc > 4 ? strtod(argv[4], NULL) : SOUND_SECONDS);
+    }
+    if(argc > 3 && !strcmp(argv[1], "-S")) {               // -S file out [seconds]: play the TED sound in real time
+        return play_sound(argv[2], argv[3], argc > 4 ? strtod(argv[4], NULL) : SOUND_SECONDS);
+    }
+    if(argc > 2 && !strcmp(argv[1], "-f")) {               // -f file: run a program file
+        program = argv[2];
+    }
+    if(argc > 2 && !strcmp(argv[1], "-p")) {               // -p file: run a program file in real time
+        program = argv[2];
+        paced = true;
+        show_data = show_status = false;
+    }
+    if(argc > 2 && !strcmp(argv[1], "-P")) {               // -P file: run a program file with the profiler
+        program = argv[2];
+        profile = create_profile();
+        if(!profile) {
+            return 1;
+        }
+        show_data = show_status = false;
+    }
+    if(argc > 2 && !strcmp(argv[1], "-t")) {               // -t file: record a binary trace instead of printing
+        trace = trace_open(argv[2]);
+        if(!trace) {
+            return 1;
+        }
+        show_data = show_status = false;
+    }
+
+    machine *m = create_machine();                          // define CPU and memory (filled with zeros), reset CPU
+    if(!m) {
+        return 1;
+    }
+
+    printf("SIMPLE\n\n    ###   #####    ####    #####\n   ##  #  ##      ##  ##  #    ##\n  ##      ##      ##  ##       ##\n  #####   #####   ##  ##      ##\n  ##  ##      ##  ##  ##     ##\n  ##  ##  #   ##  ##  ##    ##  #\n   ####    ####    ####   #######\n\n                           EMULATOR\n\n");
+
+    if(program && !load_program(m, program, RAW_ADDRESS)) {    // load program, PC from the reset vector
+        destroy_machine(m);
+        return 1;
+    }
+    printf("Initial CPU status after reset:\n");
+    show_cpu_status(m->cpu);
+
+    if(!program) {
+        enter_code(m->memory);                              // load test scenario
+    }
+
+    run_budget budget = {0};                                // no limits: run until BRK
+    budget.trace = trace;
+    budget.profile = profile;
+    if(show_data || show_status) {
+        budget.instructions = 1;                            // live output: one instruction per call
+    }
+    run_result result;
+    uint64_t instructions = 0;
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    do {                                                    // main loop,
+        uint16_t start = m->cpu.PC;
+        uint64_t cycle = m->cpu.cycles;
+        uint8_t bytes[3];
+        trace_fetch_begin(&m->bus, start, bytes);           // live output: the bytes as fetched, see trace.c
+        result = paced ? run_paced(m, budget, CLOCK_SPEED) : run_machine(m, budget);
+        instructions += result.instructions;
+        if(show_data || show_status) {                      // live output: build a trace record and print it right away
+            trace_record record;
+            trace_fetch_end(&m->bus, start, bytes);
+            fill_trace_record(&record, &m->cpu, start, cycle, bytes);
+            print_trace_record(&record, show_data, show_status);
+        }
+    } while(result.reason != STOP_BRK && result.reason != STOP_UNKNOWN_OPCODE);     // exited after BRK
+
+    bool traced = true;
+    if(trace) {
+        traced = trace_close(trace);                        // waits until the writer thread has saved everything
+        if(traced) {
+            printf("Trace of %llu instructions written to %s.\n\n", (unsigned long long) instructions, argv[2]);
+        } else {
+            printf("Unable to write %s, the trace is incomplete.\n\n", argv[2]);
+        }
+    }
+    if(show_data && !show_status) {
+        printf("\n");
+    }
+    if(result.reason == STOP_UNKNOWN_OPCODE) {
+        printf("Unknown opcode %02X at %04X, program stopped. Final CPU status:\n\n", peek_register(m, m->cpu.PC), m->cpu.PC);
+    } else {
+        printf("B flag has been set, program terminated. Final CPU status:\n\n");
+    }
+    show_cpu_status(m->cpu);
+    if(!program) {
+        show_memory_dump(0XEE, 0XEE, m->memory);
+    }
+    printf("On a 1 MHz 6502, this code would have taken %llu µs to run.\n", (unsigned long long) m->cpu.cycles);
+    if(paced) {
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        printf("Paced run took %.0f µs.\n", (finished.tv_sec - started.tv_sec) * 1e6 + (finished.tv_nsec - started.tv_nsec) / 1e3);
+    }
+    if(profile) {
+        char folded[FILENAME_MAX];
+        snprintf(folded, sizeof(folded), "%s.folded", program);
+        printf("\n");
+        profile_report(profile, stdout, PROFILE_REPORT_LINES);
+        if(profile_write_folded(profile, folded)) {
+            printf("Collapsed stacks written to %s.\n", folded);
+        }
+        destroy_profile(profile);
+    }
+    destroy_machine(m);
+    return traced ? 0 : 1;
+}
+
+void enter_code(uint8_t memory[MEMORY_SIZE]) {
+
+    // Test case for LDA/LDX/LDY: program code
+
+    memory[0xFFFC] = 0xA9;   // LDA #$FF
+    memory[0xFFFD] = 0xFF;   //     A9 FF
+    memory[0xFFFE] = 0xA5;   // LDA $22
+    memory[0xFFFF] = 0x22;   //     A9 22
+    memory[0x0000] = 0xAD;   // LDA $1234
+    memory[0x0001] = 0x34;   //     AC 34 12
+    memory[0x0002] = 0x12;   //
+    memory[0x0003] = 0xA2;   // LDX #$05
+    memory[0x0004] = 0x05;   //     A2 05
+    memory[0x0005] = 0xBD;   // LDA $1234,X
+    memory[0x0006] = 0x34;   //     BD 34 12
+    memory[0x0007] = 0x12;   //
+    memory[0x0008] = 0xB5;   // LDA $FF,X
+    memory[0x0009] = 0xFF;   //     B5 FF
+    memory[0x000A] = 0xA1;   // LDA ($02,X)
+    memory[0x000B] = 0x02;   //     A1 02
+    memory[0x000C] = 0xA0;   // LDY #$03
+    memory[0x000D] = 0x03;   //     A0 03
+    memory[0x000E] = 0xB9;   // LDA $3456,Y
+    memory[0x000F] = 0x56;   //     B9 56 34
+    memory[0x0010] = 0x34;   //
+    memory[0x0011] = 0xB1;   // LDA $05,Y
+    memory[0x0012] = 0x05;   //
+    memory[0x0013] = 0xA6;   // LDX $00
+    memory[0x0014] = 0x00;   //     A6 00
+    memory[0x0015] = 0xAE;   // LDX $1234
+    memory[0x0016] = 0x34;   //     AE 34 12
+    memory[0x0017] = 0x12;   //
+    memory[0x0018] = 0xB6;   // LDX $05,Y
+    memory[0x0019] = 0x05;   //     B6 05
+    memory[0x001A] = 0xBE;   // LDX $1231,Y
+    memory[0x001B] = 0x31;   //     BE 31 12
+    memory[0x001C] = 0x12;   //
+    memory[0x001D] = 0xA4;   // LDY $03
+    memory[0x001E] = 0x03;   //     A4 03
+    memory[0x001F] = 0xAC;   // LDY $1234
+    memory[0x0020] = 0x34;   //     AC 34 12
+    memory[0x0021] = 0x12;   //
+    memory[0x0022] = 0xB4;   // LDY $00,X
+    memory[0x0023] = 0x01;   //
+    memory[0x0024] = 0xBC;   // LDY $46CD,X
+    memory[0x0025] = 0xCD;   //     BC CD 46
+    memory[0x0026] = 0x46;   //
+    memory[0x0027] = 0x95;   // STA $AA,X
+    memory[0x0028] = 0xAA;   //     85 AA
+    memory[0x0029] = 0x00;   // BRK
+
+    printf("This code will test LDA, LDX, and LDY commands:\n\n");
+    show_listing(memory, 0xFFFC, 0x002A);                   // the code wraps around from $FFFF to $0000
+
+    // Test case for LDA/LDX/LDY: data
+
+    memory[0x0022] = 0xB4;
+    memory[0x0045] = 0x42;
+    memory[0x00AD] = 0xAA;
+    memory[0x00C0] = 0x11;
+    memory[0x00C1] = 0x47;
+    memory[0x1234] = 0x44;
+    memory[0x1239] = 0x93;
+    memory[0x3459] = 0x99;
+    memory[0x34C0] = 0x47;
+    memory[0x4711] = 0xDA;
+    memory[0xB512] = 0x77;
+
+    printf("Contents of 0022 is %02X.  ", memory[0x0022]);
+    printf("Contents of 1234 is %02X.  ", memory[0x1234]);
+    printf("Contents of 1239 is %02X.  ", memory[0x1239]);
+    printf("Contents of 0004 is %02X.\n", memory[0x0004]);
+    printf("Contents of B512 is %02X.  ", memory[0xB512]);
+    printf("Contents of 3459 is %02X.  ", memory[0x3459]);
+    printf("Contents of 0001 is %02X.  ", memory[0x0001]);
+    printf("Contents of 0008 is %02X.\n", memory[0x0008]);
+    printf("Contents of 4711 is %02X.  ", memory[0x4711]);
+    printf("Contents of 00B0 is %02X.  ", memory[0x00B0]);
+    printf("Contents of 0008 is %02X.  ", memory[0x0008]);
+    printf("Contents of 0003 is %02X.\n", memory[0x0003]);
+    printf("Contents of 0045 is %02X.  ", memory[0x0045]);
+    printf("Contents of 34C0 is %02X.  ", memory[0x34C0]);
+    printf("\n\n");
+}
+
+
+// Prints the disassembly of memory from "first" up to "end" (exclusive), wrapping around $FFFF
+
+void show_listing(uint8_t memory[MEMORY_SIZE], uint16_t first, uint16_t end) {
+    char listing[DISASSEMBLY_LINE * 64];
+    uint16_t address = first;
+
+    while(address != end) {
+        size_t size = end > address ? (size_t) (end - address) : (size_t) (MEMORY_SIZE - address);
+        size_t written;
+        address += disassemble(memory + address, size, address, listing, sizeof(listing), &written);
+        fwrite(listing, 1, written, stdout);
+    }
+}
+
+
+// Batch mode: maps all files, runs them on all cores and prints one line per file plus a summary
+
+int run_images(int count, char *files[]) {
+    batch_job *jobs = calloc(count, sizeof(batch_job));
+    program_file *programs = calloc(count, sizeof(program_file));
+    int result = 0;
+    if(!jobs || !programs) {
+        printf("Memory allocation failed.\n");
+        free(jobs);
+        free(programs);
+        return 1;
+    }
+    for(int i = 0; i < count && !result; i++) {
+        if(!map_program(files[i], RAW_ADDRESS, &programs[i])) {
+            result = 1;
+        }
+        jobs[i].image = programs[i].data;                   // copied into the machine for every run, no parsing
+        jobs[i].size = programs[i].size;
+        jobs[i].load_address = jobs[i].start_address = programs[i].address;
+        jobs[i].budget.cycles = BATCH_CYCLES;
+    }
+
+    if(!result) {
+        batch_summary summary = run_batch(jobs, count, 0);  // one thread per core
+        for(int i = 0; i < count; i++) {
+            printf("%-30s %-10s %12llu cycles  PC=%04X A=%02X X=%02X Y=%02X\n", files[i],
+                   jobs[i].loaded ? stop_reason_name(jobs[i].result.reason) : "not loaded", (unsigned long long) jobs[i].result.cycles,
+                   jobs[i].cpu.PC, jobs[i].cpu.A, jobs[i].cpu.X, jobs[i].cpu.Y);
+        }
+        printf("\n");
+        show_batch_summary(summary);
+    }
+    for(int i = 0; i < count; i++) {
+        unmap_program(&programs[i]);
+    }
+    free(programs);
+    free(jobs);
+    return result;
+}
+
+
+// Test mode: runs a suite on all cores, prints one line per test plus a summary, and writes the report
+
+int run_tests(const char *path, const char *report) {
+    test_suite *suite = load_suite(path);
+    if(!suite) {
+        return 1;
+    }
+    run_suite(suite, 0);                                    // one thread per core
+    show_suite_results(suite);
+    bool written = !report || write_suite_report(suite, report);
+    if(report && written) {
+        printf("Report written to %s.\n", report);
+    }
+    int result = written && suite->passed == suite->count ? 0 : 1;
+    destroy_suite(suite);
+    return result;
+}
+
+
+// Sound mode: runs a program with the TED sound device as fast as possible and saves what it plays. The report goes
+// to stderr, as the sound may go to stdout.
+
+int render_sound(const char *program, const char *output, double seconds) {
+    machine *m = create_machine();
+    if(!m || !load_program(m, program, RAW_ADDRESS) || !enable_translation_cache(m)) {
+        destroy_machine(m);
+        return 1;
+    }
+    wav_file *wav = wav_open(output, TED_SAMPLE_RATE);
+    ted_sound *ted = wav ? create_ted_sound(m, CLOCK_SPEED, TED_SAMPLE_RATE, wav_write, wav) : NULL;
+    if(!ted) {
+        if(wav) {
+            wav_close(wav);
+        }
+        destroy_machine(m);
+        return 1;
+    }
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    run_budget budget = {0};
+    budget.cycles = (uint64_t) (seconds * CLOCK_SPEED);
+    run_result result = run_machine(m, budget);
+    ted_sound_render(ted, m->cpu.cycles);                   // the rest since the last register write
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    uint64_t samples = ted_sound_samples(ted);
+    destroy_machine(m);
+    destroy_ted_sound(ted);
+    if(!wav_close(wav)) {
+        fprintf(stderr, "Unable to write %s.\n", output);
+        return 1;
+    }
+    fprintf(stderr, "%s after %llu cycles: %.2f s of sound (%llu samples) rendered in %.3f s.\n",
+            result.reason == STOP_BUDGET ? "Time is up" : stop_reason_name(result.reason), (unsigned long long) result.cycles,
+            (double) samples / TED_SAMPLE_RATE, (unsigned long long) samples,
+            (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    return 0;
+}
+
+
+// Live sound: runs a program in real time and streams its sound through an audio_stream, which never holds up the
+// emulation; prints the counters of the stream at the end (to stderr)
+
+int play_sound(const char *program, const char *output, double seconds) {
+    machine *m = create_machine();
+    if(!m || !load_program(m, program, RAW_ADDRESS) || !enable_translation_cache(m)) {
+        destroy_machine(m);
+        return 1;
+    }
+    audio_stream *stream = audio_stream_open(output, TED_SAMPLE_RATE, LIVE_SAMPLE_RATE);
+    ted_sound *ted = stream ? create_ted_sound(m, CLOCK_SPEED, TED_SAMPLE_RATE, audio_stream_write, stream) : NULL;
+    if(!ted || !ted_sound_schedule(ted, LIVE_RENDER_INTERVAL)) {
+        if(stream) {
+            audio_stream_close(stream);
+        }
+        destroy_machine(m);
+        destroy_ted_sound(ted);
+        return 1;
+    }
+
+    run_budget budget = {0};
+    budget.cycles = (uint64_t) (seconds * CLOCK_SPEED);
+    run_result result = run_paced(m, budget, CLOCK_SPEED);
+    ted_sound_render(ted, m->cpu.cycles);
+    destroy_machine(m);
+    destroy_ted_sound(ted);
+
+    audio_stream_stats stats = audio_stream_close(stream);
+    fprintf(stderr, "%s after %llu cycles: %llu samples received, %llu dropped (overruns); %llu samples played, "
+            "%llu filled in (underruns); drift correction %+.3f%%.\n", result.reason == STOP_BUDGET ? "Time is up" : stop_reason_name(result.reason),
+            (unsigned long long) result.cycles, (unsigned long long) stats.received, (unsigned long long) stats.overruns,
+            (unsigned long long) stats.played, (unsigned long long) stats.underruns, (stats.ratio - 1) * 100);
+    return 0;
+}
+
+
+// Check mode: the self-checks of the parts that have no other way to be run from here; all of them run, even after
+// one has failed
+
+bool run_checks(void) {
+    bool passed = true;
+    passed &= check_events(EVENT_CHECK_ROUNDS);
+    passed &= check_snapshots(SNAPSHOT_CHECK_STEPS);
+    passed &= check_cache(CACHE_CHECK_PROGRAMS);
+    passed &= check_debugger();
+    passed &= check_profile();
+    passed &= check_trace();
+    passed &= check_suite();
+    passed &= check_replay();
+    printf("\nSelf-checks %s.\n", passed ? "passed" : "FAILED");
+    return passed;
+}
@@ -0,0 +1,289 @@
+// PROFILER FOR THE SIMPLE 6502 EMULATOR
+//
+// Shows where an emulated program spends its time, without sampling: run(), run_translated() and run_debug() call
+// profile_instruction() (6502.h) after every instruction if the budget has a profile. That costs a handful of
+// increments in tables indexed by address and opcode, so profiling can stay on in production runs.
+//
+// Only instructions that change the flow of control take the out-of-line path here:
+// - Jumps back to the same or an earlier address are loop back-edges; they are counted per (from, to) pair in a
+//   small hash table. BRK and RTI also go to other places, but they enter and leave interrupt handlers: no loops.
+// - JSR and RTS move between calling contexts. A context is one path of nested subroutine calls; contexts form a
+//   tree, found by (parent, function) in another hash table. Cycles are counted for the current context, which gives
+//   exactly the "collapsed stacks" that flame graph tools read (profile_write_folded()).
+//
+// Both tables have a fixed size and never grow; what does not fit is counted as lost.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>                                         // for close()
+
+#include "6502.h"
+
+#define PROFILE_BLOCK 0x1000                                // address ranges of the report: 4 KB
+
+static const char *mode_names[] = {                        // per addressing_mode
+    "implied", "accumulator", "immediate", "zeropage", "zeropage,X", "zeropage,Y", "absolute", "absolute,X",
+    "absolute,Y", "indirect", "(indirect,X)", "(indirect),Y", "relative"
+};
+
+profile* create_profile(void) {
+    profile *p = calloc(1, sizeof(profile));
+    if(!p) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    p->contexts[0].parent = -1;                             // the root
+    p->context_count = 1;
+    return p;
+}
+
+void destroy_profile(profile *p) {
+    free(p);
+}
+
+
+// Out-of-line part of profile_instruction(): JSR, RTS, and jumps
+
+static inline uint32_t hash(uint32_t key, int bits) {
+    return (key * 2654435761u) >> (32 - bits);             // Fibonacci hashing
+}
+
+static void count_edge(profile *p, uint16_t from, uint16_t to) {
+    uint32_t slot = hash((uint32_t) from << 16 | to, 12) & (PROFILE_EDGES - 1);
+    for(int probe = 0; probe < PROFILE_EDGES; probe++, slot = (slot + 1) & (PROFILE_EDGES - 1)) {
+        profile_edge *edge = &p->edges[slot];
+        if(edge->count == 0) {
+            *edge = (profile_edge) {from, to, 0};
+        }
+        if(edge->from == from && edge->to == to) {
+            edge->count++;
+            return;
+        }
+    }
+    p->lost_edges++;
+}
+
+static void enter_context(profile *p, uint16_t function) {
+    uint32_t slot = hash((uint32_t) p->context << 16 | function, 13) & (2 * PROFILE_CONTEXTS - 1);
+    for(int probe = 0; probe < 2 * PROFILE_CONTEXTS; probe++, slot = (slot + 1) & (2 * PROFILE_CONTEXTS - 1)) {
+        int index = p->context_slots[slot] - 1;
+        if(index < 0) {                                     // new context
+            if(p->context_count == PROFILE_CONTEXTS) {
+                break;
+            }
+            index = p->context_count++;
+            p->contexts[index] = (profile_context) {p->context, function, 0};
+            p->context_slots[slot] = index + 1;
+        }
+        if(p->contexts[index].parent == p->context && p->contexts[index].function == function) {
+            p->context = index;
+            return;
+        }
+    }
+    p->lost_contexts++;                                     // its cycles stay with the caller
+}
+
+void profile_control(profile *p, uint8_t opcode, uint16_t start, uint16_t next) {
+    if(opcode == 0x20 && opcode_implemented(opcode)) {      // JSR
+        enter_context(p, next);
+    } else if(opcode == 0x60 && opcode_implemented(opcode)) {     // RTS
+        if(p->context > 0) {
+            p->context = p->contexts[p->context].parent;
+        }
+    } else if(next <= start && opcode != 0x00 && opcode != 0x40) {     // BRK and RTI are no loops
+        count_edge(p, start, next);
+    }
+}
+
+
+// Report
+
+uint64_t profile_range_cycles(const profile *p, uint16_t first, uint16_t last) {
+    uint64_t cycles = 0;
+    for(int address = first; address <= last; address++) {
+        cycles += p->cycles[address];
+    }
+    return cycles;
+}
+
+static int compare_edges(const void *a, const void *b) {
+    uint64_t first = ((const profile_edge *) a)->count, second = ((const profile_edge *) b)->count;
+    return first < second ? 1 : first > second ? -1 : 0;  // most frequent first
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total ? 100.0 * part / total : 0;
+}
+
+void profile_report(const profile *p, FILE *file, int count) {
+    fprintf(file, "Profile: %llu instructions, %llu cycles\n\n", (unsigned long long) p->instructions,
+            (unsigned long long) p->total_cycles);
+
+    int top[count > 0 ? count : 1], found = 0;              // hottest addresses by cycles, by insertion
+    for(int address = 0; address < MEMORY_SIZE && count > 0; address++) {
+        if(p->cycles[address] == 0 || (found == count && p->cycles[address] <= p->cycles[top[found - 1]])) {
+            continue;
+        }
+        int i = found < count ? found++ : count - 1;
+        while(i > 0 && p->cycles[top[i - 1]] < p->cycles[address]) {
+            top[i] = top[i - 1];
+            i--;
+        }
+        top[i] = address;
+    }
+    fprintf(file, "Hottest addresses:\n");
+    for(int i = 0; i < found; i++) {
+        fprintf(file, "  $%04X  %12llu instructions  %12llu cycles  %5.1f %%\n", top[i], (unsigned long long) p->hits[top[i]],
+                (unsigned long long) p->cycles[top[i]], percent(p->cycles[top[i]], p->total_cycles));
+    }
+
+    profile_edge edges[PROFILE_EDGES];
+    int edge_count = 0;
+    for(int i = 0; i < PROFILE_EDGES; i++) {
+        if(p->edges[i].count) {
+            edges[edge_count++] = p->edges[i];
+        }
+    }
+    qsort(edges, edge_count, sizeof(profile_edge), compare_edges);
+    fprintf(file, "\nLoops (back-edges):%s\n", edge_count ? "" : " none");
+    for(int i = 0; i < edge_count && i < count; i++) {
+        fprintf(file, "  $%04X -> $%04X  %12llu times\n", edges[i].from, edges[i].to, (unsigned long long) edges[i].count);
+    }
+    if(p->lost_edges) {
+        fprintf(file, "  (%d back-edges not recorded)\n", p->lost_edges);
+    }
+
+    uint64_t modes[MODE_RELATIVE + 1] = {0};
+    fprintf(file, "\nOpcodes:\n");
+    for(int opcode = 0; opcode < 256; opcode++) {
+        if(p->opcodes[opcode]) {
+            fprintf(file, "  $%02X %s  %12llu  %5.1f %%\n", opcode, opcode_table[opcode].mnemonic,
+                    (unsigned long long) p->opcodes[opcode], percent(p->opcodes[opcode], p->instructions));
+            modes[opcode_table[opcode].mode] += p->opcodes[opcode];
+        }
+    }
+    fprintf(file, "\nAddressing modes:\n");
+    for(int mode = 0; mode <= MODE_RELATIVE; mode++) {
+        if(modes[mode]) {
+            fprintf(file, "  %-12s  %12llu  %5.1f %%\n", mode_names[mode], (unsigned long long) modes[mode],
+                    percent(modes[mode], p->instructions));
+        }
+    }
+
+    fprintf(file, "\nCycles per address range:\n");
+    for(int first = 0; first < MEMORY_SIZE; first += PROFILE_BLOCK) {
+        uint64_t cycles = profile_range_cycles(p, first, first + PROFILE_BLOCK - 1);
+        if(cycles) {
+            fprintf(file, "  $%04X-$%04X  %12llu cycles  %5.1f %%\n", first, first + PROFILE_BLOCK - 1,
+                    (unsigned long long) cycles, percent(cycles, p->total_cycles));
+        }
+    }
+    if(p->lost_contexts) {
+        fprintf(file, "\n%d subroutine calls not recorded, cycles counted for the caller\n", p->lost_contexts);
+    }
+    fprintf(file, "\n");
+}
+
+
+// Collapsed stacks, one line per calling context: "root;$C000;$C123 cycles"
+
+bool profile_write_folded(const profile *p, const char *filename) {
+    FILE *file = fopen(filename, "w");
+    if(!file) {
+        printf("Unable to write %s.\n", filename);
+        return false;
+    }
+    int path[PROFILE_CONTEXTS];
+    for(int context = 0; context < p->context_count; context++) {
+        if(p->contexts[context].cycles == 0) {
+            continue;
+        }
+        int depth = 0;
+        for(int c = context; c > 0; c = p->contexts[c].parent) {
+            path[depth++] = c;
+        }
+        fprintf(file, "root");
+        while(depth > 0) {
+            fprintf(file, ";$%04X", p->contexts[path[--depth]].function);
+        }
+        fprintf(file, " %llu\n", (unsigned long long) p->contexts[context].cycles);
+    }
+    bool written = !ferror(file);
+    if(fclose(file) || !written) {
+        printf("Unable to write %s.\n", filename);
+        return false;
+    }
+    return true;
+}
+
+
+// Self-check (./6502 -c): a subroutine and an interrupt handler, run by run(), then the back-edges of the branches
+// the core does not have yet, fed to profile_instruction() as run() would. The JSR gets its context, the RTI from the
+// handler at $0300 back to $0205 is not a loop, and neither is the fall-through from $FFFF to $0000.
+
+static const uint8_t check_code[] = {
+    0x20, 0x10, 0x02,                                       // $0200 JSR $0210
+    0x00, 0x00,                                             // $0203 BRK      to $0300, which returns to $0205
+    0x00                                                    // $0205 BRK
+};
+static const uint8_t check_subroutine[] = {0xA9, 0x01, 0x60};              // $0210 LDA #$01, RTS
+static const uint8_t check_handler[] = {0x40};                              // $0300 RTI
+
+bool check_profile(void) {
+    machine *m = create_machine();
+    profile *p = create_profile();
+    char filename[] = "/tmp/6502-profile-XXXXXX";
+    int file = mkstemp(filename), failures = 0;
+    if(!m || !p || file < 0 || !load_image(m, check_code, sizeof(check_code), 0x0200)
+       || !load_image(m, check_subroutine, sizeof(check_subroutine), 0x0210)
+       || !load_image(m, check_handler, sizeof(check_handler), 0x0300)) {
+        printf("Profiler: unable to set up the check\n");
+        failures++;
+    } else {
+        m->memory[0xFFFE] = 0x00;
+        m->memory[0xFFFF] = 0x03;
+        m->cpu.PC = 0x0200;
+        run_budget budget = {0};
+        budget.instructions = 20;
+        budget.profile = p;
+        run_machine(m, budget);                             // up to the first BRK
+        run_machine(m, budget);                             // RTI, then the second one
+        profile_instruction(p, 0xD0, 0x0235, 0x0230, 3);    // BNE back
+        profile_instruction(p, 0x4C, 0x0240, 0x0240, 3);    // JMP * (a trap)
+        profile_instruction(p, 0x18, 0xFFFF, 0x0000, 2);    // CLC at the end of memory
+
+        int edges = 0, subroutine = 0;
+        for(int i = 0; i < PROFILE_EDGES; i++) {
+            const profile_edge *edge = &p->edges[i];
+            if(edge->count) {
+                bool expected = edge->count == 1 && ((edge->from == 0x0235 && edge->to == 0x0230)
+                                                     || (edge->from == 0x0240 && edge->to == 0x0240));
+                if(!expected) {
+                    printf("Profiler: loop $%04X -> $%04X counted %llu times\n", edge->from, edge->to,
+                           (unsigned long long) edge->count);
+                    failures++;
+                }
+                edges++;
+            }
+        }
+        for(int i = 1; i < p->context_count; i++) {
+            if(p->contexts[i].function == 0x0210 && p->contexts[i].parent == 0 && p->contexts[i].cycles) {
+                subroutine = i;
+            }
+        }
+        if(edges != 2 || !subroutine || p->context != 0) {
+            printf("Profiler: %d loops (expected: 2), %s context for $0210, %s the root at the end\n", edges,
+                   subroutine ? "a" : "no", p->context ? "not back in" : "back in");
+            failures++;
+        }
+        failures += !profile_write_folded(p, filename);
+    }
+    if(file >= 0) {
+        close(file);
+        remove(filename);
+    }
+    destroy_profile(p);
+    destroy_machine(m);
+    printf("Profiler: back-edges, a subroutine context and an interrupt handler, %d failed\n", failures);
+    return failures == 0;
+}
@@ -0,0 +1,690 @@
+// RECORD AND REPLAY FOR THE SIMPLE 6502 EMULATOR
+//
+// The core is deterministic: given the same machine state, it executes the same instructions in the same cycles. The
+// only things that come from outside are values read from attached devices (keyboards, joysticks, anything that
+// talks to the host), interrupts raised by them, and bytes the host writes into memory (e.g. keys typed into the
+// keyboard buffer). A recording logs just these, each entry with the cycle it happened at, and a replay feeds them
+// back at exactly the same cycles, so it runs through the same states as the recorded run, however long it was.
+//
+// Log format: one varint (7 bits per byte, low bits first) per entry with the cycles since the previous entry
+// shifted left by three, LOG_ACCESS and the entry type in the low three bits, followed by the payload:
+//   LOG_READ   value read from a device                1 byte
+//   LOG_IRQ    IRQ lines after set_irq()               1 byte
+//   LOG_NMI    trigger_nmi()                           -
+//   LOG_INPUT  address (low byte first) and value      3 bytes
+// Device reads up to 2,000 cycles apart cost three bytes, so a recording can be left on all the time.
+//
+// During a replay, device reads are answered from the log without calling the device, and interrupts and inputs of
+// the running devices are ignored: the log applies them itself. Most interrupts are raised between instructions, by
+// events; these are applied by an event at the recorded cycle (events.c). Devices also raise and acknowledge
+// interrupts while one of their registers is read or written, in the middle of an instruction, which the cycle alone
+// cannot tell from the boundary before it. Such entries are marked with LOG_ACCESS and applied at the next device
+// access of the same cycle. As all device state that matters for the CPU comes from the log, devices need not be
+// part of snapshots.
+//
+// Keyframes: every keyframe_interval cycles, an event takes a snapshot together with the log position, while
+// recording and while replaying (for parts of the log not covered yet). seek_replay() restores the last keyframe
+// before the target and replays only the rest. Snapshots share unchanged pages, so a keyframe costs little more
+// than the pages written since the previous one.
+//
+// File format: 8 byte signature "6502REC1", the cycle count at the end of the recording, the keyframe interval and
+// the log size (uint64_t each), the initial machine state (CPU6502, profile, RAM and I/O pages), then the log; all in
+// native byte order. Keyframes are not saved: a loaded recording builds them again during its first replay. ROMs and
+// devices have to be set up as when recording.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>                                         // for close() in check_replay()
+
+#include "6502.h"
+
+#define RECORDING_SIGNATURE "6502REC1"
+
+enum { LOG_READ, LOG_IRQ, LOG_NMI, LOG_INPUT };
+
+#define LOG_ACCESS 4                                        // logged during a device access
+
+typedef struct {
+    uint64_t cycle;
+    uint8_t type;
+    bool access;                                            // LOG_ACCESS
+    uint8_t value;                                          // LOG_READ, LOG_IRQ, LOG_INPUT
+    uint16_t address;                                       // LOG_INPUT
+} log_entry;
+
+typedef struct {
+    snapshot *state;
+    size_t position;                                        // log position of the next entry
+    uint64_t cycle;                                         // cycle of the entry before it (base of the next delta)
+} keyframe;
+
+typedef struct {                                            // machine state at the start of the recording
+    CPU6502 cpu;
+    uint32_t profile;                                       // machine_profile
+    uint8_t pages[SNAPSHOT_PAGES][PAGE_SIZE];               // RAM, then the I/O registers
+} recorded_state;
+
+struct recording {
+    machine *machine;                                       // recording or replaying on this machine, NULL: neither
+    bool replaying;
+    bool diverged;                                          // the replay has left the recorded path
+    bool in_access;                                         // recording: a device is being read or written
+    bool scheduled;                                         // replaying: replay_event() is pending
+    recorded_state *initial;
+    uint8_t *log;
+    size_t size, capacity;
+    size_t position;                                        // replay: next entry, recording: equals size
+    uint64_t cycle;                                         // cycle of the last entry written or read
+    uint64_t end_cycle;                                     // cycle count at the end of the recording
+    uint64_t entries;                                       // entries written (or read when loaded)
+    uint64_t keyframe_interval;                             // 0: no keyframes apart from the initial one
+    keyframe *keyframes;                                    // ordered by cycle, keyframes[0] is the start
+    int keyframe_count, keyframe_capacity;
+};
+
+static void replay_event(void *device, uint64_t cycle);
+static void keyframe_event(void *device, uint64_t cycle);
+
+
+// Log encoding
+
+static bool append(recording *r, const uint8_t *bytes, size_t size) {
+    if(r->size + size > r->capacity) {
+        size_t capacity = r->capacity ? 2 * r->capacity : 65536;
+        uint8_t *log = realloc(r->log, capacity);
+        if(!log) {
+            printf("Memory allocation failed, recording stopped.\n");
+            stop_recording(r->machine);
+            return false;
+        }
+        r->log = log;
+        r->capacity = capacity;
+    }
+    memcpy(r->log + r->size, bytes, size);
+    r->size += size;
+    r->position = r->size;
+    return true;
+}
+
+static void write_entry(recording *r, uint8_t type, const uint8_t *payload, size_t payload_size) {
+    uint8_t bytes[16];
+    size_t size = 0;
+    uint64_t cycle = r->machine->cpu.cycles;
+    uint64_t header = (cycle - r->cycle) << 3 | (r->in_access ? LOG_ACCESS : 0) | type;
+
+    do {
+        bytes[size++] = (header & 0x7F) | (header > 0x7F ? 0x80 : 0);
+        header >>= 7;
+    } while(header);
+    memcpy(bytes + size, payload, payload_size);
+    if(append(r, bytes, size + payload_size)) {
+        r->cycle = cycle;
+        r->entries++;
+    }
+}
+
+static size_t read_entry(const recording *r, size_t position, uint64_t cycle, log_entry *entry) {
+    const uint8_t *bytes = r->log + position, *end = r->log + r->size;  // cycle: of the entry before
+    uint64_t header = 0;
+    int shift = 0;
+
+    do {
+        if(bytes == end || shift > 63) {
+            return 0;
+        }
+        header |= (uint64_t) (*bytes & 0x7F) << shift;
+        shift += 7;
+    } while(*bytes++ & 0x80);
+    entry->cycle = cycle + (header >> 3);
+    entry->type = header & 3;
+    entry->access = header & LOG_ACCESS;
+    size_t payload = entry->type == LOG_INPUT ? 3 : entry->type == LOG_NMI ? 0 : 1;
+    if((size_t) (end - bytes) < payload) {
+        return 0;
+    }
+    entry->value = entry->type == LOG_INPUT ? bytes[2] : payload ? bytes[0] : 0;
+    entry->address = entry->type == LOG_INPUT ? bytes[0] | (bytes[1] << 8) : 0;
+    return bytes + payload - (r->log + position);       // its size, 0 at the end of the log
+}
+
+static void skip_entry(recording *r, const log_entry *entry, size_t size) {
+    r->position += size;
+    r->cycle = entry->cycle;
+}
+
+
+// Keyframes
+
+static bool add_keyframe(recording *r) {
+    if(r->keyframe_count == r->keyframe_capacity) {
+        int capacity = r->keyframe_capacity ? 2 * r->keyframe_capacity : 64;
+        keyframe *keyframes = realloc(r->keyframes, capacity * sizeof(keyframe));
+        if(!keyframes) {
+            printf("Memory allocation failed.\n");
+            return false;
+        }
+        r->keyframes = keyframes;
+        r->keyframe_capacity = capacity;
+    }
+    snapshot *s = take_snapshot(r->machine);
+    if(!s) {
+        return false;
+    }
+    r->keyframes[r->keyframe_count++] = (keyframe) {s, r->position, r->cycle};
+    return true;
+}
+
+static void schedule_keyframe(recording *r) {               // at the next multiple of the interval after the start
+    if(r->keyframe_interval) {
+        uint64_t start = r->initial->cpu.cycles;
+        uint64_t passed = r->machine->cpu.cycles - start;
+        uint64_t next = start + (passed / r->keyframe_interval + 1) * r->keyframe_interval;
+        schedule_event(r->machine, next, keyframe_event, r);
+    }
+}
+
+static void keyframe_event(void *device, uint64_t cycle) {
+    recording *r = device;
+    (void) cycle;
+    if(r->machine->cpu.cycles > r->keyframes[r->keyframe_count - 1].state->cpu.cycles) {   // not covered yet
+        add_keyframe(r);
+    }
+    schedule_keyframe(r);
+}
+
+
+// Recording: the machine logs every input from now on. The recording starts with the current machine state.
+
+recording* start_recording(machine *m, uint64_t keyframe_interval) {
+    recording *r = calloc(1, sizeof(recording));
+    if(!r || !(r->initial = malloc(sizeof(recorded_state)))) {
+        printf("Memory allocation failed.\n");
+        free(r);
+        return NULL;
+    }
+    if(m->recording) {
+        stop_recording(m);
+    }
+    r->machine = m;
+    r->keyframe_interval = keyframe_interval;
+    r->cycle = m->cpu.cycles;
+    if(!add_keyframe(r)) {
+        destroy_recording(r);
+        return NULL;
+    }
+    snapshot *s = r->keyframes[0].state;                    // the initial state, as saved with the log
+    r->initial->cpu = s->cpu;
+    r->initial->profile = s->profile;
+    for(int page = 0; page < SNAPSHOT_PAGES; page++) {
+        memcpy(r->initial->pages[page], s->pages[page]->bytes, PAGE_SIZE);
+    }
+    m->recording = r;
+    schedule_keyframe(r);
+    return r;
+}
+
+void stop_recording(machine *m) {                           // ends a recording or a replay of the machine
+    recording *r = m ? m->recording : NULL;
+    if(!r) {
+        return;
+    }
+    if(!r->replaying) {
+        r->end_cycle = m->cpu.cycles;
+    }
+    cancel_events(m, r);
+    m->recording = NULL;
+    r->machine = NULL;
+    r->replaying = false;
+}
+
+
+// Replay: entries are applied when they are due -- device reads and LOG_ACCESS entries at the device accesses of
+// their cycle, all others by replay_event() at the first instruction boundary at or after their cycle
+
+static void apply_entries(recording *r, bool access) {      // access: at a device access, else between instructions
+    machine *m = r->machine;
+    log_entry entry;
+    size_t size;
+
+    while(!r->diverged && (size = read_entry(r, r->position, r->cycle, &entry)) && entry.type != LOG_READ) {
+        if(access ? !entry.access || entry.cycle != m->cpu.cycles
+                  : entry.cycle > m->cpu.cycles || (entry.access && entry.cycle == m->cpu.cycles)) {
+            return;                                         // not yet
+        }
+        skip_entry(r, &entry, size);
+        switch(entry.type) {
+            case LOG_IRQ:   m->cpu.irq = entry.value;                       break;
+            case LOG_NMI:   m->cpu.nmi = true;                              break;
+            default:        bus_write(&m->bus, entry.address, entry.value); break;
+        }
+    }
+}
+
+// The event is always scheduled between two slices of run_machine(), for the next entry after any device reads:
+// an event scheduled during a device read would not shorten the slice that is running.
+
+static void schedule_replay(recording *r) {
+    size_t position = r->position, size;
+    uint64_t cycle = r->cycle;
+    log_entry entry;
+
+    while((size = read_entry(r, position, cycle, &entry)) && entry.type == LOG_READ) {
+        position += size;
+        cycle = entry.cycle;
+    }
+    if(size && !r->scheduled && !r->diverged) {             // LOG_ACCESS entries: late, if no access has taken them
+        r->scheduled = schedule_event(r->machine, entry.cycle + entry.access, replay_event, r);
+    }
+}
+
+static void replay_event(void *device, uint64_t cycle) {
+    recording *r = device;
+    log_entry entry;
+    (void) cycle;
+
+    r->scheduled = false;
+    apply_entries(r, false);
+    if(read_entry(r, r->position, r->cycle, &entry) && entry.type == LOG_READ && entry.cycle < r->machine->cpu.cycles) {
+        printf("Replay diverged at cycle %llu (read at %llu missing).\n", (unsigned long long) r->machine->cpu.cycles,
+               (unsigned long long) entry.cycle);
+        r->diverged = true;
+    }
+    schedule_replay(r);
+}
+
+static void start_at(recording *r, const keyframe *k) {     // the machine is in the state of keyframe k
+    r->position = k->position;
+    r->cycle = k->cycle;
+    r->diverged = false;
+    cancel_events(r->machine, r);
+    r->scheduled = false;
+    schedule_replay(r);
+    schedule_keyframe(r);
+}
+
+
+// Hooks for the bus (io_read(), io_write()) and for the interrupt lines (events.c). While recording, they log the
+// input; while replaying, a device read takes its value from the log, and interrupts from the devices are ignored,
+// as the log applies them itself. After the end of the recording, or once the replay has diverged, the devices take
+// over.
+
+static bool replay_active(const recording *r) {             // up to the end of the recording, not just of the log
+    return r->replaying && !r->diverged && (r->position < r->size || r->machine->cpu.cycles <= r->end_cycle);
+}
+
+uint8_t recorded_read(machine *m, const io_device *device, uint16_t address) {
+    recording *r = m->recording;
+    if(!r->replaying) {
+        r->in_access = true;
+        uint8_t value = device->read(device->device, address);
+        r->in_access = false;
+        write_entry(r, LOG_READ, &value, 1);
+        return value;
+    }
+    if(!replay_active(r)) {
+        return device->read(device->device, address);
+    }
+
+    log_entry entry;
+    apply_entries(r, true);
+    size_t size = read_entry(r, r->position, r->cycle, &entry);
+    if(!size || entry.type != LOG_READ || entry.cycle != m->cpu.cycles) {
+        printf("Replay diverged at cycle %llu (read of %04X).\n", (unsigned long long) m->cpu.cycles, address);
+        r->diverged = true;
+        return device->read(device->device, address);
+    }
+    skip_entry(r, &entry, size);
+    return entry.value;
+}
+
+void recorded_write(machine *m, const io_device *device, uint16_t address, uint8_t value) {
+    recording *r = m->recording;
+    r->in_access = !r->replaying;
+    device->write(device->device, address, value);          // devices still see all writes during a replay
+    r->in_access = false;
+    if(replay_active(r)) {
+        apply_entries(r, true);
+    }
+}
+
+bool recorded_interrupt(machine *m, uint8_t irq, bool nmi) {
+    recording *r = m->recording;
+    if(r->replaying) {
+        return !replay_active(r);
+    }
+    if(nmi) {
+        write_entry(r, LOG_NMI, NULL, 0);
+    } else {
+        write_entry(r, LOG_IRQ, &irq, 1);
+    }
+    return true;
+}
+
+void write_input(machine *m, uint16_t address, uint8_t value) {    // a byte from the host, e.g. a key in a buffer
+    recording *r = m->recording;
+    if(r && replay_active(r)) {
+        return;
+    }
+    if(r && !r->replaying) {
+        uint8_t payload[3] = {address & 0xFF, address >> 8, value};
+        write_entry(r, LOG_INPUT, payload, 3);
+    }
+    bus_write(&m->bus, address, value);
+}
+
+
+// Starting a replay, and jumping around in it
+
+bool start_replay(machine *m, recording *r) {               // ROMs and devices must be set up as for the recording
+    if(r->machine) {
+        stop_recording(r->machine);
+    }
+    if(m->recording) {
+        stop_recording(m);
+    }
+    if(m->profile != (machine_profile) r->initial->profile) {
+        set_machine_profile(m, r->initial->profile);
+    }
+    r->machine = m;
+    r->replaying = true;
+    m->recording = r;
+    if(r->keyframe_count) {
+        if(!restore_snapshot(m, r->keyframes[0].state)) {
+            stop_recording(m);
+            return false;
+        }
+    } else {                                                // loaded from a file: no keyframes yet
+        mark_all_dirty(m);
+        for(int page = 0; page < SNAPSHOT_PAGES; page++) {
+            memcpy(page < BUS_PAGES ? m->memory + page * PAGE_SIZE : m->io + (page - BUS_PAGES) * PAGE_SIZE,
+                   r->initial->pages[page], PAGE_SIZE);
+        }
+        m->cpu = r->initial->cpu;
+        r->position = 0;
+        r->cycle = m->cpu.cycles;
+        if(!add_keyframe(r)) {
+            stop_recording(m);
+            return false;
+        }
+    }
+    start_at(r, &r->keyframes[0]);
+    return true;
+}
+
+bool seek_replay(machine *m, uint64_t cycle) {              // stops at the first instruction boundary >= cycle
+    recording *r = m->recording;
+    if(!r || !r->replaying) {
+        printf("The machine is not replaying a recording.\n");
+        return false;
+    }
+    int first = 0, last = r->keyframe_count - 1;            // the last keyframe at or before cycle
+    while(first < last) {
+        int middle = (first + last + 1) / 2;
+        if(r->keyframes[middle].state->cpu.cycles <= cycle) {
+            first = middle;
+        } else {
+            last = middle - 1;
+        }
+    }
+    if(cycle < m->cpu.cycles || r->keyframes[first].state->cpu.cycles > m->cpu.cycles) {
+        if(!restore_snapshot(m, r->keyframes[first].state)) {
+            return false;
+        }
+        start_at(r, &r->keyframes[first]);
+    }
+    while(cycle > m->cpu.cycles) {                          // BRK stops a run, but does not change the path
+        run_budget budget = {0};
+        budget.cycles = cycle - m->cpu.cycles;
+        if(!run_machine(m, budget).cycles) {
+            break;
+        }
+    }
+    dispatch_events(m);                                     // with the inputs logged at that very cycle
+    return !r->diverged;
+}
+
+bool replay_diverged(const recording *r) {
+    return r->diverged;
+}
+
+
+// Files
+
+bool save_recording(recording *r, const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if(!file) {
+        printf("Unable to open recording file %s.\n", filename);
+        return false;
+    }
+    uint64_t end_cycle = r->machine && !r->replaying ? r->machine->cpu.cycles : r->end_cycle;
+    uint64_t size = r->size;
+    bool written = fwrite(RECORDING_SIGNATURE, 1, 8, file) == 8 && fwrite(&end_cycle, 8, 1, file) == 1
+                   && fwrite(&r->keyframe_interval, 8, 1, file) == 1 && fwrite(&size, 8, 1, file) == 1
+                   && fwrite(r->initial, sizeof(recorded_state), 1, file) == 1
+                   && fwrite(r->log, 1, r->size, file) == r->size;
+    if(fclose(file) || !written) {
+        printf("Unable to write recording file %s.\n", filename);
+        return false;
+    }
+    return true;
+}
+
+recording* load_recording(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    char signature[8];
+    uint64_t size;
+    if(!file) {
+        printf("Unable to open recording file %s.\n", filename);
+        return NULL;
+    }
+    recording *r = calloc(1, sizeof(recording));
+    if(!r || !(r->initial = malloc(sizeof(recorded_state)))) {
+        printf("Memory allocation failed.\n");
+        free(r);
+        fclose(file);
+        return NULL;
+    }
+    if(fread(signature, 1, 8, file) != 8 || memcmp(signature, RECORDING_SIGNATURE, 8)
+       || fread(&r->end_cycle, 8, 1, file) != 1 || fread(&r->keyframe_interval, 8, 1, file) != 1
+       || fread(&size, 8, 1, file) != 1
+       || fread(r->initial, sizeof(recorded_state), 1, file) != 1 || r->initial->profile > PROFILE_C16
+       || !(r->log = malloc(size ? size : 1)) || fread(r->log, 1, size, file) != size) {
+        printf("%s is not a recording file.\n", filename);
+        destroy_recording(r);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    r->size = r->capacity = size;
+    r->cycle = r->initial->cpu.cycles;
+    log_entry entry;
+    size_t entry_size;
+    while((entry_size = read_entry(r, r->position, r->cycle, &entry))) {    // count the entries, check the log
+        skip_entry(r, &entry, entry_size);
+        r->entries++;
+    }
+    if(r->position != r->size) {
+        printf("Recording %s is cut off after %llu entries.\n", filename, (unsigned long long) r->entries);
+    }
+    r->position = 0;
+    r->cycle = r->initial->cpu.cycles;
+    return r;
+}
+
+void destroy_recording(recording *r) {
+    if(!r) {
+        return;
+    }
+    if(r->machine) {
+        stop_recording(r->machine);
+    }
+    for(int i = 0; i < r->keyframe_count; i++) {
+        release_snapshot(r->keyframes[i].state);
+    }
+    free(r->keyframes);
+    free(r->log);
+    free(r->initial);
+    free(r);
+}
+
+void show_recording_summary(const recording *r) {
+    uint64_t end_cycle = r->machine && !r->replaying ? r->machine->cpu.cycles : r->end_cycle;
+    uint64_t cycles = end_cycle - r->initial->cpu.cycles;
+    printf("Recording of %llu cycles (%.1f s at 1 MHz): %llu entries in %zu bytes (%.2f bytes per entry), "
+           "%d keyframes\n", (unsigned long long) cycles, (double) cycles / CLOCK_SPEED,
+           (unsigned long long) r->entries, r->size, r->entries ? (double) r->size / r->entries : 0.0, r->keyframe_count);
+}
+
+
+// Self-check (./6502 -c): records a program that reads a device returning host random numbers, takes the IRQs of a
+// timer that it acknowledges by reading a device register, and gets bytes from the host with write_input(). The
+// recording is saved, loaded and replayed on a second machine, which has to reach the same state at the end; then
+// seek_replay() goes back to a cycle in the middle and forward to the end again, with the same states as recorded.
+
+#define CHECK_DEVICE 0xD000                                 // $D000: random number, $D001: acknowledge the IRQ
+#define CHECK_PERIOD 997                                    // cycles between timer IRQs
+#define CHECK_SLICE 50000                                   // cycles between inputs from the host
+#define CHECK_SLICES 40
+
+typedef struct {
+    machine *m;
+    uint32_t random;                                        // not part of the machine: differs in every run
+    uint64_t period;
+} check_device;
+
+static uint8_t check_device_read(void *device, uint16_t address) {
+    check_device *d = device;
+    if(address == CHECK_DEVICE + 1) {
+        set_irq(d->m, 1, false);
+        return (uint8_t) d->m->cpu.cycles;
+    }
+    d->random = d->random * 1103515245u + 12345u;
+    return (uint8_t) (d->random >> 16);
+}
+
+static void check_device_event(void *device, uint64_t cycle) {
+    check_device *d = device;
+    set_irq(d->m, 1, true);
+    schedule_event(d->m, cycle + d->period, check_device_event, d);
+}
+
+static machine* check_machine(check_device *d, uint32_t seed) {
+    static const uint8_t program[] = {
+        0xAD, 0x00, 0xD0,                                   // $0200  LDA $D000
+        0x65, 0x10,                                         //        ADC $10
+        0x85, 0x10,                                         //        STA $10
+        0x65, 0x30,                                         //        ADC $30      (written by the host)
+        0x85, 0x11,                                         //        STA $11
+        0xAC, 0x00, 0xD0,                                   //        LDY $D000
+        0x99, 0x00, 0x03,                                   //        STA $0300,Y
+        0x58,                                               //        CLI
+        0x20, 0x00, 0x02,                                   //        JSR $0200    (the stack wraps around)
+        0x48,                                               // $0215  PHA          (IRQ)
+        0xAD, 0x01, 0xD0,                                   //        LDA $D001
+        0x65, 0x12,                                         //        ADC $12
+        0x85, 0x12,                                         //        STA $12
+        0x68,                                               //        PLA
+        0x40                                                //        RTI
+    };
+    machine *m = create_machine();
+    if(!m) {
+        return NULL;
+    }
+    *d = (check_device) {m, seed, CHECK_PERIOD};
+    load_image(m, program, sizeof(program), 0x0200);
+    set_reset_vector(m->memory, 0x0200);
+    m->memory[0xFFFE] = 0x15;
+    m->memory[0xFFFF] = 0x02;
+    reset_cpu_from_vector(&m->cpu, &m->bus);
+    if(!attach_device(m, CHECK_DEVICE, CHECK_DEVICE + 1, check_device_read, NULL, d)
+       || !schedule_event(m, CHECK_PERIOD, check_device_event, d)) {
+        destroy_machine(m);
+        return NULL;
+    }
+    return m;
+}
+
+typedef struct {
+    CPU6502 cpu;
+    uint8_t status;
+    uint8_t memory[MEMORY_SIZE];
+} check_state;
+
+static void keep_state(const machine *m, check_state *state) {
+    state->cpu = m->cpu;
+    state->status = get_status(&m->cpu);
+    memcpy(state->memory, m->memory, MEMORY_SIZE);
+}
+
+static bool same_state(const machine *m, const check_state *state, const char *when) {
+    const CPU6502 *cpu = &m->cpu;
+    bool same = cpu->A == state->cpu.A && cpu->X == state->cpu.X && cpu->Y == state->cpu.Y
+                && cpu->SP == state->cpu.SP && cpu->PC == state->cpu.PC && cpu->cycles == state->cpu.cycles
+                && get_status(cpu) == state->status && !memcmp(m->memory, state->memory, MEMORY_SIZE);
+    if(!same) {
+        printf("Replay: state %s differs: cycle %llu, PC %04X (recorded: cycle %llu, PC %04X)\n", when,
+               (unsigned long long) cpu->cycles, cpu->PC, (unsigned long long) state->cpu.cycles, state->cpu.PC);
+    }
+    return same;
+}
+
+bool check_replay(void) {
+    check_state *states = malloc(2 * sizeof(check_state));     // in the middle and at the end of the recording
+    check_device devices[2];
+    machine *m = check_machine(&devices[0], 1), *replay = check_machine(&devices[1], 2);
+    recording *r = m ? start_recording(m, CHECK_SLICE * 3) : NULL;
+    char filename[] = "/tmp/6502-recording-XXXXXX";
+    int file = mkstemp(filename);
+    bool passed = states && replay && r && file >= 0;
+    if(file >= 0) {
+        close(file);
+    }
+
+    uint32_t random = 3;
+    for(int slice = 0; passed && slice < CHECK_SLICES; slice++) {
+        run_budget budget = {0};
+        budget.cycles = CHECK_SLICE;
+        run_machine(m, budget);
+        random = random * 1103515245u + 12345u;
+        write_input(m, 0x0030, (uint8_t) (random >> 16));
+        if(slice == CHECK_SLICES / 2) {
+            keep_state(m, &states[0]);
+        }
+    }
+    uint64_t entries = r ? r->entries : 0;
+    if(passed) {
+        keep_state(m, &states[1]);
+        stop_recording(m);
+        for(int i = 0; i < m->event_count; i++) {           // destroy_recording() would leave them dangling
+            passed &= m->events[i].device != r;
+        }
+        if(!passed) {
+            printf("Replay: events of the recording left after stop_recording()\n");
+        }
+        passed &= save_recording(r, filename);
+    }
+    destroy_recording(r);
+    r = passed ? load_recording(filename) : NULL;
+    passed = r && start_replay(replay, r);
+
+    if(passed) {                                            // the whole recording, then back and forth
+        run_budget budget = {0};
+        budget.cycles = states[1].cpu.cycles - replay->cpu.cycles;
+        run_machine(replay, budget);
+        passed = same_state(replay, &states[1], "at the end");
+        passed &= seek_replay(replay, states[0].cpu.cycles) && same_state(replay, &states[0], "after seeking back");
+        passed &= seek_replay(replay, states[1].cpu.cycles) && same_state(replay, &states[1], "after seeking forward");
+        passed &= !replay_diverged(r);
+    }
+    if(r) {
+        show_recording_summary(r);
+    }
+    printf("Replay: %llu entries recorded, replayed and sought %s\n", (unsigned long long) entries,
+           passed ? "with the same states" : "FAILED");
+    destroy_machine(replay);
+    destroy_recording(r);
+    destroy_machine(m);
+    remove(filename);
+    free(states);
+    return passed;
+}
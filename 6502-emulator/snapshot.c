@@ -0,0 +1,338 @@
+// SNAPSHOTS FOR THE SIMPLE 6502 EMULATOR
+//
+// Checkpoints of whole machines for rewinding, bisecting failures, and forking runs from a common state, cheap enough
+// to take one every frame.
+//
+// Dirty tracking: after a snapshot, every RAM page is watched (see watch_page() in bus.c) -- its write pointer is taken
+// out of the page table, so the first write to the page takes the slow path, which marks the page dirty and puts the
+// pointer back. Each page costs one slow write per snapshot, all other accesses run at full speed. Writes to I/O
+// pages always take the slow path, which marks them dirty as well (see io_write() in bus.c).
+//
+// A snapshot holds one pointer per page. Pages are reference counted: the next snapshot copies only the dirty pages
+// and shares all others with the previous one, so memory grows with the pages a program actually writes. Restoring
+// copies back only the pages that are dirty or differ between the snapshot and the one the machine is based on.
+//
+// A forked machine does not copy RAM at all: its page table reads straight from the snapshot's pages (copy-on-write),
+// and the first write to a page copies it into the machine's own memory (unshare_page()). Pages of RAM
+// below ROM or I/O are copied at once, as the bus does not read them directly. machine.memory of a forked machine is
+// only up to date for the pages it owns; mark_all_dirty() brings it up to date completely.
+//
+// Reference counts are atomic, so snapshots and forked machines can be used from different threads; a single machine
+// and its snapshot calls must stay in one thread.
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "6502.h"
+
+static void set_base(machine *m, snapshot *s);
+
+static inline bool is_dirty(const machine *m, int page) {
+    return (m->dirty[page >> 6] >> (page & 63)) & 1;
+}
+
+static inline uint8_t* page_bytes(machine *m, int page) {   // RAM pages first, then the I/O pages
+    return page < BUS_PAGES ? m->memory + page * PAGE_SIZE : m->io + (page - BUS_PAGES) * PAGE_SIZE;
+}
+
+static inline bool is_ram_page(const machine *m, int page) {
+    return m->bus.read[page] == m->memory + page * PAGE_SIZE && m->bus.write[page] == m->memory + page * PAGE_SIZE;
+}
+
+static void release_page(snapshot_page *page) {
+    if(page && atomic_fetch_sub(&page->references, 1) == 1) {
+        free(page);
+    }
+}
+
+
+// Stores the machine state. The first snapshot of a machine copies all pages, later ones only the dirty pages.
+
+snapshot* take_snapshot(machine *m) {
+    snapshot *s = calloc(1, sizeof(snapshot));
+    if(!s) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    atomic_init(&s->references, 1);
+    s->cpu = m->cpu;
+    s->profile = m->profile;
+
+    for(int page = 0; page < SNAPSHOT_PAGES; page++) {
+        if(m->base && !is_dirty(m, page)) {                 // unchanged: share with the previous snapshot
+            s->pages[page] = m->base->pages[page];
+            atomic_fetch_add(&s->pages[page]->references, 1);
+            continue;
+        }
+        s->pages[page] = malloc(sizeof(snapshot_page));
+        if(!s->pages[page]) {
+            printf("Memory allocation failed.\n");
+            release_snapshot(s);
+            return NULL;
+        }
+        atomic_init(&s->pages[page]->references, 1);
+        memcpy(s->pages[page]->bytes, page_bytes(m, page), PAGE_SIZE);
+        s->stored_pages++;
+    }
+    set_base(m, s);
+    return s;
+}
+
+
+// Sets the machine back to a snapshot (of this machine or of any other one with the same profile)
+
+bool restore_snapshot(machine *m, snapshot *s) {
+    if(s->profile != m->profile) {
+        printf("Snapshot does not match the machine profile.\n");
+        return false;
+    }
+    for(int page = 0; page < SNAPSHOT_PAGES; page++) {
+        snapshot_page *target = s->pages[page];
+        if(m->base && !is_dirty(m, page) && m->base->pages[page] == target) {
+            continue;                                       // already the same
+        }
+        if(page < BUS_PAGES && m->shared[page]) {           // still shared: simply share the other page
+            atomic_fetch_add(&target->references, 1);
+            release_page(m->shared[page]);
+            m->shared[page] = target;
+            m->bus.read[page] = target->bytes;
+        } else {
+            memcpy(page_bytes(m, page), target->bytes, PAGE_SIZE);
+        }
+        if(page < BUS_PAGES) {
+            page_changed(m, page);
+        }
+    }
+    m->cpu = s->cpu;
+    set_base(m, s);
+    return true;
+}
+
+
+// Creates a new machine in the state of a snapshot. RAM pages are shared with the snapshot until they are written.
+
+machine* fork_machine(const machine *parent, snapshot *s) {
+    machine *m = create_machine();
+    if(!m) {
+        return NULL;
+    }
+    set_machine_profile(m, s->profile);
+    if(s->profile != PROFILE_FLAT) {
+        memcpy(m->rom, parent->rom, MEMORY_SIZE);
+    }
+    for(int page = 0; page < SNAPSHOT_PAGES; page++) {
+        snapshot_page *source = s->pages[page];
+        if(page < BUS_PAGES && is_ram_page(m, page)) {
+            atomic_fetch_add(&source->references, 1);
+            m->shared[page] = source;
+            m->bus.read[page] = source->bytes;
+        } else {                                            // RAM below ROM or I/O, I/O registers
+            memcpy(page_bytes(m, page), source->bytes, PAGE_SIZE);
+        }
+    }
+    m->cpu = s->cpu;
+    set_base(m, s);
+    return m;
+}
+
+void retain_snapshot(snapshot *s) {
+    atomic_fetch_add(&s->references, 1);
+}
+
+void release_snapshot(snapshot *s) {
+    if(!s || atomic_fetch_sub(&s->references, 1) != 1) {
+        return;
+    }
+    for(int page = 0; page < SNAPSHOT_PAGES; page++) {
+        release_page(s->pages[page]);
+    }
+    free(s);
+}
+
+
+// For code that writes machine.memory or machine.io without the bus (loaders, reset_machine(), ...): the pages
+// must be stored by the next snapshot, shared pages must be copied first, as they are about to be overwritten,
+// and code decoded from them is out of date.
+
+void mark_dirty(machine *m, uint16_t address, size_t size) {
+    if(size == 0) {
+        return;
+    }
+    size_t last = address + size - 1 < MEMORY_SIZE ? address + size - 1 : MEMORY_SIZE - 1;
+    for(int page = address >> 8; page <= (int) (last >> 8); page++) {
+        page_changed(m, page);
+        if(!m->base) {                                      // no snapshot yet: everything is stored anyway
+            continue;
+        }
+        if(m->shared[page]) {
+            unshare_page(m, page);
+        }
+        unwatch_page(m, page);                              // no need to watch it any longer
+        mark_page_dirty(m, page);
+    }
+}
+
+void mark_all_dirty(machine *m) {
+    mark_dirty(m, 0, MEMORY_SIZE);
+    for(int page = BUS_PAGES; page < SNAPSHOT_PAGES && m->base; page++) {
+        mark_page_dirty(m, page);
+    }
+}
+
+
+// Back to a plain machine: owns all of its memory, no watched pages, no base snapshot
+
+void stop_dirty_tracking(machine *m) {
+    mark_all_dirty(m);
+    if(m->base) {
+        release_snapshot(m->base);
+        m->base = NULL;
+    }
+    memset(m->dirty, 0, sizeof(m->dirty));
+}
+
+
+// The machine's memory now equals snapshot s: nothing is dirty, and all RAM pages are watched for their first write
+
+static void set_base(machine *m, snapshot *s) {
+    retain_snapshot(s);
+    if(m->base) {
+        release_snapshot(m->base);
+    }
+    m->base = s;
+    memset(m->dirty, 0, sizeof(m->dirty));
+    for(int page = 0; page < BUS_PAGES; page++) {
+        watch_page(m, page);                                // I/O pages mark themselves in io_write()
+    }
+}
+
+
+// A page that is still shared gets its own copy before it is written
+
+void unshare_page(machine *m, int page) {
+    memcpy(m->memory + page * PAGE_SIZE, m->shared[page]->bytes, PAGE_SIZE);
+    m->bus.read[page] = m->memory + page * PAGE_SIZE;
+    release_page(m->shared[page]);
+    m->shared[page] = NULL;
+}
+
+
+// Self-check (./6502 -c): random writes through the bus on all three profiles, with snapshots taken, restored and
+// forked at random in between. Every snapshot is kept with a full copy of the state it was taken from as well (CPU,
+// all 64 KB as the CPU reads them, RAM below ROM and I/O, and the I/O registers), and every restore and fork has to
+// give exactly that state again. Forks get the same writes as their parent, after which both must be the same, and
+// restoring the fork must give the snapshot unchanged.
+
+#define CHECK_SNAPSHOTS 40
+#define CHECK_VIEW (2 * MEMORY_SIZE + IO_SIZE)
+
+static void check_view(machine *m, uint8_t *view) {         // the whole state, without the CPU
+    memset(view, 0, CHECK_VIEW);
+    for(int address = 0; address < MEMORY_SIZE; address++) {
+        view[address] = bus_read(&m->bus, address);
+    }
+    for(int page = 0; page < BUS_PAGES; page++) {           // RAM that the CPU does not read: below ROM and I/O
+        if(m->bus.read[page] != m->memory + page * PAGE_SIZE && !m->shared[page]) {
+            memcpy(view + MEMORY_SIZE + page * PAGE_SIZE, m->memory + page * PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+    memcpy(view + 2 * MEMORY_SIZE, m->io, IO_SIZE);
+}
+
+static bool check_state(machine *m, const uint8_t *expected, const CPU6502 *cpu, uint8_t *view, const char *what) {
+    check_view(m, view);
+    bool same = !memcmp(view, expected, CHECK_VIEW) && m->cpu.PC == cpu->PC && m->cpu.A == cpu->A
+                && m->cpu.cycles == cpu->cycles;
+    if(!same) {
+        printf("Snapshots: state after %s differs (profile %d)\n", what, m->profile);
+    }
+    return same;
+}
+
+static void random_writes(machine *m, uint32_t *random) {   // a few pages written often, now and then any address
+    *random = *random * 1103515245u + 12345u;
+    int writes = 1 + (*random >> 16) % 200, pages = 1 + (*random >> 8) % 8;
+    for(int i = 0; i < writes; i++) {
+        *random = *random * 1103515245u + 12345u;
+        int page = (int) ((*random >> 24) % pages) * 31 + 2;  // 2, 33, 64, ...: on all profiles up to ROM and I/O
+        int offset = *random >> 9 & 0xFF;
+        uint16_t address = (*random & 0x100) ? (uint16_t) (*random >> 16) : (uint16_t) (page << 8 | offset);
+        bus_write(&m->bus, address, (uint8_t) (*random >> 12));
+    }
+    m->cpu.PC = (uint16_t) *random;
+    m->cpu.A = (uint8_t) (*random >> 20);
+    m->cpu.cycles += writes;
+}
+
+bool check_snapshots(int steps) {
+    uint8_t *views = malloc((size_t) (CHECK_SNAPSHOTS + 2) * CHECK_VIEW);
+    if(!views) {
+        printf("Memory allocation failed.\n");
+        return false;
+    }
+    uint8_t *view = views + (size_t) CHECK_SNAPSHOTS * CHECK_VIEW;
+    uint32_t random = 5;
+    int failures = 0, taken = 0;
+    long stored = 0;
+
+    for(int profile = PROFILE_FLAT; profile <= PROFILE_C16; profile++) {
+        snapshot *snapshots[CHECK_SNAPSHOTS] = {NULL};
+        CPU6502 cpus[CHECK_SNAPSHOTS];
+        machine *m = create_machine();
+        if(!m) {
+            free(views);
+            return false;
+        }
+        set_machine_profile(m, profile);
+        for(int address = 0; address < MEMORY_SIZE; address++) {
+            m->rom[address] = (uint8_t) (address * 7 + 1);
+        }
+        for(int step = 0; step < steps && failures < 10; step++) {
+            random = random * 1103515245u + 12345u;
+            int action = (random >> 16) % 8, slot = (random >> 4) % CHECK_SNAPSHOTS;
+            if(action < 4) {                                // write
+                random_writes(m, &random);
+            } else if(action < 6) {                         // snapshot
+                release_snapshot(snapshots[slot]);
+                snapshots[slot] = take_snapshot(m);
+                if(!snapshots[slot]) {
+                    failures++;
+                    break;
+                }
+                cpus[slot] = m->cpu;
+                check_view(m, views + (size_t) slot * CHECK_VIEW);
+                stored += snapshots[slot]->stored_pages;
+                taken++;
+            } else if(action == 6 && snapshots[slot]) {     // restore, and go on from there
+                failures += !restore_snapshot(m, snapshots[slot])
+                            || !check_state(m, views + (size_t) slot * CHECK_VIEW, &cpus[slot], view, "restore");
+            } else if(snapshots[slot]) {                    // fork, the same writes to fork and parent, restore
+                machine *fork = fork_machine(m, snapshots[slot]);
+                if(!fork) {
+                    failures++;
+                    break;
+                }
+                failures += !check_state(fork, views + (size_t) slot * CHECK_VIEW, &cpus[slot], view, "fork");
+                failures += !restore_snapshot(m, snapshots[slot]);
+                uint32_t seed = random;
+                random_writes(fork, &random);
+                random_writes(m, &seed);
+                check_view(m, view + CHECK_VIEW);
+                failures += !check_state(fork, view + CHECK_VIEW, &m->cpu, view, "writes to a fork");
+                failures += !restore_snapshot(fork, snapshots[slot])
+                            || !check_state(fork, views + (size_t) slot * CHECK_VIEW, &cpus[slot], view,
+                                            "restore in a fork");
+                destroy_machine(fork);
+            }
+        }
+        for(int slot = 0; slot < CHECK_SNAPSHOTS; slot++) {
+            release_snapshot(snapshots[slot]);
+        }
+        destroy_machine(m);
+    }
+    printf("Snapshots: %d taken on three profiles, %.1f%% of their pages stored, %d failures\n", taken,
+           taken ? 100.0 * stored / ((double) taken * SNAPSHOT_PAGES) : 0.0, failures);
+    free(views);
+    return failures == 0;
+}
@@ -0,0 +1,515 @@
+// TEST SUITES FOR THE SIMPLE 6502 EMULATOR
+//
+// Runs a whole directory of program images, or the images listed in a manifest, with the batch runner (batch.c) on all
+// cores and decides for each one whether it has passed: by BRK, by a trap at a given address, or by a value in memory,
+// plus any number of expected bytes afterwards. The results can be written as a JSON or CSV report for other tools.
+//
+// A trap is an instruction that jumps to itself: JMP to its own address, or a branch to itself whose condition holds.
+// Functional test programs end in such a loop, at one address when all tests have passed and at another one for each
+// test that has failed. The tests run in slices of SUITE_SLICE cycles, and traps and memory values are checked after
+// each slice, so the cycles reported for them include the rest of the slice spent in the loop.
+//
+// Manifest format: one image per line, file names relative to the manifest, "#" starts a comment. Options:
+//     load=XXXX           load address of raw binaries (default $0200; .prg files bring their own)
+//     start=XXXX          initial PC (default: load address)
+//     cycles=N            cycle budget (default SUITE_CYCLES)
+//     end=brk             passed when the program executes BRK (default)
+//     end=trap:XXXX       passed when the program gets stuck in a trap at XXXX; traps elsewhere fail right away
+//     end=mem:XXXX:VV     passed when memory at XXXX holds VV
+//     expect=XXXX:VV      additionally, memory at XXXX must hold VV at the end (up to SUITE_EXPECTS per image)
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>                                         // for rmdir()
+
+#include "6502.h"
+
+#define SUITE_ADDRESS 0x0200                                // default load address of raw binaries
+#define SUITE_CYCLES 100000000                              // default cycle budget per image
+#define SUITE_SLICE 100000                                  // cycles between checks for traps and memory values
+
+static bool add_test(test_suite *suite, const char *filename, const char *options, const char *directory, int line);
+static bool parse_option(suite_test *test, const char *option);
+static bool is_trap(machine *m, uint16_t address);
+static bool test_stopped(batch_job *job, machine *m);
+static void check_test(batch_job *job, machine *m);
+static void write_json_string(FILE *file, const char *text);
+static void write_csv_string(FILE *file, const char *text);
+
+
+// Reads a suite from a directory (all regular files, in alphabetical order, with the default options) or a manifest
+
+test_suite* load_suite(const char *path) {
+    test_suite *suite = calloc(1, sizeof(test_suite));
+    struct stat status;
+    bool loaded = true;
+    if(!suite) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    if(stat(path, &status)) {
+        printf("Unable to read %s.\n", path);
+        free(suite);
+        return NULL;
+    }
+
+    if(S_ISDIR(status.st_mode)) {
+        struct dirent **entries;
+        int count = scandir(path, &entries, NULL, alphasort);
+        if(count < 0) {
+            printf("Unable to read directory %s.\n", path);
+            free(suite);
+            return NULL;
+        }
+        for(int i = 0; i < count; i++) {
+            char filename[FILENAME_MAX];
+            snprintf(filename, sizeof(filename), "%s/%s", path, entries[i]->d_name);
+            if(loaded && entries[i]->d_name[0] != '.' && !stat(filename, &status) && S_ISREG(status.st_mode)) {
+                loaded = add_test(suite, filename, "", path, 0);
+            }
+            free(entries[i]);
+        }
+        free(entries);
+    } else {
+        FILE *file = fopen(path, "r");
+        char line[FILENAME_MAX + 256];
+        if(!file) {
+            printf("Unable to read %s.\n", path);
+            free(suite);
+            return NULL;
+        }
+        for(int number = 1; loaded && fgets(line, sizeof(line), file); number++) {
+            char *comment = strchr(line, '#');
+            if(comment) {
+                *comment = '\0';
+            }
+            char *filename = line + strspn(line, " \t\r\n");
+            if(*filename == '\0') {
+                continue;                                   // empty line or comment only
+            }
+            char *options = filename + strcspn(filename, " \t\r\n");
+            if(*options) {
+                *options++ = '\0';
+            }
+            char directory[FILENAME_MAX];                   // file names are relative to the manifest
+            snprintf(directory, sizeof(directory), "%s", path);
+            char *slash = strrchr(directory, '/');
+            if(slash) {
+                *slash = '\0';
+            } else {
+                strcpy(directory, ".");
+            }
+            loaded = add_test(suite, filename, options, directory, number);
+        }
+        fclose(file);
+    }
+
+    if(loaded && suite->count == 0) {
+        printf("No images in %s.\n", path);
+        loaded = false;
+    }
+    if(!loaded) {
+        destroy_suite(suite);
+        return NULL;
+    }
+    return suite;
+}
+
+static bool add_test(test_suite *suite, const char *filename, const char *options, const char *directory, int line) {
+    if(suite->count % 64 == 0) {                            // grow both arrays in steps of 64 tests
+        suite_test *tests = realloc(suite->tests, (suite->count + 64) * sizeof(suite_test));
+        if(tests) {
+            suite->tests = tests;
+        }
+        batch_job *jobs = realloc(suite->jobs, (suite->count + 64) * sizeof(batch_job));
+        if(jobs) {
+            suite->jobs = jobs;
+        }
+        if(!tests || !jobs) {
+            printf("Memory allocation failed.\n");
+            return false;
+        }
+    }
+
+    suite_test *test = &suite->tests[suite->count];
+    memset(test, 0, sizeof(suite_test));
+    if(line && filename[0] != '/') {
+        snprintf(test->image, sizeof(test->image), "%s/%s", directory, filename);
+    } else {
+        snprintf(test->image, sizeof(test->image), "%s", filename);
+    }
+    test->load_address = SUITE_ADDRESS;
+    test->cycles = SUITE_CYCLES;
+    test->end = END_BRK;
+    test->start_address = -1;                               // default: load address
+
+    char option[256];
+    int length;
+    while(sscanf(options, " %255s%n", option, &length) == 1) {
+        if(!parse_option(test, option)) {
+            printf("Manifest line %d: unknown or invalid option %s.\n", line, option);
+            return false;
+        }
+        options += length;
+    }
+    if(!map_program(test->image, test->load_address, &test->program)) {
+        return false;
+    }
+
+    batch_job *job = &suite->jobs[suite->count++];
+    memset(job, 0, sizeof(batch_job));
+    job->image = test->program.data;
+    job->size = test->program.size;
+    job->load_address = test->program.address;
+    job->start_address = test->start_address >= 0 ? (uint16_t) test->start_address : test->program.address;
+    job->budget.cycles = test->cycles;
+    job->stop = test_stopped;
+    job->slice = SUITE_SLICE;
+    job->check = check_test;                                // job->user is set by run_suite(), tests may still move
+    return true;
+}
+
+static bool parse_option(suite_test *test, const char *option) {
+    unsigned address, value;
+    unsigned long long cycles;
+    char end;                                               // catches anything after the expected format
+
+    if(sscanf(option, "load=%4x%c", &address, &end) == 1) {
+        test->load_address = address;
+    } else if(sscanf(option, "start=%4x%c", &address, &end) == 1) {
+        test->start_address = address;
+    } else if(sscanf(option, "cycles=%llu%c", &cycles, &end) == 1 && cycles > 0) {
+        test->cycles = cycles;
+    } else if(!strcmp(option, "end=brk")) {
+        test->end = END_BRK;
+    } else if(sscanf(option, "end=trap:%4x%c", &address, &end) == 1) {
+        test->end = END_TRAP;
+        test->end_address = address;
+    } else if(sscanf(option, "end=mem:%4x:%2x%c", &address, &value, &end) == 2) {
+        test->end = END_MEMORY;
+        test->end_address = address;
+        test->end_value = value;
+    } else if(sscanf(option, "expect=%4x:%2x%c", &address, &value, &end) == 2 && test->expects < SUITE_EXPECTS) {
+        test->expect_address[test->expects] = address;
+        test->expect_value[test->expects++] = value;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+// Runs all tests on the given number of threads (<= 0: one per core) and counts the passed ones
+
+void run_suite(test_suite *suite, int threads) {
+    for(size_t i = 0; i < suite->count; i++) {
+        suite->jobs[i].user = &suite->tests[i];
+    }
+    suite->summary = run_batch(suite->jobs, suite->count, threads);
+    suite->passed = 0;
+    for(size_t i = 0; i < suite->count; i++) {
+        if(!suite->jobs[i].loaded) {
+            suite->tests[i].passed = false;
+            snprintf(suite->tests[i].detail, sizeof(suite->tests[i].detail), "not loaded");
+        }
+        suite->passed += suite->tests[i].passed;
+    }
+}
+
+
+// Traps: JMP to itself, or a branch to itself that will be taken. The branch opcodes are xxy10000, with xx selecting
+// the flag (N, V, C, Z) and y the value for which the branch is taken.
+
+static bool is_trap(machine *m, uint16_t address) {
+    static const uint8_t branch_flags[4] = {FLAG_N, FLAG_V, FLAG_C, FLAG_Z};
+    uint8_t opcode = m->memory[address];
+
+    if(opcode == 0x4C) {
+        return (m->memory[(uint16_t) (address + 1)] | (m->memory[(uint16_t) (address + 2)] << 8)) == address;
+    }
+    if((opcode & 0x1F) == 0x10 && m->memory[(uint16_t) (address + 1)] == 0xFE) {
+        bool set = (get_status(&m->cpu) & branch_flags[opcode >> 6]) != 0;
+        return set == ((opcode & 0x20) != 0);
+    }
+    return false;
+}
+
+static bool test_stopped(batch_job *job, machine *m) {      // called by the batch runner after every slice
+    suite_test *test = job->user;
+    if(test->end == END_MEMORY && m->memory[test->end_address] == test->end_value) {
+        return true;
+    }
+    return is_trap(m, m->cpu.PC);                           // the program will not get out of a trap any more
+}
+
+// Called by the batch runner at the end of the run. An unknown opcode fails the test whatever its end condition: the
+// core cannot run the program correctly (e.g. a JMP would be skipped and its operand run as BRK). After BRK, PC is
+// at the vector; the BRK itself is 2 bytes before the return address it has pushed.
+
+static void check_test(batch_job *job, machine *m) {
+    suite_test *test = job->user;
+    bool trapped = is_trap(m, m->cpu.PC);
+
+    test->PC = m->cpu.PC;
+    if(job->result.reason == STOP_BRK) {
+        uint16_t stack = 0x0100 | (uint8_t) (m->cpu.SP + 2);
+        test->PC = (m->memory[stack] | (m->memory[0x0100 | (uint8_t) (stack + 1)] << 8)) - 2;
+    }
+    if(job->result.reason == STOP_UNKNOWN_OPCODE) {
+        snprintf(test->detail, sizeof(test->detail), "unknown opcode %02X at %04X", m->memory[m->cpu.PC], m->cpu.PC);
+        test->passed = false;
+        return;
+    }
+    if(trapped) {
+        snprintf(test->detail, sizeof(test->detail), "trap at %04X", m->cpu.PC);
+    } else if(job->result.reason == STOP_BRK) {
+        snprintf(test->detail, sizeof(test->detail), "BRK at %04X", test->PC);
+    } else if(test->end == END_MEMORY && m->memory[test->end_address] == test->end_value) {
+        snprintf(test->detail, sizeof(test->detail), "%04X is %02X", test->end_address, test->end_value);
+    } else {
+        snprintf(test->detail, sizeof(test->detail), "cycle budget used up");
+    }
+    switch(test->end) {
+        case END_BRK:
+            test->passed = job->result.reason == STOP_BRK;
+            break;
+        case END_TRAP:
+            test->passed = trapped && m->cpu.PC == test->end_address;
+            break;
+        case END_MEMORY:
+            test->passed = m->memory[test->end_address] == test->end_value;
+            break;
+    }
+    for(int i = 0; i < test->expects && test->passed; i++) {
+        uint16_t address = test->expect_address[i];
+        if(m->memory[address] != test->expect_value[i]) {
+            snprintf(test->detail, sizeof(test->detail), "%04X is %02X, expected %02X", address, m->memory[address],
+                     test->expect_value[i]);
+            test->passed = false;
+        }
+    }
+}
+
+
+// Output: one line per test and the batch summary on the console, or a report file
+
+void show_suite_results(const test_suite *suite) {
+    for(size_t i = 0; i < suite->count; i++) {
+        const suite_test *test = &suite->tests[i];
+        const batch_job *job = &suite->jobs[i];
+        printf("%-30s %-4s %-28s %12llu cycles %10.6f s  PC=%04X A=%02X X=%02X Y=%02X\n", test->image,
+               test->passed ? "pass" : "FAIL", test->detail, (unsigned long long) job->result.cycles, job->seconds,
+               test->PC, job->cpu.A, job->cpu.X, job->cpu.Y);
+    }
+    printf("\n%zu of %zu tests passed\n", suite->passed, suite->count);
+    show_batch_summary(suite->summary);
+}
+
+bool write_suite_report(const test_suite *suite, const char *filename) {
+    size_t length = strlen(filename);
+    bool csv = length >= 4 && !strcmp(filename + length - 4, ".csv");
+    FILE *file = fopen(filename, "w");
+    if(!file) {
+        printf("Unable to write %s.\n", filename);
+        return false;
+    }
+
+    if(csv) {
+        fprintf(file, "image,result,end,cycles,instructions,seconds,pc,a,x,y,sp,sr\n");
+    } else {
+        fprintf(file, "{\n  \"tests\": %zu,\n  \"passed\": %zu,\n  \"threads\": %d,\n  \"seconds\": %.6f,\n",
+                suite->count, suite->passed, suite->summary.threads, suite->summary.seconds);
+        fprintf(file, "  \"cycles\": %llu,\n  \"instructions\": %llu,\n  \"results\": [\n",
+                (unsigned long long) suite->summary.cycles, (unsigned long long) suite->summary.instructions);
+    }
+    for(size_t i = 0; i < suite->count; i++) {
+        const suite_test *test = &suite->tests[i];
+        const batch_job *job = &suite->jobs[i];
+        CPU6502 cpu = job->cpu;
+        if(csv) {
+            write_csv_string(file, test->image);
+            fprintf(file, ",%s,", test->passed ? "pass" : "fail");
+            write_csv_string(file, test->detail);
+            fprintf(file, ",%llu,%llu,%.6f,%04X,%02X,%02X,%02X,%02X,%02X\n", (unsigned long long) job->result.cycles,
+                    (unsigned long long) job->result.instructions, job->seconds, test->PC, cpu.A, cpu.X, cpu.Y, cpu.SP,
+                    get_status(&cpu));
+        } else {
+            fprintf(file, "    {\"image\": ");
+            write_json_string(file, test->image);
+            fprintf(file, ", \"passed\": %s, \"end\": ", test->passed ? "true" : "false");
+            write_json_string(file, test->detail);
+            fprintf(file, ", \"cycles\": %llu, \"instructions\": %llu, \"seconds\": %.6f, ",
+                    (unsigned long long) job->result.cycles, (unsigned long long) job->result.instructions, job->seconds);
+            fprintf(file, "\"pc\": \"%04X\", \"a\": \"%02X\", \"x\": \"%02X\", \"y\": \"%02X\", \"sp\": \"%02X\", \"sr\": \"%02X\"}%s\n",
+                    test->PC, cpu.A, cpu.X, cpu.Y, cpu.SP, get_status(&cpu), i + 1 < suite->count ? "," : "");
+        }
+    }
+    if(!csv) {
+        fprintf(file, "  ]\n}\n");
+    }
+    bool written = !ferror(file);
+    if(fclose(file) || !written) {
+        printf("Unable to write %s.\n", filename);
+        return false;
+    }
+    return true;
+}
+
+static void write_json_string(FILE *file, const char *text) {
+    fputc('"', file);
+    for(; *text; text++) {
+        if(*text == '"' || *text == '\\') {
+            fprintf(file, "\\%c", *text);
+        } else if((unsigned char) *text < 0x20) {
+            fprintf(file, "\\u%04x", (unsigned char) *text);
+        } else {
+            fputc(*text, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void write_csv_string(FILE *file, const char *text) {  // always quoted, with quotes doubled
+    fputc('"', file);
+    for(; *text; text++) {
+        if(*text == '"') {
+            fputc('"', file);
+        }
+        fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+void destroy_suite(test_suite *suite) {
+    if(!suite) {
+        return;
+    }
+    for(size_t i = 0; i < suite->count; i++) {
+        unmap_program(&suite->tests[i].program);
+    }
+    free(suite->tests);
+    free(suite->jobs);
+    free(suite);
+}
+
+
+// Self-check (./6502 -c): a small suite with every end condition, run and written as JSON and CSV. The core has no
+// JMP or branches yet, so the trap image must fail by its unknown opcode, not pass by the BRK its operand would be;
+// is_trap() itself is checked on a machine of its own.
+
+static const uint8_t check_brk[] = {0xA9, 0x42, 0x85, 0x10, 0x00};          // LDA #$42, STA $10, BRK at $0204
+static const uint8_t check_jmp[] = {0x4C, 0x00, 0x02};                      // JMP $0200
+
+static const struct {
+    const char *options;
+    const uint8_t *image;
+    bool passed;
+    const char *detail;
+} check_tests[] = {
+    {"end=brk expect=0010:42", check_brk, true,  "BRK at 0204"},
+    {"end=mem:0010:42",        check_brk, true,  "BRK at 0204"},
+    {"end=mem:0010:43",        check_brk, false, "BRK at 0204"},
+    {"expect=0010:43",         check_brk, false, "0010 is 42, expected 43"},
+    {"end=trap:0200",          check_jmp, false, "unknown opcode 4C at 0200"},
+    {"",                       check_jmp, false, "unknown opcode 4C at 0200"}
+};
+
+static const char *check_reports[] = {              // expected lines of the reports
+    "  \"passed\": 2,",
+    "    {\"image\": \"%s/brk.bin\", \"passed\": true, \"end\": \"BRK at 0204\", ",
+    "\"%s/jmp.bin\",fail,\"unknown opcode 4C at 0200\","
+};
+
+static bool check_is_trap(void) {
+    machine *m = create_machine();
+    bool passed = m != NULL;
+    if(passed) {
+        memcpy(&m->memory[0x0300], (const uint8_t[]) {0x4C, 0x00, 0x03, 0xD0, 0xFE}, 5);    // JMP $0300, BNE $0303
+        set_status(&m->cpu, 0x00);
+        passed = is_trap(m, 0x0300) && is_trap(m, 0x0303) && !is_trap(m, 0x0304);
+        set_status(&m->cpu, FLAG_Z);                        // BNE not taken
+        passed &= !is_trap(m, 0x0303);
+    }
+    destroy_machine(m);
+    return passed;
+}
+
+static bool report_contains(const char *filename, const char *expected, const char *directory) {
+    char line[FILENAME_MAX + 256], wanted[FILENAME_MAX + 256];
+    bool found = false;
+    FILE *file = fopen(filename, "r");
+    snprintf(wanted, sizeof(wanted), expected, directory);
+    while(file && !found && fgets(line, sizeof(line), file)) {
+        found = !strncmp(line, wanted, strlen(wanted));
+    }
+    if(file) {
+        fclose(file);
+    }
+    if(!found) {
+        printf("Test suite: no line %s in %s\n", wanted, filename);
+    }
+    return found;
+}
+
+bool check_suite(void) {
+    int tests = sizeof(check_tests) / sizeof(check_tests[0]), failures = 0;
+    char directory[] = "/tmp/6502-suite-XXXXXX", manifest[64], images[2][64], reports[2][64];
+    if(!mkdtemp(directory)) {
+        printf("Test suite: unable to create a temporary directory\n");
+        return false;
+    }
+    snprintf(manifest, sizeof(manifest), "%s/manifest", directory);
+    snprintf(images[0], sizeof(images[0]), "%s/brk.bin", directory);
+    snprintf(images[1], sizeof(images[1]), "%s/jmp.bin", directory);
+    snprintf(reports[0], sizeof(reports[0]), "%s/report.json", directory);
+    snprintf(reports[1], sizeof(reports[1]), "%s/report.csv", directory);
+
+    FILE *files[3] = {fopen(manifest, "w"), fopen(images[0], "wb"), fopen(images[1], "wb")};
+    bool written = files[0] && files[1] && files[2];
+    if(written) {
+        for(int i = 0; i < tests; i++) {
+            fprintf(files[0], "%s %s\n", check_tests[i].image == check_brk ? "brk.bin" : "jmp.bin", check_tests[i].options);
+        }
+        fwrite(check_brk, 1, sizeof(check_brk), files[1]);
+        fwrite(check_jmp, 1, sizeof(check_jmp), files[2]);
+    }
+    for(int i = 0; i < 3; i++) {
+        written = files[i] && !fclose(files[i]) && written;
+    }
+
+    test_suite *suite = written ? load_suite(manifest) : NULL;
+    if(suite && (size_t) tests == suite->count) {
+        run_suite(suite, 1);
+        for(int i = 0; i < tests; i++) {
+            if(suite->tests[i].passed != check_tests[i].passed || strcmp(suite->tests[i].detail, check_tests[i].detail)) {
+                printf("Test suite: %s %s: %s, %s (expected: %s, %s)\n", suite->tests[i].image, check_tests[i].options,
+                       suite->tests[i].passed ? "pass" : "FAIL", suite->tests[i].detail,
+                       check_tests[i].passed ? "pass" : "FAIL", check_tests[i].detail);
+                failures++;
+            }
+        }
+        for(int i = 0; i < 2; i++) {
+            failures += !write_suite_report(suite, reports[i]);
+        }
+        failures += !report_contains(reports[0], check_reports[0], directory);
+        failures += !report_contains(reports[0], check_reports[1], directory);
+        failures += !report_contains(reports[1], check_reports[2], directory);
+    } else {
+        failures++;
+    }
+    if(!check_is_trap()) {
+        printf("Test suite: traps not recognized\n");
+        failures++;
+    }
+    destroy_suite(suite);
+    for(int i = 0; i < 2; i++) {
+        remove(reports[i]);
+        remove(images[i]);
+    }
+    remove(manifest);
+    rmdir(directory);
+    printf("Test suite: %d images with all end conditions, JSON and CSV reports, %d failed\n", tests, failures);
+    return failures == 0;
+}
@@ -0,0 +1,402 @@
+// TED SOUND FOR THE SIMPLE 6502 EMULATOR
+//
+// The sound part of the MOS 7360/8360 TED of the C16, C116 and Plus/4 (see ted-demo): two voices, each a 10 bit
+// counter that counts up from its frequency register at the sound clock (PAL: 17.734475 MHz / 80, about 221.7 kHz)
+// and flips its square wave output when it overflows, so a tone has 221.7 kHz / 2 / (1024 - value). Voice 2 can put
+// out noise instead, one bit of an 8 bit shift register that is clocked by the same overflows. Registers:
+//     $FF0E  voice 1 frequency, bits 0-7
+//     $FF0F  voice 2 frequency, bits 0-7
+//     $FF10  voice 2 frequency, bits 8-9 (bits 0-1)
+//     $FF11  volume 0-8 (bits 0-3), voice 1 on (bit 4), voice 2 square on (bit 5), voice 2 noise on (bit 6, wins over
+//            bit 5), D/A mode (bit 7: the voices that are on stay high, for sampled sound)
+//     $FF12  voice 1 frequency, bits 8-9 (bits 0-1); the other bits belong to the video part and are only stored
+//
+// Nothing happens per cycle. A register write first renders all samples up to the cycle of the write with the old
+// register values, then changes them; between writes, samples are produced in blocks. Each sample is the average of
+// both voices over its whole interval (a box filter), computed from the time up to the next overflow, so high tones do
+// not alias as badly as with point sampling. Times are 32.32 fixed point sound clock ticks, so the output only depends
+// on the register writes and their cycles.
+//
+// Samples are rendered per voice first: while a counter does not overflow, its output stays the same, so the samples
+// up to the next overflow are filled as one run of equal values, and only samples with an overflow in them go through
+// the exact loop of run_voice(). The noise register steps through a precomputed table. Then both voices are mixed into
+// 16 bit samples, four or two at a time with AVX2 or SSE2 if the compiler targets them (e.g. -mavx2). The result is
+// bit for bit the same as with the per-sample reference loop, which benchmark_ted_sound() checks.
+//
+// The device can be attached to a machine, which then provides the cycle of each write, or be fed from a register log
+// with ted_sound_write(). The samples go to a sample_sink (e.g. wav_write() of audio.c) in blocks of
+// TED_SOUND_BLOCK samples, 16 bit mono, from 0 (silence) up to 2 * 8 * TED_SOUND_STEP. For live output (an
+// audio_stream), ted_sound_schedule() adds an event that renders regularly, also while the registers stay the same.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for clock() in the benchmark
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "6502.h"
+
+#define TED_CLOCK 17734475ull                               // PAL master clock in Hz
+#define TED_SOUND_DIVIDER 80                                // master clock cycles per sound clock tick
+#define TED_SOUND_STEP 2047                                 // output of one voice per volume step
+#define TED_NOISE_SEED 0x01
+#define TED_BENCHMARK_RATE 44100                            // sample rate of the benchmark
+#define TED_BENCHMARK_WRITES 200                            // register writes per second of sound in the benchmark
+
+#define NOISE_STEP(s) ((uint8_t) (((s) << 1) | ((((s) >> 7) ^ ((s) >> 5) ^ ((s) >> 4) ^ ((s) >> 3)) & 1)))
+#define NOISE_STEPS_4(s) NOISE_STEP(s), NOISE_STEP(s + 1), NOISE_STEP(s + 2), NOISE_STEP(s + 3)
+#define NOISE_STEPS_16(s) NOISE_STEPS_4(s), NOISE_STEPS_4(s + 4), NOISE_STEPS_4(s + 8), NOISE_STEPS_4(s + 12)
+#define NOISE_STEPS_64(s) NOISE_STEPS_16(s), NOISE_STEPS_16(s + 16), NOISE_STEPS_16(s + 32), NOISE_STEPS_16(s + 48)
+
+static const uint8_t noise_steps[256] = {                   // next state of the noise register (x^8 + x^6 + x^5 + x^4
+                                                            // + 1) for each state
+    NOISE_STEPS_64(0), NOISE_STEPS_64(64), NOISE_STEPS_64(128), NOISE_STEPS_64(192)
+};
+
+typedef struct {
+    uint64_t remaining;                                     // ticks up to the next overflow (32.32 fixed point)
+    uint64_t period;                                        // ticks between overflows, from the frequency register
+    uint8_t level;                                          // square wave output, 0 or 1
+    uint8_t noise;                                          // shift register, clocked by the overflows
+} ted_voice;
+
+struct ted_sound {
+    machine *m;                                             // NULL if fed from a register log
+    uint8_t registers[5];                                   // $FF0E-$FF12
+    uint32_t sample_rate;
+    uint64_t clock_speed;                                   // machine cycles per second
+    uint64_t step;                                          // ticks per sample (32.32 fixed point)
+    uint64_t first_cycle;                                   // cycle of sample 0
+    uint64_t samples;                                       // samples rendered so far
+    uint64_t interval;                                      // cycles between render events, 0: none
+    ted_voice voices[2];
+    sample_sink sink;
+    void *context;
+    bool reference;                                         // per-sample loop instead of runs (for the benchmark)
+    size_t buffered;
+    int16_t buffer[TED_SOUND_BLOCK];
+    uint64_t high[2][TED_SOUND_BLOCK];                      // ticks each voice is high, per sample of a block
+};
+
+static uint8_t ted_sound_read(void *device, uint16_t address);
+static void ted_sound_device_write(void *device, uint16_t address, uint8_t value);
+static void render_samples(ted_sound *ted, uint64_t count);
+static void update_voices(ted_sound *ted);
+static void flush_samples(ted_sound *ted);
+static void render_event(void *device, uint64_t cycle);
+
+
+// Creates the device; with a machine, it is attached at $FF0E-$FF12 and counts time from the machine's current cycle.
+// clock_speed: machine cycles per second (CLOCK_SPEED), which relates cycles to the TED's own sound clock.
+// Destroy the device only after the machine.
+
+ted_sound* create_ted_sound(machine *m, uint64_t clock_speed, uint32_t sample_rate, sample_sink sink, void *context) {
+    ted_sound *ted = calloc(1, sizeof(ted_sound));
+    if(!ted) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    ted->m = m;
+    ted->sample_rate = sample_rate;
+    ted->clock_speed = clock_speed;
+    ted->step = (TED_CLOCK << 32) / ((uint64_t) TED_SOUND_DIVIDER * sample_rate);
+    ted->first_cycle = m ? m->cpu.cycles : 0;
+    ted->sink = sink;
+    ted->context = context;
+    for(int i = 0; i < 2; i++) {
+        ted->voices[i].noise = TED_NOISE_SEED;
+    }
+    update_voices(ted);
+    for(int i = 0; i < 2; i++) {
+        ted->voices[i].remaining = ted->voices[i].period;
+    }
+    if(m && !attach_device(m, 0xFF0E, 0xFF12, ted_sound_read, ted_sound_device_write, ted)) {
+        free(ted);
+        return NULL;
+    }
+    return ted;
+}
+
+void destroy_ted_sound(ted_sound *ted) {
+    free(ted);
+}
+
+
+// Register access. A write renders the samples up to its cycle first; the new frequencies take effect with the next
+// overflow of each counter, as on the chip.
+
+void ted_sound_write(ted_sound *ted, uint64_t cycle, uint16_t address, uint8_t value) {
+    if(address < 0xFF0E || address > 0xFF12) {
+        return;
+    }
+    ted_sound_render(ted, cycle);
+    ted->registers[address - 0xFF0E] = value;
+    update_voices(ted);
+}
+
+uint8_t ted_sound_register(const ted_sound *ted, uint16_t address) {
+    return address >= 0xFF0E && address <= 0xFF12 ? ted->registers[address - 0xFF0E] : 0;
+}
+
+static uint8_t ted_sound_read(void *device, uint16_t address) {
+    return ted_sound_register(device, address);
+}
+
+static void ted_sound_device_write(void *device, uint16_t address, uint8_t value) {
+    ted_sound *ted = device;
+    ted_sound_write(ted, ted->m->cpu.cycles, address, value);
+}
+
+static void update_voices(ted_sound *ted) {
+    uint16_t frequency1 = ted->registers[0] | ((ted->registers[4] & 0x03) << 8);
+    uint16_t frequency2 = ted->registers[1] | ((ted->registers[2] & 0x03) << 8);
+    ted->voices[0].period = (uint64_t) (1024 - frequency1) << 32;
+    ted->voices[1].period = (uint64_t) (1024 - frequency2) << 32;
+}
+
+
+// Renders all samples up to "cycle" and hands them to the sink
+
+void ted_sound_render(ted_sound *ted, uint64_t cycle) {
+    if(cycle > ted->first_cycle) {
+        uint64_t due = (cycle - ted->first_cycle) / ted->clock_speed * ted->sample_rate
+                       + (cycle - ted->first_cycle) % ted->clock_speed * ted->sample_rate / ted->clock_speed;
+        if(due > ted->samples) {
+            render_samples(ted, due - ted->samples);
+        }
+    }
+    flush_samples(ted);
+}
+
+uint64_t ted_sound_samples(const ted_sound *ted) {
+    return ted->samples;
+}
+
+bool ted_sound_schedule(ted_sound *ted, uint64_t interval) {
+    if(!ted->m || interval == 0) {
+        return false;
+    }
+    ted->interval = interval;
+    return schedule_event(ted->m, ted->m->cpu.cycles + interval, render_event, ted);
+}
+
+static void render_event(void *device, uint64_t cycle) {
+    ted_sound *ted = device;
+    ted_sound_render(ted, cycle);
+    schedule_event(ted->m, cycle + ted->interval, render_event, ted);
+}
+
+
+// Runs a voice for "length" ticks and returns the ticks its output has been high
+
+static inline uint64_t run_voice(ted_voice *voice, uint64_t length, bool noise) {
+    uint64_t high = 0;
+    uint8_t output = noise ? voice->noise & 1 : voice->level;
+
+    while(voice->remaining <= length) {                     // overflows within this interval
+        high += output ? voice->remaining : 0;
+        length -= voice->remaining;
+        voice->remaining = voice->period;
+        voice->level ^= 1;
+        voice->noise = noise_steps[voice->noise];
+        output = noise ? voice->noise & 1 : voice->level;
+    }
+    voice->remaining -= length;
+    return high + (output ? length : 0);
+}
+
+// The same for "count" samples of "step" ticks each: runs of samples without an overflow get the same value, without
+// going through the loop
+
+static void run_voice_block(ted_voice *voice, uint64_t step, bool noise, uint64_t *high, size_t count) {
+    size_t i = 0;
+    while(i < count) {
+        uint64_t run = (voice->remaining - 1) / step;       // samples before the one with the next overflow
+        if(run == 0) {
+            high[i++] = run_voice(voice, step, noise);
+            continue;
+        }
+        if(run > count - i) {
+            run = count - i;
+        }
+        uint64_t value = (noise ? voice->noise & 1 : voice->level) ? step : 0;
+        for(size_t end = i + run; i < end; i++) {
+            high[i] = value;
+        }
+        voice->remaining -= run * step;
+    }
+}
+
+// Mixes both voices: sample = high * scale >> 32, with high the sum of the voices that are on. The vector versions
+// split high into its upper and lower 32 bits, as they only multiply 32 by 32 bits; the sum is the same.
+
+static void mix_samples(const uint64_t *high1, const uint64_t *high2, uint64_t mask1, uint64_t mask2, uint64_t scale,
+                        int16_t *samples, size_t count) {
+    size_t i = 0;
+    if(scale <= UINT32_MAX) {
+#ifdef __AVX2__
+        __m256i voice1 = _mm256_set1_epi64x((long long) mask1), voice2 = _mm256_set1_epi64x((long long) mask2);
+        __m256i factor = _mm256_set1_epi64x((long long) scale);
+        __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+        for(; i + 8 <= count; i += 8) {
+            __m128i parts[2];
+            for(int j = 0; j < 2; j++) {
+                __m256i high = _mm256_add_epi64(
+                    _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (high1 + i + 4 * j)), voice1),
+                    _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (high2 + i + 4 * j)), voice2));
+                __m256i sample = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(high, 32), factor),
+                                                  _mm256_srli_epi64(_mm256_mul_epu32(high, factor), 32));
+                parts[j] = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(sample, even));
+            }
+            _mm_storeu_si128((__m128i *) (samples + i), _mm_packs_epi32(parts[0], parts[1]));
+        }
+#elif defined(__SSE2__)
+        __m128i voice1 = _mm_set1_epi64x((long long) mask1), voice2 = _mm_set1_epi64x((long long) mask2);
+        __m128i factor = _mm_set1_epi64x((long long) scale);
+        for(; i + 8 <= count; i += 8) {
+            __m128i parts[4];
+            for(int j = 0; j < 4; j++) {
+                __m128i high = _mm_add_epi64(
+                    _mm_and_si128(_mm_loadu_si128((const __m128i *) (high1 + i + 2 * j)), voice1),
+                    _mm_and_si128(_mm_loadu_si128((const __m128i *) (high2 + i + 2 * j)), voice2));
+                __m128i sample = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(high, 32), factor),
+                                               _mm_srli_epi64(_mm_mul_epu32(high, factor), 32));
+                parts[j] = _mm_shuffle_epi32(sample, _MM_SHUFFLE(3, 1, 2, 0));    // results in the lower half
+            }
+            _mm_storeu_si128((__m128i *) (samples + i), _mm_packs_epi32(_mm_unpacklo_epi64(parts[0], parts[1]),
+                                                                        _mm_unpacklo_epi64(parts[2], parts[3])));
+        }
+#endif
+    }
+    for(; i < count; i++) {
+        samples[i] = (int16_t) ((((high1[i] & mask1) + (high2[i] & mask2)) * scale) >> 32);
+    }
+}
+
+static void render_samples(ted_sound *ted, uint64_t count) {
+    uint8_t control = ted->registers[3];
+    uint8_t volume = (control & 0x0F) > 8 ? 8 : control & 0x0F;
+    bool on1 = control & 0x10, on2 = control & 0x60, noise = control & 0x40, direct = control & 0x80;
+    uint64_t scale = ((uint64_t) volume * TED_SOUND_STEP << 32) / ted->step;   // output per high tick, 32.32
+
+    if(ted->reference) {
+        for(uint64_t i = 0; i < count; i++) {
+            uint64_t high1 = run_voice(&ted->voices[0], ted->step, false);
+            uint64_t high2 = run_voice(&ted->voices[1], ted->step, noise);
+            if(direct) {                                    // D/A mode: constant level, the counters keep running
+                high1 = high2 = ted->step;
+            }
+            uint64_t high = (on1 ? high1 : 0) + (on2 ? high2 : 0);
+            ted->buffer[ted->buffered++] = (int16_t) ((high * scale) >> 32);
+            if(ted->buffered == TED_SOUND_BLOCK) {
+                flush_samples(ted);
+            }
+        }
+        ted->samples += count;
+        return;
+    }
+
+    ted->samples += count;
+    while(count) {
+        size_t block = TED_SOUND_BLOCK - ted->buffered < count ? TED_SOUND_BLOCK - ted->buffered : (size_t) count;
+        int16_t *samples = ted->buffer + ted->buffered;
+        run_voice_block(&ted->voices[0], ted->step, false, ted->high[0], block);
+        run_voice_block(&ted->voices[1], ted->step, noise, ted->high[1], block);
+        if(direct) {                                        // D/A mode: constant level, the counters keep running
+            int16_t sample = (int16_t) ((((on1 ? ted->step : 0) + (on2 ? ted->step : 0)) * scale) >> 32);
+            for(size_t i = 0; i < block; i++) {
+                samples[i] = sample;
+            }
+        } else {
+            mix_samples(ted->high[0], ted->high[1], on1 ? UINT64_MAX : 0, on2 ? UINT64_MAX : 0, scale, samples, block);
+        }
+        ted->buffered += block;
+        count -= block;
+        if(ted->buffered == TED_SOUND_BLOCK) {
+            flush_samples(ted);
+        }
+    }
+}
+
+static void flush_samples(ted_sound *ted) {
+    if(ted->buffered && ted->sink) {
+        ted->sink(ted->context, ted->buffer, ted->buffered);
+    }
+    ted->buffered = 0;
+}
+
+
+// Benchmark: renders the same random register log with the per-sample reference loop and with the block renderer,
+// which must produce exactly the same samples. The log changes a register TED_BENCHMARK_WRITES times per second of
+// sound, with all frequencies, noise, D/A mode and volume, but rarely enough that most samples come from runs.
+
+typedef struct {
+    int16_t *samples;
+    size_t count;
+} sample_buffer;
+
+static void collect_samples(void *context, const int16_t *samples, size_t count) {
+    sample_buffer *buffer = context;
+    memcpy(buffer->samples + buffer->count, samples, count * sizeof(int16_t));
+    buffer->count += count;
+}
+
+bool benchmark_ted_sound(double seconds) {
+    uint64_t writes = (uint64_t) (seconds * TED_BENCHMARK_WRITES);
+    uint64_t end = (uint64_t) (seconds * CLOCK_SPEED);
+    size_t size = (end / CLOCK_SPEED * TED_BENCHMARK_RATE + end % CLOCK_SPEED * TED_BENCHMARK_RATE / CLOCK_SPEED + 1)
+                  * sizeof(int16_t);
+    sample_buffer buffers[2] = {{malloc(size), 0}, {malloc(size), 0}};
+    double times[2];
+
+    if(!buffers[0].samples || !buffers[1].samples) {
+        printf("Memory allocation failed.\n");
+        free(buffers[0].samples);
+        free(buffers[1].samples);
+        return false;
+    }
+    for(int engine = 0; engine < 2; engine++) {
+        ted_sound *ted = create_ted_sound(NULL, CLOCK_SPEED, TED_BENCHMARK_RATE, collect_samples, &buffers[engine]);
+        if(!ted) {
+            free(buffers[0].samples);
+            free(buffers[1].samples);
+            return false;
+        }
+        ted->reference = engine == 0;
+        uint32_t random = 1;                                // the same log for both
+        clock_t start = clock();
+        for(uint64_t i = 0; i < writes; i++) {
+            random = random * 1103515245u + 12345u;
+            uint16_t address = 0xFF0E + (random >> 16) % 5;
+            uint8_t value = (uint8_t) (random >> 8);
+            if(address == 0xFF11 && (random & 0x7000)) {    // D/A mode only now and then
+                value &= 0x7F;
+            }
+            ted_sound_write(ted, end * i / writes, address, value);
+        }
+        ted_sound_render(ted, end);
+        times[engine] = (double) (clock() - start) / CLOCKS_PER_SEC;
+        destroy_ted_sound(ted);
+    }
+
+    bool identical = buffers[0].count == buffers[1].count
+                     && !memcmp(buffers[0].samples, buffers[1].samples, buffers[0].count * sizeof(int16_t));
+    printf("TED sound benchmark, %.0f s of sound (%llu samples), %llu register writes\n\n", seconds,
+           (unsigned long long) buffers[0].count, (unsigned long long) writes);
+    for(int engine = 0; engine < 2; engine++) {
+        if(times[engine] <= 0) {
+            times[engine] = 1e-9;
+        }
+        printf("%-20s %8.3f s  %12.0f samples/s\n", engine ? "runs" : "per sample", times[engine],
+               buffers[engine].count / times[engine]);
+    }
+    printf("\nSpeedup of runs over per-sample rendering: %.2fx\n", times[0] / times[1]);
+    printf("Samples %s.\n", identical ? "identical" : "differ");
+    free(buffers[0].samples);
+    free(buffers[1].samples);
+    return identical;
+}
@@ -0,0 +1,359 @@
+// TED VIDEO FOR THE SIMPLE 6502 EMULATOR
+//
+// The video part of the MOS 7360/8360 TED of the C16, C116 and Plus/4, as a device that renders whole frames from the
+// machine's memory into a TED_pixel picture of basic-graphics-commands (320 x 200 plus a border of TED_VIDEO_BORDER
+// pixels, one byte per pixel as in the color registers), which save_BMP() writes or a frame_sink takes, e.g.
+// frame_stream_write() for a stream of raw frames. Colors become RGB only there.
+// Registers, read at the start of each frame:
+//     $FF06  bit 4: display on, bit 5: bitmap mode, bit 6: extended color mode
+//     $FF07  bit 4: multicolor mode, bit 7: 256 characters instead of 128 plus their reverse
+//     $FF12  bits 3-5: bitmap address / $2000, bit 2: character set from ROM
+//     $FF13  bits 2-7: character set address / $400
+//     $FF14  bits 3-7: video matrix address / $800: attributes (color and luminance) at +0, screen codes at +$400
+//     $FF15  background, $FF16-$FF18: multicolor and extended color backgrounds, $FF19: border
+// Colors are TED color bytes: color in bits 0-3, luminance in bits 4-6 (bit 7 of an attribute, flashing, is shown
+// steady). In bitmap mode, the screen code gives the colors (bits 4-7 for set pixels, 0-3 for clear ones) and the
+// attribute their luminance (bits 0-2 and 4-6).
+//
+// Only what has changed is drawn again. The pages of the video matrix, the bitmap and a character set in RAM are
+// watched (see watch_page() in bus.c): the first write to such a page after a frame counts a new generation of it, and
+// all further writes run at full speed. At the next frame, only pages with a new generation are compared with the
+// copy of what has been drawn, and only the 8 x 8 cells whose bytes (or character patterns) differ are rasterized
+// again. Without writes to the screen, a frame costs a few dozen comparisons of generation counters. A change of any
+// register draws the whole frame.
+//
+// The character ROM is not included: the character set from ROM is the upper case and graphics set of the machine's
+// ROM ($D000) in the C16 profile, and otherwise a built-in copy of its first 64 characters (letters, digits and
+// punctuation); the other graphics characters show a checkerboard there. Timing within a frame (raster effects),
+// the cursor, and hardware scrolling are not emulated.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tedvideo.h"
+
+#define TED_CELLS 1000                                      // 40 x 25
+#define TED_MATRIX_SIZE 0x0800                              // attributes, then screen codes
+#define TED_BITMAP_SIZE 8000
+#define TED_CHARSET_SIZE 0x0800                             // 256 characters
+#define TED_ROM_CHARSET 0xD000
+#define TED_REGISTERS 10                                    // $FF06, $FF07, $FF12-$FF19
+
+static const uint16_t register_addresses[TED_REGISTERS] = {
+    0xFF06, 0xFF07, 0xFF12, 0xFF13, 0xFF14, 0xFF15, 0xFF16, 0xFF17, 0xFF18, 0xFF19
+};
+
+enum { REG_CONTROL1, REG_CONTROL2, REG_BITMAP, REG_CHARSET, REG_MATRIX, REG_BACKGROUND, REG_BORDER = 9 };
+
+static const uint8_t builtin_font[64][8] = {                // screen codes 0-63 of the upper case character set
+    {0x3C, 0x66, 0x6E, 0x6E, 0x60, 0x62, 0x3C, 0x00}, {0x18, 0x3C, 0x66, 0x7E, 0x66, 0x66, 0x66, 0x00},
+    {0x7C, 0x66, 0x66, 0x7C, 0x66, 0x66, 0x7C, 0x00}, {0x3C, 0x66, 0x60, 0x60, 0x60, 0x66, 0x3C, 0x00},
+    {0x78, 0x6C, 0x66, 0x66, 0x66, 0x6C, 0x78, 0x00}, {0x7E, 0x60, 0x60, 0x78, 0x60, 0x60, 0x7E, 0x00},
+    {0x7E, 0x60, 0x60, 0x78, 0x60, 0x60, 0x60, 0x00}, {0x3C, 0x66, 0x60, 0x6E, 0x66, 0x66, 0x3C, 0x00},
+    {0x66, 0x66, 0x66, 0x7E, 0x66, 0x66, 0x66, 0x00}, {0x3C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00},
+    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x6C, 0x38, 0x00}, {0x66, 0x6C, 0x78, 0x70, 0x78, 0x6C, 0x66, 0x00},
+    {0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x7E, 0x00}, {0x63, 0x77, 0x7F, 0x6B, 0x63, 0x63, 0x63, 0x00},
+    {0x66, 0x76, 0x7E, 0x7E, 0x6E, 0x66, 0x66, 0x00}, {0x3C, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x00},
+    {0x7C, 0x66, 0x66, 0x7C, 0x60, 0x60, 0x60, 0x00}, {0x3C, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x0E, 0x00},
+    {0x7C, 0x66, 0x66, 0x7C, 0x78, 0x6C, 0x66, 0x00}, {0x3C, 0x66, 0x60, 0x3C, 0x06, 0x66, 0x3C, 0x00},
+    {0x7E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00}, {0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x00},
+    {0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x18, 0x00}, {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00},
+    {0x66, 0x66, 0x3C, 0x18, 0x3C, 0x66, 0x66, 0x00}, {0x66, 0x66, 0x66, 0x3C, 0x18, 0x18, 0x18, 0x00},
+    {0x7E, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x7E, 0x00}, {0x3C, 0x30, 0x30, 0x30, 0x30, 0x30, 0x3C, 0x00},
+    {0x0C, 0x12, 0x30, 0x7C, 0x30, 0x62, 0xFC, 0x00}, {0x3C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x3C, 0x00},
+    {0x00, 0x18, 0x3C, 0x7E, 0x18, 0x18, 0x18, 0x18}, {0x00, 0x10, 0x30, 0x7F, 0x7F, 0x30, 0x10, 0x00},
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, {0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x18, 0x00},
+    {0x66, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00}, {0x66, 0x66, 0xFF, 0x66, 0xFF, 0x66, 0x66, 0x00},
+    {0x18, 0x3E, 0x60, 0x3C, 0x06, 0x7C, 0x18, 0x00}, {0x62, 0x66, 0x0C, 0x18, 0x30, 0x66, 0x46, 0x00},
+    {0x3C, 0x66, 0x3C, 0x38, 0x67, 0x66, 0x3F, 0x00}, {0x06, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x0C, 0x18, 0x30, 0x30, 0x30, 0x18, 0x0C, 0x00}, {0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x18, 0x30, 0x00},
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, {0x00, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x00, 0x00},
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x30}, {0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x00},
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00}, {0x00, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x00},
+    {0x3C, 0x66, 0x6E, 0x76, 0x66, 0x66, 0x3C, 0x00}, {0x18, 0x18, 0x38, 0x18, 0x18, 0x18, 0x7E, 0x00},
+    {0x3C, 0x66, 0x06, 0x0C, 0x30, 0x60, 0x7E, 0x00}, {0x3C, 0x66, 0x06, 0x1C, 0x06, 0x66, 0x3C, 0x00},
+    {0x06, 0x0E, 0x1E, 0x66, 0x7F, 0x06, 0x06, 0x00}, {0x7E, 0x60, 0x7C, 0x06, 0x06, 0x66, 0x3C, 0x00},
+    {0x3C, 0x66, 0x60, 0x7C, 0x66, 0x66, 0x3C, 0x00}, {0x7E, 0x66, 0x0C, 0x18, 0x18, 0x18, 0x18, 0x00},
+    {0x3C, 0x66, 0x66, 0x3C, 0x66, 0x66, 0x3C, 0x00}, {0x3C, 0x66, 0x66, 0x3E, 0x06, 0x66, 0x3C, 0x00},
+    {0x00, 0x00, 0x18, 0x00, 0x00, 0x18, 0x00, 0x00}, {0x00, 0x00, 0x18, 0x00, 0x00, 0x18, 0x18, 0x30},
+    {0x0E, 0x18, 0x30, 0x60, 0x30, 0x18, 0x0E, 0x00}, {0x00, 0x00, 0x7E, 0x00, 0x7E, 0x00, 0x00, 0x00},
+    {0x70, 0x18, 0x0C, 0x06, 0x0C, 0x18, 0x70, 0x00}, {0x3C, 0x66, 0x06, 0x0C, 0x18, 0x00, 0x18, 0x00}
+};
+
+static const uint8_t checkerboard[8] = {0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55, 0xAA, 0x55};
+
+struct ted_video {
+    machine *m;
+    frame_sink sink;
+    void *context;
+    uint64_t interval;                                      // cycles between render events, 0: none
+    TED_pixel *frame;                                       // TED_VIDEO_WIDTH x TED_VIDEO_HEIGHT
+    uint8_t registers[TED_REGISTERS];                       // as drawn
+    bool drawn;                                             // false: nothing drawn yet
+    uint8_t matrix[TED_MATRIX_SIZE];                        // copies of the memory as drawn
+    uint8_t bitmap[TED_BITMAP_SIZE];
+    uint8_t charset[TED_CHARSET_SIZE];
+    uint32_t generations[BUS_PAGES];                        // of the pages when they were last compared
+    bool dirty[TED_CELLS];
+    bool glyph_changed[256];
+    uint64_t frames, cells;
+};
+
+static void render_event(void *device, uint64_t cycle);
+
+
+// Creates the device. It needs no registers of its own: it reads $FF06-$FF19 wherever they are (RAM in the flat
+// profile, the I/O area of the C16 profile, or a device such as the TED sound for $FF12).
+
+ted_video* create_ted_video(machine *m, frame_sink sink, void *context) {
+    ted_video *video = calloc(1, sizeof(ted_video));
+    TED_pixel *frame = malloc(TED_VIDEO_WIDTH * TED_VIDEO_HEIGHT * sizeof(TED_pixel));
+    if(!video || !frame) {
+        printf("Memory allocation failed.\n");
+        free(video);
+        free(frame);
+        return NULL;
+    }
+    video->m = m;
+    video->sink = sink;
+    video->context = context;
+    video->frame = frame;
+    return video;
+}
+
+void destroy_ted_video(ted_video *video) {
+    if(video) {
+        free(video->frame);
+        free(video);
+    }
+}
+
+const TED_pixel* ted_video_frame(const ted_video *video, resolution *size) {
+    *size = (resolution) {TED_VIDEO_WIDTH, TED_VIDEO_HEIGHT};
+    return video->frame;
+}
+
+uint64_t ted_video_frames(const ted_video *video) {
+    return video->frames;
+}
+
+uint64_t ted_video_cells(const ted_video *video) {
+    return video->cells;
+}
+
+bool ted_video_schedule(ted_video *video, uint64_t interval) {
+    if(interval == 0) {
+        return false;
+    }
+    video->interval = interval;
+    return schedule_event(video->m, video->m->cpu.cycles + interval, render_event, video);
+}
+
+static void render_event(void *device, uint64_t cycle) {
+    ted_video *video = device;
+    ted_video_render(video);
+    schedule_event(video->m, cycle + video->interval, render_event, video);
+}
+
+
+// Change detection: compares the watched pages of a memory area that have been written since the last frame (or all
+// of them if everything is drawn anyway) with the copy, and calls mark() for every byte that differs
+
+static const uint8_t* video_memory(machine *m, int page) {  // RAM as the TED sees it, also if shared with a snapshot
+    return m->shared[page] ? m->bus.read[page] : m->memory + (page << 8);
+}
+
+static void compare_area(ted_video *video, uint16_t address, uint8_t *copy, size_t size, bool all,
+                         void (*mark)(ted_video *video, size_t offset)) {
+    machine *m = video->m;
+    for(size_t offset = 0; offset < size; ) {
+        int page = (address + offset) >> 8 & 0xFF;
+        size_t length = PAGE_SIZE - ((address + offset) & 0xFF);
+        length = length < size - offset ? length : size - offset;
+        if(all || m->generation[page] != video->generations[page]) {
+            const uint8_t *memory = video_memory(m, page) + ((address + offset) & 0xFF);
+            for(size_t i = 0; i < length; i++) {
+                if(copy[offset + i] != memory[i] || all) {
+                    copy[offset + i] = memory[i];
+                    mark(video, offset + i);
+                }
+            }
+            video->generations[page] = m->generation[page];
+            watch_page(m, page);                            // the next write counts a new generation
+        }
+        offset += length;
+    }
+}
+
+static void mark_matrix(ted_video *video, size_t offset) {  // attributes and screen codes
+    if((offset & 0x3FF) < TED_CELLS) {
+        video->dirty[offset & 0x3FF] = true;
+    }
+}
+
+static void mark_bitmap(ted_video *video, size_t offset) {
+    video->dirty[offset / 8] = true;
+}
+
+static void mark_glyph(ted_video *video, size_t offset) {
+    video->glyph_changed[offset / 8] = true;
+}
+
+
+// Rasterization of one cell: eight rows of eight pixels, from a pattern byte per row and up to four colors
+
+static void draw_cell(ted_video *video, int cell, const uint8_t *pattern, const TED_pixel *colors, bool multicolor) {
+    TED_pixel *pixel = video->frame + (TED_VIDEO_BORDER + cell / 40 * 8) * TED_VIDEO_WIDTH + TED_VIDEO_BORDER
+                      + cell % 40 * 8;
+    for(int row = 0; row < 8; row++, pixel += TED_VIDEO_WIDTH) {
+        uint8_t bits = pattern[row];
+        if(multicolor) {                                    // two bits per pixel, pixels twice as wide
+            for(int x = 0; x < 8; x += 2) {
+                pixel[x] = pixel[x + 1] = colors[(bits >> (6 - x)) & 3];
+            }
+        } else {
+            for(int x = 0; x < 8; x++) {
+                pixel[x] = colors[(bits >> (7 - x)) & 1];
+            }
+        }
+    }
+}
+
+static const uint8_t* glyph(ted_video *video, uint8_t code, bool rom) {
+    if(!rom) {
+        return video->charset + code * 8;
+    }
+    if(video->m->profile == PROFILE_C16) {
+        return video->m->rom + TED_ROM_CHARSET + code * 8;
+    }
+    return code < 64 ? builtin_font[code] : checkerboard;
+}
+
+static void draw_text_cell(ted_video *video, int cell, const uint8_t *registers, bool rom) {
+    uint8_t code = video->matrix[0x400 + cell], attribute = video->matrix[cell];
+    TED_pixel colors[4] = {registers[REG_BACKGROUND] & 0x7F, attribute & 0x7F};
+    bool reverse = false, multicolor = false;
+    uint8_t pattern[8];
+
+    if(registers[REG_CONTROL1] & 0x40) {                   // extended color: background from the upper two bits
+        colors[0] = registers[REG_BACKGROUND + (code >> 6)] & 0x7F;
+        code &= 0x3F;
+    } else if(!(registers[REG_CONTROL2] & 0x80)) {         // 128 characters, bit 7 reverses them
+        reverse = code & 0x80;
+        code &= 0x7F;
+    }
+    if((registers[REG_CONTROL2] & 0x10) && (attribute & 0x08)) {   // multicolor cell
+        multicolor = true;
+        colors[1] = registers[REG_BACKGROUND + 1] & 0x7F;
+        colors[2] = registers[REG_BACKGROUND + 2] & 0x7F;
+        colors[3] = attribute & 0x77;
+    }
+    memcpy(pattern, glyph(video, code, rom), 8);
+    for(int row = 0; reverse && row < 8; row++) {
+        pattern[row] = (uint8_t) ~pattern[row];
+    }
+    draw_cell(video, cell, pattern, colors, multicolor);
+}
+
+static void draw_bitmap_cell(ted_video *video, int cell, const uint8_t *registers) {
+    uint8_t code = video->matrix[0x400 + cell], attribute = video->matrix[cell];
+    TED_pixel set = (TED_pixel) ((attribute & 0x07) << 4 | code >> 4);
+    TED_pixel clear = (attribute & 0x70) | (code & 0x0F);
+    if(registers[REG_CONTROL2] & 0x10) {
+        TED_pixel colors[4] = {registers[REG_BACKGROUND] & 0x7F, set, clear, registers[REG_BACKGROUND + 1] & 0x7F};
+        draw_cell(video, cell, video->bitmap + cell * 8, colors, true);
+    } else {
+        TED_pixel colors[2] = {clear, set};
+        draw_cell(video, cell, video->bitmap + cell * 8, colors, false);
+    }
+}
+
+
+// Renders a frame: reads the registers, finds the cells that have changed and draws them. Returns the number of
+// cells drawn (0 for a frame without changes).
+
+int ted_video_render(ted_video *video) {
+    machine *m = video->m;
+    uint8_t registers[TED_REGISTERS];
+    for(int i = 0; i < TED_REGISTERS; i++) {
+        registers[i] = peek_register(m, register_addresses[i]);
+    }
+    bool all = !video->drawn || memcmp(registers, video->registers, TED_REGISTERS);
+    bool bitmap_mode = registers[REG_CONTROL1] & 0x20, rom = registers[REG_BITMAP] & 0x04;
+    uint16_t matrix = (uint16_t) ((registers[REG_MATRIX] & 0xF8) << 8);
+    uint16_t bitmap = (uint16_t) ((registers[REG_BITMAP] & 0x38) << 10);
+    uint16_t charset = (uint16_t) ((registers[REG_CHARSET] & 0xFC) << 8);
+    int drawn = 0;
+
+    video->frames++;
+    if(all) {
+        memcpy(video->registers, registers, TED_REGISTERS);
+        video->drawn = true;
+        memset(video->frame, registers[REG_BORDER] & 0x7F, TED_VIDEO_WIDTH * TED_VIDEO_HEIGHT);
+    }
+    if(!(registers[REG_CONTROL1] & 0x10)) {                // display off: border color only
+        if(video->sink) {
+            video->sink(video->context, video->frame, (resolution) {TED_VIDEO_WIDTH, TED_VIDEO_HEIGHT});
+        }
+        return 0;
+    }
+
+    compare_area(video, matrix, video->matrix, TED_MATRIX_SIZE, all, mark_matrix);
+    if(bitmap_mode) {
+        compare_area(video, bitmap, video->bitmap, TED_BITMAP_SIZE, all, mark_bitmap);
+    } else if(!rom) {
+        bool changed = false;
+        compare_area(video, charset, video->charset, TED_CHARSET_SIZE, all, mark_glyph);
+        for(int i = 0; i < 256; i++) {
+            changed |= video->glyph_changed[i];
+        }
+        for(int cell = 0; changed && cell < TED_CELLS; cell++) {   // cells that show a changed character
+            uint8_t code = video->matrix[0x400 + cell];
+            if(video->glyph_changed[code] || video->glyph_changed[code & 0x7F] || video->glyph_changed[code & 0x3F]) {
+                video->dirty[cell] = true;
+            }
+        }
+        memset(video->glyph_changed, 0, sizeof(video->glyph_changed));
+    }
+
+    for(int cell = 0; cell < TED_CELLS; cell++) {
+        if(video->dirty[cell] || all) {
+            if(bitmap_mode) {
+                draw_bitmap_cell(video, cell, registers);
+            } else {
+                draw_text_cell(video, cell, registers, rom);
+            }
+            video->dirty[cell] = false;
+            drawn++;
+        }
+    }
+    video->cells += drawn;
+    if(video->sink) {
+        video->sink(video->context, video->frame, (resolution) {TED_VIDEO_WIDTH, TED_VIDEO_HEIGHT});
+    }
+    return drawn;
+}
+
+void ted_video_save(ted_video *video, const char *filename) {
+    ted_video_render(video);
+    save_BMP(filename, video->frame, (resolution) {TED_VIDEO_WIDTH, TED_VIDEO_HEIGHT});
+}
+
+
+// Frame stream: raw frames, one after the other, 3 bytes per pixel in the order blue, green, red, top row first
+// (for ffmpeg: -f rawvideo -pixel_format bgr24 -video_size 384x264 -framerate 50), converted a line at a time
+
+void frame_stream_write(void *context, const TED_pixel *frame, resolution size) {
+    RGB_data palette[128], line[TED_VIDEO_WIDTH];
+    size_t count = (size_t) size.width * size.height;
+    for(int i = 0; i < 128; i++) {
+        palette[i] = TED_RGB((TED_pixel) i);
+    }
+    for(size_t i = 0; i < count; i += TED_VIDEO_WIDTH) {
+        size_t length = count - i < TED_VIDEO_WIDTH ? count - i : TED_VIDEO_WIDTH;
+        for(size_t x = 0; x < length; x++) {
+            line[x] = palette[frame[i + x] & 0x7F];
+        }
+        fwrite(line, sizeof(RGB_data), length, context);
+    }
+}
@@ -0,0 +1,34 @@
+// TED video (tedvideo.c)
+//
+// Kept out of 6502.h, as the frames are TED_pixel pictures of basic-graphics-commands: programs that use the video
+// device compile with -I../basic-graphics-commands and link tedvideo.c and C16_graphics.c (built with
+// -DC16_GRAPHICS_LIBRARY). The emulator itself does not need either.
+
+#ifndef TEDVIDEO_H
+#define TEDVIDEO_H
+
+#include <stdio.h>
+
+#include "6502.h"
+#include "C16_graphics.h"
+
+#define TED_VIDEO_BORDER 32                                 // border pixels on each side of the 320 x 200 screen
+#define TED_VIDEO_WIDTH (320 + 2 * TED_VIDEO_BORDER)
+#define TED_VIDEO_HEIGHT (200 + 2 * TED_VIDEO_BORDER)
+#define TED_FRAME_CYCLES (CLOCK_SPEED / 50)                 // PAL: 50 frames per second
+
+typedef struct ted_video ted_video;
+typedef void (*frame_sink)(void *context, const TED_pixel *frame, resolution size);
+
+ted_video* create_ted_video(machine *m, frame_sink sink, void *context);
+void destroy_ted_video(ted_video *video);                   // after the machine, if scheduled
+int ted_video_render(ted_video *video);                     // draws what has changed, returns the cells drawn
+const TED_pixel* ted_video_frame(const ted_video *video, resolution *size);
+void ted_video_save(ted_video *video, const char *filename);   // renders and writes a BMP file
+bool ted_video_schedule(ted_video *video, uint64_t interval);  // render every interval cycles
+uint64_t ted_video_frames(const ted_video *video);
+uint64_t ted_video_cells(const ted_video *video);           // cells drawn over all frames
+
+void frame_stream_write(void *context, const TED_pixel *frame, resolution size);  // a frame_sink, context: a FILE
+
+#endif
@@ -0,0 +1,325 @@
+// TRACING FOR THE SIMPLE 6502 EMULATOR
+//
+// Printing every fetched byte and the CPU status after every instruction makes a traced run as slow as the terminal.
+// Instead, the emulator can store one fixed-size binary record per instruction (see trace_record in 6502.h).
+//
+// The records go into a ring buffer that is allocated once when the trace is opened. The emulator is the only producer,
+// a background thread is the only consumer: it saves everything between "tail" and "head" to the file in large blocks.
+// As each side only writes its own index, no locks are needed. If the buffer is full, the emulator waits for the writer,
+// so no record is ever lost.
+//
+// trace_decode() reads such a file later and prints the same text output as the live trace of the demo.
+//
+// File format: 8 byte signature "6502TRC1", followed by trace_record structs (native byte order).
+
+#include <pthread.h>
+#include <sched.h>                                          // for sched_yield()
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>                                           // for nanosleep()
+#include <unistd.h>                                         // for close()
+
+#include "6502.h"
+
+#define TRACE_SIGNATURE "6502TRC1"
+#define TRACE_DECODE_BLOCK 4096                             // records read at once by trace_decode()
+
+struct trace_buffer {
+    trace_record *records;                                  // TRACE_BUFFER_SIZE records
+    _Atomic uint64_t head;                                  // next record to be filled by the emulator
+    _Atomic uint64_t tail;                                  // next record to be saved by the writer thread
+    atomic_bool stop;                                       // set by trace_close()
+    FILE *file;
+    pthread_t writer;
+};
+
+static void* trace_writer(void *argument);
+
+
+// Opens the trace file, allocates the ring buffer and starts the writer thread
+
+trace_buffer* trace_open(const char *filename) {
+    trace_buffer *trace = calloc(1, sizeof(trace_buffer));
+    if(!trace) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    trace->records = malloc(TRACE_BUFFER_SIZE * sizeof(trace_record));
+    trace->file = fopen(filename, "wb");
+    if(!trace->records || !trace->file) {
+        printf("Unable to open trace file %s.\n", filename);
+        if(trace->file) {
+            fclose(trace->file);
+        }
+        free(trace->records);
+        free(trace);
+        return NULL;
+    }
+    fwrite(TRACE_SIGNATURE, 1, 8, trace->file);
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->stop, false);
+    if(pthread_create(&trace->writer, NULL, trace_writer, trace)) {
+        printf("Unable to start trace writer.\n");
+        fclose(trace->file);
+        free(trace->records);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+
+// Called by the emulator before every traced instruction: copies the bytes at "start" that lie in host memory, before
+// the instruction can change them, and tells the bus to keep the bytes the CPU fetches from devices (bus_read_device()).
+// The trace never reads a device itself, so a traced run makes the same device accesses as an untraced one.
+
+void trace_fetch_begin(memory_bus *bus, uint16_t start, uint8_t bytes[3]) {
+    bus->fetch_start = start;
+    for(int i = 0; i < 3; i++) {
+        uint16_t address = start + i;
+        const uint8_t *memory = bus->read[address >> 8];
+        bytes[i] = memory ? memory[address & 0xFF] : 0;
+    }
+}
+
+
+// Called after the instruction: fills in the bytes fetched from devices. Only the bytes of the instruction count;
+// unknown opcodes take one byte, as executed (not from PC, as the instruction may have jumped).
+
+void trace_fetch_end(const memory_bus *bus, uint16_t start, uint8_t bytes[3]) {
+    if(!bus->read[start >> 8]) {
+        bytes[0] = bus->fetched[0];
+    }
+    int length = opcode_implemented(bytes[0]) ? opcode_table[bytes[0]].length : 1;
+    for(int i = 1; i < 3; i++) {
+        uint16_t address = start + i;
+        if(i >= length) {
+            bytes[i] = 0;
+        } else if(!bus->read[address >> 8]) {
+            bytes[i] = bus->fetched[i];
+        }
+    }
+}
+
+
+// Called by the emulator after every instruction: fills the next free slot of the ring buffer
+
+void trace_instruction(trace_buffer *trace, CPU6502 *cpu, uint16_t start, uint64_t cycle, const uint8_t bytes[3]) {
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);      // only this thread writes head
+
+    while(head - atomic_load_explicit(&trace->tail, memory_order_acquire) >= TRACE_BUFFER_SIZE) {
+        sched_yield();                                      // buffer full: give the writer some time
+    }
+    fill_trace_record(&trace->records[head & (TRACE_BUFFER_SIZE - 1)], cpu, start, cycle, bytes);
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);           // publish the record
+}
+
+
+// Stops the writer thread after it has saved all remaining records, closes the file. Returns false on write errors
+// (e.g. a full disk), which the writer thread cannot report itself: the trace is incomplete then.
+
+bool trace_close(trace_buffer *trace) {
+    atomic_store(&trace->stop, true);
+    pthread_join(trace->writer, NULL);
+    bool written = !ferror(trace->file);
+    written = !fclose(trace->file) && written;
+    free(trace->records);
+    free(trace);
+    return written;
+}
+
+
+// Writer thread: saves everything between tail and head, then moves tail along.
+// A block never wraps around the end of the buffer, so each block is a single fwrite().
+
+static void* trace_writer(void *argument) {
+    trace_buffer *trace = argument;
+    struct timespec pause = {0, 1000000};                   // 1 ms when there is nothing to do
+
+    while(1) {
+        bool stopping = atomic_load(&trace->stop);          // read before head, so no last record can slip through
+        uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+        if(head == tail) {
+            if(stopping) {
+                return NULL;
+            }
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        uint64_t first = tail & (TRACE_BUFFER_SIZE - 1);
+        uint64_t count = head - tail;
+        if(first + count > TRACE_BUFFER_SIZE) {
+            count = TRACE_BUFFER_SIZE - first;
+        }
+        fwrite(&trace->records[first], sizeof(trace_record), count, trace->file);   // errors: see trace_close()
+        atomic_store_explicit(&trace->tail, tail + count, memory_order_release);   // free the slots for the emulator
+    }
+}
+
+
+// Builds a record for the instruction that started at "start" and has just been executed, from the bytes that
+// trace_fetch_begin() and trace_fetch_end() have collected
+
+void fill_trace_record(trace_record *record, CPU6502 *cpu, uint16_t start, uint64_t cycle, const uint8_t bytes[3]) {
+    record->cycle   = cycle;
+    record->PC      = start;
+    record->next_PC = cpu->PC;
+    memcpy(record->bytes, bytes, 3);
+    record->length  = opcode_implemented(bytes[0]) ? opcode_table[bytes[0]].length : 1;
+    record->A  = cpu->A;
+    record->X  = cpu->X;
+    record->Y  = cpu->Y;
+    record->SP = cpu->SP;
+    record->SR = get_status(cpu);
+    memset(record->reserved, 0, sizeof(record->reserved));
+}
+
+
+// Prints one record in the classic text format: address and bytes, then the CPU status
+
+void print_trace_record(const trace_record *record, bool show_data, bool show_status) {
+    if(show_data) {
+        printf(".%04X  ", record->PC);
+        for(int i = 0; i < record->length; i++) {
+            printf("%02X ", record->bytes[i]);
+        }
+    }
+    if(!opcode_implemented(record->bytes[0])) {
+        printf("Unknown opcode %02X.\n", record->bytes[0]);
+    }
+    if(show_data && show_status) {
+        printf("\n\n");
+    } else {
+        if(show_data) {
+            printf("\n");
+        }
+    }
+    if(show_status) {
+        CPU6502 cpu = {record->A, record->X, record->Y, record->SP, record->next_PC, 0, record->cycle, 0, false, 0, 0, 0};
+        set_status(&cpu, record->SR);
+        show_cpu_status(cpu);
+    }
+}
+
+
+// Offline decoder: prints a complete trace file
+
+int trace_decode(const char *filename, bool show_data, bool show_status) {
+    FILE *file = fopen(filename, "rb");
+    char signature[8];
+    if(!file) {
+        printf("Unable to open trace file %s.\n", filename);
+        return 1;
+    }
+    if(fread(signature, 1, 8, file) != 8 || memcmp(signature, TRACE_SIGNATURE, 8)) {
+        printf("%s is not a trace file.\n", filename);
+        fclose(file);
+        return 1;
+    }
+
+    trace_record *block = malloc(TRACE_DECODE_BLOCK * sizeof(trace_record));
+    if(!block) {
+        printf("Memory allocation failed.\n");
+        fclose(file);
+        return 1;
+    }
+    size_t count;
+    while((count = fread(block, sizeof(trace_record), TRACE_DECODE_BLOCK, file)) > 0) {
+        for(size_t i = 0; i < count; i++) {
+            print_trace_record(&block[i], show_data, show_status);
+        }
+    }
+    free(block);
+    fclose(file);
+    return 0;
+}
+
+
+// Self-check (./6502 -c): the trace records the bytes as fetched and adds no device reads. The program rewrites the
+// operand of its own STA, then runs into a device that serves the next instructions; the CLC at $02FF is followed by
+// two bytes of the device, which are not part of it.
+
+static const uint8_t check_code[] = {0xA9, 0x01, 0x8D, 0xFA, 0x02, 0x18, 0x18, 0x18, 0x18};     // at $02F7
+static const uint8_t check_device_code[] = {0xA9, 0x42, 0x00};                                  // at $0300
+
+static const struct {
+    uint16_t PC;
+    uint8_t bytes[3];
+} check_records[] = {
+    {0x02F7, {0xA9, 0x01, 0x00}},                           // LDA #$01
+    {0x02F9, {0x8D, 0xFA, 0x02}},                           // STA $02FA  as executed, not as $02F9 afterwards
+    {0x02FC, {0x18, 0x00, 0x00}},                           // CLC
+    {0x02FD, {0x18, 0x00, 0x00}},                           // CLC
+    {0x02FE, {0x18, 0x00, 0x00}},                           // CLC
+    {0x02FF, {0x18, 0x00, 0x00}},                           // CLC
+    {0x0300, {0xA9, 0x42, 0x00}},                           // LDA #$42   from the device
+    {0x0302, {0x00, 0x00, 0x00}}                            // BRK
+};
+
+static uint8_t check_device_read(void *device, uint16_t address) {
+    (*(int *) device)++;
+    return address - 0x0300 < (int) sizeof(check_device_code) ? check_device_code[address - 0x0300] : 0x00;
+}
+
+static int check_run(trace_buffer *trace) {                 // returns the device reads
+    machine *m = create_machine();
+    int reads = 0;
+    if(!m || !load_image(m, check_code, sizeof(check_code), 0x02F7)
+       || !attach_device(m, 0x0300, 0x03FF, check_device_read, NULL, &reads)) {
+        destroy_machine(m);
+        return -1;
+    }
+    m->cpu.PC = 0x02F7;
+    run_budget budget = {0};
+    budget.instructions = 20;
+    budget.trace = trace;
+    run_machine(m, budget);
+    destroy_machine(m);
+    return reads;
+}
+
+bool check_trace(void) {
+    int records = sizeof(check_records) / sizeof(check_records[0]), failures = 0;
+    char filename[] = "/tmp/6502-trace-XXXXXX";
+    int file = mkstemp(filename);
+    if(file < 0) {
+        printf("Trace: unable to create a temporary file\n");
+        return false;
+    }
+    close(file);
+
+    trace_buffer *trace = trace_open(filename);
+    int untraced = check_run(NULL), traced = trace ? check_run(trace) : -1;
+    if(trace && !trace_close(trace)) {
+        printf("Trace: unable to write %s\n", filename);
+        failures++;
+    }
+    if(traced != untraced || traced < 0) {
+        printf("Trace: %d device reads with the trace, %d without\n", traced, untraced);
+        failures++;
+    }
+
+    trace_record record;
+    FILE *saved = fopen(filename, "rb");
+    for(int i = 0; saved && !failures && i < records; i++) {
+        bool read = fseek(saved, 8 + i * (long) sizeof(trace_record), SEEK_SET) == 0
+                    && fread(&record, sizeof(trace_record), 1, saved) == 1;
+        if(!read || record.PC != check_records[i].PC || memcmp(record.bytes, check_records[i].bytes, 3)) {
+            printf("Trace: record %d wrong (expected .%04X  %02X %02X %02X)\n", i, check_records[i].PC,
+                   check_records[i].bytes[0], check_records[i].bytes[1], check_records[i].bytes[2]);
+            failures++;
+        }
+    }
+    if(saved) {
+        fclose(saved);
+    }
+    remove(filename);
+    printf("Trace: %d records of a self-modifying program and of code in a device, %d device reads, %d failed\n",
+           records, untraced, failures);
+    return saved && failures == 0;
+}
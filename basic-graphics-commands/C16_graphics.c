@@ -12,14 +12,17 @@
 //
 // Other commands included CIRCLE (drawing circles or ellipses or segments of them: this looks really hard to do)
 //                     and COLOR  (defining the color from a fixed palette of color/brightness values),
-// but those are not implemented here.
+// but those are not implemented here; TED_index and TED_color only provide the palette, for callers like the BASIC interpreter.
 //
 // The demos use the C16's max screen resolution of 320 x 200 pixels (how impressive...).
 // As the C16 had only 16 KB, graphics information was stored differently: Color information was stored by storing a color ID 
 // and a brightness ID of a few bits each, not multi-byte RGB data. The lo-res mode had further restrictions concerning
 // how many colors might be used within one square of 8 x 8 pixels, resulting in less graphics memory that had to be reserved.
-// My program uses 320 x 200 = 64,000 pixels à 3 char values à 1 byte, resulting in 192,000 bytes or 187,5 KB (let alone linked lists etc.).
+// My program first used 320 x 200 = 64,000 pixels à 3 char values à 1 byte, resulting in 192,000 bytes or 187,5 KB (let alone linked lists etc.).
 // This is more than 11 times the complete RAM of C16, and still nearly 3 times the RAM of C64!
+// Now every pixel is one byte like the TED's color registers (color ID and brightness ID, see TED_pixel), 62,5 KB in all,
+// and comparing two colors in PAINT compares one byte. RGB values only appear when a picture is saved.
+// (Four bits per pixel would halve this again, but only hold the 16 colors of one brightness, not the 121 of the TED.)
 //
 // I found a BASIC / assembly version of the line-drawing algorithm in an old book on computer graphics
 // (Klaus Loeffelmann, Axel Plenge: "Das Grafikbuch zum Commodore 16", Duesseldorf 1986) and simply translated in to C.
@@ -36,6 +39,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "C16_graphics.h"
+
 #pragma pack(push, 1)
 
 typedef struct {
@@ -59,61 +64,21 @@ typedef struct {
 
 #pragma pack(pop)
 
-typedef struct {                                                                    // Color information for a single pixel
-    unsigned char b, g, r;
-} RGB_data;
-
-typedef struct {                                                                    // Set of X/Y coordinates
-    int x, y;
-} coordinates;
 
-typedef struct parameter_list {
-    coordinates xy;
-    struct parameter_list* next;
-} parameter_list;
+// main is simply a succession of demo routines. Programs that use the commands as a library (see C16_graphics.h)
+// compile this file with -DC16_GRAPHICS_LIBRARY to leave it out.
 
-typedef struct {
-    int width, height;
-} resolution;
-
-
-// Function prototypes: GRAPHIC ........ set screen resolution
-//                      SCNCLR ......... clear screen
-//                      DRAW ........... draw a line, using two pair of coordinates (from -> to)
-//                      DRAW_from_list . draw a line, taking coordinates from a linked list
-//                      PAINT .......... fill an area, return number of pixels
-void GRAPHIC(int mode, resolution* screen);
-void SCNCLR(RGB_data* bitmap, resolution screen);
-void DRAW(coordinates start, coordinates end, RGB_data color, coordinates* graphics_cursor, RGB_data* bitmap, resolution screen);
-void DRAW_from_list(parameter_list* head, RGB_data color, coordinates* graphics_cursor, RGB_data* bitmap, resolution screen);
-void BOX(coordinates start, coordinates end, RGB_data color, int angle, bool fill, coordinates* graphics_cursor, RGB_data* bitmap, resolution screen);
-int  PAINT(coordinates start, RGB_data target_color, RGB_data fill_color, RGB_data* bitmap, resolution screen);
-void LOCATE(coordinates new, coordinates* graphics_cursor, resolution screen);
-
-// Utility functions:   line drawing algorithm
-//                      linked list management (add element, delete list)
-//                      box corner rotation
-//                      color check
-//                      file save
-void draw_line(coordinates from, coordinates to, RGB_data color, RGB_data* bitmap, resolution screen);
-void add_coordinates_to_list(parameter_list **head, int x, int y);
-void free_coordinates_list(parameter_list* head);
-coordinates rotate(coordinates point, int angle, coordinates pivot);
-bool same_color(RGB_data color1, RGB_data color2);
-void save_BMP(const char *filename, RGB_data* bitmap, resolution screen);
-
-
-// main is simply a succession of demo routines.
+#ifndef C16_GRAPHICS_LIBRARY
 
 int main() {
     printf("Graphics demo emulating the 320 x 200 pixel 'hi-res' mode of the Commodore 16.\n\n");
     resolution screen;                                                              // Declare resolution variable
     GRAPHIC(1, &screen);                                                            // 1 and 2: Hi-res resolution of 320 x 200 pixels
-    RGB_data* bitmap = (RGB_data *) malloc(screen.width * screen.height * sizeof(RGB_data));
-    RGB_data current_color = {0xFF, 0x00, 0x00};                                    // Current color for drawing
-    RGB_data target_color  = {0xFF, 0xFF, 0xFF};                                    // Color that will be filled
-    RGB_data fill_color1   = {0x00, 0xFF, 0x00};                                    // Color 1 to fill an area with
-    RGB_data fill_color2   = {0xFF, 0xFF, 0x00};                                    // Color 2 to fill an area with
+    TED_pixel* bitmap = (TED_pixel *) malloc(screen.width * screen.height * sizeof(TED_pixel));
+    TED_pixel current_color = TED_index(7, 3);                                      // Current color for drawing (blue)
+    TED_pixel target_color  = TED_index(2, 7);                                      // Color that will be filled (white)
+    TED_pixel fill_color1   = TED_index(6, 5);                                      // Color 1 to fill an area with (green)
+    TED_pixel fill_color2   = TED_index(4, 6);                                      // Color 2 to fill an area with (cyan)
     coordinates* graphics_cursor = malloc(sizeof(coordinates));                     // Graphics cursor
     if(!graphics_cursor || !bitmap) {
         printf("Memory allocation failed.\n");
@@ -183,6 +148,8 @@ int main() {
     return 0;
 }
 
+#endif
+
 
 // Sets the graphic mode to hi-res or lo-res
 
@@ -211,11 +178,10 @@ void GRAPHIC(int mode, resolution* screen) {
 // Implements the SCNCLR command:
 // Iterates complete bitmap and fill with white pixels
 
-void SCNCLR(RGB_data* bitmap, resolution screen) {
+void SCNCLR(TED_pixel* bitmap, resolution screen) {
+    TED_pixel white = TED_index(2, 7);
     for (int i = 0; i < screen.width * screen.height; i++) {
-        bitmap[i].r = 0xFF;
-        bitmap[i].g = 0xFF;
-        bitmap[i].b = 0xFF;
+        bitmap[i] = white;
     }
 }
 
@@ -225,7 +191,7 @@ void SCNCLR(RGB_data* bitmap, resolution screen) {
 // -- if end   == -1, draw a dot at start / graphics cursor position
 // -- otherwise,      draw a line from start to end and update graphics cursor position
 
-void DRAW(coordinates start, coordinates end, RGB_data color, coordinates* graphics_cursor, RGB_data* bitmap, resolution screen) {
+void DRAW(coordinates start, coordinates end, TED_pixel color, coordinates* graphics_cursor, TED_pixel* bitmap, resolution screen) {
     if (start.x == -1 || start.y == -1) {                                           // Check if starting point is {-1, -1}
         start.x = graphics_cursor->x;
         start.y = graphics_cursor->y;
@@ -243,7 +209,7 @@ void DRAW(coordinates start, coordinates end, RGB_data color, coordinates* graph
 
 // Draw a shape indicated by a linked list of coordinates.
 
-void DRAW_from_list(parameter_list* head, RGB_data color, coordinates* graphics_cursor, RGB_data* bitmap, resolution screen) {
+void DRAW_from_list(parameter_list* head, TED_pixel color, coordinates* graphics_cursor, TED_pixel* bitmap, resolution screen) {
     if (head == NULL || head->next == NULL) {                                       // Empty list
         return;
     }
@@ -266,13 +232,14 @@ void DRAW_from_list(parameter_list* head, RGB_data color, coordinates* graphics_
 // "fill" parameter is passed but not processed. I would need to calculate a starting point within the rectangle,
 // then modify PAINT so that every color that is not equal to the border color of the rectangle will be overwritten.
 
-void BOX(coordinates start, coordinates end, RGB_data color, int angle, bool fill, coordinates* graphics_cursor, RGB_data* bitmap, resolution screen) {
+void BOX(coordinates start, coordinates end, TED_pixel color, int angle, bool fill, coordinates* graphics_cursor, TED_pixel* bitmap, resolution screen) {
     coordinates corners[4] = {                                                      // Determine the four corner points
         start,
         {end.x, start.y},
         end,
         {start.x, end.y}
     };
+    (void) fill;                                                                    // not supported yet, see above
 
     if(angle) {                                                                     // If necessary, rotate corner points
         for(int i = 0; i < 4; i++) {
@@ -288,7 +255,7 @@ void BOX(coordinates start, coordinates end, RGB_data color, int angle, bool fil
 
 // This fills a certain area of adjacent pixels in "target_color" by updating them to "fill_color".
 
-int PAINT(coordinates start, RGB_data target_color, RGB_data fill_color, RGB_data* bitmap, resolution screen) {
+int PAINT(coordinates start, TED_pixel target_color, TED_pixel fill_color, TED_pixel* bitmap, resolution screen) {
     if(start.x < 0 || start.x >= screen.width || start.y < 0 || start.y >= screen.height) {     // Check for boundaries
         return 0;
     }
@@ -359,13 +326,13 @@ void LOCATE(coordinates new, coordinates* graphics_cursor, resolution screen) {
 
 // Bresenham algorithm for drawing lines.
 
-void draw_line(coordinates from, coordinates to, RGB_data color, RGB_data* bitmap, resolution screen) {
+void draw_line(coordinates from, coordinates to, TED_pixel color, TED_pixel* bitmap, resolution screen) {
     int dx =  abs(to.x - from.x), sx = from.x < to.x ? 1 : -1;                      // Difference and sign, x axis (dx, sx)
     int dy = -abs(to.y - from.y), sy = from.y < to.y ? 1 : -1;                      // Same for y axis
     int error = dx + dy, temp_error;                                                // Initial error value and temp error declaration
 
     while (1) {
-        if(from.x >= 0 && from.x < screen.width && from.y >= 0 && from.y < screen.width) {  // Check for boundaries
+        if(from.x >= 0 && from.x < screen.width && from.y >= 0 && from.y < screen.height) { // Check for boundaries
             // Set next point of line:
             // from.y * screen.width "fast forwards" complete lines,
             // from.x adds until we reach the correct x axis position
@@ -448,19 +415,79 @@ coordinates rotate(coordinates point, int angle, coordinates pivot) {
 }
 
 
-// Compares color1 and color2; this is trivial.
+// Compares color1 and color2; this is trivial (one byte each).
 
-bool same_color(RGB_data color1, RGB_data color2) {
-    return color1.r == color2.r && color1.g == color2.g && color1.b == color2.b;
+bool same_color(TED_pixel color1, TED_pixel color2) {
+    return color1 == color2;
 }
 
 
-// BMP saving
+// Pixel value of a color 1-16 in luminance 0-7, as in the COLOR command. Black is always 0, so that PAINT
+// doesn't tell apart black pixels that look the same.
+
+TED_pixel TED_index(int color, int luminance) {
+    if(color <= 1 || color > 16) {                                                  // Black (and invalid colors)
+        return 0;
+    }
+    luminance = luminance < 0 ? 0 : luminance > 7 ? 7 : luminance;
+    return (TED_pixel) (luminance << 4 | (color - 1));
+}
 
-void save_BMP(const char *filename, RGB_data* bitmap, resolution screen) {
+
+// Approximates the TED palette: colors 1-16 (numbered as in the COLOR command) in luminances 0-7, 121 different values
+// in all, as black looks the same in every luminance. Each color is a hue angle on the YUV color plane (0 for white),
+// with a fixed saturation; the luminance sets Y.
+
+RGB_data TED_color(int color, int luminance) {
+    static const int hues[16] = {                                                   // Degrees; -1 = no color
+        -1, -1, 103, 283, 53, 241, 347, 167, 123, 148, 195, 83, 265, 323, 5, 213
+    };
+    static const double levels[8] = {0.13, 0.19, 0.26, 0.35, 0.47, 0.61, 0.77, 0.96};
+    if(color <= 1 || color > 16) {                                                  // Black (and invalid colors)
+        return (RGB_data) {0, 0, 0};
+    }
+    luminance = luminance < 0 ? 0 : luminance > 7 ? 7 : luminance;
+    double y = levels[luminance], u = 0, v = 0;
+    if(hues[color - 1] >= 0) {
+        u = 0.18 * cos(hues[color - 1] * M_PI / 180);
+        v = 0.18 * sin(hues[color - 1] * M_PI / 180);
+    }
+    double rgb[3] = {y + 1.140 * v, y - 0.395 * u - 0.581 * v, y + 2.032 * u};
+    unsigned char value[3];
+    for(int i = 0; i < 3; i++) {                                                    // Clamp to 0..1, scale to 0..255
+        value[i] = (unsigned char) round((rgb[i] < 0 ? 0 : rgb[i] > 1 ? 1 : rgb[i]) * 255);
+    }
+    return (RGB_data) {value[2], value[1], value[0]};
+}
+
+
+// RGB value of a pixel; the 128 possible values are calculated once.
+
+RGB_data TED_RGB(TED_pixel pixel) {
+    static RGB_data palette[128];
+    static bool ready = false;
+    if(!ready) {
+        for(int i = 0; i < 128; i++) {
+            palette[i] = TED_color((i & 0x0F) + 1, i >> 4);
+        }
+        ready = true;
+    }
+    return palette[pixel & 0x7F];
+}
+
+
+// BMP saving: 24-bit BMP, each line of pixels is converted to RGB just before it is written
+
+void save_BMP(const char *filename, const TED_pixel* bitmap, resolution screen) {
+    RGB_data* line = malloc(screen.width * sizeof(RGB_data));                       // One line of pixels in RGB
+    if(!line) {
+        printf("Memory allocation failed.\n");
+        return;
+    }
     FILE *file = fopen(filename, "wb");
     if(!file) {
         printf("Unable to open file %s.\n", filename);
+        free(line);
         return;
     }
 
@@ -486,6 +513,12 @@ void save_BMP(const char *filename, RGB_data* bitmap, resolution screen) {
 
     fwrite(&bmp_header, sizeof(file_header), 1, file);                              // Write file header
     fwrite(&bmp_info_header, sizeof(info_header), 1, file);                         // Write info header
-    fwrite(bitmap, sizeof(RGB_data), screen.width * screen.height, file);           // Write bitmap data
+    for(int y = 0; y < screen.height; y++) {                                        // Write bitmap data, line by line
+        for(int x = 0; x < screen.width; x++) {
+            line[x] = TED_RGB(bitmap[y * screen.width + x]);
+        }
+        fwrite(line, sizeof(RGB_data), screen.width, file);
+    }
+    free(line);
     fclose(file);                                                                   // Close
 }
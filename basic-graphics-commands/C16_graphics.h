@@ -0,0 +1,59 @@
+// Declarations of the graphics commands in C16_graphics.c, for programs that use them as a library
+// (compile C16_graphics.c with -DC16_GRAPHICS_LIBRARY to leave out its demo main).
+
+#ifndef C16_GRAPHICS_H
+#define C16_GRAPHICS_H
+
+#include <stdbool.h>
+
+typedef struct {                                                                    // RGB color, as written to BMP files
+    unsigned char b, g, r;
+} RGB_data;
+
+typedef unsigned char TED_pixel;                                                    // Color of a single pixel, as in the TED's color registers:
+                                                                                    // color 0-15 in bits 0-3, luminance 0-7 in bits 4-6
+
+typedef struct {                                                                    // Set of X/Y coordinates
+    int x, y;
+} coordinates;
+
+typedef struct parameter_list {
+    coordinates xy;
+    struct parameter_list* next;
+} parameter_list;
+
+typedef struct {
+    int width, height;
+} resolution;
+
+
+// Function prototypes: GRAPHIC ........ set screen resolution
+//                      SCNCLR ......... clear screen
+//                      DRAW ........... draw a line, using two pair of coordinates (from -> to)
+//                      DRAW_from_list . draw a line, taking coordinates from a linked list
+//                      PAINT .......... fill an area, return number of pixels
+void GRAPHIC(int mode, resolution* screen);
+void SCNCLR(TED_pixel* bitmap, resolution screen);
+void DRAW(coordinates start, coordinates end, TED_pixel color, coordinates* graphics_cursor, TED_pixel* bitmap, resolution screen);
+void DRAW_from_list(parameter_list* head, TED_pixel color, coordinates* graphics_cursor, TED_pixel* bitmap, resolution screen);
+void BOX(coordinates start, coordinates end, TED_pixel color, int angle, bool fill, coordinates* graphics_cursor, TED_pixel* bitmap, resolution screen);
+int  PAINT(coordinates start, TED_pixel target_color, TED_pixel fill_color, TED_pixel* bitmap, resolution screen);
+void LOCATE(coordinates new, coordinates* graphics_cursor, resolution screen);
+
+// Utility functions:   line drawing algorithm
+//                      linked list management (add element, delete list)
+//                      box corner rotation
+//                      color check
+//                      TED color (color 1-16 and luminance 0-7 as in the COLOR command) as pixel value and as RGB
+//                      file save (the only place where pixels become RGB)
+void draw_line(coordinates from, coordinates to, TED_pixel color, TED_pixel* bitmap, resolution screen);
+void add_coordinates_to_list(parameter_list **head, int x, int y);
+void free_coordinates_list(parameter_list* head);
+coordinates rotate(coordinates point, int angle, coordinates pivot);
+bool same_color(TED_pixel color1, TED_pixel color2);
+TED_pixel TED_index(int color, int luminance);
+RGB_data TED_color(int color, int luminance);
+RGB_data TED_RGB(TED_pixel pixel);
+void save_BMP(const char *filename, const TED_pixel* bitmap, resolution screen);
+
+#endif
@@ -0,0 +1,2999 @@
+// COMMODORE BASIC V3.5 INTERPRETER
+//
+// Runs BASIC programs for the C16, C116 and Plus/4 (such as ted-demo/demo.bas) on the host, much faster than the
+// BASIC ROM does on the real machine, but in the machine's own memory: PEEK and POKE go to the 64 KB of an emulated
+// machine (6502-emulator) with the TED sound device (tedsound.c) at $FF0E-$FF12, SYS calls machine code on its CPU,
+// and GRAPHIC, SCNCLR, DRAW, BOX, PAINT, LOCATE and COLOR draw with the commands of basic-graphics-commands.
+//
+// The program is translated once, when it is loaded, into bytecode for a stack machine, so the interpreter loop
+// never looks at program text again:
+// - Keywords are recognized as by the ROM, also without spaces ("fori=1to9"). Expressions become postfix code, and
+//   their types are checked at load time.
+// - Variables (two significant characters plus type, as in the ROM) get a slot number when they first appear; at
+//   run time, a variable is an index into an array instead of an entry of a list that is searched on every access.
+// - GOTO, GOSUB, THEN, ELSE and ON ... GOTO/GOSUB targets are resolved to code offsets, and DO/LOOP/EXIT are matched,
+//   so no jump ever searches for a line.
+//
+// Time: every statement counts BASIC_STATEMENT_CYCLES cycles of the machine, about the speed of the ROM. This gives
+// POKEs to the sound registers their place in time, and paces the key script (-k) that GET, GETKEY and INPUT read,
+// one key every BASIC_KEY_INTERVAL cycles. The program runs until END, STOP, an error, the end of the key script
+// while waiting for a key, or its time limit (-t, in seconds of machine time).
+//
+// Text goes to the screen memory at $0C00 (40 x 25 characters, cursor in $CA/$CD as in the KERNAL; SYS 55464 moves
+// the cursor there). It is printed when the program ends or, with -a, streamed to the terminal as it happens. The TED
+// video device (tedvideo.c) can also render it as the machine shows it, as a picture at the end (-v) or as a stream
+// of frames, 50 per second of machine time (-V).
+// Program text and key scripts are taken as the C16 keyboard types them: lower case letters are the unshifted ones
+// (PETSCII 65-90), upper case letters the shifted ones (193-218).
+//
+// Not included: user functions (DEF FN), the disk, sprite and music commands (SOUND, CIRCLE, CHAR, ...), BEGIN/BEND,
+// TRAP, and direct mode. INPUT, GET and READ go to simple variables or array elements; DO/LOOP is matched by its
+// position in the program, not at run time.
+//
+// Build: gcc -O2 -pthread -DC16_GRAPHICS_LIBRARY -I../6502-emulator -I../basic-graphics-commands -o basic basic.c
+//        ../6502-emulator/{6502,bus,snapshot,cache,loader,events,replay,audio,tedsound,tedvideo,debug,profile,disasm,
+//        trace,batch,suite,lockstep,alu}.c ../basic-graphics-commands/C16_graphics.c -lm
+// Usage: ./basic [-k keys] [-t seconds] [-w sound.wav] [-g picture.bmp] [-v screen.bmp] [-V frames] [-a] program.bas
+//        keys: as typed, with \e (Esc), \n (Return), \\ and \xNN for other PETSCII codes
+//        frames: raw BGR frames of TED_VIDEO_WIDTH x TED_VIDEO_HEIGHT pixels ("-": stdout), see tedvideo.c
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "6502.h"
+#include "C16_graphics.h"
+#include "tedvideo.h"
+
+#define BASIC_LINE_LENGTH 256                               // longest program line
+#define BASIC_STATEMENT_CYCLES 1000                         // machine cycles per statement
+#define BASIC_KEY_INTERVAL (CLOCK_SPEED / 2)                // cycles between two keys of the key script
+#define BASIC_SECONDS 60                                    // default time limit
+#define BASIC_SYS_CYCLES (10 * CLOCK_SPEED)                 // longest machine code call
+#define BASIC_NAMES 1024                                    // variable names (hash table size, a power of 2)
+#define BASIC_NESTING 32                                    // expression nesting; bounds the stack depth
+#define BASIC_STACK 256                                     // numbers on the stack
+#define BASIC_STRING_STACK 64                               // strings on the stack
+#define BASIC_GOSUB_DEPTH 256
+#define BASIC_FOR_DEPTH 64
+#define BASIC_DO_DEPTH 32
+#define BASIC_DO_EXITS 16                                   // EXITs per DO loop
+#define BASIC_IFS 16                                        // IFs and ELSEs per line
+#define BASIC_DIMENSIONS 4
+#define BASIC_DRAW_POINTS 32                                // TO points per DRAW
+#define BASIC_INPUT_LENGTH 88                               // as the screen editor: two lines of 40, plus a little
+#define BASIC_LARGEST 1.70141183E+38                        // largest number of the ROM's floating point format
+
+#define SCREEN_MEMORY 0x0C00
+#define COLOR_MEMORY 0x0800
+#define SCREEN_COLUMNS 40
+#define SCREEN_ROWS 25
+#define TEXT_COLOR 0x00                                     // black
+#define CURSOR_COLUMN 202                                   // $CA
+#define CURSOR_ROW 205                                      // $CD
+#define PLOT_ROUTINE 55464                                  // $D8A8: sets the cursor from $CD/$CA
+#define SYS_REGISTERS 0x07F2                                // A, X, Y and SR for SYS, and after it
+#define SYS_RETURN 0xFFF8                                   // SYS calls return here, where a breakpoint stops them
+#define SOUND_CONTROL 0xFF11                                // TED volume and voice switches
+
+typedef struct {
+    uint8_t length;
+    uint8_t text[255];
+} basic_string;
+
+enum {                                                      // bytecode; operands follow the opcode, 16 and 32 bit
+    OP_STATEMENT,                                           // little endian
+    OP_NUMBER,                                              // double (8 bytes)
+    OP_STRING,                                              // length, text
+    OP_LOAD, OP_LOAD_STRING,                                // slot
+    OP_STORE, OP_STORE_INTEGER, OP_STORE_STRING,            // slot
+    OP_LOAD_ELEMENT, OP_LOAD_STRING_ELEMENT,                // slot, dimensions; subscripts on the stack
+    OP_STORE_ELEMENT, OP_STORE_INTEGER_ELEMENT, OP_STORE_STRING_ELEMENT,
+    OP_DIM, OP_DIM_STRING,                                  // slot, dimensions
+    OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_POWER, OP_NEGATE,
+    OP_EQUAL, OP_NOT_EQUAL, OP_LESS, OP_GREATER, OP_LESS_EQUAL, OP_GREATER_EQUAL,
+    OP_STRING_EQUAL, OP_STRING_NOT_EQUAL, OP_STRING_LESS, OP_STRING_GREATER, OP_STRING_LESS_EQUAL,
+    OP_STRING_GREATER_EQUAL, OP_CONCATENATE,
+    OP_AND, OP_OR, OP_NOT,
+    OP_FUNCTION,                                            // function, number of arguments
+    OP_JUMP, OP_JUMP_IF_FALSE, OP_JUMP_IF_TRUE, OP_GOSUB,   // code offset
+    OP_RETURN,
+    OP_ON_GOTO, OP_ON_GOSUB,                                // count, code offsets
+    OP_FOR,                                                 // slot; limit and step on the stack
+    OP_NEXT,                                                // slot, NEXT_ANY: the innermost loop
+    OP_PRINT_NUMBER, OP_PRINT_STRING, OP_PRINT_COMMA, OP_PRINT_NEWLINE, OP_PRINT_SPC, OP_PRINT_TAB,
+    OP_USING,                                               // PRINT USING format from the stack
+    OP_PRINT_USING_NUMBER, OP_PRINT_USING_STRING,
+    OP_GET,                                                 // GET_* flags; pushes the key
+    OP_INPUT,                                               // prompt on the stack; reads a line
+    OP_INPUT_NUMBER, OP_INPUT_STRING,                       // push the next field of the line
+    OP_READ_NUMBER, OP_READ_STRING, OP_RESTORE,
+    OP_POKE, OP_SYS, OP_VOL, OP_SCNCLR,
+    OP_GRAPHIC, OP_COLOR, OP_BOX, OP_PAINT, OP_LOCATE,      // mask of the arguments given
+    OP_DRAW,                                                // DRAW_* flags, number of TO points
+    OP_STOP, OP_END
+};
+
+#define NEXT_ANY 0xFFFF
+#define GET_NUMBER 1                                        // OP_GET: for a number variable
+#define GET_WAIT 2                                          // OP_GET: GETKEY, waits for a key
+#define DRAW_SOURCE 1                                       // OP_DRAW: color source given
+#define DRAW_START 2                                        // OP_DRAW: start point given
+
+typedef enum {
+    KW_AND, KW_OR, KW_NOT, KW_REM, KW_PRINT, KW_GOSUB, KW_GOTO, KW_DO, KW_LOOP, KW_WHILE, KW_UNTIL, KW_EXIT, KW_GET,
+    KW_GETKEY, KW_IF, KW_THEN, KW_ELSE, KW_POKE, KW_VOL, KW_SYS, KW_RETURN, KW_END, KW_STOP, KW_INPUT, KW_LET,
+    KW_FOR, KW_TO, KW_STEP, KW_NEXT, KW_DIM, KW_DATA, KW_READ, KW_RESTORE, KW_ON, KW_SCNCLR, KW_GRAPHIC, KW_DRAW,
+    KW_BOX, KW_PAINT, KW_LOCATE, KW_COLOR, KW_USING, KW_SPC, KW_TAB, KW_KEYWORDS
+} keyword;
+
+static const char *keywords[KW_KEYWORDS] = {
+    "and", "or", "not", "rem", "print", "gosub", "goto", "do", "loop", "while", "until", "exit", "get",
+    "getkey", "if", "then", "else", "poke", "vol", "sys", "return", "end", "stop", "input", "let",
+    "for", "to", "step", "next", "dim", "data", "read", "restore", "on", "scnclr", "graphic", "draw",
+    "box", "paint", "locate", "color", "using", "spc(", "tab("
+};
+
+typedef enum {
+    FN_ASC, FN_PEEK, FN_INT, FN_HEX, FN_VAL, FN_CHR, FN_ABS, FN_SGN, FN_SQR, FN_RND, FN_LEN, FN_STR, FN_LEFT,
+    FN_RIGHT, FN_MID, FN_SIN, FN_COS, FN_TAN, FN_ATN, FN_EXP, FN_LOG, FN_DEC, FN_INSTR, FN_FUNCTIONS
+} function_id;
+
+typedef struct {
+    const char *name;                                       // with the opening bracket
+    char result;                                            // 'n': number, 's': string
+    const char *arguments;                                  // 'n', 's'; upper case: may be left out
+} basic_function;
+
+static const basic_function functions[FN_FUNCTIONS] = {
+    {"asc(", 'n', "s"}, {"peek(", 'n', "n"}, {"int(", 'n', "n"}, {"hex$(", 's', "n"}, {"val(", 'n', "s"},
+    {"chr$(", 's', "n"}, {"abs(", 'n', "n"}, {"sgn(", 'n', "n"}, {"sqr(", 'n', "n"}, {"rnd(", 'n', "n"},
+    {"len(", 'n', "s"}, {"str$(", 's', "n"}, {"left$(", 's', "sn"}, {"right$(", 's', "sn"}, {"mid$(", 's', "snN"},
+    {"sin(", 'n', "n"}, {"cos(", 'n', "n"}, {"tan(", 'n', "n"}, {"atn(", 'n', "n"}, {"exp(", 'n', "n"},
+    {"log(", 'n', "n"}, {"dec(", 'n', "s"}, {"instr(", 'n', "ssN"}
+};
+
+typedef enum {
+    TOKEN_END, TOKEN_NUMBER, TOKEN_STRING, TOKEN_NAME, TOKEN_KEYWORD, TOKEN_FUNCTION, TOKEN_SYMBOL
+} token_kind;
+
+enum { TYPE_ERROR = -1, TYPE_NUMBER, TYPE_STRING };        // types of expressions
+
+enum { KIND_NUMBER, KIND_INTEGER, KIND_STRING };            // types of variables
+
+typedef struct {
+    token_kind kind;
+    int id;                                                 // keyword or function
+    char symbol;
+    double number;
+    basic_string text;                                      // string literal (PETSCII)
+    char name[3];                                           // first two characters of a name
+    int variable_kind;
+} token;
+
+typedef struct {                                            // a variable, as the code refers to it
+    int kind;
+    uint16_t slot;
+    uint8_t dimensions;                                     // 0: simple variable, otherwise an array element
+} variable;
+
+typedef struct {
+    char name[3];
+    uint8_t kind;                                           // KIND_*, plus 3 for arrays
+    bool used;
+    uint16_t slot;
+} variable_name;
+
+typedef struct {
+    uint16_t line;
+    uint32_t offset;
+} line_entry;
+
+typedef struct {
+    uint32_t position;                                      // of the operand
+    uint16_t target;                                        // line number
+    uint16_t line;                                          // line of the jump, for the error message
+} line_fixup;
+
+typedef struct {
+    uint32_t start;
+    uint32_t exits[BASIC_DO_EXITS];
+    int exit_count;
+    uint16_t line;
+} do_block;
+
+typedef struct {
+    uint8_t *code;
+    size_t size, capacity;
+    line_entry *lines;                                      // code offset of every line, in order
+    size_t line_count;
+    basic_string *data;                                     // items of all DATA statements
+    size_t data_count, data_capacity;
+    int numbers, strings, number_arrays, string_arrays;     // slots
+} basic_program;
+
+typedef struct {
+    basic_program *program;
+    const char *position;                                   // in the current line
+    token token;
+    uint16_t line;
+    const char *error;
+    int depth;                                              // expression nesting
+    variable_name names[BASIC_NAMES];
+    line_fixup *fixups;
+    size_t fixup_count, fixup_capacity;
+    do_block blocks[BASIC_DO_DEPTH];
+    int block_count;
+    uint32_t ifs[BASIC_IFS];                                // JUMP_IF_FALSE of the open IFs on this line
+    int if_count;
+    uint32_t line_ends[BASIC_IFS];                          // jumps to the end of this line
+    int line_end_count;
+} compiler;
+
+typedef struct {
+    uint8_t dimensions;                                     // 0: not yet dimensioned
+    uint16_t bounds[BASIC_DIMENSIONS];                      // highest subscript + 1
+    double *numbers;
+    basic_string *strings;
+} basic_array;
+
+typedef struct {
+    uint16_t slot;
+    double limit, step;
+    uint32_t loop;                                          // code offset of the loop body
+} for_frame;
+
+typedef struct {
+    uint32_t return_to;
+    int for_depth;                                          // loops opened inside the subroutine end with RETURN
+} gosub_frame;
+
+typedef enum { BASIC_END, BASIC_STOP, BASIC_ERROR, BASIC_TIME, BASIC_NO_KEYS } basic_result;
+
+typedef struct {
+    basic_program *program;
+    machine *m;
+    double *numbers;
+    basic_string *strings;
+    basic_array *number_arrays, *string_arrays;
+    basic_string string_stack[BASIC_STRING_STACK];
+    gosub_frame gosubs[BASIC_GOSUB_DEPTH];
+    int gosub_depth;
+    for_frame fors[BASIC_FOR_DEPTH];
+    int for_depth;
+    size_t data_position;
+    basic_string format;                                    // of PRINT USING
+    uint32_t statement;                                     // code offset of the current statement
+    const char *error;
+    uint64_t statements;
+    uint64_t cycle_limit;
+    uint64_t next_stop;                                     // cycle of the next time limit or frame
+    ted_video *video;                                       // NULL: no video
+    bool stream;                                            // a frame every TED_FRAME_CYCLES
+    uint64_t next_frame;
+    uint32_t random;
+    const uint8_t *keys;                                    // key script (PETSCII)
+    size_t key_count, key_position;
+    uint64_t next_key;                                      // cycle from which the next key is there
+    uint8_t input[BASIC_INPUT_LENGTH];                      // the line read by INPUT
+    int input_length, input_position;
+    int row, column;                                        // cursor
+    bool reverse;
+    bool live;                                              // stream the screen to the terminal
+    FILE *terminal;
+    int terminal_row, terminal_column;
+    bool terminal_reverse;
+    int graphic_mode;                                       // 0: text
+    resolution screen;
+    TED_pixel *bitmap;
+    coordinates graphics_cursor;
+    TED_pixel colors[5];                                    // color sources: background, foreground, multicolor 1
+                                                            // and 2, border
+    uint8_t breakpoints[MEMORY_SIZE / 8];                   // SYS_RETURN
+} basic;
+
+static void next_token(compiler *c);
+static int compile_expression(compiler *c);
+static void compile_statement(compiler *c);
+static void put_char(basic *b, uint8_t c);
+
+
+// Program text
+
+static uint8_t petscii(char c) {                            // as typed: lower case unshifted, upper case shifted
+    if(c >= 'a' && c <= 'z') {
+        return (uint8_t) (c - 'a' + 0x41);
+    }
+    if(c >= 'A' && c <= 'Z') {
+        return (uint8_t) (c - 'A' + 0xC1);
+    }
+    return (uint8_t) c;
+}
+
+static int match_word(const char *text, const char *word) {   // length of word if text starts with it, else 0
+    int length = 0;
+    while(word[length]) {
+        if(tolower((unsigned char) text[length]) != word[length]) {
+            return 0;
+        }
+        length++;
+    }
+    return length;
+}
+
+static int match_keyword(const char *text, token *t) {      // longest keyword or function at text; 0: none
+    int best = 0;
+    for(int i = 0; i < KW_KEYWORDS; i++) {
+        int length = match_word(text, keywords[i]);
+        if(length > best) {
+            best = length;
+            t->kind = TOKEN_KEYWORD;
+            t->id = i;
+        }
+    }
+    for(int i = 0; i < FN_FUNCTIONS; i++) {
+        int length = match_word(text, functions[i].name);
+        if(length > best) {
+            best = length;
+            t->kind = TOKEN_FUNCTION;
+            t->id = i;
+        }
+    }
+    return best;
+}
+
+static void next_token(compiler *c) {
+    token *t = &c->token;
+    const char *p = c->position;
+
+    while(*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if(!*p || *p == '\n' || *p == '\r') {
+        t->kind = TOKEN_END;
+    } else if(isdigit((unsigned char) *p) || (*p == '.' && isdigit((unsigned char) p[1]))) {
+        const char *start = p;
+        while(isdigit((unsigned char) *p) || *p == '.') {
+            p++;
+        }
+        if(tolower((unsigned char) *p) == 'e' && (isdigit((unsigned char) p[1])
+           || ((p[1] == '+' || p[1] == '-') && isdigit((unsigned char) p[2])))) {
+            p += 2;
+            while(isdigit((unsigned char) *p)) {
+                p++;
+            }
+        }
+        char number[64];
+        size_t length = (size_t) (p - start) < sizeof(number) ? (size_t) (p - start) : sizeof(number) - 1;
+        memcpy(number, start, length);
+        number[length] = 0;
+        t->kind = TOKEN_NUMBER;
+        t->number = strtod(number, NULL);
+    } else if(*p == '"') {
+        t->kind = TOKEN_STRING;
+        t->text.length = 0;
+        for(p++; *p && *p != '"' && *p != '\n' && *p != '\r'; p++) {
+            if(t->text.length < 255) {
+                t->text.text[t->text.length++] = petscii(*p);
+            }
+        }
+        if(*p == '"') {
+            p++;
+        }
+    } else if(isalpha((unsigned char) *p)) {
+        int length = match_keyword(p, t);
+        if(length) {
+            p += length;
+        } else {                                            // a name ends where a keyword starts, as in the ROM
+            t->kind = TOKEN_NAME;
+            t->name[0] = (char) tolower((unsigned char) *p++);
+            t->name[1] = t->name[2] = 0;
+            token ignored;
+            while(isalnum((unsigned char) *p) && !(isalpha((unsigned char) *p) && match_keyword(p, &ignored))) {
+                if(!t->name[1]) {
+                    t->name[1] = (char) tolower((unsigned char) *p);
+                }
+                p++;
+            }
+            t->variable_kind = KIND_NUMBER;
+            if(*p == '$') {
+                t->variable_kind = KIND_STRING;
+                p++;
+            } else if(*p == '%') {
+                t->variable_kind = KIND_INTEGER;
+                p++;
+            }
+        }
+    } else if(*p == '?') {
+        t->kind = TOKEN_KEYWORD;
+        t->id = KW_PRINT;
+        p++;
+    } else {
+        t->kind = TOKEN_SYMBOL;
+        t->symbol = *p++;
+    }
+    c->position = p;
+}
+
+static bool is_symbol(compiler *c, char symbol) {
+    return c->token.kind == TOKEN_SYMBOL && c->token.symbol == symbol;
+}
+
+static bool is_keyword(compiler *c, keyword id) {
+    return c->token.kind == TOKEN_KEYWORD && c->token.id == (int) id;
+}
+
+static bool statement_ends(compiler *c) {
+    return c->token.kind == TOKEN_END || is_symbol(c, ':') || is_keyword(c, KW_ELSE);
+}
+
+static bool fail(compiler *c, const char *error) {          // keeps the first error
+    if(!c->error) {
+        c->error = error;
+    }
+    return false;
+}
+
+static bool expect_symbol(compiler *c, char symbol) {
+    if(!is_symbol(c, symbol)) {
+        return fail(c, "SYNTAX");
+    }
+    next_token(c);
+    return true;
+}
+
+
+// Code generation
+
+static void emit(compiler *c, uint8_t byte) {
+    basic_program *program = c->program;
+    if(program->size == program->capacity) {
+        size_t capacity = program->capacity ? program->capacity * 2 : 4096;
+        uint8_t *code = realloc(program->code, capacity);
+        if(!code) {
+            fail(c, "OUT OF MEMORY");
+            return;
+        }
+        program->code = code;
+        program->capacity = capacity;
+    }
+    program->code[program->size++] = byte;
+}
+
+static void emit_16(compiler *c, uint16_t value) {
+    emit(c, value & 0xFF);
+    emit(c, value >> 8);
+}
+
+static uint32_t emit_32(compiler *c, uint32_t value) {      // returns the position of the value, for patch_32()
+    uint32_t position = (uint32_t) c->program->size;
+    for(int i = 0; i < 4; i++) {
+        emit(c, (uint8_t) (value >> (8 * i)));
+    }
+    return position;
+}
+
+static void patch_32(compiler *c, uint32_t position, uint32_t value) {
+    if(c->error) {
+        return;
+    }
+    for(int i = 0; i < 4; i++) {
+        c->program->code[position + i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+static uint32_t here(compiler *c) {
+    return (uint32_t) c->program->size;
+}
+
+static uint32_t emit_jump(compiler *c, uint8_t op) {       // returns the position of the target, for patch_32()
+    emit(c, op);
+    return emit_32(c, 0);
+}
+
+static void emit_number(compiler *c, double value) {
+    uint8_t bytes[sizeof(double)];
+    memcpy(bytes, &value, sizeof(double));
+    emit(c, OP_NUMBER);
+    for(size_t i = 0; i < sizeof(double); i++) {
+        emit(c, bytes[i]);
+    }
+}
+
+static void emit_string(compiler *c, const basic_string *text) {
+    emit(c, OP_STRING);
+    emit(c, text->length);
+    for(int i = 0; i < text->length; i++) {
+        emit(c, text->text[i]);
+    }
+}
+
+static void emit_line_jump(compiler *c, uint8_t op, double line) {    // GOTO and GOSUB: resolved after loading
+    if(line < 0 || line > 63999 || line != (int) line) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    if(op) {
+        emit(c, op);
+    }
+    if(c->fixup_count == c->fixup_capacity) {
+        size_t capacity = c->fixup_capacity ? c->fixup_capacity * 2 : 256;
+        line_fixup *fixups = realloc(c->fixups, capacity * sizeof(line_fixup));
+        if(!fixups) {
+            fail(c, "OUT OF MEMORY");
+            return;
+        }
+        c->fixups = fixups;
+        c->fixup_capacity = capacity;
+    }
+    c->fixups[c->fixup_count++] = (line_fixup) {emit_32(c, 0), (uint16_t) line, c->line};
+}
+
+
+// Variables: a hash table of names, used at load time only; the code refers to slots
+
+static uint16_t variable_slot(compiler *c, const char name[3], int kind, bool array) {
+    uint8_t key = (uint8_t) (kind + (array ? 3 : 0));
+    unsigned hash = ((unsigned char) name[0] * 31u + (unsigned char) name[1]) * 7u + key;
+    for(unsigned i = 0; i < BASIC_NAMES; i++) {
+        variable_name *entry = &c->names[(hash + i) & (BASIC_NAMES - 1)];
+        if(!entry->used) {
+            basic_program *program = c->program;
+            int *slots = kind == KIND_STRING ? (array ? &program->string_arrays : &program->strings)
+                                             : (array ? &program->number_arrays : &program->numbers);
+            memcpy(entry->name, name, 3);
+            entry->kind = key;
+            entry->used = true;
+            entry->slot = (uint16_t) (*slots)++;
+            return entry->slot;
+        }
+        if(entry->kind == key && !memcmp(entry->name, name, 3)) {
+            return entry->slot;
+        }
+    }
+    fail(c, "OUT OF MEMORY");
+    return 0;
+}
+
+static bool compile_variable(compiler *c, variable *v) {   // a name, with its subscripts (code for them is emitted)
+    if(c->token.kind != TOKEN_NAME) {
+        return fail(c, "SYNTAX");
+    }
+    char name[3];
+    memcpy(name, c->token.name, 3);
+    v->kind = c->token.variable_kind;
+    v->dimensions = 0;
+    next_token(c);
+    if(is_symbol(c, '(')) {
+        do {
+            next_token(c);
+            if(compile_expression(c) != TYPE_NUMBER) {
+                return fail(c, "TYPE MISMATCH");
+            }
+            if(++v->dimensions > BASIC_DIMENSIONS) {
+                return fail(c, "BAD SUBSCRIPT");
+            }
+        } while(is_symbol(c, ','));
+        if(!expect_symbol(c, ')')) {
+            return false;
+        }
+    }
+    v->slot = variable_slot(c, name, v->kind, v->dimensions > 0);
+    return !c->error;
+}
+
+static void emit_load(compiler *c, variable v) {
+    if(v.dimensions) {
+        emit(c, v.kind == KIND_STRING ? OP_LOAD_STRING_ELEMENT : OP_LOAD_ELEMENT);
+        emit_16(c, v.slot);
+        emit(c, v.dimensions);
+    } else {
+        emit(c, v.kind == KIND_STRING ? OP_LOAD_STRING : OP_LOAD);
+        emit_16(c, v.slot);
+    }
+}
+
+static void emit_store(compiler *c, variable v) {
+    static const uint8_t simple[3] = {OP_STORE, OP_STORE_INTEGER, OP_STORE_STRING};
+    static const uint8_t element[3] = {OP_STORE_ELEMENT, OP_STORE_INTEGER_ELEMENT, OP_STORE_STRING_ELEMENT};
+    emit(c, v.dimensions ? element[v.kind] : simple[v.kind]);
+    emit_16(c, v.slot);
+    if(v.dimensions) {
+        emit(c, v.dimensions);
+    }
+}
+
+static int variable_type(variable v) {
+    return v.kind == KIND_STRING ? TYPE_STRING : TYPE_NUMBER;
+}
+
+
+// Expressions, by precedence as in the ROM: OR, AND, NOT, comparisons, + -, * /, unary minus, ^
+
+static int compile_primary(compiler *c) {
+    token *t = &c->token;
+    if(t->kind == TOKEN_NUMBER) {
+        if(t->number > BASIC_LARGEST) {
+            fail(c, "OVERFLOW");
+            return TYPE_NUMBER;
+        }
+        emit_number(c, t->number);
+        next_token(c);
+        return TYPE_NUMBER;
+    }
+    if(t->kind == TOKEN_STRING) {
+        emit_string(c, &t->text);
+        next_token(c);
+        return TYPE_STRING;
+    }
+    if(t->kind == TOKEN_NAME) {
+        variable v;
+        if(!compile_variable(c, &v)) {
+            return TYPE_ERROR;
+        }
+        emit_load(c, v);
+        return variable_type(v);
+    }
+    if(t->kind == TOKEN_FUNCTION) {
+        const basic_function *function = &functions[t->id];
+        int id = t->id, count = 0;
+        next_token(c);
+        for(const char *argument = function->arguments; *argument; argument++) {
+            if(count) {
+                if(isupper((unsigned char) *argument) && is_symbol(c, ')')) {
+                    break;
+                }
+                if(!expect_symbol(c, ',')) {
+                    return TYPE_ERROR;
+                }
+            }
+            int type = compile_expression(c);
+            if(type == TYPE_ERROR) {
+                return TYPE_ERROR;
+            }
+            if(type != (tolower((unsigned char) *argument) == 's' ? TYPE_STRING : TYPE_NUMBER)) {
+                fail(c, "TYPE MISMATCH");
+                return TYPE_ERROR;
+            }
+            count++;
+        }
+        if(!expect_symbol(c, ')')) {
+            return TYPE_ERROR;
+        }
+        emit(c, OP_FUNCTION);
+        emit(c, (uint8_t) id);
+        emit(c, (uint8_t) count);
+        return function->result == 's' ? TYPE_STRING : TYPE_NUMBER;
+    }
+    if(is_symbol(c, '(')) {
+        next_token(c);
+        int type = compile_expression(c);
+        if(type != TYPE_ERROR && !expect_symbol(c, ')')) {
+            return TYPE_ERROR;
+        }
+        return type;
+    }
+    fail(c, "SYNTAX");
+    return TYPE_ERROR;
+}
+
+static int compile_unary(compiler *c);
+
+static int compile_power(compiler *c) {
+    int type = compile_primary(c);
+    while(type == TYPE_NUMBER && is_symbol(c, '^')) {
+        next_token(c);
+        int right = is_symbol(c, '-') || is_symbol(c, '+') ? compile_unary(c) : compile_primary(c);
+        if(right != TYPE_NUMBER) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        emit(c, OP_POWER);
+    }
+    return type;
+}
+
+static int compile_unary(compiler *c) {
+    if(is_symbol(c, '-') || is_symbol(c, '+')) {
+        bool negate = is_symbol(c, '-');
+        next_token(c);
+        if(compile_unary(c) != TYPE_NUMBER) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        if(negate) {
+            emit(c, OP_NEGATE);
+        }
+        return TYPE_NUMBER;
+    }
+    return compile_power(c);
+}
+
+static int compile_term(compiler *c) {
+    int type = compile_unary(c);
+    while(type != TYPE_ERROR && (is_symbol(c, '*') || is_symbol(c, '/'))) {
+        uint8_t op = is_symbol(c, '*') ? OP_MULTIPLY : OP_DIVIDE;
+        next_token(c);
+        if(type != TYPE_NUMBER || compile_unary(c) != TYPE_NUMBER) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        emit(c, op);
+    }
+    return type;
+}
+
+static int compile_sum(compiler *c) {
+    int type = compile_term(c);
+    while(type != TYPE_ERROR && (is_symbol(c, '+') || is_symbol(c, '-'))) {
+        bool add = is_symbol(c, '+');
+        next_token(c);
+        int right = compile_term(c);
+        if(right != type || (type == TYPE_STRING && !add)) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        emit(c, type == TYPE_STRING ? OP_CONCATENATE : add ? OP_ADD : OP_SUBTRACT);
+    }
+    return type;
+}
+
+static int compile_comparison(compiler *c) {
+    int type = compile_sum(c);
+    while(type != TYPE_ERROR && (is_symbol(c, '<') || is_symbol(c, '>') || is_symbol(c, '='))) {
+        int relation = 0;                                   // bit 0: less, bit 1: equal, bit 2: greater
+        while(is_symbol(c, '<') || is_symbol(c, '>') || is_symbol(c, '=')) {
+            relation |= is_symbol(c, '<') ? 1 : is_symbol(c, '=') ? 2 : 4;
+            next_token(c);
+        }
+        static const uint8_t ops[8] = {0, OP_LESS, OP_EQUAL, OP_LESS_EQUAL, OP_GREATER, OP_NOT_EQUAL,
+                                       OP_GREATER_EQUAL, 0};
+        if(!ops[relation]) {
+            fail(c, "SYNTAX");
+            return TYPE_ERROR;
+        }
+        if(compile_sum(c) != type) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        emit(c, (uint8_t) (ops[relation] + (type == TYPE_STRING ? OP_STRING_EQUAL - OP_EQUAL : 0)));
+        type = TYPE_NUMBER;
+    }
+    return type;
+}
+
+static int compile_not(compiler *c) {
+    if(is_keyword(c, KW_NOT)) {
+        next_token(c);
+        if(compile_not(c) != TYPE_NUMBER) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        emit(c, OP_NOT);
+        return TYPE_NUMBER;
+    }
+    return compile_comparison(c);
+}
+
+static int compile_and(compiler *c) {
+    int type = compile_not(c);
+    while(type != TYPE_ERROR && is_keyword(c, KW_AND)) {
+        next_token(c);
+        if(type != TYPE_NUMBER || compile_not(c) != TYPE_NUMBER) {
+            fail(c, "TYPE MISMATCH");
+            return TYPE_ERROR;
+        }
+        emit(c, OP_AND);
+    }
+    return type;
+}
+
+static int compile_expression(compiler *c) {
+    if(++c->depth > BASIC_NESTING) {
+        fail(c, "FORMULA TOO COMPLEX");
+        return TYPE_ERROR;
+    }
+    int type = compile_and(c);
+    while(type != TYPE_ERROR && is_keyword(c, KW_OR)) {
+        next_token(c);
+        if(type != TYPE_NUMBER || compile_and(c) != TYPE_NUMBER) {
+            fail(c, "TYPE MISMATCH");
+            type = TYPE_ERROR;
+            break;
+        }
+        emit(c, OP_OR);
+    }
+    c->depth--;
+    return c->error ? TYPE_ERROR : type;
+}
+
+static bool compile_number(compiler *c) {
+    int type = compile_expression(c);
+    return type == TYPE_NUMBER || (type == TYPE_STRING && fail(c, "TYPE MISMATCH"));
+}
+
+static int compile_arguments(compiler *c, int count) {     // numbers, any of which may be left out; returns the mask
+    int mask = 0;
+    for(int i = 0; i < count; i++) {
+        if(!statement_ends(c) && !is_symbol(c, ',')) {
+            if(!compile_number(c)) {
+                return -1;
+            }
+            mask |= 1 << i;
+        }
+        if(!is_symbol(c, ',')) {
+            break;
+        }
+        next_token(c);
+    }
+    return statement_ends(c) ? mask : (fail(c, "SYNTAX"), -1);
+}
+
+
+// Statements
+
+static void compile_print(compiler *c) {
+    bool using = false, newline = true;
+    next_token(c);
+    if(is_keyword(c, KW_USING)) {
+        next_token(c);
+        if(compile_expression(c) != TYPE_STRING) {
+            fail(c, "TYPE MISMATCH");
+            return;
+        }
+        emit(c, OP_USING);
+        using = true;
+        if(!is_symbol(c, ';') && !expect_symbol(c, ',')) {
+            return;
+        }
+        if(is_symbol(c, ';')) {
+            next_token(c);
+        }
+    }
+    while(!c->error && !statement_ends(c)) {
+        if(is_symbol(c, ';') || is_symbol(c, ',')) {
+            if(is_symbol(c, ',') && !using) {
+                emit(c, OP_PRINT_COMMA);
+            }
+            newline = false;
+            next_token(c);
+            continue;
+        }
+        if(is_keyword(c, KW_SPC) || is_keyword(c, KW_TAB)) {
+            uint8_t op = is_keyword(c, KW_SPC) ? OP_PRINT_SPC : OP_PRINT_TAB;
+            next_token(c);
+            if(compile_number(c) && expect_symbol(c, ')')) {
+                emit(c, op);
+            }
+        } else {
+            int type = compile_expression(c);
+            if(type == TYPE_NUMBER) {
+                emit(c, using ? OP_PRINT_USING_NUMBER : OP_PRINT_NUMBER);
+            } else if(type == TYPE_STRING) {
+                emit(c, using ? OP_PRINT_USING_STRING : OP_PRINT_STRING);
+            }
+        }
+        newline = true;
+    }
+    if(newline) {
+        emit(c, OP_PRINT_NEWLINE);
+    }
+}
+
+static void compile_input(compiler *c, keyword id) {       // INPUT, GET, GETKEY, READ
+    next_token(c);
+    if(id == KW_INPUT) {
+        basic_string prompt = {0};
+        if(c->token.kind == TOKEN_STRING) {
+            prompt = c->token.text;
+            next_token(c);
+            if(!expect_symbol(c, ';')) {
+                return;
+            }
+        }
+        emit_string(c, &prompt);
+        emit(c, OP_INPUT);
+    }
+    do {
+        if(is_symbol(c, ',')) {
+            next_token(c);
+        }
+        variable v;
+        if(!compile_variable(c, &v)) {
+            return;
+        }
+        bool string = v.kind == KIND_STRING;
+        switch(id) {
+            case KW_INPUT:
+                emit(c, string ? OP_INPUT_STRING : OP_INPUT_NUMBER);
+                break;
+            case KW_READ:
+                emit(c, string ? OP_READ_STRING : OP_READ_NUMBER);
+                break;
+            default:
+                emit(c, OP_GET);
+                emit(c, (string ? 0 : GET_NUMBER) | (id == KW_GETKEY ? GET_WAIT : 0));
+        }
+        emit_store(c, v);
+    } while(!c->error && is_symbol(c, ','));
+}
+
+static void compile_data(compiler *c) {                     // the items go to the program's data list
+    basic_program *program = c->program;
+    const char *p = c->position;
+    while(1) {
+        basic_string item = {0};
+        while(*p == ' ') {
+            p++;
+        }
+        if(*p == '"') {
+            for(p++; *p && *p != '"' && *p != '\n' && *p != '\r'; p++) {
+                if(item.length < 255) {
+                    item.text[item.length++] = petscii(*p);
+                }
+            }
+            if(*p == '"') {
+                p++;
+            }
+            while(*p == ' ') {
+                p++;
+            }
+        } else {
+            for(; *p && *p != ',' && *p != ':' && *p != '\n' && *p != '\r'; p++) {
+                if(item.length < 255) {
+                    item.text[item.length++] = petscii(*p);
+                }
+            }
+            while(item.length && item.text[item.length - 1] == ' ') {
+                item.length--;
+            }
+        }
+        if(program->data_count == program->data_capacity) {
+            size_t capacity = program->data_capacity ? program->data_capacity * 2 : 64;
+            basic_string *data = realloc(program->data, capacity * sizeof(basic_string));
+            if(!data) {
+                fail(c, "OUT OF MEMORY");
+                return;
+            }
+            program->data = data;
+            program->data_capacity = capacity;
+        }
+        program->data[program->data_count++] = item;
+        if(*p != ',') {
+            break;
+        }
+        p++;
+    }
+    c->position = p;
+    next_token(c);
+}
+
+static void compile_if(compiler *c) {
+    next_token(c);
+    if(!compile_number(c)) {
+        return;
+    }
+    if(c->if_count == BASIC_IFS) {
+        fail(c, "FORMULA TOO COMPLEX");
+        return;
+    }
+    c->ifs[c->if_count++] = emit_jump(c, OP_JUMP_IF_FALSE);
+    if(!is_keyword(c, KW_THEN) && !is_keyword(c, KW_GOTO)) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    bool then = is_keyword(c, KW_THEN);
+    next_token(c);
+    if(c->token.kind == TOKEN_NUMBER) {                     // THEN 100, GOTO 100
+        emit_line_jump(c, OP_JUMP, c->token.number);
+        next_token(c);
+    } else if(!then) {
+        fail(c, "SYNTAX");
+    } else if(!statement_ends(c)) {
+        compile_statement(c);                               // the rest of the line belongs to THEN
+    }
+}
+
+static void compile_else(compiler *c) {                    // ELSE: the end of the innermost open THEN part
+    if(!c->if_count || c->line_end_count == BASIC_IFS) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    c->line_ends[c->line_end_count++] = emit_jump(c, OP_JUMP);
+    patch_32(c, c->ifs[--c->if_count], here(c));
+    next_token(c);
+    if(c->token.kind == TOKEN_NUMBER) {
+        emit_line_jump(c, OP_JUMP, c->token.number);
+        next_token(c);
+    }
+}
+
+static void compile_condition(compiler *c, bool until, bool jump_if_true) {   // WHILE/UNTIL of DO and LOOP
+    if(compile_number(c)) {
+        emit(c, (until ? !jump_if_true : jump_if_true) ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE);
+    }
+}
+
+static void compile_do(compiler *c) {
+    if(c->block_count == BASIC_DO_DEPTH) {
+        fail(c, "FORMULA TOO COMPLEX");
+        return;
+    }
+    do_block *block = &c->blocks[c->block_count++];
+    block->start = here(c);
+    block->exit_count = 0;
+    block->line = c->line;
+    next_token(c);
+    if(is_keyword(c, KW_WHILE) || is_keyword(c, KW_UNTIL)) {     // leaves the loop
+        bool until = is_keyword(c, KW_UNTIL);
+        next_token(c);
+        compile_condition(c, until, false);
+        block->exits[block->exit_count++] = emit_32(c, 0);
+    }
+}
+
+static void compile_loop(compiler *c) {
+    if(!c->block_count) {
+        fail(c, "LOOP WITHOUT DO");
+        return;
+    }
+    do_block *block = &c->blocks[--c->block_count];
+    next_token(c);
+    if(is_keyword(c, KW_WHILE) || is_keyword(c, KW_UNTIL)) {     // goes back to DO
+        bool until = is_keyword(c, KW_UNTIL);
+        next_token(c);
+        compile_condition(c, until, true);
+    } else {
+        emit(c, OP_JUMP);
+    }
+    emit_32(c, block->start);
+    for(int i = 0; i < block->exit_count; i++) {
+        patch_32(c, block->exits[i], here(c));
+    }
+}
+
+static void compile_exit(compiler *c) {
+    if(!c->block_count) {
+        fail(c, "LOOP NOT FOUND");
+        return;
+    }
+    do_block *block = &c->blocks[c->block_count - 1];
+    if(block->exit_count == BASIC_DO_EXITS) {
+        fail(c, "FORMULA TOO COMPLEX");
+        return;
+    }
+    block->exits[block->exit_count++] = emit_jump(c, OP_JUMP);
+    next_token(c);
+}
+
+static void compile_for(compiler *c) {
+    next_token(c);
+    variable v;
+    if(!compile_variable(c, &v)) {
+        return;
+    }
+    if(v.kind != KIND_NUMBER || v.dimensions) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    if(!expect_symbol(c, '=') || !compile_number(c)) {
+        return;
+    }
+    emit_store(c, v);
+    if(!is_keyword(c, KW_TO)) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    next_token(c);
+    if(!compile_number(c)) {
+        return;
+    }
+    if(is_keyword(c, KW_STEP)) {
+        next_token(c);
+        if(!compile_number(c)) {
+            return;
+        }
+    } else {
+        emit_number(c, 1);
+    }
+    emit(c, OP_FOR);
+    emit_16(c, v.slot);
+}
+
+static void compile_next(compiler *c) {
+    next_token(c);
+    if(statement_ends(c)) {
+        emit(c, OP_NEXT);
+        emit_16(c, NEXT_ANY);
+        return;
+    }
+    while(1) {
+        if(c->token.kind != TOKEN_NAME || c->token.variable_kind != KIND_NUMBER) {
+            fail(c, "SYNTAX");
+            return;
+        }
+        emit(c, OP_NEXT);
+        emit_16(c, variable_slot(c, c->token.name, KIND_NUMBER, false));
+        next_token(c);
+        if(!is_symbol(c, ',')) {
+            return;
+        }
+        next_token(c);
+    }
+}
+
+static void compile_on(compiler *c) {
+    next_token(c);
+    if(!compile_number(c)) {
+        return;
+    }
+    if(!is_keyword(c, KW_GOTO) && !is_keyword(c, KW_GOSUB)) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    emit(c, is_keyword(c, KW_GOTO) ? OP_ON_GOTO : OP_ON_GOSUB);
+    uint32_t count = here(c);
+    emit(c, 0);
+    int targets = 0;
+    do {
+        next_token(c);
+        if(c->token.kind != TOKEN_NUMBER || targets == 255) {
+            fail(c, "SYNTAX");
+            return;
+        }
+        emit_line_jump(c, 0, c->token.number);
+        targets++;
+        next_token(c);
+    } while(is_symbol(c, ','));
+    if(!c->error) {
+        c->program->code[count] = (uint8_t) targets;
+    }
+}
+
+static void compile_dim(compiler *c) {
+    do {
+        next_token(c);
+        variable v;
+        if(!compile_variable(c, &v)) {
+            return;
+        }
+        if(!v.dimensions) {
+            fail(c, "SYNTAX");
+            return;
+        }
+        emit(c, v.kind == KIND_STRING ? OP_DIM_STRING : OP_DIM);
+        emit_16(c, v.slot);
+        emit(c, v.dimensions);
+    } while(is_symbol(c, ','));
+}
+
+static void compile_assignment(compiler *c) {
+    variable v;
+    if(!compile_variable(c, &v) || !expect_symbol(c, '=')) {
+        return;
+    }
+    int type = compile_expression(c);
+    if(type != TYPE_ERROR && type != variable_type(v)) {
+        fail(c, "TYPE MISMATCH");
+        return;
+    }
+    emit_store(c, v);
+}
+
+static void compile_command(compiler *c, uint8_t op, int count, int required) {   // op, numbers; required: a mask
+    next_token(c);
+    int mask = compile_arguments(c, count);
+    if(mask < 0) {
+        return;
+    }
+    if((mask & required) != required) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    emit(c, op);
+    if(count > 1 || !required) {
+        emit(c, (uint8_t) mask);
+    }
+}
+
+static void compile_draw(compiler *c) {                     // DRAW [source] [, x, y] [TO x, y] ...
+    int flags = 0, points = 0;
+    next_token(c);
+    if(!statement_ends(c) && !is_symbol(c, ',') && !is_keyword(c, KW_TO)) {
+        if(!compile_number(c)) {
+            return;
+        }
+        flags |= DRAW_SOURCE;
+    }
+    if(is_symbol(c, ',')) {
+        next_token(c);
+        if(!compile_number(c) || !expect_symbol(c, ',') || !compile_number(c)) {
+            return;
+        }
+        flags |= DRAW_START;
+    }
+    while(is_keyword(c, KW_TO)) {
+        next_token(c);
+        if(++points > BASIC_DRAW_POINTS) {
+            fail(c, "FORMULA TOO COMPLEX");
+            return;
+        }
+        if(!compile_number(c) || !expect_symbol(c, ',') || !compile_number(c)) {
+            return;
+        }
+    }
+    if(!statement_ends(c) || (!(flags & DRAW_START) && !points)) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    emit(c, OP_DRAW);
+    emit(c, (uint8_t) flags);
+    emit(c, (uint8_t) points);
+}
+
+static void compile_statement(compiler *c) {
+    if(c->token.kind == TOKEN_NAME) {
+        compile_assignment(c);
+        return;
+    }
+    if(c->token.kind != TOKEN_KEYWORD) {
+        fail(c, "SYNTAX");
+        return;
+    }
+    switch(c->token.id) {
+        case KW_REM:
+            c->position = "";
+            next_token(c);
+            break;
+        case KW_LET:
+            next_token(c);
+            compile_assignment(c);
+            break;
+        case KW_PRINT:
+            compile_print(c);
+            break;
+        case KW_GOTO:
+        case KW_GOSUB: {
+            uint8_t op = c->token.id == KW_GOTO ? OP_JUMP : OP_GOSUB;
+            next_token(c);
+            if(c->token.kind != TOKEN_NUMBER) {
+                fail(c, "SYNTAX");
+                break;
+            }
+            emit_line_jump(c, op, c->token.number);
+            next_token(c);
+            break;
+        }
+        case KW_IF:
+            compile_if(c);
+            break;
+        case KW_DO:
+            compile_do(c);
+            break;
+        case KW_LOOP:
+            compile_loop(c);
+            break;
+        case KW_EXIT:
+            compile_exit(c);
+            break;
+        case KW_FOR:
+            compile_for(c);
+            break;
+        case KW_NEXT:
+            compile_next(c);
+            break;
+        case KW_ON:
+            compile_on(c);
+            break;
+        case KW_INPUT:
+        case KW_GET:
+        case KW_GETKEY:
+        case KW_READ:
+            compile_input(c, c->token.id);
+            break;
+        case KW_DATA:
+            compile_data(c);
+            break;
+        case KW_DIM:
+            compile_dim(c);
+            break;
+        case KW_POKE:
+            next_token(c);
+            if(compile_number(c) && expect_symbol(c, ',') && compile_number(c)) {
+                emit(c, OP_POKE);
+            }
+            break;
+        case KW_SYS:
+            compile_command(c, OP_SYS, 1, 1);
+            break;
+        case KW_VOL:
+            compile_command(c, OP_VOL, 1, 1);
+            break;
+        case KW_GRAPHIC:
+            compile_command(c, OP_GRAPHIC, 2, 1);
+            break;
+        case KW_COLOR:
+            compile_command(c, OP_COLOR, 3, 3);
+            break;
+        case KW_BOX:
+            compile_command(c, OP_BOX, 7, 6);
+            break;
+        case KW_PAINT:
+            compile_command(c, OP_PAINT, 4, 6);
+            break;
+        case KW_LOCATE:
+            compile_command(c, OP_LOCATE, 2, 3);
+            break;
+        case KW_DRAW:
+            compile_draw(c);
+            break;
+        case KW_RETURN:
+        case KW_RESTORE:
+        case KW_SCNCLR:
+        case KW_STOP:
+        case KW_END: {
+            static const uint8_t ops[] = {[KW_RETURN] = OP_RETURN, [KW_RESTORE] = OP_RESTORE,
+                                          [KW_SCNCLR] = OP_SCNCLR, [KW_STOP] = OP_STOP, [KW_END] = OP_END};
+            emit(c, ops[c->token.id]);
+            next_token(c);
+            break;
+        }
+        default:
+            fail(c, "SYNTAX");
+    }
+}
+
+static void compile_line(compiler *c, const char *text) {
+    c->position = text;
+    c->if_count = c->line_end_count = 0;
+    next_token(c);
+    while(!c->error && c->token.kind != TOKEN_END) {
+        if(is_keyword(c, KW_ELSE)) {
+            compile_else(c);
+            continue;
+        }
+        emit(c, OP_STATEMENT);
+        compile_statement(c);
+        if(is_symbol(c, ':')) {
+            next_token(c);
+        } else if(c->token.kind != TOKEN_END && !is_keyword(c, KW_ELSE)) {
+            fail(c, "SYNTAX");
+        }
+    }
+    for(int i = 0; i < c->if_count; i++) {                 // a false condition skips the rest of the line
+        patch_32(c, c->ifs[i], here(c));
+    }
+    for(int i = 0; i < c->line_end_count; i++) {
+        patch_32(c, c->line_ends[i], here(c));
+    }
+}
+
+
+// Loading: reads the lines, sorts them by number, compiles them and resolves the line numbers
+
+typedef struct {
+    uint16_t number;
+    size_t order;                                           // in the file; the last of equal numbers wins
+    char *text;
+} source_line;
+
+static int compare_lines(const void *a, const void *b) {
+    const source_line *x = a, *y = b;
+    if(x->number != y->number) {
+        return x->number < y->number ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void destroy_program(basic_program *program) {
+    if(program) {
+        free(program->code);
+        free(program->lines);
+        free(program->data);
+        free(program);
+    }
+}
+
+static size_t find_line(const basic_program *program, uint16_t number) {   // index, or line_count if missing
+    size_t low = 0, high = program->line_count;
+    while(low < high) {
+        size_t middle = (low + high) / 2;
+        if(program->lines[middle].line < number) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < program->line_count && program->lines[low].line == number ? low : program->line_count;
+}
+
+static basic_program* compile_program(source_line *lines, size_t count) {
+    basic_program *program = calloc(1, sizeof(basic_program));
+    compiler *c = calloc(1, sizeof(compiler));
+    if(program) {
+        program->lines = malloc((count ? count : 1) * sizeof(line_entry));
+    }
+    if(!program || !c || !program->lines) {
+        printf("Memory allocation failed.\n");
+        destroy_program(program);
+        free(c);
+        return NULL;
+    }
+    c->program = program;
+    for(size_t i = 0; i < count && !c->error; i++) {
+        if(i + 1 < count && lines[i + 1].number == lines[i].number) {
+            continue;
+        }
+        c->line = lines[i].number;
+        program->lines[program->line_count++] = (line_entry) {lines[i].number, here(c)};
+        compile_line(c, lines[i].text);
+    }
+    emit(c, OP_END);
+    if(!c->error && c->block_count) {
+        c->line = c->blocks[c->block_count - 1].line;
+        c->error = "LOOP NOT FOUND";
+    }
+    for(size_t i = 0; i < c->fixup_count && !c->error; i++) {
+        size_t line = find_line(program, c->fixups[i].target);
+        if(line == program->line_count) {
+            c->line = c->fixups[i].line;
+            c->error = "UNDEF'D STATEMENT";
+        } else {
+            patch_32(c, c->fixups[i].position, program->lines[line].offset);
+        }
+    }
+    if(c->error) {
+        printf("?%s  ERROR IN %u\n", c->error, c->line);
+        destroy_program(program);
+        program = NULL;
+    }
+    free(c->fixups);
+    free(c);
+    return program;
+}
+
+static basic_program* load_basic(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if(!file) {
+        printf("Unable to open file %s.\n", filename);
+        return NULL;
+    }
+    source_line *lines = NULL;
+    size_t count = 0, capacity = 0;
+    char text[BASIC_LINE_LENGTH];
+    bool ok = true;
+    while(ok && fgets(text, sizeof(text), file)) {
+        char *p = text;
+        while(*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if(!*p || *p == '\n' || *p == '\r') {
+            continue;
+        }
+        if(!isdigit((unsigned char) *p)) {
+            printf("Line without number in %s: %s", filename, text);
+            ok = false;
+            break;
+        }
+        long number = strtol(p, &p, 10);
+        if(number > 63999) {
+            printf("?SYNTAX  ERROR IN %ld\n", number);
+            ok = false;
+            break;
+        }
+        if(count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            source_line *grown = realloc(lines, capacity * sizeof(source_line));
+            if(!grown) {
+                printf("Memory allocation failed.\n");
+                ok = false;
+                break;
+            }
+            lines = grown;
+        }
+        lines[count] = (source_line) {(uint16_t) number, count, strdup(p)};
+        if(!lines[count++].text) {
+            printf("Memory allocation failed.\n");
+            ok = false;
+        }
+    }
+    fclose(file);
+    basic_program *program = NULL;
+    if(ok) {
+        qsort(lines, count, sizeof(source_line), compare_lines);
+        program = compile_program(lines, count);
+    }
+    for(size_t i = 0; i < count; i++) {
+        free(lines[i].text);
+    }
+    free(lines);
+    return program;
+}
+
+
+// Screen: 40 x 25 characters in the machine's screen memory, optionally mirrored to the terminal
+
+static uint8_t screen_code(uint8_t c) {                     // PETSCII to screen code
+    if(c < 0x40 || c == 0xFF) {
+        return c == 0xFF ? 0x5E : c;
+    }
+    if(c < 0x60) {
+        return c - 0x40;
+    }
+    if(c < 0x80) {
+        return c - 0x20;
+    }
+    return c < 0xC0 ? c - 0x40 : c - 0x80;
+}
+
+static char host_char(uint8_t code) {                       // screen code to ASCII: letters upper case, shifted
+    code &= 0x7F;                                           // letters lower case
+    if(code >= 1 && code <= 26) {
+        return (char) ('A' + code - 1);
+    }
+    if(code >= 0x41 && code <= 0x5A) {
+        return (char) ('a' + code - 0x41);
+    }
+    static const char symbols[] = "@ABCDEFGHIJKLMNOPQRSTUVWXYZ[#]^_ !\"#$%&'()*+,-./0123456789:;<=>?";
+    return code < 0x40 ? symbols[code] : code == 0x40 ? '-' : '#';
+}
+
+static void terminal_place(basic *b) {
+    if(b->terminal_row != b->row || b->terminal_column != b->column) {
+        fprintf(b->terminal, "\033[%d;%dH", b->row + 1, b->column + 1);
+        b->terminal_row = b->row;
+        b->terminal_column = b->column;
+    }
+}
+
+static void redraw_terminal(basic *b) {
+    fprintf(b->terminal, "\033[H\033[2J");
+    for(int row = 0; row < SCREEN_ROWS; row++) {
+        for(int column = 0; column < SCREEN_COLUMNS; column++) {
+            uint8_t code = bus_read(&b->m->bus, SCREEN_MEMORY + row * SCREEN_COLUMNS + column);
+            fprintf(b->terminal, (code & 0x80) ? "\033[7m%c\033[27m" : "%c", host_char(code));
+        }
+        fputc('\n', b->terminal);
+    }
+    b->terminal_row = b->terminal_column = -1;
+    b->terminal_reverse = false;
+}
+
+static void clear_screen(basic *b) {
+    for(int i = 0; i < SCREEN_ROWS * SCREEN_COLUMNS; i++) {
+        bus_write(&b->m->bus, SCREEN_MEMORY + i, 0x20);
+        bus_write(&b->m->bus, COLOR_MEMORY + i, TEXT_COLOR);
+    }
+    b->row = b->column = 0;
+    if(b->live) {
+        redraw_terminal(b);
+    }
+}
+
+static void newline(basic *b) {
+    b->column = 0;
+    b->reverse = false;                                     // Return ends reverse mode, as on the real machine
+    if(++b->row < SCREEN_ROWS) {
+        return;
+    }
+    b->row = SCREEN_ROWS - 1;                               // scroll up
+    memory_bus *bus = &b->m->bus;
+    for(int i = 0; i < (SCREEN_ROWS - 1) * SCREEN_COLUMNS; i++) {
+        bus_write(bus, SCREEN_MEMORY + i, bus_read(bus, SCREEN_MEMORY + SCREEN_COLUMNS + i));
+        bus_write(bus, COLOR_MEMORY + i, bus_read(bus, COLOR_MEMORY + SCREEN_COLUMNS + i));
+    }
+    for(int i = 0; i < SCREEN_COLUMNS; i++) {
+        bus_write(bus, SCREEN_MEMORY + (SCREEN_ROWS - 1) * SCREEN_COLUMNS + i, 0x20);
+    }
+    if(b->live) {
+        redraw_terminal(b);
+    }
+}
+
+static void put_char(basic *b, uint8_t c) {
+    switch(c) {
+        case 13:
+        case 141:
+            newline(b);
+            return;
+        case 18:
+            b->reverse = true;
+            return;
+        case 146:
+            b->reverse = false;
+            return;
+        case 147:
+            clear_screen(b);
+            return;
+        case 19:
+            b->row = b->column = 0;
+            return;
+        case 17:
+            b->row += b->row < SCREEN_ROWS - 1;
+            return;
+        case 145:
+            b->row -= b->row > 0;
+            return;
+        case 29:
+            b->column += b->column < SCREEN_COLUMNS - 1;
+            return;
+        case 157:
+            b->column -= b->column > 0;
+            return;
+    }
+    if((c & 0x7F) < 0x20) {                                 // other control codes
+        return;
+    }
+    uint8_t code = screen_code(c) | (b->reverse ? 0x80 : 0);
+    bus_write(&b->m->bus, SCREEN_MEMORY + b->row * SCREEN_COLUMNS + b->column, code);
+    bus_write(&b->m->bus, COLOR_MEMORY + b->row * SCREEN_COLUMNS + b->column, TEXT_COLOR);
+    if(b->live) {
+        terminal_place(b);
+        if(b->terminal_reverse != b->reverse) {
+            fputs(b->reverse ? "\033[7m" : "\033[27m", b->terminal);
+            b->terminal_reverse = b->reverse;
+        }
+        fputc(host_char(code), b->terminal);
+        b->terminal_column++;
+    }
+    if(++b->column == SCREEN_COLUMNS) {
+        bool reverse = b->reverse;
+        newline(b);
+        b->reverse = reverse;                               // wrapping is no Return
+    }
+}
+
+static void put_text(basic *b, const uint8_t *text, size_t length) {
+    for(size_t i = 0; i < length; i++) {
+        put_char(b, text[i]);
+    }
+}
+
+static void put_string(basic *b, const char *text) {        // messages: upper case ASCII, unshifted on the screen
+    while(*text) {
+        put_char(b, petscii((char) tolower((unsigned char) *text++)));
+    }
+}
+
+static void update_cursor(basic *b) {                       // where the KERNAL keeps it
+    bus_write(&b->m->bus, CURSOR_ROW, (uint8_t) b->row);
+    bus_write(&b->m->bus, CURSOR_COLUMN, (uint8_t) b->column);
+}
+
+static void print_screen(basic *b, FILE *output) {
+    int rows = SCREEN_ROWS;
+    char line[SCREEN_COLUMNS + 1];
+    while(rows > 0) {                                       // leave out empty rows at the bottom
+        int i = 0;
+        while(i < SCREEN_COLUMNS && bus_read(&b->m->bus, SCREEN_MEMORY + (rows - 1) * SCREEN_COLUMNS + i) == 0x20) {
+            i++;
+        }
+        if(i < SCREEN_COLUMNS) {
+            break;
+        }
+        rows--;
+    }
+    for(int row = 0; row < rows; row++) {
+        int length = 0;
+        for(int column = 0; column < SCREEN_COLUMNS; column++) {
+            line[column] = host_char(bus_read(&b->m->bus, SCREEN_MEMORY + row * SCREEN_COLUMNS + column));
+            if(line[column] != ' ') {
+                length = column + 1;
+            }
+        }
+        line[length] = 0;
+        fprintf(output, "%s\n", line);
+    }
+}
+
+
+// Numbers
+
+static int format_number(double value, char *text) {       // as the ROM prints them: sign or space, 9 digits at most,
+    char digits[48];                                        // E format below 0.01 and from 1E+09
+    double magnitude = fabs(value);
+    if(value == 0) {
+        return sprintf(text, " 0");
+    }
+    if(magnitude >= 1e9 || magnitude < 0.01) {
+        snprintf(digits, sizeof(digits), "%.8E", magnitude);
+        char *exponent = strchr(digits, 'E'), *end = exponent;
+        while(end[-1] == '0') {
+            end--;
+        }
+        if(end[-1] == '.') {
+            end--;
+        }
+        memmove(end, exponent, strlen(exponent) + 1);
+    } else {
+        int integer_digits = magnitude >= 1 ? (int) floor(log10(magnitude)) + 1 : 0;
+        snprintf(digits, sizeof(digits), "%.*f", 9 - integer_digits, magnitude);
+        if(strchr(digits, '.')) {
+            char *end = digits + strlen(digits);
+            while(end[-1] == '0') {
+                end--;
+            }
+            if(end[-1] == '.') {
+                end--;
+            }
+            *end = 0;
+        }
+        if(digits[0] == '0' && digits[1] == '.') {
+            memmove(digits, digits + 1, strlen(digits));
+        }
+    }
+    return sprintf(text, "%c%s", value < 0 ? '-' : ' ', digits);
+}
+
+static double string_value(const basic_string *s, bool *valid) {   // VAL; valid: the whole string is a number
+    char text[256];
+    int length = 0;
+    for(int i = 0; i < s->length; i++) {                    // spaces do not count, as in the ROM
+        if(s->text[i] != ' ') {
+            text[length++] = (char) s->text[i];
+        }
+    }
+    text[length] = 0;
+    char *end;
+    double value = strtod(text, &end);
+    if(isinf(value) || isnan(value) || (text[0] != '.' && text[0] != '-' && text[0] != '+'
+                                        && !isdigit((unsigned char) text[0]))) {
+        value = 0, end = text;
+    }
+    if(valid) {
+        *valid = !*end;
+    }
+    return value;
+}
+
+static inline bool overflows(double value) {               // out of the ROM's range: ?OVERFLOW ERROR
+    return fabs(value) > BASIC_LARGEST;
+}
+
+static bool to_integer(double value, int *result) {        // 16 bit signed, for AND, OR, NOT and % variables
+    if(!(value > -32769 && value < 32768)) {
+        return false;
+    }
+    *result = (int) value;
+    return true;
+}
+
+static bool to_range(double value, int low, int high, int *result) {
+    if(!(value >= low && value < high + 1.0)) {
+        return false;
+    }
+    *result = (int) value;
+    return true;
+}
+
+// PRINT USING: the first field of "#", "." and "," in the format, with a "+" or "-" in front of it or behind it.
+// Commas separate thousands where digits are on both sides, blanks elsewhere. "+" shows the sign of every number,
+// "-" only the minus; without either, the minus takes a "#" in front of the digits. Numbers that do not fit are
+// shown as asterisks.
+
+static bool is_digits(const basic_string *format, int i) {           // "#" or "."
+    return i < format->length && (format->text[i] == '#' || format->text[i] == '.');
+}
+
+static bool is_field(const basic_string *format, int i) {
+    return is_digits(format, i) || (i < format->length && format->text[i] == ',');
+}
+
+static bool is_sign(const basic_string *format, int i) {
+    return i < format->length && (format->text[i] == '+' || format->text[i] == '-');
+}
+
+static void print_using(basic *b, const basic_string *format, double number, const basic_string *string) {
+    int start = 0, end;
+    while(start < format->length && !is_digits(format, start) && !(is_sign(format, start) && is_digits(format, start + 1))) {
+        start++;
+    }
+    int sign = is_sign(format, start) ? start : -1, point = -1, decimals = 0;
+    for(end = sign >= 0 ? start + 1 : start; is_field(format, end); end++) {
+        if(format->text[end] == '.' && point < 0) {
+            point = end;
+        } else if(point >= 0 && format->text[end] == '#') {
+            decimals++;
+        }
+    }
+    if(sign < 0 && is_sign(format, end)) {
+        sign = end++;
+    }
+    int width = end - start;
+    char text[320];
+    int length = width;
+    if(string) {                                            // strings: left aligned, cut to the field
+        length = string->length < width ? string->length : width;
+        memcpy(text, string->text, length);
+        while(length < width) {
+            text[length++] = ' ';
+        }
+    } else {
+        char digits[320];
+        snprintf(digits, sizeof(digits), "%.*f", decimals, fabs(number));
+        char *fraction = strchr(digits, '.');
+        int left = fraction ? (int) (fraction - digits) : (int) strlen(digits);     // integer digits still to place
+        bool minus = number < 0 && sign < 0;                // takes a position in front of the digits
+        memcpy(text, format->text + start, width);
+        for(int i = (point >= 0 ? point : end) - 1 - start; i >= 0; i--) {     // integer part, from the right
+            if(text[i] == '#' || (text[i] == ',' && !left && minus)) {
+                if(left) {
+                    text[i] = digits[--left];
+                } else if(minus) {
+                    text[i] = '-';
+                    minus = false;
+                } else {
+                    text[i] = ' ';
+                }
+            } else if(text[i] == ',') {
+                text[i] = left ? ',' : ' ';
+            }
+        }
+        bool fits = !left && !minus;
+        for(int i = point + 1 - start, digit = 1; point >= 0 && i < width; i++) {      // fraction, from the left
+            if(text[i] == '#') {
+                text[i] = fraction[digit++];
+            }
+        }
+        if(sign >= 0) {
+            text[sign - start] = number < 0 ? '-' : format->text[sign] == '+' ? '+' : ' ';
+        }
+        if(!fits) {                                         // does not fit: asterisks
+            memset(text, '*', width);
+        }
+    }
+    put_text(b, format->text, start);
+    put_text(b, (const uint8_t *) text, length);
+    put_text(b, format->text + end, format->length - end);
+}
+
+
+// Machine: keys, SYS, sound and graphics
+
+static int next_key(basic *b, bool wait) {                  // PETSCII code, or -1
+    if(b->key_position == b->key_count) {
+        return -1;
+    }
+    if(b->m->cpu.cycles < b->next_key) {
+        if(!wait) {
+            return -1;
+        }
+        b->m->cpu.cycles = b->next_key;                     // time passes while waiting
+    }
+    b->next_key = b->m->cpu.cycles + BASIC_KEY_INTERVAL;
+    return b->keys[b->key_position++];
+}
+
+static bool read_line(basic *b) {                           // INPUT; false if the keys run out
+    b->input_length = b->input_position = 0;
+    while(1) {
+        int key = next_key(b, true);
+        if(key < 0) {
+            return false;
+        }
+        if(key == 13) {
+            put_char(b, 13);
+            return true;
+        }
+        if(key == 20 && b->input_length) {                  // DEL
+            b->input_length--;
+            put_char(b, 157);
+            put_char(b, ' ');
+            put_char(b, 157);
+        } else if(key >= 0x20 && key != 20 && b->input_length < BASIC_INPUT_LENGTH) {
+            b->input[b->input_length++] = (uint8_t) key;
+            put_char(b, (uint8_t) key);
+        }
+    }
+}
+
+static void input_field(basic *b, basic_string *field) {    // next comma-separated field of the INPUT line
+    field->length = 0;
+    while(b->input_position < b->input_length && b->input[b->input_position] == ' ') {
+        b->input_position++;
+    }
+    bool quoted = b->input_position < b->input_length && b->input[b->input_position] == '"';
+    b->input_position += quoted;
+    while(b->input_position < b->input_length) {
+        uint8_t c = b->input[b->input_position++];
+        if(quoted ? c == '"' : c == ',') {
+            break;
+        }
+        field->text[field->length++] = c;
+    }
+    if(quoted) {
+        while(b->input_position < b->input_length && b->input[b->input_position++] != ',');
+    }
+}
+
+static void call_machine_code(basic *b, uint16_t address) {
+    CPU6502 *cpu = &b->m->cpu;
+    memory_bus *bus = &b->m->bus;
+    if(address == PLOT_ROUTINE) {                           // the KERNAL is not there: the host moves the cursor
+        int row = bus_read(bus, CURSOR_ROW), column = bus_read(bus, CURSOR_COLUMN);
+        b->row = row < SCREEN_ROWS ? row : SCREEN_ROWS - 1;
+        b->column = column < SCREEN_COLUMNS ? column : SCREEN_COLUMNS - 1;
+        return;
+    }
+    uint8_t SP = cpu->SP;                                   // as JSR from SYS_RETURN - 3
+    bus_write(bus, 0x0100 | cpu->SP--, (SYS_RETURN - 1) >> 8);
+    bus_write(bus, 0x0100 | cpu->SP--, (SYS_RETURN - 1) & 0xFF);
+    cpu->A = bus_read(bus, SYS_REGISTERS);
+    cpu->X = bus_read(bus, SYS_REGISTERS + 1);
+    cpu->Y = bus_read(bus, SYS_REGISTERS + 2);
+    set_status(cpu, bus_read(bus, SYS_REGISTERS + 3));
+    cpu->PC = address;
+    run_machine(b->m, (run_budget) {.cycles = BASIC_SYS_CYCLES, .breakpoints = b->breakpoints});
+    bus_write(bus, SYS_REGISTERS, cpu->A);
+    bus_write(bus, SYS_REGISTERS + 1, cpu->X);
+    bus_write(bus, SYS_REGISTERS + 2, cpu->Y);
+    bus_write(bus, SYS_REGISTERS + 3, get_status(cpu));
+    cpu->SP = SP;
+}
+
+static void pop_arguments(double **number, int mask, int count, double *values) {   // missing ones: NAN
+    for(int i = count - 1; i >= 0; i--) {
+        values[i] = (mask & (1 << i)) ? *(*number)-- : NAN;
+    }
+}
+
+static bool color_source(basic *b, double value, TED_pixel *color) {
+    int source = 1;
+    if(!isnan(value) && !to_range(value, 0, 4, &source)) {
+        return false;
+    }
+    *color = b->colors[source];
+    return true;
+}
+
+static coordinates point(double x, double y, coordinates otherwise) {
+    return isnan(x) || isnan(y) ? otherwise : (coordinates) {(int) x, (int) y};
+}
+
+static const char* graphic(basic *b, double mode, double clear) {
+    int value;
+    if(!to_range(mode, 0, 4, &value)) {
+        return "ILLEGAL QUANTITY";
+    }
+    b->graphic_mode = value;
+    if(!value) {
+        return NULL;
+    }
+    bool first = !b->bitmap;
+    if(first) {
+        b->bitmap = malloc(320 * 200 * sizeof(TED_pixel));
+        if(!b->bitmap) {
+            return "OUT OF MEMORY";
+        }
+    }
+    GRAPHIC(value, &b->screen);
+    if(first || (!isnan(clear) && clear == 1)) {
+        SCNCLR(b->bitmap, b->screen);
+        b->graphics_cursor = (coordinates) {b->screen.width / 2, b->screen.height / 2};
+    }
+    return NULL;
+}
+
+
+// The interpreter loop
+
+static uint16_t read_16(const uint8_t *code) {
+    return (uint16_t) (code[0] | (code[1] << 8));
+}
+
+static uint32_t read_32(const uint8_t *code) {
+    return code[0] | (code[1] << 8) | (code[2] << 16) | ((uint32_t) code[3] << 24);
+}
+
+static int compare_strings(const basic_string *a, const basic_string *b) {
+    int length = a->length < b->length ? a->length : b->length;
+    int result = memcmp(a->text, b->text, length);
+    return result ? result : a->length - b->length;
+}
+
+static void copy_string(basic_string *to, const basic_string *from) {
+    to->length = from->length;
+    memcpy(to->text, from->text, from->length);
+}
+
+static bool find_element(basic_array *array, const double *subscripts, int dimensions, bool strings, size_t *index) {
+    if(!array->dimensions) {                                // first use without DIM: 0-10 in every dimension
+        size_t size = 1;
+        array->dimensions = (uint8_t) dimensions;
+        for(int i = 0; i < dimensions; i++) {
+            array->bounds[i] = 11;
+            size *= 11;
+        }
+        if(strings ? !(array->strings = calloc(size, sizeof(basic_string)))
+                   : !(array->numbers = calloc(size, sizeof(double)))) {
+            array->dimensions = 0;
+            return false;
+        }
+    }
+    if(array->dimensions != dimensions) {
+        return false;
+    }
+    *index = 0;
+    for(int i = 0; i < dimensions; i++) {
+        int subscript;
+        if(!to_range(subscripts[i], 0, array->bounds[i] - 1, &subscript)) {
+            return false;
+        }
+        *index = *index * array->bounds[i] + (size_t) subscript;
+    }
+    return true;
+}
+
+static const char* dimension(basic_array *array, const double *bounds, int dimensions, bool strings) {
+    if(array->dimensions) {
+        return "REDIM'D ARRAY";
+    }
+    size_t size = 1;
+    for(int i = 0; i < dimensions; i++) {
+        int bound;
+        if(!to_range(bounds[i], 0, 32766, &bound)) {
+            return "ILLEGAL QUANTITY";
+        }
+        array->bounds[i] = (uint16_t) (bound + 1);
+        size *= (size_t) bound + 1;
+    }
+    if(size > 1 << 24 || (strings ? !(array->strings = calloc(size, sizeof(basic_string)))
+                                  : !(array->numbers = calloc(size, sizeof(double))))) {
+        return "OUT OF MEMORY";
+    }
+    array->dimensions = (uint8_t) dimensions;
+    return NULL;
+}
+
+static bool reach_stop(basic *b) {                          // renders the frames due; false if the time is up
+    uint64_t cycles = b->m->cpu.cycles;
+    while(b->stream && b->next_frame <= cycles) {           // also those skipped while waiting for a key
+        ted_video_render(b->video);
+        b->next_frame += TED_FRAME_CYCLES;
+    }
+    b->next_stop = b->stream && b->next_frame < b->cycle_limit ? b->next_frame : b->cycle_limit;
+    return cycles < b->cycle_limit;
+}
+
+static double next_random(basic *b) {
+    b->random = b->random * 1103515245u + 12345u;
+    return (b->random >> 8) / 16777216.0;
+}
+
+static basic_result run_basic(basic *b) {
+    const uint8_t *code = b->program->code;
+    uint32_t pc = 0;
+    double numbers[BASIC_STACK], *number = numbers - 1;    // tops of the stacks
+    basic_string *string = b->string_stack - 1;
+    CPU6502 *cpu = &b->m->cpu;
+    memory_bus *bus = &b->m->bus;
+    const char *error = NULL;
+    char text[64];
+    int a, c;
+
+    while(1) {
+        uint8_t op = code[pc++];
+        switch(op) {
+            case OP_STATEMENT:
+                b->statement = pc - 1;
+                b->statements++;
+                cpu->cycles += BASIC_STATEMENT_CYCLES;
+                if(cpu->cycles >= b->next_stop && !reach_stop(b)) {
+                    return BASIC_TIME;
+                }
+                break;
+            case OP_NUMBER:
+                memcpy(++number, code + pc, sizeof(double));
+                pc += sizeof(double);
+                break;
+            case OP_STRING:
+                string++;
+                string->length = code[pc];
+                memcpy(string->text, code + pc + 1, code[pc]);
+                pc += 1 + code[pc];
+                break;
+            case OP_LOAD:
+                *++number = b->numbers[read_16(code + pc)];
+                pc += 2;
+                break;
+            case OP_LOAD_STRING:
+                copy_string(++string, &b->strings[read_16(code + pc)]);
+                pc += 2;
+                break;
+            case OP_STORE:
+                b->numbers[read_16(code + pc)] = *number--;
+                pc += 2;
+                break;
+            case OP_STORE_INTEGER:
+                if(!to_integer(*number--, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                b->numbers[read_16(code + pc)] = a;
+                pc += 2;
+                break;
+            case OP_STORE_STRING:
+                copy_string(&b->strings[read_16(code + pc)], string--);
+                pc += 2;
+                break;
+            case OP_LOAD_ELEMENT:
+            case OP_LOAD_STRING_ELEMENT:
+            case OP_STORE_ELEMENT:
+            case OP_STORE_INTEGER_ELEMENT:
+            case OP_STORE_STRING_ELEMENT: {
+                bool strings = op == OP_LOAD_STRING_ELEMENT || op == OP_STORE_STRING_ELEMENT;
+                bool load = op == OP_LOAD_ELEMENT || op == OP_LOAD_STRING_ELEMENT;
+                basic_array *array = strings ? &b->string_arrays[read_16(code + pc)]
+                                             : &b->number_arrays[read_16(code + pc)];
+                int dimensions = code[pc + 2];
+                double value = load || strings ? 0 : *number--;    // stored numbers are above the subscripts
+                size_t index;
+                pc += 3;
+                number -= dimensions;
+                if(!find_element(array, number + 1, dimensions, strings, &index)) {
+                    error = array->dimensions ? "BAD SUBSCRIPT" : "OUT OF MEMORY";
+                    goto failed;
+                }
+                if(op == OP_LOAD_ELEMENT) {
+                    *++number = array->numbers[index];
+                } else if(op == OP_LOAD_STRING_ELEMENT) {
+                    copy_string(++string, &array->strings[index]);
+                } else if(op == OP_STORE_STRING_ELEMENT) {
+                    copy_string(&array->strings[index], string--);
+                } else if(op == OP_STORE_INTEGER_ELEMENT && !to_integer(value, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                } else {
+                    array->numbers[index] = op == OP_STORE_INTEGER_ELEMENT ? a : value;
+                }
+                break;
+            }
+            case OP_DIM:
+            case OP_DIM_STRING: {
+                bool strings = op == OP_DIM_STRING;
+                int dimensions = code[pc + 2];
+                number -= dimensions;
+                uint16_t slot = read_16(code + pc);
+                error = dimension(strings ? &b->string_arrays[slot] : &b->number_arrays[slot], number + 1, dimensions,
+                                  strings);
+                if(error) {
+                    goto failed;
+                }
+                pc += 3;
+                break;
+            }
+            case OP_ADD:
+                number[-1] += number[0];
+                number--;
+                if(overflows(*number)) {
+                    error = "OVERFLOW";
+                    goto failed;
+                }
+                break;
+            case OP_SUBTRACT:
+                number[-1] -= number[0];
+                number--;
+                if(overflows(*number)) {
+                    error = "OVERFLOW";
+                    goto failed;
+                }
+                break;
+            case OP_MULTIPLY:
+                number[-1] *= number[0];
+                number--;
+                if(overflows(*number)) {
+                    error = "OVERFLOW";
+                    goto failed;
+                }
+                break;
+            case OP_DIVIDE:
+                if(number[0] == 0) {
+                    error = "DIVISION BY ZERO";
+                    goto failed;
+                }
+                number[-1] /= number[0];
+                number--;
+                if(overflows(*number)) {
+                    error = "OVERFLOW";
+                    goto failed;
+                }
+                break;
+            case OP_POWER:
+                number[-1] = pow(number[-1], number[0]);
+                number--;
+                if(isnan(*number) || overflows(*number)) {
+                    error = isnan(*number) ? "ILLEGAL QUANTITY" : "OVERFLOW";
+                    goto failed;
+                }
+                break;
+            case OP_NEGATE:
+                *number = -*number;
+                break;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_LESS:
+            case OP_GREATER:
+            case OP_LESS_EQUAL:
+            case OP_GREATER_EQUAL: {
+                double x = number[-1], y = number[0];
+                bool result = op == OP_EQUAL ? x == y : op == OP_NOT_EQUAL ? x != y : op == OP_LESS ? x < y
+                            : op == OP_GREATER ? x > y : op == OP_LESS_EQUAL ? x <= y : x >= y;
+                *--number = result ? -1 : 0;
+                break;
+            }
+            case OP_STRING_EQUAL:
+            case OP_STRING_NOT_EQUAL:
+            case OP_STRING_LESS:
+            case OP_STRING_GREATER:
+            case OP_STRING_LESS_EQUAL:
+            case OP_STRING_GREATER_EQUAL: {
+                int order = compare_strings(string - 1, string);
+                bool result = op == OP_STRING_EQUAL ? !order : op == OP_STRING_NOT_EQUAL ? order
+                            : op == OP_STRING_LESS ? order < 0 : op == OP_STRING_GREATER ? order > 0
+                            : op == OP_STRING_LESS_EQUAL ? order <= 0 : order >= 0;
+                string -= 2;
+                *++number = result ? -1 : 0;
+                break;
+            }
+            case OP_CONCATENATE:
+                if(string[-1].length + string[0].length > 255) {
+                    error = "STRING TOO LONG";
+                    goto failed;
+                }
+                memcpy(string[-1].text + string[-1].length, string[0].text, string[0].length);
+                string[-1].length += string[0].length;
+                string--;
+                break;
+            case OP_AND:
+            case OP_OR:
+                if(!to_integer(number[-1], &a) || !to_integer(number[0], &c)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                *--number = (int16_t) (op == OP_AND ? a & c : a | c);
+                break;
+            case OP_NOT:
+                if(!to_integer(*number, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                *number = (int16_t) ~a;
+                break;
+            case OP_FUNCTION: {
+                int function = code[pc], count = code[pc + 1];
+                pc += 2;
+                switch(function) {
+                    case FN_ASC:
+                        a = string->length ? string->text[0] : 0;
+                        string--;
+                        *++number = a;
+                        break;
+                    case FN_PEEK:
+                        if(!to_range(*number, 0, 65535, &a)) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        *number = bus_read(bus, (uint16_t) a);
+                        break;
+                    case FN_INT:
+                        *number = floor(*number);
+                        break;
+                    case FN_HEX:
+                        if(!to_range(*number--, 0, 65535, &a)) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        string++;
+                        string->length = (uint8_t) sprintf((char *) string->text, "%04X", a);
+                        break;
+                    case FN_VAL:
+                        *++number = string_value(string--, NULL);
+                        break;
+                    case FN_CHR:
+                        if(!to_range(*number--, 0, 255, &a)) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        string++;
+                        string->length = 1;
+                        string->text[0] = (uint8_t) a;
+                        break;
+                    case FN_ABS:
+                        *number = fabs(*number);
+                        break;
+                    case FN_SGN:
+                        *number = (*number > 0) - (*number < 0);
+                        break;
+                    case FN_SQR:
+                        if(*number < 0) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        *number = sqrt(*number);
+                        break;
+                    case FN_RND:
+                        if(*number < 0) {
+                            b->random = (uint32_t) (int32_t) *number;
+                        } else if(*number == 0) {
+                            b->random ^= (uint32_t) cpu->cycles;
+                        }
+                        *number = next_random(b);
+                        break;
+                    case FN_LEN:
+                        a = string->length;
+                        string--;
+                        *++number = a;
+                        break;
+                    case FN_STR:
+                        string++;
+                        string->length = (uint8_t) format_number(*number--, (char *) string->text);
+                        break;
+                    case FN_LEFT:
+                    case FN_RIGHT:
+                        if(!to_range(*number--, 0, 255, &a)) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        if(a < string->length) {
+                            if(function == FN_RIGHT) {
+                                memmove(string->text, string->text + string->length - a, a);
+                            }
+                            string->length = (uint8_t) a;
+                        }
+                        break;
+                    case FN_MID:
+                        c = 255;
+                        if((count == 3 && !to_range(*number--, 0, 255, &c)) || !to_range(*number--, 1, 255, &a)) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        if(a > string->length) {
+                            string->length = 0;
+                        } else {
+                            c = c < string->length - a + 1 ? c : string->length - a + 1;
+                            memmove(string->text, string->text + a - 1, c);
+                            string->length = (uint8_t) c;
+                        }
+                        break;
+                    case FN_SIN:
+                        *number = sin(*number);
+                        break;
+                    case FN_COS:
+                        *number = cos(*number);
+                        break;
+                    case FN_TAN:
+                        *number = tan(*number);
+                        break;
+                    case FN_ATN:
+                        *number = atan(*number);
+                        break;
+                    case FN_EXP:
+                        *number = exp(*number);
+                        if(overflows(*number)) {
+                            error = "OVERFLOW";
+                            goto failed;
+                        }
+                        break;
+                    case FN_LOG:
+                        if(*number <= 0) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        *number = log(*number);
+                        break;
+                    case FN_DEC: {
+                        char *end;
+                        memcpy(text, string->text, string->length);
+                        text[string->length] = 0;
+                        long value = strtol(text, &end, 16);
+                        if(!string->length || *end || value < 0 || value > 65535) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        string--;
+                        *++number = value;
+                        break;
+                    }
+                    case FN_INSTR:
+                        a = 1;
+                        if(count == 3 && !to_range(*number--, 1, 255, &a)) {
+                            error = "ILLEGAL QUANTITY";
+                            goto failed;
+                        }
+                        c = 0;
+                        for(int i = a - 1; string->length && i + string->length <= string[-1].length; i++) {
+                            if(!memcmp(string[-1].text + i, string->text, string->length)) {
+                                c = i + 1;
+                                break;
+                            }
+                        }
+                        string -= 2;
+                        *++number = c;
+                        break;
+                }
+                break;
+            }
+            case OP_JUMP:
+                pc = read_32(code + pc);
+                break;
+            case OP_JUMP_IF_FALSE:
+                pc = *number-- == 0 ? read_32(code + pc) : pc + 4;
+                break;
+            case OP_JUMP_IF_TRUE:
+                pc = *number-- != 0 ? read_32(code + pc) : pc + 4;
+                break;
+            case OP_GOSUB:
+                if(b->gosub_depth == BASIC_GOSUB_DEPTH) {
+                    error = "OUT OF MEMORY";
+                    goto failed;
+                }
+                b->gosubs[b->gosub_depth++] = (gosub_frame) {pc + 4, b->for_depth};
+                pc = read_32(code + pc);
+                break;
+            case OP_RETURN:
+                if(!b->gosub_depth) {
+                    error = "RETURN WITHOUT GOSUB";
+                    goto failed;
+                }
+                b->gosub_depth--;
+                b->for_depth = b->gosubs[b->gosub_depth].for_depth;
+                pc = b->gosubs[b->gosub_depth].return_to;
+                break;
+            case OP_ON_GOTO:
+            case OP_ON_GOSUB: {
+                int count = code[pc];
+                uint32_t next = pc + 1 + 4 * count;
+                if(!to_range(*number--, 0, 255, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                if(a < 1 || a > count) {
+                    pc = next;
+                    break;
+                }
+                if(op == OP_ON_GOSUB) {
+                    if(b->gosub_depth == BASIC_GOSUB_DEPTH) {
+                        error = "OUT OF MEMORY";
+                        goto failed;
+                    }
+                    b->gosubs[b->gosub_depth++] = (gosub_frame) {next, b->for_depth};
+                }
+                pc = read_32(code + pc + 1 + 4 * (a - 1));
+                break;
+            }
+            case OP_FOR: {
+                uint16_t slot = read_16(code + pc);
+                double step = *number--, limit = *number--;
+                for(int i = b->for_depth - 1; i >= 0; i--) {    // a running loop with the same variable ends
+                    if(b->fors[i].slot == slot) {
+                        b->for_depth = i;
+                        break;
+                    }
+                }
+                if(b->for_depth == BASIC_FOR_DEPTH) {
+                    error = "OUT OF MEMORY";
+                    goto failed;
+                }
+                pc += 2;
+                b->fors[b->for_depth++] = (for_frame) {slot, limit, step, pc};
+                break;
+            }
+            case OP_NEXT: {
+                uint16_t slot = read_16(code + pc);
+                int i = b->for_depth - 1;
+                while(i >= 0 && slot != NEXT_ANY && b->fors[i].slot != slot) {
+                    i--;
+                }
+                if(i < 0) {
+                    error = "NEXT WITHOUT FOR";
+                    goto failed;
+                }
+                for_frame *loop = &b->fors[i];
+                double value = b->numbers[loop->slot] += loop->step;
+                if(overflows(value)) {
+                    error = "OVERFLOW";
+                    goto failed;
+                }
+                if(loop->step >= 0 ? value <= loop->limit : value >= loop->limit) {
+                    b->for_depth = i + 1;
+                    pc = loop->loop;
+                } else {
+                    b->for_depth = i;
+                    pc += 2;
+                }
+                break;
+            }
+            case OP_PRINT_NUMBER:
+                a = format_number(*number--, text);
+                text[a++] = ' ';
+                put_text(b, (const uint8_t *) text, a);
+                update_cursor(b);
+                break;
+            case OP_PRINT_STRING:
+                put_text(b, string->text, string->length);
+                string--;
+                update_cursor(b);
+                break;
+            case OP_PRINT_COMMA:                            // next column of 10
+                do {
+                    put_char(b, ' ');
+                } while(b->column % 10);
+                update_cursor(b);
+                break;
+            case OP_PRINT_NEWLINE:
+                put_char(b, 13);
+                update_cursor(b);
+                break;
+            case OP_PRINT_SPC:
+            case OP_PRINT_TAB:
+                if(!to_range(*number--, 0, 255, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                if(op == OP_PRINT_TAB) {
+                    a = a > b->column ? a - b->column : 0;
+                }
+                while(a--) {
+                    put_char(b, op == OP_PRINT_TAB ? 29 : ' ');
+                }
+                update_cursor(b);
+                break;
+            case OP_USING:
+                copy_string(&b->format, string--);
+                break;
+            case OP_PRINT_USING_NUMBER:
+                print_using(b, &b->format, *number--, NULL);
+                update_cursor(b);
+                break;
+            case OP_PRINT_USING_STRING:
+                print_using(b, &b->format, 0, string--);
+                update_cursor(b);
+                break;
+            case OP_GET: {
+                int flags = code[pc++];
+                int key = next_key(b, flags & GET_WAIT);
+                if(key < 0 && (flags & GET_WAIT)) {
+                    return BASIC_NO_KEYS;
+                }
+                if(flags & GET_NUMBER) {
+                    if(key >= 0 && !isdigit(key) && key != ' ') {
+                        error = "SYNTAX";
+                        goto failed;
+                    }
+                    *++number = isdigit(key) ? key - '0' : 0;
+                } else {
+                    string++;
+                    string->length = key >= 0;
+                    string->text[0] = (uint8_t) key;
+                }
+                break;
+            }
+            case OP_INPUT:
+                put_text(b, string->text, string->length);
+                string--;
+                put_string(b, "? ");
+                if(!read_line(b)) {
+                    return BASIC_NO_KEYS;
+                }
+                update_cursor(b);
+                break;
+            case OP_INPUT_NUMBER:
+                input_field(b, ++string);
+                *++number = string_value(string--, NULL);
+                break;
+            case OP_INPUT_STRING:
+                input_field(b, ++string);
+                break;
+            case OP_READ_NUMBER:
+            case OP_READ_STRING:
+                if(b->data_position == b->program->data_count) {
+                    error = "OUT OF DATA";
+                    goto failed;
+                }
+                if(op == OP_READ_STRING) {
+                    copy_string(++string, &b->program->data[b->data_position++]);
+                } else {
+                    bool valid;
+                    *++number = string_value(&b->program->data[b->data_position++], &valid);
+                    if(!valid) {
+                        error = "SYNTAX";
+                        goto failed;
+                    }
+                }
+                break;
+            case OP_RESTORE:
+                b->data_position = 0;
+                break;
+            case OP_POKE:
+                if(!to_range(number[0], 0, 255, &c) || !to_range(number[-1], 0, 65535, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                number -= 2;
+                bus_write(bus, (uint16_t) a, (uint8_t) c);
+                break;
+            case OP_SYS:
+                if(!to_range(*number--, 0, 65535, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                call_machine_code(b, (uint16_t) a);
+                break;
+            case OP_VOL:
+                if(!to_range(*number--, 0, 8, &a)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                bus_write(bus, SOUND_CONTROL, (uint8_t) ((bus_read(bus, SOUND_CONTROL) & 0xF0) | a));
+                break;
+            case OP_SCNCLR:
+                if(b->graphic_mode) {
+                    SCNCLR(b->bitmap, b->screen);
+                } else {
+                    clear_screen(b);
+                    update_cursor(b);
+                }
+                break;
+            case OP_GRAPHIC:
+            case OP_COLOR:
+            case OP_BOX:
+            case OP_PAINT:
+            case OP_LOCATE: {
+                static const int counts[] = {[OP_GRAPHIC - OP_GRAPHIC] = 2, [OP_COLOR - OP_GRAPHIC] = 3,
+                                             [OP_BOX - OP_GRAPHIC] = 7, [OP_PAINT - OP_GRAPHIC] = 4,
+                                             [OP_LOCATE - OP_GRAPHIC] = 2};
+                double values[7];
+                TED_pixel color;
+                pop_arguments(&number, code[pc++], counts[op - OP_GRAPHIC], values);
+                if(op == OP_GRAPHIC) {
+                    error = graphic(b, values[0], values[1]);
+                    if(error) {
+                        goto failed;
+                    }
+                    break;
+                }
+                if(op == OP_COLOR) {
+                    if(!to_range(values[0], 0, 4, &a) || !to_range(values[1], 1, 16, &c)) {
+                        error = "ILLEGAL QUANTITY";
+                        goto failed;
+                    }
+                    int luminance = 0;
+                    if(!isnan(values[2]) && !to_range(values[2], 0, 7, &luminance)) {
+                        error = "ILLEGAL QUANTITY";
+                        goto failed;
+                    }
+                    b->colors[a] = TED_index(c, luminance);
+                    break;
+                }
+                if(!b->graphic_mode) {
+                    error = "NO GRAPHICS AREA";
+                    goto failed;
+                }
+                if(op != OP_LOCATE && !color_source(b, values[0], &color)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                if(op == OP_BOX) {
+                    coordinates corner = point(values[1], values[2], b->graphics_cursor);
+                    BOX(corner, point(values[3], values[4], b->graphics_cursor), color,
+                        isnan(values[5]) ? 0 : (int) values[5], !isnan(values[6]) && values[6] != 0,
+                        &b->graphics_cursor, b->bitmap, b->screen);
+                } else if(op == OP_PAINT) {
+                    coordinates start = point(values[1], values[2], b->graphics_cursor);
+                    if(start.x >= 0 && start.x < b->screen.width && start.y >= 0 && start.y < b->screen.height) {
+                        TED_pixel target = b->bitmap[start.y * b->screen.width + start.x];
+                        if(!same_color(target, color)) {    // filling with the same color would never end
+                            PAINT(start, target, color, b->bitmap, b->screen);
+                        }
+                    }
+                } else {
+                    LOCATE(point(values[0], values[1], b->graphics_cursor), &b->graphics_cursor, b->screen);
+                }
+                break;
+            }
+            case OP_DRAW: {
+                int flags = code[pc], points = code[pc + 1];
+                double *values = number - 2 * points + 1;    // the TO points, in order
+                coordinates from = {-1, -1};
+                TED_pixel color;
+                pc += 2;
+                number -= 2 * points;
+                if(flags & DRAW_START) {
+                    from = (coordinates) {(int) number[-1], (int) number[0]};
+                    number -= 2;
+                }
+                double source = NAN;
+                if(flags & DRAW_SOURCE) {
+                    source = *number--;
+                }
+                if(!b->graphic_mode) {
+                    error = "NO GRAPHICS AREA";
+                    goto failed;
+                }
+                if(!color_source(b, source, &color)) {
+                    error = "ILLEGAL QUANTITY";
+                    goto failed;
+                }
+                if(!points) {                               // a dot
+                    DRAW(from, (coordinates) {-1, -1}, color, &b->graphics_cursor, b->bitmap, b->screen);
+                }
+                for(int i = 0; i < points; i++) {
+                    coordinates to = {(int) values[2 * i], (int) values[2 * i + 1]};
+                    DRAW(from, to, color, &b->graphics_cursor, b->bitmap, b->screen);
+                    from = to;
+                }
+                break;
+            }
+            case OP_STOP:
+                return BASIC_STOP;
+            case OP_END:
+                return BASIC_END;
+        }
+    }
+
+failed:
+    b->error = error;
+    return BASIC_ERROR;
+}
+
+static uint16_t statement_line(const basic *b) {           // line of the current statement, for messages
+    const basic_program *program = b->program;
+    size_t low = 0, high = program->line_count;
+    while(high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if(program->lines[middle].offset <= b->statement) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return program->line_count ? program->lines[low].line : 0;
+}
+
+
+// Set up and tear down
+
+static basic* create_basic(basic_program *program, machine *m) {
+    basic *b = calloc(1, sizeof(basic));
+    if(!b) {
+        printf("Memory allocation failed.\n");
+        return NULL;
+    }
+    b->program = program;
+    b->m = m;
+    b->numbers = calloc(program->numbers + 1, sizeof(double));
+    b->strings = calloc(program->strings + 1, sizeof(basic_string));
+    b->number_arrays = calloc(program->number_arrays + 1, sizeof(basic_array));
+    b->string_arrays = calloc(program->string_arrays + 1, sizeof(basic_array));
+    if(!b->numbers || !b->strings || !b->number_arrays || !b->string_arrays) {
+        printf("Memory allocation failed.\n");
+        free(b->numbers);
+        free(b->strings);
+        free(b->number_arrays);
+        free(b->string_arrays);
+        free(b);
+        return NULL;
+    }
+    b->random = 1;
+    b->colors[0] = TED_index(2, 7);                         // white background, black foreground, as after power-on
+    b->colors[1] = TED_index(1, 0);
+    b->colors[2] = TED_index(3, 4);
+    b->colors[3] = TED_index(6, 4);
+    b->colors[4] = TED_index(2, 7);
+    set_breakpoint(b->breakpoints, SYS_RETURN, true);
+    static const uint16_t ted_video_registers[][2] = {     // as after power-on: text mode, video matrix at $0800,
+        {0xFF06, 0x1B}, {0xFF07, 0x08}, {0xFF12, 0xC4},     // character set from ROM, background white, border
+        {0xFF13, 0xD0}, {0xFF14, 0x08}, {0xFF15, 0x71},     // light blue
+        {0xFF16, 0x5B}, {0xFF17, 0x75}, {0xFF18, 0x77}, {0xFF19, 0x6E}
+    };
+    for(size_t i = 0; i < sizeof(ted_video_registers) / sizeof(ted_video_registers[0]); i++) {
+        bus_write(&m->bus, ted_video_registers[i][0], (uint8_t) ted_video_registers[i][1]);
+    }
+    clear_screen(b);
+    update_cursor(b);
+    return b;
+}
+
+static void destroy_basic(basic *b) {
+    for(int i = 0; i < b->program->number_arrays; i++) {
+        free(b->number_arrays[i].numbers);
+    }
+    for(int i = 0; i < b->program->string_arrays; i++) {
+        free(b->string_arrays[i].strings);
+    }
+    free(b->numbers);
+    free(b->strings);
+    free(b->number_arrays);
+    free(b->string_arrays);
+    free(b->bitmap);
+    free(b);
+}
+
+static size_t parse_keys(const char *text, uint8_t *keys) { // C escapes, then PETSCII as typed
+    size_t count = 0;
+    while(*text) {
+        if(*text != '\\' || !text[1]) {
+            keys[count++] = petscii(*text++);
+            continue;
+        }
+        text++;
+        switch(*text++) {
+            case 'e':
+                keys[count++] = 27;
+                break;
+            case 'n':
+            case 'r':
+                keys[count++] = 13;
+                break;
+            case 'x':
+                keys[count++] = (uint8_t) strtol(text, (char **) &text, 16);
+                break;
+            default:
+                keys[count++] = (uint8_t) text[-1];
+        }
+    }
+    return count;
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *keys = "", *wav_name = NULL, *bmp_name = NULL, *screen_name = NULL, *frames_name = NULL;
+    const char *filename = NULL;
+    double seconds = BASIC_SECONDS;
+    bool live = false;
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-k") && i + 1 < argc) {
+            keys = argv[++i];
+        } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if(!strcmp(argv[i], "-w") && i + 1 < argc) {
+            wav_name = argv[++i];
+        } else if(!strcmp(argv[i], "-g") && i + 1 < argc) {
+            bmp_name = argv[++i];
+        } else if(!strcmp(argv[i], "-v") && i + 1 < argc) {
+            screen_name = argv[++i];
+        } else if(!strcmp(argv[i], "-V") && i + 1 < argc) {
+            frames_name = argv[++i];
+        } else if(!strcmp(argv[i], "-a")) {
+            live = true;
+        } else if(argv[i][0] != '-' && !filename) {
+            filename = argv[i];
+        } else {
+            filename = NULL;
+            break;
+        }
+    }
+    bool wav_out = wav_name && !strcmp(wav_name, "-"), frames_out = frames_name && !strcmp(frames_name, "-");
+    if(!filename || seconds <= 0 || (wav_out && frames_out)) {
+        printf("Usage: %s [-k keys] [-t seconds] [-w sound.wav] [-g picture.bmp] [-v screen.bmp] [-V frames] [-a] "
+               "program.bas\n", argv[0]);
+        return 1;
+    }
+    FILE *console = wav_out || frames_out ? stderr : stdout;
+    FILE *frames = frames_out ? stdout : frames_name ? fopen(frames_name, "wb") : NULL;
+    if(frames_name && !frames) {
+        printf("Unable to open file %s.\n", frames_name);
+        return 1;
+    }
+
+    basic_program *program = load_basic(filename);
+    machine *m = program ? create_machine() : NULL;
+    ted_video *video = m && (screen_name || frames) ? create_ted_video(m, frames ? frame_stream_write : NULL, frames)
+                                                   : NULL;
+    if(!m || ((screen_name || frames) && !video)) {
+        if(frames && !frames_out) {
+            fclose(frames);
+        }
+        destroy_machine(m);
+        destroy_program(program);
+        return 1;
+    }
+    wav_file *wav = wav_name ? wav_open(wav_name, TED_SAMPLE_RATE) : NULL;
+    ted_sound *sound = !wav_name || wav ? create_ted_sound(m, CLOCK_SPEED, TED_SAMPLE_RATE, wav ? wav_write : NULL, wav)
+                                        : NULL;
+    uint8_t *key_codes = malloc(strlen(keys) + 1);
+    basic *b = sound && key_codes ? create_basic(program, m) : NULL;
+    if(!b) {
+        free(key_codes);
+        if(wav) {
+            wav_close(wav);
+        }
+        if(frames && !frames_out) {
+            fclose(frames);
+        }
+        destroy_machine(m);
+        destroy_ted_sound(sound);
+        destroy_ted_video(video);
+        destroy_program(program);
+        return 1;
+    }
+    b->keys = key_codes;
+    b->key_count = parse_keys(keys, key_codes);
+    b->next_key = m->cpu.cycles + BASIC_KEY_INTERVAL;
+    b->cycle_limit = m->cpu.cycles + (uint64_t) (seconds * CLOCK_SPEED);
+    b->video = video;
+    b->stream = frames != NULL;
+    b->next_frame = m->cpu.cycles;
+    reach_stop(b);
+    b->terminal = console;
+    if(live) {
+        b->live = true;
+        redraw_terminal(b);
+    }
+
+    uint64_t start_cycle = m->cpu.cycles;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    basic_result result = run_basic(b);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if(result == BASIC_ERROR || result == BASIC_STOP) {     // reported on the screen, as by the ROM
+        char message[64];
+        if(result == BASIC_STOP) {
+            snprintf(message, sizeof(message), "BREAK IN %u", statement_line(b));
+        } else {
+            snprintf(message, sizeof(message), "?%s  ERROR IN %u", b->error, statement_line(b));
+        }
+        if(b->column) {
+            put_char(b, 13);
+        }
+        put_string(b, message);
+        put_char(b, 13);
+    }
+    if(result == BASIC_END || result == BASIC_STOP || result == BASIC_ERROR) {
+        if(b->column) {
+            put_char(b, 13);
+        }
+        put_string(b, "READY.");
+        put_char(b, 13);
+    }
+    if(live) {
+        fprintf(console, "\033[%d;1H", SCREEN_ROWS + 1);
+    } else {
+        print_screen(b, console);
+    }
+
+    ted_sound_render(sound, m->cpu.cycles);
+    bool saved = !wav || wav_close(wav);
+    if(bmp_name && b->bitmap) {
+        save_BMP(bmp_name, b->bitmap, b->screen);
+    }
+    if(screen_name) {                                       // the last frame, with READY., also to the stream
+        ted_video_save(video, screen_name);
+    } else if(frames) {
+        ted_video_render(video);
+    }
+    if(frames) {
+        saved &= !ferror(frames);
+        if(!frames_out) {
+            saved &= !fclose(frames);
+        } else {
+            fflush(frames);
+        }
+    }
+    static const char *endings[] = {"ended", "stopped", "ended with an error", "ran out of time",
+                                    "ran out of keys"};
+    double emulated = (double) (m->cpu.cycles - start_cycle) / CLOCK_SPEED;
+    fprintf(console, "\nProgram %s after %llu statements: %.1f s of machine time in %.3f s (%.0fx real time)",
+            endings[result], (unsigned long long) b->statements, emulated, wall, wall > 0 ? emulated / wall : 0);
+    if(wav) {
+        fprintf(console, ", %llu samples", (unsigned long long) ted_sound_samples(sound));
+    }
+    if(video) {
+        fprintf(console, ", %llu frames with %llu cells drawn", (unsigned long long) ted_video_frames(video),
+                (unsigned long long) ted_video_cells(video));
+    }
+    fprintf(console, ".\n");
+
+    free(key_codes);
+    destroy_basic(b);
+    destroy_machine(m);
+    destroy_ted_sound(sound);
+    destroy_ted_video(video);
+    destroy_program(program);
+    return result == BASIC_ERROR || !saved ? 1 : 0;
+}